@@ -17,6 +17,12 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+/* Polling time used when growing from zero, in nanoseconds */
+#define POLL_NS_START 4000
 
 struct AioHandler
 {
@@ -24,6 +30,7 @@ struct AioHandler
     IOHandler *io_read;
     IOHandler *io_write;
     AioFlushHandler *io_flush;
+    AioPollEventNotifierHandler *io_poll;
     int deleted;
     int pollfds_idx;
     void *opaque;
@@ -105,6 +112,32 @@ void aio_set_event_notifier(AioContext *ctx,
                        (AioFlushHandler *)io_flush, notifier);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    AioHandler *node;
+
+    node = find_aio_handler(ctx, event_notifier_get_fd(notifier));
+    if (node) {
+        node->io_poll = io_poll;
+    }
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink)
+{
+    /* No synchronization with the thread running @ctx; a stale value is
+     * used for at most one iteration.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
@@ -169,11 +202,72 @@ static bool aio_dispatch(AioContext *ctx)
     return progress;
 }
 
+/* Call the polling callbacks until one of them makes progress, aio_notify()
+ * is called or @deadline (in get_clock() nanoseconds) passes.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t deadline)
+{
+    AioHandler *node;
+    bool progress = false;
+
+    ctx->walking_handlers++;
+    do {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->io_poll &&
+                node->io_poll(node->opaque)) {
+                progress = true;
+            }
+        }
+    } while (!progress && !atomic_read(&ctx->notified) &&
+             get_clock() < deadline);
+    ctx->walking_handlers--;
+
+    ctx->poll_attempts++;
+    if (progress) {
+        ctx->poll_successes++;
+    }
+    trace_run_poll_handlers(ctx, progress);
+    return progress;
+}
+
+/* Adapt the polling time to how long aio_poll() took to find an event */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* Polling caught the event, keep the current budget */
+        return;
+    }
+
+    if (block_ns > ctx->poll_max_ns) {
+        /* The event came too late to be worth polling for, poll less */
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* Polling a little longer would have caught the event */
+        if (ctx->poll_ns == 0) {
+            ctx->poll_ns = POLL_NS_START;
+        } else {
+            ctx->poll_ns *= ctx->poll_grow ? ctx->poll_grow : 2;
+        }
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int ret;
-    bool busy, progress;
+    bool busy, progress, try_poll;
+    int64_t start = 0;
 
     progress = false;
 
@@ -201,6 +295,7 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     /* fill pollfds */
     busy = false;
+    try_poll = blocking && ctx->poll_max_ns;
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         node->pollfds_idx = -1;
 
@@ -213,6 +308,11 @@ bool aio_poll(AioContext *ctx, bool blocking)
                 continue;
             }
             busy = true;
+
+            /* Do not delay handlers that can only be woken up by poll() */
+            if (!node->io_poll) {
+                try_poll = false;
+            }
         }
         if (!node->deleted && node->pfd.events) {
             GPollFD pfd = {
@@ -231,11 +331,25 @@ bool aio_poll(AioContext *ctx, bool blocking)
         return progress;
     }
 
+    if (try_poll) {
+        start = get_clock();
+        if (ctx->poll_ns && !atomic_read(&ctx->notified) &&
+            run_poll_handlers(ctx, start + ctx->poll_ns)) {
+            /* Still pick up file descriptors that became ready meanwhile */
+            blocking = false;
+            progress = true;
+        }
+    }
+
     /* wait until next event */
     ret = g_poll((GPollFD *)ctx->pollfds->data,
                  ctx->pollfds->len,
                  blocking ? -1 : 0);
 
+    if (try_poll) {
+        adjust_poll_time(ctx, get_clock() - start);
+    }
+
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
         QLIST_FOREACH(node, &ctx->aio_handlers, node) {
@@ -79,6 +79,21 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll)
+{
+    /* Polling is not implemented, aio_poll() always waits for events */
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink)
+{
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+}
+
 bool aio_pending(AioContext *ctx)
 {
     AioHandler *node;
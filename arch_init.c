@@ -24,6 +24,7 @@
 #include <stdint.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <zlib.h>
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -45,6 +46,14 @@
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/sockets.h"
+#include "block/coroutine.h"
+#ifdef CONFIG_USERFAULTFD
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
@@ -119,6 +128,14 @@ static void check_guest_throttling(void);
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_CHANNEL  0x100
+#define RAM_SAVE_FLAG_POSTCOPY 0x200
+
+/* RAM_SAVE_FLAG_CHANNEL commands */
+#define RAM_CHANNEL_OPEN       0x1 /* followed by the number of channels */
+#define RAM_CHANNEL_SYNC       0x2 /* wait for the round on all channels */
+#define RAM_CHANNEL_EXPECT     0x3 /* followed by the number of additional
+                                      connections and their token */
 
 
 static struct defconfig_file {
@@ -194,6 +211,9 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_busy;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -253,6 +273,52 @@ uint64_t xbzrle_mig_pages_overflow(void)
     return acct_info.xbzrle_overflows;
 }
 
+XBZRLECacheSetStatsList *xbzrle_mig_cache_set_stats(void)
+{
+    XBZRLECacheSetStatsList *head = NULL, *entry;
+    uint64_t hits, misses;
+    int64_t i;
+
+    if (!XBZRLE.cache) {
+        return NULL;
+    }
+
+    for (i = cache_get_num_sets(XBZRLE.cache) - 1; i >= 0; i--) {
+        cache_get_set_stats(XBZRLE.cache, i, &hits, &misses);
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        entry->value->hits = hits;
+        entry->value->misses = misses;
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
+uint64_t compress_mig_pages_transferred(void)
+{
+    return acct_info.compress_pages;
+}
+
+uint64_t compress_mig_bytes_transferred(void)
+{
+    return acct_info.compress_bytes;
+}
+
+uint64_t compress_mig_busy(void)
+{
+    return acct_info.compress_busy;
+}
+
+double compress_mig_rate(void)
+{
+    if (!acct_info.compress_bytes) {
+        return 0;
+    }
+    return (double)acct_info.compress_pages * TARGET_PAGE_SIZE /
+           acct_info.compress_bytes;
+}
+
 static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
                              int cont, int flag)
 {
@@ -271,6 +337,7 @@ static size_t save_block_hdr(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
+#define ENCODING_FLAG_ZLIB   0x2
 
 static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
                             ram_addr_t current_addr, RAMBlock *block,
@@ -332,6 +399,7 @@ static RAMBlock *last_seen_block;
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
+static ram_addr_t migration_bitmap_pages;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
@@ -359,26 +427,10 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
     return (next - base) << TARGET_PAGE_BITS;
 }
 
-static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
-                                              ram_addr_t offset)
-{
-    bool ret;
-    int nr = (mr->ram_addr + offset) >> TARGET_PAGE_BITS;
-
-    ret = test_and_set_bit(nr, migration_bitmap);
-
-    if (!ret) {
-        migration_dirty_pages++;
-    }
-    return ret;
-}
-
 /* Needs iothread lock! */
 
 static void migration_bitmap_sync(void)
 {
-    RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
@@ -398,15 +450,10 @@ static void migration_bitmap_sync(void)
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
-        }
-    }
+    migration_dirty_pages +=
+        memory_global_sync_dirty_bitmap(migration_bitmap,
+                                        migration_bitmap_pages,
+                                        DIRTY_MEMORY_MIGRATION);
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
@@ -442,20 +489,418 @@ static void migration_bitmap_sync(void)
 }
 
 /*
- * ram_save_block: Writes a page of memory to the stream f
+ * Post-copy
+ *
+ * When the x-postcopy-ram capability is set, ram_save_complete() does not
+ * send the remaining dirty pages.  Instead it sends the list of dirty pages,
+ * which the destination drops, and opens a separate channel on which a
+ * thread sends the dirty pages in the background while the guest is already
+ * running on the destination.  The destination traps accesses to pages that
+ * have not arrived yet with userfaultfd and requests them over the reverse
+ * direction of the same channel; requested pages are sent ahead of the
+ * background pages.
+ *
+ * The source only gives up the guest once the destination has answered on
+ * that channel that it is ready to trap accesses.  If the channel cannot be
+ * opened or the destination declines, the remaining dirty pages are sent
+ * on the main stream as in a normal migration.
+ */
+typedef struct PostcopyRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    int64_t time;
+    QSIMPLEQ_ENTRY(PostcopyRequest) next;
+} PostcopyRequest;
+
+static struct {
+    bool active;
+    QEMUFile *file;
+    QEMUFile *return_file;
+    QemuThread send_thread;
+    QemuThread return_thread;
+    QemuMutex lock;
+    QSIMPLEQ_HEAD(, PostcopyRequest) requests;
+} postcopy_send;
+
+/*
+ * Shared by source and destination, latencies in microseconds.  Updated by
+ * the post-copy threads and read by the monitor, hence the lock.
+ */
+static struct {
+    bool valid;
+    QemuMutex lock;
+    uint64_t requests;
+    uint64_t total_latency;
+    uint64_t max_latency;
+} postcopy_stats;
+
+/* Called before the post-copy threads are started */
+static void postcopy_stats_reset(void)
+{
+    if (!postcopy_stats.valid) {
+        qemu_mutex_init(&postcopy_stats.lock);
+    }
+    qemu_mutex_lock(&postcopy_stats.lock);
+    postcopy_stats.requests = 0;
+    postcopy_stats.total_latency = 0;
+    postcopy_stats.max_latency = 0;
+    qemu_mutex_unlock(&postcopy_stats.lock);
+    atomic_set(&postcopy_stats.valid, true);
+}
+
+static void postcopy_stats_account(int64_t latency_ns)
+{
+    uint64_t latency = latency_ns / 1000;
+
+    qemu_mutex_lock(&postcopy_stats.lock);
+    postcopy_stats.requests++;
+    postcopy_stats.total_latency += latency;
+    postcopy_stats.max_latency = MAX(postcopy_stats.max_latency, latency);
+    qemu_mutex_unlock(&postcopy_stats.lock);
+}
+
+PostcopyStats *ram_postcopy_get_stats(void)
+{
+    PostcopyStats *stats;
+
+    if (!atomic_read(&postcopy_stats.valid)) {
+        return NULL;
+    }
+
+    stats = g_malloc0(sizeof(*stats));
+    qemu_mutex_lock(&postcopy_stats.lock);
+    stats->requests = postcopy_stats.requests;
+    stats->average_latency = postcopy_stats.requests ?
+        postcopy_stats.total_latency / postcopy_stats.requests : 0;
+    stats->max_latency = postcopy_stats.max_latency;
+    qemu_mutex_unlock(&postcopy_stats.lock);
+    return stats;
+}
+
+bool ram_postcopy_ready(void)
+{
+    /* the first pass over RAM is complete */
+    return !ram_bulk_stage;
+}
+
+/*
+ * ram_save_page: Writes the page at @offset of @block to the stream f
+ *
+ * Called both from the migration thread and from the RAM send channels,
+ * hence the atomic accounting.  XBZRLE must only be used by the migration
+ * thread.
+ *
+ * Returns:  The number of bytes written.
+ *           0 means the page is unmodified (XBZRLE)
+ */
+static int ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                         int cont, bool last_stage, bool use_xbzrle)
+{
+    int ret;
+    int bytes_sent;
+    uint8_t *p;
+    ram_addr_t current_addr;
+
+    p = memory_region_get_ram_ptr(block->mr) + offset;
+
+    /* In doubt sent page as normal */
+    bytes_sent = -1;
+    ret = ram_control_save_page(f, block->offset,
+                       offset, TARGET_PAGE_SIZE, &bytes_sent);
+
+    if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
+        if (ret != RAM_SAVE_CONTROL_DELAYED) {
+            if (bytes_sent > 0) {
+                atomic_inc(&acct_info.norm_pages);
+            } else if (bytes_sent == 0) {
+                atomic_inc(&acct_info.dup_pages);
+            }
+        }
+    } else if (is_zero_page(p)) {
+        atomic_inc(&acct_info.dup_pages);
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+    } else if (!ram_bulk_stage && use_xbzrle) {
+        current_addr = block->offset + offset;
+        bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                      offset, cont, last_stage);
+        if (!last_stage) {
+            p = get_cached_data(XBZRLE.cache, current_addr);
+        }
+    }
+
+    /* XBZRLE overflow or normal page */
+    if (bytes_sent == -1) {
+        bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        atomic_inc(&acct_info.norm_pages);
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * Compression threads
+ *
+ * With the compress capability, the migration thread hands the pages that
+ * are not zero to a pool of threads that deflate them.  Each thread keeps
+ * its result until the migration thread picks it again for another page, or
+ * until the end of the iteration, so compression overlaps with sending.
+ * Because of that, compressed pages are written out of order and always
+ * carry the name of their block.  Flushing the threads before the end of an
+ * iteration guarantees that a page sent again after the next dirty bitmap
+ * sync arrives after its older copy.
+ *
+ * Compressed pages use the XBZRLE record with a different encoding, so the
+ * stream needs no new flag.
+ */
+typedef struct CompressThread {
+    QemuThread thread;
+    QemuSemaphore sem;
+    bool quit;
+    /* protected by compress_send.lock */
+    bool busy;
+    RAMBlock *block;
+    ram_addr_t offset;
+    z_stream stream;
+    uint8_t *buf;
+    /* length of the compressed page, -1 if it is not worth compressing */
+    int len;
+} CompressThread;
+
+static struct {
+    CompressThread *threads;
+    int num;
+    QemuMutex lock;
+    QemuCond cond;
+} compress_send;
+
+static void *compress_thread(void *opaque)
+{
+    CompressThread *t = opaque;
+    z_stream *stream = &t->stream;
+    int len;
+
+    while (true) {
+        qemu_sem_wait(&t->sem);
+        if (t->quit) {
+            break;
+        }
+
+        /* the record header and length must fit in the size of a page */
+        len = -1;
+        if (deflateReset(stream) == Z_OK) {
+            stream->next_in = memory_region_get_ram_ptr(t->block->mr) +
+                              t->offset;
+            stream->avail_in = TARGET_PAGE_SIZE;
+            stream->next_out = t->buf;
+            stream->avail_out = TARGET_PAGE_SIZE - 3;
+            if (deflate(stream, Z_FINISH) == Z_STREAM_END) {
+                len = TARGET_PAGE_SIZE - 3 - stream->avail_out;
+            }
+        }
+
+        qemu_mutex_lock(&compress_send.lock);
+        t->len = len;
+        t->busy = false;
+        qemu_cond_signal(&compress_send.cond);
+        qemu_mutex_unlock(&compress_send.lock);
+    }
+
+    return NULL;
+}
+
+static void compress_threads_stop(void)
+{
+    CompressThread *t;
+    int i;
+
+    for (i = 0; i < compress_send.num; i++) {
+        t = &compress_send.threads[i];
+        t->quit = true;
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+        deflateEnd(&t->stream);
+        g_free(t->buf);
+    }
+
+    if (compress_send.threads) {
+        g_free(compress_send.threads);
+        compress_send.threads = NULL;
+        compress_send.num = 0;
+        qemu_cond_destroy(&compress_send.cond);
+        qemu_mutex_destroy(&compress_send.lock);
+    }
+}
+
+static int compress_threads_start(int num, int level)
+{
+    CompressThread *t;
+    int i;
+
+    qemu_mutex_init(&compress_send.lock);
+    qemu_cond_init(&compress_send.cond);
+    compress_send.threads = g_new0(CompressThread, num);
+
+    for (i = 0; i < num; i++) {
+        t = &compress_send.threads[i];
+        if (deflateInit(&t->stream, level) != Z_OK) {
+            DPRINTF("Error initializing compression\n");
+            compress_threads_stop();
+            return -1;
+        }
+        t->buf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_sem_init(&t->sem, 0);
+        qemu_thread_create(&t->thread, compress_thread, t,
+                           QEMU_THREAD_JOINABLE);
+        compress_send.num++;
+    }
+
+    return 0;
+}
+
+/* Writes the result of the last page compressed by @t */
+static int compress_write_page(QEMUFile *f, CompressThread *t)
+{
+    int bytes_sent;
+    uint8_t *p;
+
+    if (!t->block) {
+        return 0;
+    }
+
+    if (t->len < 0) {
+        p = memory_region_get_ram_ptr(t->block->mr) + t->offset;
+        bytes_sent = save_block_hdr(f, t->block, t->offset, 0,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    } else {
+        bytes_sent = save_block_hdr(f, t->block, t->offset, 0,
+                                    RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_byte(f, ENCODING_FLAG_ZLIB);
+        qemu_put_be16(f, t->len);
+        qemu_put_buffer(f, t->buf, t->len);
+        bytes_sent += t->len + 1 + 2;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += bytes_sent;
+    }
+
+    /* following pages of the same block may use RAM_SAVE_FLAG_CONTINUE */
+    last_sent_block = t->block;
+    t->block = NULL;
+
+    return bytes_sent;
+}
+
+/*
+ * Hands the page at @offset of @block to an idle compression thread.
+ *
+ * Returns:  The number of bytes written for the previous page of the thread
+ */
+static int compress_queue_page(QEMUFile *f, RAMBlock *block,
+                               ram_addr_t offset)
+{
+    CompressThread *t = NULL;
+    int i, bytes_sent;
+
+    qemu_mutex_lock(&compress_send.lock);
+    while (true) {
+        for (i = 0; i < compress_send.num; i++) {
+            if (!compress_send.threads[i].busy) {
+                t = &compress_send.threads[i];
+                break;
+            }
+        }
+        if (t) {
+            break;
+        }
+        acct_info.compress_busy++;
+        qemu_cond_wait(&compress_send.cond, &compress_send.lock);
+    }
+    qemu_mutex_unlock(&compress_send.lock);
+
+    bytes_sent = compress_write_page(f, t);
+
+    t->block = block;
+    t->offset = offset;
+    qemu_mutex_lock(&compress_send.lock);
+    t->busy = true;
+    qemu_mutex_unlock(&compress_send.lock);
+    qemu_sem_post(&t->sem);
+
+    return bytes_sent;
+}
+
+/* Writes out all the pages that are being compressed */
+static uint64_t compress_flush(QEMUFile *f)
+{
+    uint64_t bytes_sent = 0;
+    int i;
+
+    qemu_mutex_lock(&compress_send.lock);
+    for (i = 0; i < compress_send.num; i++) {
+        while (compress_send.threads[i].busy) {
+            qemu_cond_wait(&compress_send.cond, &compress_send.lock);
+        }
+    }
+    qemu_mutex_unlock(&compress_send.lock);
+
+    for (i = 0; i < compress_send.num; i++) {
+        bytes_sent += compress_write_page(f, &compress_send.threads[i]);
+    }
+
+    return bytes_sent;
+}
+
+/*
+ * ram_save_compressed_page: Writes the page at @offset of @block to the
+ * stream f, or hands it to a compression thread
  *
  * Returns:  The number of bytes written.
+ */
+static int ram_save_compressed_page(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t offset, int cont)
+{
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (is_zero_page(p)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        last_sent_block = block;
+        return bytes_sent + 1;
+    }
+
+    return compress_queue_page(f, block, offset);
+}
+
+/*
+ * ram_save_block: Writes a page of memory to the stream f
+ *
+ * Returns:  The number of pages written or handed to a compression thread.
  *           0 means no dirty pages
+ *
+ * The number of bytes written is added to @bytes_written.
  */
 
-static int ram_save_block(QEMUFile *f, bool last_stage)
+static int ram_save_block(QEMUFile *f, bool last_stage,
+                          uint64_t *bytes_written)
 {
     RAMBlock *block = last_seen_block;
     ram_addr_t offset = last_offset;
     bool complete_round = false;
+    bool use_compress = compress_send.num && !postcopy_send.active;
     int bytes_sent = 0;
+    int pages = 0;
     MemoryRegion *mr;
-    ram_addr_t current_addr;
 
     if (!block)
         block = QTAILQ_FIRST(&ram_list.blocks);
@@ -476,52 +921,25 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
                 ram_bulk_stage = false;
             }
         } else {
-            int ret;
-            uint8_t *p;
             int cont = (block == last_sent_block) ?
                 RAM_SAVE_FLAG_CONTINUE : 0;
 
-            p = memory_region_get_ram_ptr(mr) + offset;
-
-            /* In doubt sent page as normal */
-            bytes_sent = -1;
-            ret = ram_control_save_page(f, block->offset,
-                               offset, TARGET_PAGE_SIZE, &bytes_sent);
-
-            if (ret != RAM_SAVE_CONTROL_NOT_SUPP) {
-                if (ret != RAM_SAVE_CONTROL_DELAYED) {
-                    if (bytes_sent > 0) {
-                        acct_info.norm_pages++;
-                    } else if (bytes_sent == 0) {
-                        acct_info.dup_pages++;
-                    }
-                }
-            } else if (is_zero_page(p)) {
-                acct_info.dup_pages++;
-                bytes_sent = save_block_hdr(f, block, offset, cont,
-                                            RAM_SAVE_FLAG_COMPRESS);
-                qemu_put_byte(f, 0);
-                bytes_sent++;
-            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
-                }
+            if (use_compress) {
+                *bytes_written += ram_save_compressed_page(f, block, offset,
+                                                           cont);
+                pages = 1;
+                break;
             }
 
-            /* XBZRLE overflow or normal page */
-            if (bytes_sent == -1) {
-                bytes_sent = save_block_hdr(f, block, offset, cont, RAM_SAVE_FLAG_PAGE);
-                qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
-                bytes_sent += TARGET_PAGE_SIZE;
-                acct_info.norm_pages++;
-            }
+            bytes_sent = ram_save_page(f, block, offset, cont, last_stage,
+                                       migrate_use_xbzrle() &&
+                                       !postcopy_send.active);
 
             /* if page is unmodified, continue to the next */
             if (bytes_sent > 0) {
+                *bytes_written += bytes_sent;
                 last_sent_block = block;
+                pages = 1;
                 break;
             }
         }
@@ -529,37 +947,295 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     last_seen_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return pages;
 }
 
-static uint64_t bytes_transferred;
+/*
+ * RAM send channels
+ *
+ * With more than one migration channel, the pages are sent by one thread per
+ * channel, each over its own connection.  The RAM is sharded between the
+ * channels in chunks of RAM_CHANNEL_CHUNK_PAGES pages, so a page is always
+ * sent over the same channel and its updates arrive in order.  The chunk
+ * size is a multiple of BITS_PER_LONG, so that the channels never modify the
+ * same word of the migration bitmap.
+ *
+ * The migration thread drives the channels in rounds: it hands each channel
+ * a share of the bandwidth, waits for all of them to finish, and then tells
+ * the destination on the main stream to wait for the same round on all of
+ * its receive channels.  The dirty bitmap is only synchronized between
+ * rounds.
+ */
+#define RAM_CHANNEL_CHUNK_PAGES 256
 
-void acct_update_position(QEMUFile *f, size_t size, bool zero)
+#define MAX_WAIT 50 /* ms, half buffered_file limit */
+
+typedef struct RamSaveChannel {
+    QemuThread thread;
+    QemuSemaphore sem;
+    QEMUFile *file;
+    int id;
+    bool quit;
+
+    /* state of the channel's own walk over its shard of RAM */
+    RAMBlock *last_seen_block;
+    RAMBlock *last_sent_block;
+    ram_addr_t last_offset;
+
+    /* parameters and result of the current round */
+    bool last_stage;
+    int64_t budget;
+    int64_t bytes_sent;
+} RamSaveChannel;
+
+static struct {
+    RamSaveChannel *channels;
+    int num;
+    QemuSemaphore round_done;
+} ram_send;
+
+static inline
+ram_addr_t migration_bitmap_find_and_reset_dirty_shard(MemoryRegion *mr,
+                                                       ram_addr_t start,
+                                                       int shard)
 {
-    uint64_t pages = size / TARGET_PAGE_SIZE;
-    if (zero) {
-        acct_info.dup_pages += pages;
-    } else {
-        acct_info.norm_pages += pages;
-        bytes_transferred += size;
-        qemu_update_position(f, size);
+    unsigned long base = mr->ram_addr >> TARGET_PAGE_BITS;
+    unsigned long nr = base + (start >> TARGET_PAGE_BITS);
+    unsigned long size = base + (int128_get64(mr->size) >> TARGET_PAGE_BITS);
+    unsigned long next, chunk;
+    int n = ram_send.num;
+
+    while ((next = find_next_bit(migration_bitmap, size, nr)) < size) {
+        chunk = next / RAM_CHANNEL_CHUNK_PAGES;
+        if (chunk % n == shard) {
+            clear_bit(next, migration_bitmap);
+            atomic_dec(&migration_dirty_pages);
+            break;
+        }
+        /* skip to the next chunk of this shard */
+        chunk += (shard - chunk % n + n) % n;
+        nr = chunk * RAM_CHANNEL_CHUNK_PAGES;
     }
+    return (next - base) << TARGET_PAGE_BITS;
 }
 
-static ram_addr_t ram_save_remaining(void)
+/* Like ram_save_block(), restricted to the shard of channel @c */
+static int ram_save_channel_block(RamSaveChannel *c)
 {
-    return migration_dirty_pages;
+    RAMBlock *block = c->last_seen_block;
+    ram_addr_t offset = c->last_offset;
+    bool complete_round = false;
+    int bytes_sent = 0;
+
+    if (!block) {
+        block = QTAILQ_FIRST(&ram_list.blocks);
+    }
+
+    while (true) {
+        offset = migration_bitmap_find_and_reset_dirty_shard(block->mr, offset,
+                                                             c->id);
+        if (complete_round && block == c->last_seen_block &&
+            offset >= c->last_offset) {
+            break;
+        }
+        if (offset >= block->length) {
+            offset = 0;
+            block = QTAILQ_NEXT(block, next);
+            if (!block) {
+                block = QTAILQ_FIRST(&ram_list.blocks);
+                complete_round = true;
+            }
+        } else {
+            int cont = (block == c->last_sent_block) ?
+                RAM_SAVE_FLAG_CONTINUE : 0;
+
+            bytes_sent = ram_save_page(c->file, block, offset, cont,
+                                       c->last_stage, false);
+            c->last_sent_block = block;
+            break;
+        }
+    }
+    c->last_seen_block = block;
+    c->last_offset = offset;
+
+    return bytes_sent;
 }
 
-uint64_t ram_bytes_remaining(void)
+static void ram_save_channel_round(RamSaveChannel *c)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    int64_t t0 = qemu_get_clock_ns(rt_clock);
+    int bytes_sent;
+    int i = 0;
+
+    c->bytes_sent = 0;
+    while (c->bytes_sent < c->budget && !qemu_file_get_error(c->file)) {
+        bytes_sent = ram_save_channel_block(c);
+        /* no more dirty pages in this shard */
+        if (bytes_sent == 0) {
+            break;
+        }
+        c->bytes_sent += bytes_sent;
+
+        if (!c->last_stage && (i++ & 63) == 0 &&
+            (qemu_get_clock_ns(rt_clock) - t0) / 1000000 > MAX_WAIT) {
+            break;
+        }
+    }
+
+    qemu_put_be64(c->file, RAM_SAVE_FLAG_EOS);
+    c->bytes_sent += 8;
+    qemu_fflush(c->file);
 }
 
-uint64_t ram_bytes_transferred(void)
+static void *ram_save_channel_thread(void *opaque)
 {
-    return bytes_transferred;
-}
+    RamSaveChannel *c = opaque;
+
+    while (true) {
+        qemu_sem_wait(&c->sem);
+        if (c->quit) {
+            break;
+        }
+        ram_save_channel_round(c);
+        qemu_sem_post(&ram_send.round_done);
+    }
+
+    return NULL;
+}
+
+static void ram_save_channels_stop(void)
+{
+    RamSaveChannel *c;
+    int i;
+
+    for (i = 0; i < ram_send.num; i++) {
+        c = &ram_send.channels[i];
+        c->quit = true;
+        qemu_sem_post(&c->sem);
+        qemu_thread_join(&c->thread);
+        qemu_sem_destroy(&c->sem);
+        qemu_fclose(c->file);
+    }
+
+    if (ram_send.channels) {
+        qemu_sem_destroy(&ram_send.round_done);
+    }
+    g_free(ram_send.channels);
+    ram_send.channels = NULL;
+    ram_send.num = 0;
+}
+
+static int ram_save_channels_start(int num)
+{
+    MigrationState *s = migrate_get_current();
+    Error *local_err = NULL;
+    RamSaveChannel *c;
+    QEMUFile *file;
+    int i;
+
+    ram_send.channels = g_new0(RamSaveChannel, num);
+    qemu_sem_init(&ram_send.round_done, 0);
+
+    for (i = 0; i < num; i++) {
+        file = migrate_open_channel(s, &local_err);
+        if (!file) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            ram_save_channels_stop();
+            return -1;
+        }
+
+        c = &ram_send.channels[i];
+        c->file = file;
+        c->id = i;
+        qemu_sem_init(&c->sem, 0);
+        qemu_thread_create(&c->thread, ram_save_channel_thread, c,
+                           QEMU_THREAD_JOINABLE);
+        ram_send.num++;
+    }
+
+    return 0;
+}
+
+/*
+ * ram_save_channels_round: Lets all channels send their dirty pages
+ *
+ * Outside of the last stage the channels split the bandwidth that is left
+ * for @f in the current rate limiting period, so that together they stay
+ * within the limit.  The data they send is accounted to @f.
+ *
+ * Returns: The number of bytes sent over all channels or a negative errno.
+ */
+static int64_t ram_save_channels_round(QEMUFile *f, bool last_stage)
+{
+    int64_t limit = qemu_file_get_rate_limit_left(f);
+    int64_t total = 0;
+    RamSaveChannel *c;
+    int ret = 0;
+    int i;
+
+    for (i = 0; i < ram_send.num; i++) {
+        c = &ram_send.channels[i];
+        c->last_stage = last_stage;
+        if (last_stage || limit < 0) {
+            c->budget = INT64_MAX;
+        } else {
+            /* a channel sends at least one page per round */
+            c->budget = MAX(limit / ram_send.num, 1);
+        }
+        qemu_sem_post(&c->sem);
+    }
+
+    for (i = 0; i < ram_send.num; i++) {
+        qemu_sem_wait(&ram_send.round_done);
+    }
+
+    for (i = 0; i < ram_send.num; i++) {
+        c = &ram_send.channels[i];
+        if (qemu_file_get_error(c->file) && !ret) {
+            ret = qemu_file_get_error(c->file);
+        }
+        total += c->bytes_sent;
+    }
+
+    qemu_file_update_transfer(f, total);
+    qemu_update_position(f, total);
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+    qemu_put_byte(f, RAM_CHANNEL_SYNC);
+    total += 9;
+
+    return ret < 0 ? ret : total;
+}
+
+static uint64_t bytes_transferred;
+
+void acct_update_position(QEMUFile *f, size_t size, bool zero)
+{
+    uint64_t pages = size / TARGET_PAGE_SIZE;
+    if (zero) {
+        acct_info.dup_pages += pages;
+    } else {
+        acct_info.norm_pages += pages;
+        bytes_transferred += size;
+        qemu_update_position(f, size);
+    }
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    return migration_dirty_pages;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
 
 uint64_t ram_bytes_total(void)
 {
@@ -574,6 +1250,9 @@ uint64_t ram_bytes_total(void)
 
 static void migration_end(void)
 {
+    ram_save_channels_stop();
+    compress_threads_stop();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
@@ -597,21 +1276,27 @@ static void ram_migration_cancel(void *opaque)
 
 static void reset_ram_globals(void)
 {
+    int i;
+
     last_seen_block = NULL;
     last_sent_block = NULL;
     last_offset = 0;
+    for (i = 0; i < ram_send.num; i++) {
+        ram_send.channels[i].last_seen_block = NULL;
+        ram_send.channels[i].last_sent_block = NULL;
+        ram_send.channels[i].last_offset = 0;
+    }
     last_version = ram_list.version;
     ram_bulk_stage = true;
 }
 
-#define MAX_WAIT 50 /* ms, half buffered_file limit */
-
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_pages = last_ram_offset() >> TARGET_PAGE_BITS;
 
     migration_bitmap = bitmap_new(ram_pages);
+    migration_bitmap_pages = ram_pages;
     bitmap_set(migration_bitmap, 0, ram_pages);
     migration_dirty_pages = ram_pages;
     mig_throttle_on = false;
@@ -630,6 +1315,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_compression()) {
+        if (compress_threads_start(migrate_compress_threads(),
+                                   migrate_compress_level()) < 0) {
+            return -1;
+        }
+        if (!migrate_use_xbzrle()) {
+            acct_clear();
+        }
+    }
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
@@ -652,6 +1347,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
     ram_control_after_iterate(f, RAM_CONTROL_SETUP);
 
+    /* The destination accepts no other connections than these */
+    qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+    qemu_put_byte(f, RAM_CHANNEL_EXPECT);
+    qemu_put_be32(f, (migrate_channels() > 1 ? migrate_channels() : 0) +
+                  migrate_postcopy_ram());
+    qemu_put_be64(f, migrate_get_current()->channel_token);
+
+    if (migrate_channels() > 1) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_CHANNEL);
+        qemu_put_byte(f, RAM_CHANNEL_OPEN);
+        qemu_put_be32(f, migrate_channels());
+        qemu_fflush(f);
+
+        if (ram_save_channels_start(migrate_channels()) < 0) {
+            return -1;
+        }
+    }
+
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
     return 0;
@@ -662,7 +1375,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     int ret;
     int i;
     int64_t t0;
-    int total_sent = 0;
+    uint64_t total_sent = 0;
 
     qemu_mutex_lock_ramlist();
 
@@ -672,17 +1385,30 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    if (ram_send.num) {
+        int64_t bytes_sent = ram_save_channels_round(f, false);
+
+        qemu_mutex_unlock_ramlist();
+        ram_control_after_iterate(f, RAM_CONTROL_ROUND);
+        if (bytes_sent < 0) {
+            return bytes_sent;
+        }
+
+        acct_info.iterations++;
+        check_guest_throttling();
+
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        bytes_transferred += bytes_sent + 8;
+        return bytes_sent + 8;
+    }
+
     t0 = qemu_get_clock_ns(rt_clock);
     i = 0;
     while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f, false);
         /* no more blocks to sent */
-        if (bytes_sent == 0) {
+        if (ram_save_block(f, false, &total_sent) == 0) {
             break;
         }
-        total_sent += bytes_sent;
         acct_info.iterations++;
         check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
@@ -701,6 +1427,8 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    /* the blocks must not go away while their pages are compressed */
+    total_sent += compress_flush(f);
     qemu_mutex_unlock_ramlist();
 
     /*
@@ -721,8 +1449,229 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
     return total_sent;
 }
 
+/* Sends the ranges of dirty pages that the destination has to drop */
+static void postcopy_send_discard(QEMUFile *f)
+{
+    RAMBlock *block;
+    unsigned long base, size, start, end;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        base = block->mr->ram_addr >> TARGET_PAGE_BITS;
+        size = base + (block->length >> TARGET_PAGE_BITS);
+
+        start = find_next_bit(migration_bitmap, size, base);
+        if (start >= size) {
+            continue;
+        }
+
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        while (start < size) {
+            end = find_next_zero_bit(migration_bitmap, size, start);
+            qemu_put_be64(f, (ram_addr_t)(start - base) << TARGET_PAGE_BITS);
+            qemu_put_be64(f, (ram_addr_t)(end - start) << TARGET_PAGE_BITS);
+            start = find_next_bit(migration_bitmap, size, end);
+        }
+        qemu_put_be64(f, 0);
+        qemu_put_be64(f, 0);
+    }
+    qemu_put_byte(f, 0);
+}
+
+static void *postcopy_send_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_send.file;
+    PostcopyRequest *req;
+    ram_addr_t nr;
+
+    while (!qemu_file_get_error(f)) {
+        qemu_mutex_lock(&postcopy_send.lock);
+        req = QSIMPLEQ_FIRST(&postcopy_send.requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&postcopy_send.requests, next);
+        }
+        qemu_mutex_unlock(&postcopy_send.lock);
+
+        if (req) {
+            /*
+             * Clean pages are sent as well: the destination may have
+             * dropped them (zero pages), and the guest is stopped here so
+             * their content is final.
+             */
+            nr = (req->block->mr->ram_addr + req->offset) >> TARGET_PAGE_BITS;
+            if (test_and_clear_bit(nr, migration_bitmap)) {
+                migration_dirty_pages--;
+            }
+            bytes_transferred += ram_save_page(f, req->block, req->offset, 0,
+                                               true, false);
+            last_sent_block = req->block;
+            qemu_fflush(f);
+
+            postcopy_stats_account(qemu_get_clock_ns(rt_clock) - req->time);
+            g_free(req);
+            continue;
+        }
+
+        /* all pages sent, requests from now on are for pages in flight */
+        if (ram_save_block(f, true, &bytes_transferred) == 0) {
+            break;
+        }
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+    qemu_fflush(f);
+
+    return NULL;
+}
+
+static void *postcopy_return_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_send.return_file;
+    PostcopyRequest *req;
+    RAMBlock *block;
+    ram_addr_t offset;
+    char id[256];
+    uint8_t len;
+
+    while (true) {
+        offset = qemu_get_be64(f);
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        /* the destination closes the channel when it has all pages */
+        if (qemu_file_get_error(f)) {
+            break;
+        }
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length) {
+            error_report("post-copy: invalid page request for %s at "
+                         RAM_ADDR_FMT, id, offset);
+            break;
+        }
+
+        req = g_new0(PostcopyRequest, 1);
+        req->block = block;
+        req->offset = offset & TARGET_PAGE_MASK;
+        req->time = qemu_get_clock_ns(rt_clock);
+
+        qemu_mutex_lock(&postcopy_send.lock);
+        QSIMPLEQ_INSERT_TAIL(&postcopy_send.requests, req, next);
+        qemu_mutex_unlock(&postcopy_send.lock);
+    }
+
+    return NULL;
+}
+
+/*
+ * Switches to post-copy, called with the guest stopped.
+ *
+ * Returns: true if the destination now runs the guest, false if the
+ * migration has to be completed without post-copy.
+ */
+static bool ram_postcopy_start(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    int32_t status;
+    int fd;
+
+    postcopy_send.file = migrate_open_channel(migrate_get_current(),
+                                              &local_err);
+    if (!postcopy_send.file) {
+        error_report("post-copy: %s, completing without post-copy",
+                     error_get_pretty(local_err));
+        error_free(local_err);
+        return false;
+    }
+
+    fd = dup(qemu_get_fd(postcopy_send.file));
+    if (fd < 0) {
+        error_report("post-copy: %s, completing without post-copy",
+                     strerror(errno));
+        qemu_fclose(postcopy_send.file);
+        return false;
+    }
+    postcopy_send.return_file = qemu_fopen_socket(fd, "rb");
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+    postcopy_send_discard(f);
+    qemu_fflush(f);
+
+    /* 0 once the destination traps accesses to the pages still missing */
+    status = qemu_get_be32(postcopy_send.return_file);
+    if (qemu_file_get_error(postcopy_send.return_file) || status) {
+        error_report("post-copy: the destination cannot run the guest yet, "
+                     "completing without post-copy");
+        qemu_fclose(postcopy_send.return_file);
+        qemu_fclose(postcopy_send.file);
+        return false;
+    }
+
+    qemu_mutex_init(&postcopy_send.lock);
+    QSIMPLEQ_INIT(&postcopy_send.requests);
+    postcopy_stats_reset();
+    postcopy_send.active = true;
+
+    qemu_thread_create(&postcopy_send.send_thread, postcopy_send_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&postcopy_send.return_thread, postcopy_return_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    return true;
+}
+
+bool ram_postcopy_active(void)
+{
+    return postcopy_send.active;
+}
+
+/*
+ * ram_postcopy_wait: Waits until all pages have been sent in post-copy
+ *
+ * Called from the migration thread after the device state has been sent.
+ */
+int ram_postcopy_wait(void)
+{
+    PostcopyRequest *req;
+    int ret;
+
+    if (!postcopy_send.active) {
+        return 0;
+    }
+
+    qemu_thread_join(&postcopy_send.send_thread);
+    ret = qemu_file_get_error(postcopy_send.file);
+
+    /* stop waiting for requests, all pages are on their way */
+    shutdown(qemu_get_fd(postcopy_send.return_file), SHUT_RDWR);
+    qemu_thread_join(&postcopy_send.return_thread);
+
+    while ((req = QSIMPLEQ_FIRST(&postcopy_send.requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&postcopy_send.requests, next);
+        g_free(req);
+    }
+    qemu_mutex_destroy(&postcopy_send.lock);
+    qemu_fclose(postcopy_send.return_file);
+    if (qemu_fclose(postcopy_send.file) < 0 && !ret) {
+        ret = -EIO;
+    }
+    postcopy_send.active = false;
+
+    qemu_mutex_lock_iothread();
+    migration_end();
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
 static int ram_save_complete(QEMUFile *f, void *opaque)
 {
+    int ret = 0;
+
     qemu_mutex_lock_ramlist();
     migration_bitmap_sync();
 
@@ -731,24 +1680,36 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
-    while (true) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f, true);
-        /* no more blocks to sent */
-        if (bytes_sent == 0) {
-            break;
+    if (migrate_postcopy_ram() && ram_save_remaining() &&
+        ram_postcopy_start(f)) {
+        /* the send thread takes care of the remaining pages */
+    } else if (ram_send.num) {
+        int64_t bytes_sent = ram_save_channels_round(f, true);
+
+        if (bytes_sent < 0) {
+            ret = bytes_sent;
+        } else {
+            bytes_transferred += bytes_sent;
         }
-        bytes_transferred += bytes_sent;
+    } else {
+        while (true) {
+            /* no more blocks to sent */
+            if (ram_save_block(f, true, &bytes_transferred) == 0) {
+                break;
+            }
+        }
+        bytes_transferred += compress_flush(f);
     }
 
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
-    migration_end();
+    if (!postcopy_send.active) {
+        migration_end();
+    }
 
     qemu_mutex_unlock_ramlist();
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
-    return 0;
+    return ret;
 }
 
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
@@ -766,18 +1727,16 @@ static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
     return remaining_size;
 }
 
-static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
+static int load_xbzrle(QEMUFile *f, int xh_flags, void *host)
 {
     int ret, rc = 0;
     unsigned int xh_len;
-    int xh_flags;
 
     if (!XBZRLE.decoded_buf) {
         XBZRLE.decoded_buf = g_malloc(TARGET_PAGE_SIZE);
     }
 
     /* extract RLE header */
-    xh_flags = qemu_get_byte(f);
     xh_len = qemu_get_be16(f);
 
     if (xh_flags != ENCODING_FLAG_XBZRLE) {
@@ -807,60 +1766,898 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return rc;
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+/*
+ * Decompression threads, the counterpart of the compression threads
+ *
+ * ram_load() reads each compressed page into the buffer of an idle thread,
+ * which inflates it straight into guest RAM.  Since the source only sends a
+ * page again after the end of an iteration, ram_load() waits for all the
+ * threads before returning.
+ */
+typedef struct DecompressThread {
+    QemuThread thread;
+    QemuSemaphore sem;
+    bool quit;
+    /* protected by decompress_recv.lock */
+    bool busy;
+    z_stream stream;
+    uint8_t *buf;
+    int len;
+    void *host;
+} DecompressThread;
+
+static struct {
+    DecompressThread *threads;
+    int num;
+    int error;
+    QemuMutex lock;
+    QemuCond cond;
+} decompress_recv;
+
+static void *decompress_thread(void *opaque)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    DecompressThread *t = opaque;
+    z_stream *stream = &t->stream;
+    bool ok;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
+    while (true) {
+        qemu_sem_wait(&t->sem);
+        if (t->quit) {
+            break;
         }
 
-        return memory_region_get_ram_ptr(block->mr) + offset;
-    }
-
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+        ok = false;
+        if (inflateReset(stream) == Z_OK) {
+            stream->next_in = t->buf;
+            stream->avail_in = t->len;
+            stream->next_out = t->host;
+            stream->avail_out = TARGET_PAGE_SIZE;
+            ok = inflate(stream, Z_FINISH) == Z_STREAM_END &&
+                 stream->avail_out == 0;
+        }
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return memory_region_get_ram_ptr(block->mr) + offset;
+        qemu_mutex_lock(&decompress_recv.lock);
+        if (!ok) {
+            decompress_recv.error = -EINVAL;
+        }
+        t->busy = false;
+        qemu_cond_signal(&decompress_recv.cond);
+        qemu_mutex_unlock(&decompress_recv.lock);
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
     return NULL;
 }
 
-/*
- * If a page (or a whole RDMA chunk) has been
- * determined to be zero, then zap it.
- */
-void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+static void decompress_threads_stop(void)
 {
-    if (ch != 0 || !is_zero_page(host)) {
-        memset(host, ch, size);
-#ifndef _WIN32
-        if (ch == 0 &&
-            (!kvm_enabled() || kvm_has_sync_mmu()) &&
-            getpagesize() <= TARGET_PAGE_SIZE) {
-            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
-        }
-#endif
+    DecompressThread *t;
+    int i;
+
+    for (i = 0; i < decompress_recv.num; i++) {
+        t = &decompress_recv.threads[i];
+        t->quit = true;
+        qemu_sem_post(&t->sem);
+        qemu_thread_join(&t->thread);
+        qemu_sem_destroy(&t->sem);
+        inflateEnd(&t->stream);
+        g_free(t->buf);
+    }
+
+    if (decompress_recv.threads) {
+        g_free(decompress_recv.threads);
+        decompress_recv.threads = NULL;
+        decompress_recv.num = 0;
+        qemu_cond_destroy(&decompress_recv.cond);
+        qemu_mutex_destroy(&decompress_recv.lock);
     }
 }
 
-static int ram_load(QEMUFile *f, void *opaque, int version_id)
+static int decompress_threads_start(int num)
 {
-    ram_addr_t addr;
+    DecompressThread *t;
+    int i;
+
+    qemu_mutex_init(&decompress_recv.lock);
+    qemu_cond_init(&decompress_recv.cond);
+    decompress_recv.threads = g_new0(DecompressThread, num);
+    decompress_recv.error = 0;
+
+    for (i = 0; i < num; i++) {
+        t = &decompress_recv.threads[i];
+        if (inflateInit(&t->stream) != Z_OK) {
+            fprintf(stderr, "Failed to initialize decompression\n");
+            decompress_threads_stop();
+            return -EINVAL;
+        }
+        t->buf = g_malloc(TARGET_PAGE_SIZE);
+        qemu_sem_init(&t->sem, 0);
+        qemu_thread_create(&t->thread, decompress_thread, t,
+                           QEMU_THREAD_JOINABLE);
+        decompress_recv.num++;
+    }
+
+    return 0;
+}
+
+/* Waits until all compressed pages have been written to guest RAM */
+static int decompress_wait(void)
+{
+    int i, ret;
+
+    if (!decompress_recv.threads) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decompress_recv.lock);
+    for (i = 0; i < decompress_recv.num; i++) {
+        while (decompress_recv.threads[i].busy) {
+            qemu_cond_wait(&decompress_recv.cond, &decompress_recv.lock);
+        }
+    }
+    ret = decompress_recv.error;
+    qemu_mutex_unlock(&decompress_recv.lock);
+
+    if (ret < 0) {
+        fprintf(stderr, "Failed to load compressed page - decode error!\n");
+    }
+    return ret;
+}
+
+static int load_compressed(QEMUFile *f, void *host)
+{
+    DecompressThread *t = NULL;
+    unsigned int len;
+    int i, ret;
+
+    len = qemu_get_be16(f);
+    if (len == 0 || len > TARGET_PAGE_SIZE) {
+        fprintf(stderr, "Failed to load compressed page - len overflow!\n");
+        return -EINVAL;
+    }
+
+    if (!decompress_recv.threads) {
+        ret = decompress_threads_start(migrate_decompress_threads());
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    qemu_mutex_lock(&decompress_recv.lock);
+    while (true) {
+        for (i = 0; i < decompress_recv.num; i++) {
+            if (!decompress_recv.threads[i].busy) {
+                t = &decompress_recv.threads[i];
+                break;
+            }
+        }
+        if (t) {
+            break;
+        }
+        qemu_cond_wait(&decompress_recv.cond, &decompress_recv.lock);
+    }
+    qemu_mutex_unlock(&decompress_recv.lock);
+
+    qemu_get_buffer(f, t->buf, len);
+    t->len = len;
+    t->host = host;
+    qemu_mutex_lock(&decompress_recv.lock);
+    t->busy = true;
+    qemu_mutex_unlock(&decompress_recv.lock);
+    qemu_sem_post(&t->sem);
+
+    return 0;
+}
+
+/* @last_block is the block of the previous page of the same stream */
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags,
+                                            RAMBlock **last_block)
+{
+    RAMBlock *block = *last_block;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!block) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return memory_region_get_ram_ptr(block->mr) + offset;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *last_block = block;
+            return memory_region_get_ram_ptr(block->mr) + offset;
+        }
+    }
+
+    *last_block = NULL;
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+/*
+ * If a page (or a whole RDMA chunk) has been
+ * determined to be zero, then zap it.
+ */
+void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
+{
+    if (ch != 0 || !is_zero_page(host)) {
+        memset(host, ch, size);
+#ifndef _WIN32
+        if (ch == 0 &&
+            (!kvm_enabled() || kvm_has_sync_mmu()) &&
+            getpagesize() <= TARGET_PAGE_SIZE) {
+            qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+        }
+#endif
+    }
+}
+
+/*
+ * RAM receive channels, the counterpart of the RAM send channels
+ *
+ * Each channel is read by its own thread, which loads pages into guest RAM
+ * as they arrive and counts the rounds that ended on the channel.  When the
+ * main stream asks for a sync, ram_load() waits until every channel has
+ * completed the same number of rounds.  It runs in the incoming migration
+ * coroutine, so it yields to the main loop while it waits; the channel
+ * threads wake it up through a bottom half.
+ */
+typedef struct RamLoadChannel {
+    QemuThread thread;
+    QEMUFile *file;
+    uint64_t rounds;
+    int error;
+} RamLoadChannel;
+
+static struct {
+    RamLoadChannel *channels;
+    int num;
+    uint64_t syncs;
+    QemuMutex lock;
+    QEMUBH *bh;
+    /* the coroutine waiting in ram_load_channels_sync() */
+    Coroutine *co;
+} ram_recv;
+
+static void ram_load_channels_bh(void *opaque)
+{
+    if (ram_recv.co) {
+        qemu_coroutine_enter(ram_recv.co, NULL);
+    }
+}
+
+static void *ram_load_channel_thread(void *opaque)
+{
+    RamLoadChannel *c = opaque;
+    RAMBlock *last_block = NULL;
+    ram_addr_t addr;
+    void *host;
+    int flags, ret = 0;
+
+    while (!ret) {
+        addr = qemu_get_be64(c->file);
+        /* a failed or truncated read must not be parsed as flags */
+        ret = qemu_file_get_error(c->file);
+        if (ret) {
+            break;
+        }
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            qemu_mutex_lock(&ram_recv.lock);
+            c->rounds++;
+            qemu_mutex_unlock(&ram_recv.lock);
+            qemu_bh_schedule(ram_recv.bh);
+        } else if (flags & (RAM_SAVE_FLAG_COMPRESS | RAM_SAVE_FLAG_PAGE)) {
+            host = host_from_stream_offset(c->file, addr, flags, &last_block);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+
+            if (flags & RAM_SAVE_FLAG_COMPRESS) {
+                ram_handle_compressed(host, qemu_get_byte(c->file),
+                                      TARGET_PAGE_SIZE);
+            } else {
+                qemu_get_buffer(c->file, host, TARGET_PAGE_SIZE);
+            }
+        } else {
+            fprintf(stderr, "Unexpected flags 0x%x on RAM channel\n", flags);
+            ret = -EINVAL;
+            break;
+        }
+        ret = qemu_file_get_error(c->file);
+    }
+
+    /* also reached when the source closes the channel after the last round */
+    qemu_mutex_lock(&ram_recv.lock);
+    c->error = ret;
+    qemu_mutex_unlock(&ram_recv.lock);
+    qemu_bh_schedule(ram_recv.bh);
+
+    return NULL;
+}
+
+static int ram_load_channels_open(int num)
+{
+    Error *local_err = NULL;
+    RamLoadChannel *c;
+    int i;
+
+    if (ram_recv.channels) {
+        fprintf(stderr, "RAM channels are already open\n");
+        return -EINVAL;
+    }
+    if (num < 1 || num > MAX_MIGRATION_CHANNELS) {
+        fprintf(stderr, "Invalid number of RAM channels %d\n", num);
+        return -EINVAL;
+    }
+
+    qemu_mutex_init(&ram_recv.lock);
+    ram_recv.bh = qemu_bh_new(ram_load_channels_bh, NULL);
+    ram_recv.channels = g_new0(RamLoadChannel, num);
+    ram_recv.syncs = 0;
+
+    for (i = 0; i < num; i++) {
+        c = &ram_recv.channels[i];
+        c->file = migration_incoming_accept_channel(&local_err);
+        if (!c->file) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            return -EIO;
+        }
+        qemu_thread_create(&c->thread, ram_load_channel_thread, c,
+                           QEMU_THREAD_JOINABLE);
+        ram_recv.num++;
+    }
+
+    return 0;
+}
+
+static int ram_load_channels_expect(QEMUFile *f)
+{
+    uint32_t num = qemu_get_be32(f);
+    uint64_t token = qemu_get_be64(f);
+
+    if (num > MAX_MIGRATION_CHANNELS + 1) {
+        fprintf(stderr, "Invalid number of migration connections %u\n", num);
+        return -EINVAL;
+    }
+    migration_incoming_expect_channels(num, token);
+    return 0;
+}
+
+static int ram_load_channels_sync(void)
+{
+    RamLoadChannel *c;
+    int i, ret = 0;
+
+    if (!ram_recv.channels) {
+        fprintf(stderr, "RAM channel sync without open channels\n");
+        return -EINVAL;
+    }
+
+    ram_recv.syncs++;
+
+    qemu_mutex_lock(&ram_recv.lock);
+    for (i = 0; i < ram_recv.num; i++) {
+        c = &ram_recv.channels[i];
+        while (c->rounds < ram_recv.syncs && !c->error) {
+            /* the bottom half cannot run before we yield */
+            qemu_mutex_unlock(&ram_recv.lock);
+            ram_recv.co = qemu_coroutine_self();
+            qemu_coroutine_yield();
+            ram_recv.co = NULL;
+            qemu_mutex_lock(&ram_recv.lock);
+        }
+        if (c->rounds < ram_recv.syncs) {
+            ret = c->error;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&ram_recv.lock);
+
+    return ret;
+}
+
+void ram_load_cleanup(void)
+{
+    RamLoadChannel *c;
+    int i;
+
+    decompress_threads_stop();
+
+    if (!ram_recv.channels) {
+        return;
+    }
+
+    for (i = 0; i < ram_recv.num; i++) {
+        c = &ram_recv.channels[i];
+        /* wake up the thread if the source did not close the channel yet */
+        shutdown(qemu_get_fd(c->file), SHUT_RDWR);
+        qemu_thread_join(&c->thread);
+        qemu_fclose(c->file);
+    }
+
+    g_free(ram_recv.channels);
+    ram_recv.channels = NULL;
+    ram_recv.num = 0;
+    qemu_bh_delete(ram_recv.bh);
+    qemu_mutex_destroy(&ram_recv.lock);
+}
+
+/*
+ * Drops the pages that were dirty on the source when post-copy started.
+ * The list is only consumed if @apply is false, the source then resends
+ * those pages on the main stream.
+ */
+static int ram_load_postcopy_discard(QEMUFile *f, bool apply)
+{
+    RAMBlock *block;
+    ram_addr_t start, length;
+    char id[256];
+    uint8_t len;
+
+    while ((len = qemu_get_byte(f)) != 0) {
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block) {
+            fprintf(stderr, "Can't find block %s!\n", id);
+            return -EINVAL;
+        }
+
+        while (true) {
+            start = qemu_get_be64(f);
+            length = qemu_get_be64(f);
+            if (!length) {
+                break;
+            }
+            if (start + length > block->length) {
+                fprintf(stderr, "Invalid discard range for block %s\n", id);
+                return -EINVAL;
+            }
+            if (!apply) {
+                continue;
+            }
+            qemu_madvise(memory_region_get_ram_ptr(block->mr) + start, length,
+                         QEMU_MADV_DONTNEED);
+        }
+    }
+
+    return qemu_file_get_error(f);
+}
+
+#ifdef CONFIG_USERFAULTFD
+#define POSTCOPY_MAX_FAULTS 256
+
+static struct {
+    int uffd;
+    int quit_fds[2];
+    QEMUFile *file;
+    QEMUFile *request_file;
+    QemuThread fault_thread;
+    QemuThread listen_thread;
+    uint8_t *page;
+
+    /* the listen thread cannot exit the process itself */
+    QEMUBH *error_bh;
+    int error;
+
+    /* pages requested and not placed yet, to measure the fault latency */
+    QemuMutex lock;
+    struct {
+        void *host;
+        int64_t time;
+    } faults[POSTCOPY_MAX_FAULTS];
+    int num_faults;
+} postcopy_recv;
+
+static RAMBlock *ram_block_from_host(void *host, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    uint8_t *start;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        start = memory_region_get_ram_ptr(block->mr);
+        if ((uint8_t *)host >= start &&
+            (uint8_t *)host < start + block->length) {
+            *offset = (uint8_t *)host - start;
+            return block;
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_request_page(void *host)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+    QEMUFile *f = postcopy_recv.request_file;
+    int i;
+
+    block = ram_block_from_host(host, &offset);
+    if (!block) {
+        error_report("post-copy: fault outside of guest RAM at %p", host);
+        return;
+    }
+
+    qemu_mutex_lock(&postcopy_recv.lock);
+    for (i = 0; i < postcopy_recv.num_faults; i++) {
+        if (postcopy_recv.faults[i].host == host) {
+            /* already requested for another vCPU */
+            qemu_mutex_unlock(&postcopy_recv.lock);
+            return;
+        }
+    }
+    if (postcopy_recv.num_faults < POSTCOPY_MAX_FAULTS) {
+        i = postcopy_recv.num_faults++;
+        postcopy_recv.faults[i].host = host;
+        postcopy_recv.faults[i].time = qemu_get_clock_ns(rt_clock);
+    }
+    qemu_mutex_unlock(&postcopy_recv.lock);
+
+    qemu_put_be64(f, offset);
+    qemu_put_byte(f, strlen(block->idstr));
+    qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+    qemu_fflush(f);
+}
+
+static void postcopy_page_placed(void *host)
+{
+    int i;
+
+    qemu_mutex_lock(&postcopy_recv.lock);
+    for (i = 0; i < postcopy_recv.num_faults; i++) {
+        if (postcopy_recv.faults[i].host == host) {
+            postcopy_stats_account(qemu_get_clock_ns(rt_clock) -
+                                   postcopy_recv.faults[i].time);
+            postcopy_recv.faults[i] =
+                postcopy_recv.faults[--postcopy_recv.num_faults];
+            break;
+        }
+    }
+    qemu_mutex_unlock(&postcopy_recv.lock);
+}
+
+static void *postcopy_fault_thread(void *opaque)
+{
+    struct uffd_msg msg;
+    struct pollfd pfd[2];
+    ssize_t ret;
+
+    while (true) {
+        pfd[0].fd = postcopy_recv.uffd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = postcopy_recv.quit_fds[0];
+        pfd[1].events = POLLIN;
+
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        ret = read(postcopy_recv.uffd, &msg, sizeof(msg));
+        if (ret != sizeof(msg)) {
+            if (ret < 0 && (errno == EAGAIN || errno == EINTR)) {
+                continue;
+            }
+            error_report("post-copy: failed to read userfaultfd event");
+            break;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        postcopy_request_page((void *)(uintptr_t)
+                              (msg.arg.pagefault.address & TARGET_PAGE_MASK));
+    }
+
+    return NULL;
+}
+
+/* Atomically places a page and wakes up the threads that wait for it */
+static int postcopy_place_page(void *host, uint8_t ch, bool zero)
+{
+    struct uffdio_zeropage zeropage;
+    struct uffdio_copy copy;
+    int ret;
+
+    if (zero) {
+        zeropage.range.start = (uintptr_t)host;
+        zeropage.range.len = TARGET_PAGE_SIZE;
+        zeropage.mode = 0;
+        ret = ioctl(postcopy_recv.uffd, UFFDIO_ZEROPAGE, &zeropage);
+    } else {
+        if (ch) {
+            memset(postcopy_recv.page, ch, TARGET_PAGE_SIZE);
+        }
+        copy.dst = (uintptr_t)host;
+        copy.src = (uintptr_t)postcopy_recv.page;
+        copy.len = TARGET_PAGE_SIZE;
+        copy.mode = 0;
+        ret = ioctl(postcopy_recv.uffd, UFFDIO_COPY, &copy);
+    }
+
+    /* the page may have been sent twice if it was requested in flight */
+    if (ret < 0 && errno != EEXIST) {
+        return -errno;
+    }
+
+    postcopy_page_placed(host);
+    return 0;
+}
+
+static void *postcopy_listen_thread(void *opaque)
+{
+    QEMUFile *f = postcopy_recv.file;
+    RAMBlock *last_block = NULL;
+    RAMBlock *block;
+    ram_addr_t addr;
+    void *host;
+    uint8_t ch;
+    int flags, ret = 0;
+
+    while (!ret) {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            host = host_from_stream_offset(f, addr, flags, &last_block);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            ch = qemu_get_byte(f);
+            ret = postcopy_place_page(host, ch, ch == 0);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            host = host_from_stream_offset(f, addr, flags, &last_block);
+            if (!host) {
+                ret = -EINVAL;
+                break;
+            }
+            qemu_get_buffer(f, postcopy_recv.page, TARGET_PAGE_SIZE);
+            ret = postcopy_place_page(host, 0, false);
+        } else {
+            fprintf(stderr, "Unexpected flags 0x%x in post-copy\n", flags);
+            ret = -EINVAL;
+        }
+        if (!ret) {
+            ret = qemu_file_get_error(f);
+        }
+    }
+
+    if (ret < 0) {
+        postcopy_recv.error = ret;
+        qemu_bh_schedule(postcopy_recv.error_bh);
+        return NULL;
+    }
+
+    /* all pages are present, stop trapping accesses */
+    if (write(postcopy_recv.quit_fds[1], "", 1) != 1) {
+        error_report("post-copy: failed to stop fault thread");
+    }
+    qemu_thread_join(&postcopy_recv.fault_thread);
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)memory_region_get_ram_ptr(block->mr),
+            .len = block->length,
+        };
+        ioctl(postcopy_recv.uffd, UFFDIO_UNREGISTER, &range);
+    }
+    close(postcopy_recv.uffd);
+    close(postcopy_recv.quit_fds[0]);
+    close(postcopy_recv.quit_fds[1]);
+    qemu_fclose(postcopy_recv.request_file);
+    qemu_fclose(f);
+    qemu_vfree(postcopy_recv.page);
+    qemu_mutex_destroy(&postcopy_recv.lock);
+    qemu_bh_delete(postcopy_recv.error_bh);
+
+    return NULL;
+}
+
+/* Runs in the main loop once the listen thread gave up */
+static void postcopy_error_bh(void *opaque)
+{
+    /* the guest cannot continue without its memory */
+    error_report("post-copy migration failed: %s",
+                 strerror(-postcopy_recv.error));
+    exit(EXIT_FAILURE);
+}
+
+static int postcopy_register_ram(void)
+{
+    struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+    struct uffdio_register reg;
+    RAMBlock *block;
+    uint64_t needed = (1ULL << _UFFDIO_COPY) | (1ULL << _UFFDIO_ZEROPAGE);
+
+    postcopy_recv.uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (postcopy_recv.uffd < 0) {
+        error_report("post-copy: userfaultfd not available: %s",
+                     strerror(errno));
+        return -errno;
+    }
+
+    if (ioctl(postcopy_recv.uffd, UFFDIO_API, &api) < 0) {
+        error_report("post-copy: userfaultfd API mismatch");
+        goto fail;
+    }
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        reg.range.start = (uintptr_t)memory_region_get_ram_ptr(block->mr);
+        reg.range.len = block->length;
+        reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+        if (ioctl(postcopy_recv.uffd, UFFDIO_REGISTER, &reg) < 0 ||
+            (reg.ioctls & needed) != needed) {
+            error_report("post-copy: cannot register block %s: %s",
+                         block->idstr, strerror(errno));
+            goto fail;
+        }
+    }
+    return 0;
+
+fail:
+    close(postcopy_recv.uffd);
+    return -EINVAL;
+}
+
+/* Checks that accesses to the missing pages can be trapped and does so */
+static int postcopy_ram_prepare(void)
+{
+#ifndef TARGET_S390X
+    RAMBlock *block;
+#endif
+    int ret;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        error_report("post-copy needs the host page size to match the "
+                     "target page size");
+        return -EINVAL;
+    }
+#ifndef TARGET_S390X
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->fd) {
+            error_report("post-copy does not support file backed RAM");
+            return -EINVAL;
+        }
+    }
+#endif
+
+    ret = postcopy_register_ram();
+    if (ret < 0) {
+        return ret;
+    }
+    if (qemu_pipe(postcopy_recv.quit_fds) < 0) {
+        ret = -errno;
+        close(postcopy_recv.uffd);
+        return ret;
+    }
+    return 0;
+}
+
+static void postcopy_ram_abort(void)
+{
+    close(postcopy_recv.uffd);
+    close(postcopy_recv.quit_fds[0]);
+    close(postcopy_recv.quit_fds[1]);
+}
+
+static void postcopy_ram_start(QEMUFile *file, QEMUFile *request_file)
+{
+    postcopy_recv.file = file;
+    postcopy_recv.request_file = request_file;
+    postcopy_recv.page = qemu_memalign(TARGET_PAGE_SIZE, TARGET_PAGE_SIZE);
+    postcopy_recv.num_faults = 0;
+    qemu_mutex_init(&postcopy_recv.lock);
+    postcopy_recv.error_bh = qemu_bh_new(postcopy_error_bh, NULL);
+    postcopy_stats_reset();
+
+    qemu_thread_create(&postcopy_recv.fault_thread, postcopy_fault_thread,
+                       NULL, QEMU_THREAD_JOINABLE);
+    qemu_thread_create(&postcopy_recv.listen_thread, postcopy_listen_thread,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+#else
+static int postcopy_ram_prepare(void)
+{
+    error_report("post-copy migration is not supported on this host");
+    return -ENOSYS;
+}
+
+static void postcopy_ram_abort(void)
+{
+}
+
+static void postcopy_ram_start(QEMUFile *file, QEMUFile *request_file)
+{
+    abort();
+}
+#endif
+
+/*
+ * Answers the source on the post-copy channel.  If the pages cannot be
+ * trapped here, the source completes the migration without post-copy.
+ */
+static int ram_load_postcopy_start(QEMUFile *f)
+{
+    QEMUFile *file, *request_file;
+    Error *local_err = NULL;
+    int ret, status, fd;
+
+    file = migration_incoming_accept_channel(&local_err);
+    if (!file) {
+        error_report("%s", error_get_pretty(local_err));
+        error_free(local_err);
+        return -EIO;
+    }
+    fd = dup(qemu_get_fd(file));
+    if (fd < 0) {
+        ret = -errno;
+        qemu_fclose(file);
+        return ret;
+    }
+    request_file = qemu_fopen_socket(fd, "wb");
+
+    status = postcopy_ram_prepare();
+    ret = ram_load_postcopy_discard(f, status == 0);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    qemu_put_be32(request_file, status);
+    qemu_fflush(request_file);
+    ret = qemu_file_get_error(request_file);
+    if (ret < 0 || status) {
+        goto fail;
+    }
+
+    postcopy_ram_start(file, request_file);
+    return 0;
+
+fail:
+    if (!status) {
+        postcopy_ram_abort();
+    }
+    qemu_fclose(request_file);
+    qemu_fclose(file);
+    return ret;
+}
+
+static int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    ram_addr_t addr;
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    static RAMBlock *last_block;
 
     seq_iter++;
 
@@ -920,7 +2717,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             void *host;
             uint8_t ch;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, addr, flags, &last_block);
             if (!host) {
                 return -EINVAL;
             }
@@ -930,22 +2727,54 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         } else if (flags & RAM_SAVE_FLAG_PAGE) {
             void *host;
 
-            host = host_from_stream_offset(f, addr, flags);
+            host = host_from_stream_offset(f, addr, flags, &last_block);
             if (!host) {
                 return -EINVAL;
             }
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
-            void *host = host_from_stream_offset(f, addr, flags);
+            void *host = host_from_stream_offset(f, addr, flags, &last_block);
+            int encoding;
+
             if (!host) {
                 return -EINVAL;
             }
 
-            if (load_xbzrle(f, addr, host) < 0) {
+            encoding = qemu_get_byte(f);
+            if (encoding == ENCODING_FLAG_ZLIB) {
+                ret = load_compressed(f, host);
+            } else {
+                ret = load_xbzrle(f, encoding, host);
+            }
+            if (ret < 0) {
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_CHANNEL) {
+            switch (qemu_get_byte(f)) {
+            case RAM_CHANNEL_OPEN:
+                ret = ram_load_channels_open(qemu_get_be32(f));
+                break;
+            case RAM_CHANNEL_SYNC:
+                ret = ram_load_channels_sync();
+                break;
+            case RAM_CHANNEL_EXPECT:
+                ret = ram_load_channels_expect(f);
+                break;
+            default:
+                fprintf(stderr, "Unknown RAM channel command\n");
+                ret = -EINVAL;
+                break;
+            }
+            if (ret < 0) {
+                goto done;
+            }
+        } else if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            ret = ram_load_postcopy_start(f);
+            if (ret < 0) {
+                goto done;
+            }
         } else if (flags & RAM_SAVE_FLAG_HOOK) {
             ram_control_load_hook(f, flags);
         }
@@ -957,6 +2786,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    error = decompress_wait();
+    if (!ret) {
+        ret = error;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
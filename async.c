@@ -26,6 +26,7 @@
 #include "block/aio.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
+#include "qemu/atomic.h"
 
 /***********************************************************/
 /* bottom halves (can be seen as timers which expire ASAP) */
@@ -103,6 +104,20 @@ int aio_bh_poll(AioContext *ctx)
     return ret;
 }
 
+bool aio_bh_pending(AioContext *ctx)
+{
+    QEMUBH *bh;
+
+    for (bh = ctx->first_bh; bh; bh = bh->next) {
+        /* Make sure that fetching bh happens before accessing its members */
+        smp_read_barrier_depends();
+        if (!bh->deleted && bh->scheduled && !bh->idle) {
+            return true;
+        }
+    }
+    return false;
+}
+
 void qemu_bh_schedule_idle(QEMUBH *bh)
 {
     if (bh->scheduled)
@@ -204,6 +219,8 @@ aio_ctx_finalize(GSource     *source)
     aio_set_event_notifier(ctx, &ctx->notifier, NULL, NULL);
     event_notifier_cleanup(&ctx->notifier);
     qemu_mutex_destroy(&ctx->bh_lock);
+    qemu_cond_destroy(&ctx->lock_cond);
+    qemu_mutex_destroy(&ctx->lock);
     g_array_free(ctx->pollfds, TRUE);
 }
 
@@ -230,9 +247,35 @@ ThreadPool *aio_get_thread_pool(AioContext *ctx)
 
 void aio_notify(AioContext *ctx)
 {
+    atomic_set(&ctx->notified, true);
     event_notifier_set(&ctx->notifier);
 }
 
+static void aio_context_notifier_cb(EventNotifier *e)
+{
+    AioContext *ctx = container_of(e, AioContext, notifier);
+
+    atomic_set(&ctx->notified, false);
+    event_notifier_test_and_clear(e);
+}
+
+void aio_context_wait(AioContext *ctx)
+{
+    GPollFD pfd = {
+        .events = G_IO_IN,
+    };
+
+#ifdef CONFIG_POSIX
+    pfd.fd = event_notifier_get_fd(&ctx->notifier);
+#else
+    pfd.fd = (uintptr_t)event_notifier_get_handle(&ctx->notifier);
+#endif
+    if (!atomic_read(&ctx->notified)) {
+        g_poll(&pfd, 1, -1);
+    }
+    aio_context_notifier_cb(&ctx->notifier);
+}
+
 AioContext *aio_context_new(void)
 {
     AioContext *ctx;
@@ -240,10 +283,11 @@ AioContext *aio_context_new(void)
     ctx->pollfds = g_array_new(FALSE, FALSE, sizeof(GPollFD));
     ctx->thread_pool = NULL;
     qemu_mutex_init(&ctx->bh_lock);
+    qemu_mutex_init(&ctx->lock);
+    qemu_cond_init(&ctx->lock_cond);
     event_notifier_init(&ctx->notifier, false);
-    aio_set_event_notifier(ctx, &ctx->notifier, 
-                           (EventNotifierHandler *)
-                           event_notifier_test_and_clear, NULL);
+    aio_set_event_notifier(ctx, &ctx->notifier,
+                           aio_context_notifier_cb, NULL);
 
     return ctx;
 }
@@ -257,3 +301,36 @@ void aio_context_unref(AioContext *ctx)
 {
     g_source_unref(&ctx->source);
 }
+
+void aio_context_acquire(AioContext *ctx)
+{
+    unsigned int ticket;
+
+    qemu_mutex_lock(&ctx->lock);
+    if (ctx->nesting > 0 && qemu_thread_is_self(&ctx->owner)) {
+        ctx->nesting++;
+        qemu_mutex_unlock(&ctx->lock);
+        return;
+    }
+
+    ticket = ctx->tail++;
+    while (ctx->nesting > 0 || ticket != ctx->head) {
+        /* Kick the owner out of aio_poll() */
+        aio_notify(ctx);
+        qemu_cond_wait(&ctx->lock_cond, &ctx->lock);
+    }
+    qemu_thread_get_self(&ctx->owner);
+    ctx->nesting = 1;
+    qemu_mutex_unlock(&ctx->lock);
+}
+
+void aio_context_release(AioContext *ctx)
+{
+    qemu_mutex_lock(&ctx->lock);
+    assert(ctx->nesting > 0 && qemu_thread_is_self(&ctx->owner));
+    if (--ctx->nesting == 0) {
+        ctx->head++;
+        qemu_cond_broadcast(&ctx->lock_cond);
+    }
+    qemu_mutex_unlock(&ctx->lock);
+}
@@ -134,6 +134,10 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
         qemu_free_timer(bs->block_timer);
         bs->block_timer = NULL;
     }
+    if (bs->block_timer_bh) {
+        qemu_bh_delete(bs->block_timer_bh);
+        bs->block_timer_bh = NULL;
+    }
 
     bs->slice_start = 0;
     bs->slice_end   = 0;
@@ -142,14 +146,40 @@ void bdrv_io_limits_disable(BlockDriverState *bs)
 static void bdrv_block_timer(void *opaque)
 {
     BlockDriverState *bs = opaque;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
 
+    /* The timer runs in the main loop, which may not own @bs */
+    aio_context_acquire(aio_context);
     qemu_co_enter_next(&bs->throttled_reqs);
+    aio_context_release(aio_context);
+}
+
+/* QEMUTimers may only be touched from the main loop */
+static void bdrv_block_timer_arm_bh(void *opaque)
+{
+    BlockDriverState *bs = opaque;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+
+    aio_context_acquire(aio_context);
+    qemu_mod_timer(bs->block_timer, bs->block_timer_expire);
+    aio_context_release(aio_context);
+}
+
+static void bdrv_block_timer_arm(BlockDriverState *bs, int64_t expire_time)
+{
+    if (bdrv_get_aio_context(bs) == qemu_get_aio_context()) {
+        qemu_mod_timer(bs->block_timer, expire_time);
+    } else {
+        bs->block_timer_expire = expire_time;
+        qemu_bh_schedule(bs->block_timer_bh);
+    }
 }
 
 void bdrv_io_limits_enable(BlockDriverState *bs)
 {
     qemu_co_queue_init(&bs->throttled_reqs);
     bs->block_timer = qemu_new_timer_ns(vm_clock, bdrv_block_timer, bs);
+    bs->block_timer_bh = qemu_bh_new(bdrv_block_timer_arm_bh, bs);
     bs->io_limits_enabled = true;
 }
 
@@ -181,8 +211,7 @@ static void bdrv_io_limits_intercept(BlockDriverState *bs,
      */
 
     while (bdrv_exceed_io_limits(bs, nb_sectors, is_write, &wait_time)) {
-        qemu_mod_timer(bs->block_timer,
-                       wait_time + qemu_get_clock_ns(vm_clock));
+        bdrv_block_timer_arm(bs, wait_time + qemu_get_clock_ns(vm_clock));
         qemu_co_queue_wait_insert_head(&bs->throttled_reqs);
     }
 
@@ -306,6 +335,7 @@ BlockDriverState *bdrv_new(const char *device_name)
     bdrv_iostatus_disable(bs);
     notifier_list_init(&bs->close_notifiers);
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    bs->aio_context = qemu_get_aio_context();
 
     return bs;
 }
@@ -637,6 +667,30 @@ int bdrv_parse_cache_flags(const char *mode, int *flags)
     return 0;
 }
 
+/**
+ * Set open flags for a given AIO mode
+ *
+ * Return 0 on success, -1 if the mode string is invalid.
+ */
+int bdrv_parse_aio(const char *mode, int *flags)
+{
+    *flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+
+    if (!strcmp(mode, "threads")) {
+        /* this is the default */
+    } else if (!strcmp(mode, "native")) {
+        *flags |= BDRV_O_NATIVE_AIO;
+#ifdef CONFIG_LINUX_IO_URING
+    } else if (!strcmp(mode, "io_uring")) {
+        *flags |= BDRV_O_IO_URING;
+#endif
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * The copy-on-read flag is actually a reference count so multiple users may
  * use the feature without worrying about clobbering its previous state.
@@ -1440,6 +1494,23 @@ void bdrv_close_all(void)
  * coroutine is complete.  Because of this, it is not possible to have a
  * function to drain a single device's I/O queue.
  */
+static bool bdrv_requests_pending(BlockDriverState *bs)
+{
+    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+        return true;
+    }
+    if (!qemu_co_queue_empty(&bs->throttled_reqs)) {
+        return true;
+    }
+    if (bs->file && bdrv_requests_pending(bs->file)) {
+        return true;
+    }
+    if (bs->backing_hd && bdrv_requests_pending(bs->backing_hd)) {
+        return true;
+    }
+    return false;
+}
+
 void bdrv_drain_all(void)
 {
     BlockDriverState *bs;
@@ -1452,14 +1523,40 @@ void bdrv_drain_all(void)
          * a busy wait.
          */
         QTAILQ_FOREACH(bs, &bdrv_states, list) {
+            AioContext *aio_context = bdrv_get_aio_context(bs);
+
+            aio_context_acquire(aio_context);
             while (qemu_co_enter_next(&bs->throttled_reqs)) {
                 busy = true;
             }
+            /* Devices bound to another AioContext are not covered by
+             * qemu_aio_wait(); their thread is kicked out of aio_poll()
+             * by aio_context_acquire(), so poll on its behalf.  The context
+             * may contain handlers (e.g. the guest notifier) that never
+             * complete on their own, so only block while requests are in
+             * flight, and keep going until their completion bottom halves
+             * have run as well.
+             */
+            if (aio_context != qemu_get_aio_context()) {
+                aio_poll(aio_context, false);
+                if (bdrv_requests_pending(bs)) {
+                    aio_poll(aio_context, true);
+                    busy = true;
+                } else if (aio_bh_pending(aio_context)) {
+                    busy = true;
+                }
+            }
+            aio_context_release(aio_context);
         }
     } while (busy);
 
-    /* If requests are still pending there is a bug somewhere */
+    /* If requests are still pending there is a bug somewhere.  Devices in
+     * another AioContext may already have started new requests.
+     */
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
+        if (bdrv_get_aio_context(bs) != qemu_get_aio_context()) {
+            continue;
+        }
         assert(QLIST_EMPTY(&bs->tracked_requests));
         assert(qemu_co_queue_empty(&bs->throttled_reqs));
     }
@@ -1504,6 +1601,8 @@ static void bdrv_move_feature_fields(BlockDriverState *bs_dest,
     bs_dest->io_limits          = bs_src->io_limits;
     bs_dest->throttled_reqs     = bs_src->throttled_reqs;
     bs_dest->block_timer        = bs_src->block_timer;
+    bs_dest->block_timer_bh     = bs_src->block_timer_bh;
+    bs_dest->block_timer_expire = bs_src->block_timer_expire;
     bs_dest->io_limits_enabled  = bs_src->io_limits_enabled;
 
     /* r/w error */
@@ -2223,11 +2322,16 @@ static int bdrv_rwv_co(BlockDriverState *bs, int64_t sector_num,
         /* Fast-path if already in coroutine context */
         bdrv_rw_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        /* The device may be bound to a dataplane thread */
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_rw_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
     return rwco.ret;
 }
@@ -2936,7 +3040,12 @@ int bdrv_flush_all(void)
     int result = 0;
 
     QTAILQ_FOREACH(bs, &bdrv_states, list) {
-        int ret = bdrv_flush(bs);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        aio_context_acquire(aio_context);
+        ret = bdrv_flush(bs);
+        aio_context_release(aio_context);
         if (ret < 0 && !result) {
             result = ret;
         }
@@ -3037,12 +3146,16 @@ int bdrv_is_allocated(BlockDriverState *bs, int64_t sector_num, int nb_sectors,
         .pnum = pnum,
         .done = false,
     };
+    AioContext *aio_context = bdrv_get_aio_context(bs);
 
+    /* The device may be bound to a dataplane thread */
+    aio_context_acquire(aio_context);
     co = qemu_coroutine_create(bdrv_is_allocated_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
     return data.ret;
 }
 
@@ -3126,12 +3239,16 @@ int bdrv_is_allocated_above(BlockDriverState *top, BlockDriverState *base,
         .pnum = pnum,
         .done = false,
     };
+    AioContext *aio_context = bdrv_get_aio_context(top);
 
+    /* The device may be bound to a dataplane thread */
+    aio_context_acquire(aio_context);
     co = qemu_coroutine_create(bdrv_is_allocated_above_co_entry);
     qemu_coroutine_enter(co, &data);
     while (!data.done) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
     return data.ret;
 }
 
@@ -3155,6 +3272,9 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
                           const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    AioContext *aio_context;
+    int ret;
+
     if (!drv)
         return -ENOMEDIUM;
     if (!drv->bdrv_write_compressed)
@@ -3164,7 +3284,12 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     assert(!bs->dirty_bitmap);
 
-    return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    /* The driver polls the device's AioContext */
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    ret = drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
+    aio_context_release(aio_context);
+    return ret;
 }
 
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
@@ -3789,7 +3914,7 @@ static BlockDriverAIOCB *bdrv_aio_rw_vector(BlockDriverState *bs,
     acb->is_write = is_write;
     acb->qiov = qiov;
     acb->bounce = qemu_blockalign(bs, qiov->size);
-    acb->bh = qemu_bh_new(bdrv_aio_bh_cb, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_aio_bh_cb, acb);
 
     if (is_write) {
         qemu_iovec_to_buf(acb->qiov, 0, acb->bounce, qiov->size);
@@ -3830,12 +3955,15 @@ static void bdrv_aio_co_cancel_em(BlockDriverAIOCB *blockacb)
 {
     BlockDriverAIOCBCoroutine *acb =
         container_of(blockacb, BlockDriverAIOCBCoroutine, common);
+    AioContext *aio_context = bdrv_get_aio_context(acb->common.bs);
     bool done = false;
 
+    aio_context_acquire(aio_context);
     acb->done = &done;
     while (!done) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 }
 
 static const AIOCBInfo bdrv_em_co_aiocb_info = {
@@ -3871,7 +3999,7 @@ static void coroutine_fn bdrv_co_do_rw(void *opaque)
             acb->req.nb_sectors, acb->req.qiov, 0);
     }
 
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3905,7 +4033,7 @@ static void coroutine_fn bdrv_aio_flush_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_flush(bs);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -3932,7 +4060,7 @@ static void coroutine_fn bdrv_aio_discard_co_entry(void *opaque)
     BlockDriverState *bs = acb->common.bs;
 
     acb->req.error = bdrv_co_discard(bs, acb->req.sector, acb->req.nb_sectors);
-    acb->bh = qemu_bh_new(bdrv_co_em_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
     qemu_bh_schedule(acb->bh);
 }
 
@@ -4118,6 +4246,25 @@ void bdrv_invalidate_cache(BlockDriverState *bs)
     }
 }
 
+int bdrv_set_metadata_cache_size(BlockDriverState *bs, QDict *options,
+                                 Error **errp)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        error_set(errp, QERR_DEVICE_HAS_NO_MEDIUM, bdrv_get_device_name(bs));
+        return -ENOMEDIUM;
+    }
+    if (!drv->bdrv_set_metadata_cache_size) {
+        error_set(errp, QERR_BLOCK_FORMAT_FEATURE_NOT_SUPPORTED,
+                  drv->format_name, bdrv_get_device_name(bs),
+                  "metadata cache resizing");
+        return -ENOTSUP;
+    }
+
+    return drv->bdrv_set_metadata_cache_size(bs, options, errp);
+}
+
 void bdrv_invalidate_cache_all(void)
 {
     BlockDriverState *bs;
@@ -4148,11 +4295,16 @@ int bdrv_flush(BlockDriverState *bs)
         /* Fast-path if already in coroutine context */
         bdrv_flush_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        /* The device may be bound to a dataplane thread */
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_flush_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
 
     return rwco.ret;
@@ -4220,11 +4372,16 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
         /* Fast-path if already in coroutine context */
         bdrv_discard_co_entry(&rwco);
     } else {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        /* The device may be bound to a dataplane thread */
+        aio_context_acquire(aio_context);
         co = qemu_coroutine_create(bdrv_discard_co_entry);
         qemu_coroutine_enter(co, &rwco);
         while (rwco.ret == NOT_DONE) {
-            qemu_aio_wait();
+            aio_poll(aio_context, true);
         }
+        aio_context_release(aio_context);
     }
 
     return rwco.ret;
@@ -4613,8 +4770,101 @@ out:
 
 AioContext *bdrv_get_aio_context(BlockDriverState *bs)
 {
-    /* Currently BlockDriverState always uses the main loop AioContext */
-    return qemu_get_aio_context();
+    return bs->aio_context;
+}
+
+static void bdrv_detach_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->drv->bdrv_detach_aio_context) {
+        bs->drv->bdrv_detach_aio_context(bs);
+    }
+    if (bs->file) {
+        bdrv_detach_aio_context(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_detach_aio_context(bs->backing_hd);
+    }
+
+    bs->aio_context = NULL;
+}
+
+static void bdrv_attach_aio_context(BlockDriverState *bs,
+                                    AioContext *new_context)
+{
+    bs->aio_context = new_context;
+
+    if (!bs->drv) {
+        return;
+    }
+
+    if (bs->backing_hd) {
+        bdrv_attach_aio_context(bs->backing_hd, new_context);
+    }
+    if (bs->file) {
+        bdrv_attach_aio_context(bs->file, new_context);
+    }
+    if (bs->drv->bdrv_attach_aio_context) {
+        bs->drv->bdrv_attach_aio_context(bs, new_context);
+    }
+}
+
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
+{
+    bdrv_drain_all(); /* ensure there are no in-flight requests */
+
+    bdrv_detach_aio_context(bs);
+
+    /* This function executes in the old AioContext so acquire the new one in
+     * case it runs in a different thread.
+     */
+    aio_context_acquire(new_context);
+    bdrv_attach_aio_context(bs, new_context);
+    aio_context_release(new_context);
+}
+
+bool bdrv_can_set_aio_context(BlockDriverState *bs)
+{
+    if (!bs->drv) {
+        return true;
+    }
+
+    /* Protocols that register file descriptors must know how to move them */
+    if (bs->drv->bdrv_file_open && !bs->drv->bdrv_attach_aio_context) {
+        return false;
+    }
+    if (bs->file && !bdrv_can_set_aio_context(bs->file)) {
+        return false;
+    }
+    if (bs->backing_hd && !bdrv_can_set_aio_context(bs->backing_hd)) {
+        return false;
+    }
+    return true;
+}
+
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
 }
 
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
@@ -0,0 +1,356 @@
+/*
+ * Linux io_uring support.
+ *
+ * Based on linux-aio.c:
+ * Copyright (C) 2009 IBM, Corp.
+ * Copyright (C) 2009 Red Hat, Inc.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/main-loop.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "qemu/queue.h"
+
+#include <liburing.h>
+#include <linux/falloc.h>
+
+/*
+ * Submission queue size (per-device).
+ *
+ * Requests are only held in the submission queue until the next batch is
+ * handed to the kernel, so this bounds the number of requests queued in one
+ * event loop iteration rather than the number of requests in flight.
+ */
+#define MAX_ENTRIES 128
+
+/*
+ * The kernel sizes the completion queue at twice the submission queue.
+ * Kernels before Linux 5.5 drop completions that do not fit, so requests
+ * beyond this wait in a queue of their own until others complete.
+ */
+#define MAX_IN_FLIGHT (2 * MAX_ENTRIES)
+
+typedef struct LuringAIOCB {
+    BlockDriverAIOCB common;
+    LuringState *s;
+    QEMUIOVector *qiov;
+    ssize_t ret;
+    size_t nbytes;
+    int type;
+    int fd;
+    off_t offset;
+    int nb_sectors;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+} LuringAIOCB;
+
+struct LuringState {
+    struct io_uring ring;
+    EventNotifier e;            /* signalled by the kernel on completion */
+    QEMUBH *submit_bh;          /* submits the batch of queued requests */
+    unsigned int in_queue;      /* requests prepared but not yet submitted */
+    unsigned int in_flight;     /* requests prepared and not yet completed */
+    QSIMPLEQ_HEAD(, LuringAIOCB) deferred; /* requests not prepared yet */
+};
+
+static void luring_submit_pending(LuringState *s);
+static void luring_resume_deferred(LuringState *s);
+
+/*
+ * Completes an AIO request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(LuringState *s, LuringAIOCB *acb)
+{
+    int ret;
+
+    s->in_flight--;
+
+    /* luring_cancel() never cancels a request, so -ECANCELED can only come
+     * from the kernel and must be reported like any other error.
+     */
+    ret = acb->ret;
+    if (ret == acb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (acb->type == QEMU_AIO_READ) {
+            qemu_iovec_memset(acb->qiov, ret, 0, acb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    } else if (acb->type == QEMU_AIO_DISCARD &&
+               (ret == -EOPNOTSUPP || ret == -ENOSYS || ret == -EINVAL)) {
+        /* Discard is only a hint; kernels before Linux 5.6 do not know
+         * about IORING_OP_FALLOCATE and fail it with -EINVAL.
+         */
+        ret = 0;
+    }
+
+    acb->common.cb(acb->common.opaque, ret);
+    qemu_aio_release(acb);
+}
+
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *acb = io_uring_cqe_get_data(cqe);
+
+        acb->ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+        luring_process_completion(s, acb);
+    }
+
+    /* Requests that were held back or that the kernel refused for lack of
+     * resources can go now
+     */
+    luring_resume_deferred(s);
+    if (s->in_queue) {
+        luring_submit_pending(s);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions(s);
+    }
+}
+
+static int luring_flush_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    return (s->in_flight > 0 || !QSIMPLEQ_EMPTY(&s->deferred)) ? 1 : 0;
+}
+
+static bool luring_poll_cb(EventNotifier *e)
+{
+    LuringState *s = container_of(e, LuringState, e);
+
+    /* The completion queue is shared memory, no system call is needed */
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+    luring_process_completions(s);
+    return true;
+}
+
+static void luring_submit_pending(LuringState *s)
+{
+    int ret;
+
+    do {
+        ret = io_uring_submit(&s->ring);
+    } while (ret == -EINTR);
+
+    if (ret > 0) {
+        s->in_queue -= MIN(ret, s->in_queue);
+    }
+
+    /* On -EAGAIN or -EBUSY the requests stay queued and are retried when
+     * the next completion is reaped.  If none is coming, retry in the next
+     * iteration; aio_poll() in an iothread never runs idle bottom halves.
+     */
+    if (s->in_queue && s->in_queue == s->in_flight) {
+        qemu_bh_schedule(s->submit_bh);
+    }
+}
+
+static void luring_submit_bh(void *opaque)
+{
+    luring_submit_pending(opaque);
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    LuringAIOCB *acb = (LuringAIOCB *)blockacb;
+    LuringState *s = acb->s;
+    struct io_uring_cqe *cqe;
+
+    if (acb->ret != -EINPROGRESS) {
+        return;
+    }
+
+    /*
+     * Reads and writes on files and block devices cannot be cancelled once
+     * the kernel has them, so wait for the request to finish.  It may still
+     * be held back, or be in the submission queue if the kernel refused it
+     * for lack of resources; only wait for a completion if something was
+     * submitted.
+     */
+    while (acb->ret == -EINPROGRESS) {
+        if (s->in_queue) {
+            luring_submit_pending(s);
+        }
+        if (s->in_flight > s->in_queue &&
+            io_uring_wait_cqe(&s->ring, &cqe) < 0) {
+            continue;
+        }
+        luring_process_completions(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(LuringAIOCB),
+    .cancel             = luring_cancel,
+};
+
+static void luring_prep(LuringState *s, LuringAIOCB *acb,
+                        struct io_uring_sqe *sqe)
+{
+    QEMUIOVector *qiov = acb->qiov;
+
+    acb->nbytes = 0;
+    switch (acb->type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqe, acb->fd, qiov->iov, qiov->niov,
+                             acb->offset);
+        acb->nbytes = acb->nb_sectors * 512;
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqe, acb->fd, qiov->iov, qiov->niov, acb->offset);
+        acb->nbytes = acb->nb_sectors * 512;
+        break;
+    case QEMU_AIO_FLUSH:
+        /* Same as qemu_fdatasync() in the thread pool */
+        io_uring_prep_fsync(sqe, acb->fd, IORING_FSYNC_DATASYNC);
+        break;
+    case QEMU_AIO_DISCARD:
+        io_uring_prep_fallocate(sqe, acb->fd,
+                                FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                acb->offset, (off_t)acb->nb_sectors * 512);
+        break;
+    }
+    io_uring_sqe_set_data(sqe, acb);
+
+    /* Requests issued in the same event loop iteration, for example all
+     * requests taken from a virtqueue on one notification, are submitted
+     * together with a single io_uring_enter().
+     */
+    s->in_flight++;
+    if (s->in_queue++ == 0) {
+        qemu_bh_schedule(s->submit_bh);
+    }
+}
+
+/*
+ * Moves waiting requests to the submission queue, in order, as long as the
+ * completion queue has room for them.
+ */
+static void luring_resume_deferred(LuringState *s)
+{
+    struct io_uring_sqe *sqe;
+    LuringAIOCB *acb;
+
+    while ((acb = QSIMPLEQ_FIRST(&s->deferred)) != NULL &&
+           s->in_flight < MAX_IN_FLIGHT) {
+        sqe = io_uring_get_sqe(&s->ring);
+        if (!sqe) {
+            /* The batch fills the submission queue, hand it over now */
+            luring_submit_pending(s);
+            sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+        }
+        QSIMPLEQ_REMOVE_HEAD(&s->deferred, next);
+        luring_prep(s, acb, sqe);
+    }
+}
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, LuringState *s, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    LuringAIOCB *acb;
+    off_t offset = sector_num * 512;
+
+    switch (type) {
+    case QEMU_AIO_READ:
+    case QEMU_AIO_WRITE:
+    case QEMU_AIO_FLUSH:
+    case QEMU_AIO_DISCARD:
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        return NULL;
+    }
+
+    acb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    acb->s = s;
+    acb->ret = -EINPROGRESS;
+    acb->type = type;
+    acb->qiov = qiov;
+    acb->fd = fd;
+    acb->offset = offset;
+    acb->nb_sectors = nb_sectors;
+
+    QSIMPLEQ_INSERT_TAIL(&s->deferred, acb, next);
+    luring_resume_deferred(s);
+    return &acb->common;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+    qemu_bh_delete(s->submit_bh);
+    s->submit_bh = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->submit_bh = aio_bh_new(new_context, luring_submit_bh, s);
+    aio_set_event_notifier(new_context, &s->e, luring_completion_cb,
+                           luring_flush_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, luring_poll_cb);
+}
+
+LuringState *luring_init(void)
+{
+    LuringState *s;
+    int ret;
+
+    s = g_malloc0(sizeof(*s));
+    QSIMPLEQ_INIT(&s->deferred);
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_free_state;
+    }
+
+    ret = io_uring_queue_init(MAX_ENTRIES, &s->ring, 0);
+    if (ret < 0) {
+        errno = -ret;
+        goto out_close_efd;
+    }
+
+    ret = io_uring_register_eventfd(&s->ring, event_notifier_get_fd(&s->e));
+    if (ret < 0) {
+        errno = -ret;
+        goto out_exit_ring;
+    }
+
+    return s;
+
+out_exit_ring:
+    io_uring_queue_exit(&s->ring);
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    io_uring_queue_exit(&s->ring);
+    event_notifier_cleanup(&s->e);
+    g_free(s);
+}
@@ -12,6 +12,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -25,6 +26,27 @@
  */
 #define MAX_EVENTS 128
 
+/* Requests held back while plugged before io_submit() is forced */
+#define MAX_QUEUED_IO 128
+
+/*
+ * Header of the completion ring that the kernel maps at the io_context_t
+ * address (see fs/aio.c).  Completions can be detected by comparing head and
+ * tail without entering the kernel.
+ */
+#define AIO_RING_MAGIC 0xa10a10a1
+
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+};
+
 struct qemu_laiocb {
     BlockDriverAIOCB common;
     struct qemu_laio_state *ctx;
@@ -36,10 +58,19 @@ struct qemu_laiocb {
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
+typedef struct {
+    struct iocb *iocbs[MAX_QUEUED_IO];
+    int plugged;
+    unsigned int idx;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
     int count;
+
+    /* io queue for submit at batch */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -77,28 +108,52 @@ static void qemu_laio_process_completion(struct qemu_laio_state *s,
     qemu_aio_release(laiocb);
 }
 
+static void qemu_laio_process_completions(struct qemu_laio_state *s)
+{
+    struct io_event events[MAX_EVENTS];
+    struct timespec ts = { 0 };
+    int nevents, i;
+
+    do {
+        nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
+    } while (nevents == -EINTR);
+
+    for (i = 0; i < nevents; i++) {
+        struct iocb *iocb = events[i].obj;
+        struct qemu_laiocb *laiocb =
+                container_of(iocb, struct qemu_laiocb, iocb);
+
+        laiocb->ret = io_event_ret(&events[i]);
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
 static void qemu_laio_completion_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
     while (event_notifier_test_and_clear(&s->e)) {
-        struct io_event events[MAX_EVENTS];
-        struct timespec ts = { 0 };
-        int nevents, i;
-
-        do {
-            nevents = io_getevents(s->ctx, MAX_EVENTS, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
+        qemu_laio_process_completions(s);
+    }
+}
 
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
+static bool qemu_laio_poll_cb(EventNotifier *e)
+{
+    struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
 
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_process_completion(s, laiocb);
-        }
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
     }
+    smp_rmb();
+
+    /* The eventfd may be signalled again for completions reaped here; the
+     * resulting wakeup finds an empty ring and is harmless.
+     */
+    event_notifier_test_and_clear(&s->e);
+    qemu_laio_process_completions(s);
+    return true;
 }
 
 static int qemu_laio_flush_cb(EventNotifier *e)
@@ -108,15 +163,74 @@ static int qemu_laio_flush_cb(EventNotifier *e)
     return (s->count > 0) ? 1 : 0;
 }
 
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    int ret, i = 0;
+    int len = s->io_q.idx;
+
+    do {
+        ret = io_submit(s->ctx, len, s->io_q.iocbs);
+    } while (i++ < 3 && ret == -EAGAIN);
+
+    /* empty io queue */
+    s->io_q.idx = 0;
+
+    /* Fail whatever the kernel did not take, as laio_submit() would */
+    for (i = ret < 0 ? 0 : ret; i < len; i++) {
+        struct qemu_laiocb *laiocb =
+            container_of(s->io_q.iocbs[i], struct qemu_laiocb, iocb);
+
+        laiocb->ret = ret < 0 ? ret : -EIO;
+        qemu_laio_process_completion(s, laiocb);
+    }
+}
+
+static void ioq_enqueue(struct qemu_laio_state *s, struct iocb *iocb)
+{
+    /* Make room first so that a failing io_submit() never completes the
+     * request that the caller is still about to get back from laio_submit()
+     */
+    if (s->io_q.idx == MAX_QUEUED_IO) {
+        ioq_submit(s);
+    }
+    s->io_q.iocbs[s->io_q.idx++] = iocb;
+}
+
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0 && s->io_q.idx > 0) {
+        ioq_submit(s);
+    }
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
+    struct qemu_laio_state *s = laiocb->ctx;
     struct io_event event;
     int ret;
 
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* The request may still be held back by bdrv_io_plug() */
+    if (s->io_q.idx > 0) {
+        ioq_submit(s);
+        if (laiocb->ret != -EINPROGRESS) {
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -179,8 +293,11 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
+    if (s->io_q.plugged) {
+        ioq_enqueue(s, iocbs);
+    } else if (io_submit(s->ctx, 1, &iocbs) < 0) {
         goto out_dec_count;
+    }
     return &laiocb->common;
 
 out_dec_count:
@@ -190,6 +307,22 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_detach_aio_context(void *s_, AioContext *old_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(old_context, &s->e, NULL, NULL);
+}
+
+void laio_attach_aio_context(void *s_, AioContext *new_context)
+{
+    struct qemu_laio_state *s = s_;
+
+    aio_set_event_notifier(new_context, &s->e, qemu_laio_completion_cb,
+                           qemu_laio_flush_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
@@ -203,9 +336,6 @@ void *laio_init(void)
         goto out_close_efd;
     }
 
-    qemu_aio_set_event_notifier(&s->e, qemu_laio_completion_cb,
-                                qemu_laio_flush_cb);
-
     return s;
 
 out_close_efd:
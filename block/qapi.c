@@ -284,6 +284,11 @@ BlockStats *bdrv_query_stats(const BlockDriverState *bs)
     s->stats->rd_total_time_ns = bs->total_time_ns[BDRV_ACCT_READ];
     s->stats->flush_total_time_ns = bs->total_time_ns[BDRV_ACCT_FLUSH];
 
+    if (bs->drv && bs->drv->bdrv_get_metadata_cache_stats) {
+        s->stats->has_metadata_caches = true;
+        s->stats->metadata_caches = bs->drv->bdrv_get_metadata_cache_stats(bs);
+    }
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(bs->file);
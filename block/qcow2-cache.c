@@ -27,21 +27,62 @@
 #include "qcow2.h"
 #include "trace.h"
 
+/*
+ * Cached tables are found through a hash table indexed by their offset in the
+ * image file. Tables that are not in use by anyone (ref == 0) are kept in an
+ * LRU list, whose head is the next entry to be replaced. Both lookup and
+ * replacement therefore take constant time regardless of the cache size.
+ */
+
 typedef struct Qcow2CachedTable {
-    void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
     int     ref;
+    QLIST_ENTRY(Qcow2CachedTable) hash_next;
+    QTAILQ_ENTRY(Qcow2CachedTable) lru_next;
 } Qcow2CachedTable;
 
+typedef QLIST_HEAD(Qcow2CacheBucket, Qcow2CachedTable) Qcow2CacheBucket;
+
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
     int                     size;
     bool                    depends_on_flush;
+    void*                   table_array;
+    int                     table_size;
+    int                     table_bits;
+    Qcow2CacheBucket*       buckets;
+    int                     bucket_bits;
+    QTAILQ_HEAD(, Qcow2CachedTable) lru_list;
+    uint64_t                hits;
+    uint64_t                misses;
+    uint64_t                evictions;
 };
 
+static inline void *qcow2_cache_get_table_addr(Qcow2Cache *c, int i)
+{
+    return (uint8_t *) c->table_array + (size_t) i * c->table_size;
+}
+
+static inline int qcow2_cache_get_table_idx(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
+    int idx = table_offset / c->table_size;
+
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
+    return idx;
+}
+
+static inline Qcow2CacheBucket *qcow2_cache_bucket(Qcow2Cache *c,
+                                                   uint64_t offset)
+{
+    /* Fibonacci hashing of the table's cluster index */
+    uint64_t hash = (offset >> c->table_bits) * 0x9e3779b97f4a7c15ULL;
+
+    return &c->buckets[hash >> (64 - c->bucket_bits)];
+}
+
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
 {
     BDRVQcowState *s = bs->opaque;
@@ -51,9 +92,20 @@ Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
     c = g_malloc0(sizeof(*c));
     c->size = num_tables;
     c->entries = g_malloc0(sizeof(*c->entries) * num_tables);
+    c->table_size = s->cluster_size;
+    c->table_bits = s->cluster_bits;
+    c->table_array = qemu_blockalign(bs, (size_t) num_tables * c->table_size);
+
+    /* At least as many buckets as entries keeps the chains short */
+    c->bucket_bits = 1;
+    while ((1 << c->bucket_bits) < num_tables) {
+        c->bucket_bits++;
+    }
+    c->buckets = g_malloc0(sizeof(*c->buckets) << c->bucket_bits);
 
+    QTAILQ_INIT(&c->lru_list);
     for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+        QTAILQ_INSERT_TAIL(&c->lru_list, &c->entries[i], lru_next);
     }
 
     return c;
@@ -65,15 +117,37 @@ int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    qemu_vfree(c->table_array);
+    g_free(c->buckets);
     g_free(c->entries);
     g_free(c);
 
     return 0;
 }
 
+int qcow2_cache_get_num_tables(Qcow2Cache *c)
+{
+    return c->size;
+}
+
+BlockMetadataCacheStats *qcow2_cache_get_stats(BDRVQcowState *s,
+    Qcow2Cache *c)
+{
+    BlockMetadataCacheStats *stats;
+
+    stats = g_malloc0(sizeof(*stats));
+    stats->name = g_strdup(c == s->l2_table_cache ? "l2" : "refcount");
+    stats->size = (int64_t) c->size * s->cluster_size;
+    stats->entries = c->size;
+    stats->hits = c->hits;
+    stats->misses = c->misses;
+    stats->evictions = c->evictions;
+
+    return stats;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -120,8 +194,8 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
         BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
     }
 
-    ret = bdrv_pwrite(bs->file, c->entries[i].offset, c->entries[i].table,
-        s->cluster_size);
+    ret = bdrv_pwrite(bs->file, c->entries[i].offset,
+        qcow2_cache_get_table_addr(c, i), s->cluster_size);
     if (ret < 0) {
         return ret;
     }
@@ -187,38 +261,21 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
 
 static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
-
+    Qcow2CachedTable *entry = QTAILQ_FIRST(&c->lru_list);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].ref) {
-            continue;
-        }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
-        }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
-    }
-
-    if (min_index == -1) {
+    if (entry == NULL) {
         /* This can't happen in current synchronous code, but leave the check
          * here as a reminder for whoever starts using AIO with the cache */
         abort();
     }
-    return min_index;
+    return entry - c->entries;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     uint64_t offset, void **table, bool read_from_disk)
 {
     BDRVQcowState *s = bs->opaque;
+    Qcow2CachedTable *entry;
     int i;
     int ret;
 
@@ -226,11 +283,14 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
                           offset, read_from_disk);
 
     /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
+    QLIST_FOREACH(entry, qcow2_cache_bucket(c, offset), hash_next) {
+        if (entry->offset == offset) {
+            c->hits++;
+            i = entry - c->entries;
             goto found;
         }
     }
+    c->misses++;
 
     /* If not, write a table back and replace it */
     i = qcow2_cache_find_entry_to_replace(c);
@@ -239,36 +299,45 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     if (i < 0) {
         return i;
     }
+    entry = &c->entries[i];
 
     ret = qcow2_cache_entry_flush(bs, c, i);
     if (ret < 0) {
         return ret;
     }
 
+    if (entry->offset) {
+        c->evictions++;
+        QLIST_REMOVE(entry, hash_next);
+    }
+
     trace_qcow2_cache_get_read(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
-    c->entries[i].offset = 0;
+    entry->offset = 0;
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
 
-        ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_get_table_addr(c, i),
+                         s->cluster_size);
         if (ret < 0) {
+            /* The entry stays unused, so replace it first next time */
+            QTAILQ_REMOVE(&c->lru_list, entry, lru_next);
+            QTAILQ_INSERT_HEAD(&c->lru_list, entry, lru_next);
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    entry->offset = offset;
+    QLIST_INSERT_HEAD(qcow2_cache_bucket(c, offset), entry, hash_next);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
-    c->entries[i].ref++;
-    *table = c->entries[i].table;
+    if (entry->ref++ == 0) {
+        QTAILQ_REMOVE(&c->lru_list, entry, lru_next);
+    }
+    *table = qcow2_cache_get_table_addr(c, i);
 
     trace_qcow2_cache_get_done(qemu_coroutine_self(),
                                c == s->l2_table_cache, i);
@@ -290,34 +359,22 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
-    int i;
-
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
-    }
-    return -ENOENT;
+    int i = qcow2_cache_get_table_idx(c, *table);
+    Qcow2CachedTable *entry = &c->entries[i];
 
-found:
-    c->entries[i].ref--;
+    entry->ref--;
     *table = NULL;
 
-    assert(c->entries[i].ref >= 0);
+    assert(entry->ref >= 0);
+    if (entry->ref == 0) {
+        QTAILQ_INSERT_TAIL(&c->lru_list, entry, lru_next);
+    }
     return 0;
 }
 
 void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
-    int i;
+    int i = qcow2_cache_get_table_idx(c, table);
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
-    }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
@@ -30,6 +30,8 @@
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
+#include "block/thread-pool.h"
 #include "trace.h"
 
 /*
@@ -311,19 +313,108 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Generate discard requests when other clusters are freed",
         },
+        {
+            .name = QCOW2_OPT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum combined metadata (L2 table and refcount block) "
+                    "cache size",
+        },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
         { /* end of list */ }
     },
 };
 
+/*
+ * Computes the number of L2 tables and refcount blocks to cache from the
+ * cache size options in @opts. All sizes are given in bytes; a size option
+ * that is not set is derived from the others using
+ * DEFAULT_L2_REFCOUNT_SIZE_RATIO. Without any option the caches default to
+ * DEFAULT_L2_CACHE_SIZE and DEFAULT_REFCOUNT_CACHE_SIZE clusters.
+ */
+static int read_cache_sizes(BDRVQcowState *s, QemuOpts *opts,
+                            int *l2_cache_tables, int *refcount_cache_tables,
+                            Error **errp)
+{
+    uint64_t combined_cache_size, l2_cache_size, refcount_cache_size;
+    bool combined_cache_size_set, l2_cache_size_set, refcount_cache_size_set;
+
+    combined_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_CACHE_SIZE);
+    l2_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_L2_CACHE_SIZE);
+    refcount_cache_size_set = qemu_opt_get(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE);
+
+    combined_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_CACHE_SIZE, 0);
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE, 0);
+    refcount_cache_size = qemu_opt_get_size(opts,
+                                            QCOW2_OPT_REFCOUNT_CACHE_SIZE, 0);
+
+    if (combined_cache_size_set) {
+        if (l2_cache_size_set && refcount_cache_size_set) {
+            error_setg(errp, QCOW2_OPT_CACHE_SIZE ", " QCOW2_OPT_L2_CACHE_SIZE
+                       " and " QCOW2_OPT_REFCOUNT_CACHE_SIZE " may not be set "
+                       "at the same time");
+            return -EINVAL;
+        } else if (l2_cache_size > combined_cache_size) {
+            error_setg(errp, QCOW2_OPT_L2_CACHE_SIZE " may not exceed "
+                       QCOW2_OPT_CACHE_SIZE);
+            return -EINVAL;
+        } else if (refcount_cache_size > combined_cache_size) {
+            error_setg(errp, QCOW2_OPT_REFCOUNT_CACHE_SIZE " may not exceed "
+                       QCOW2_OPT_CACHE_SIZE);
+            return -EINVAL;
+        }
+
+        if (l2_cache_size_set) {
+            refcount_cache_size = combined_cache_size - l2_cache_size;
+        } else if (refcount_cache_size_set) {
+            l2_cache_size = combined_cache_size - refcount_cache_size;
+        } else {
+            refcount_cache_size = combined_cache_size
+                                / (DEFAULT_L2_REFCOUNT_SIZE_RATIO + 1);
+            l2_cache_size = combined_cache_size - refcount_cache_size;
+        }
+    } else if (!l2_cache_size_set && !refcount_cache_size_set) {
+        l2_cache_size = (uint64_t) DEFAULT_L2_CACHE_SIZE * s->cluster_size;
+        refcount_cache_size =
+            (uint64_t) DEFAULT_REFCOUNT_CACHE_SIZE * s->cluster_size;
+    } else if (!l2_cache_size_set) {
+        l2_cache_size = refcount_cache_size * DEFAULT_L2_REFCOUNT_SIZE_RATIO;
+    } else if (!refcount_cache_size_set) {
+        refcount_cache_size = l2_cache_size / DEFAULT_L2_REFCOUNT_SIZE_RATIO;
+    }
+
+    l2_cache_size /= s->cluster_size;
+    refcount_cache_size /= s->cluster_size;
+
+    if (l2_cache_size > INT_MAX || refcount_cache_size > INT_MAX) {
+        error_setg(errp, "Metadata cache size too large");
+        return -EINVAL;
+    }
+
+    *l2_cache_tables = MAX(l2_cache_size, MIN_L2_CACHE_SIZE);
+    *refcount_cache_tables = MAX(refcount_cache_size, MIN_REFCOUNT_CACHE_SIZE);
+
+    return 0;
+}
+
 static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
     uint64_t l1_vm_state_index;
+    int l2_cache_tables, refcount_cache_tables;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -469,9 +560,26 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         }
     }
 
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = read_cache_sizes(s, opts, &l2_cache_tables, &refcount_cache_tables,
+                           &local_err);
+    if (ret < 0) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -537,15 +645,6 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        qerror_report_err(local_err);
-        error_free(local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
@@ -560,6 +659,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         qemu_opt_get_bool(opts, QCOW2_OPT_DISCARD_OTHER, false);
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
@@ -577,6 +677,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -585,6 +688,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -640,6 +746,75 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
     return 0;
 }
 
+/*
+ * Replaces the L2 table and refcount block caches by caches of the size given
+ * in @options, which takes the same cache size options as qcow2_open(). The
+ * caller must make sure that no requests are in flight.
+ */
+static int qcow2_set_metadata_cache_size(BlockDriverState *bs, QDict *options,
+                                         Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int l2_cache_tables, refcount_cache_tables;
+    int ret;
+
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    ret = read_cache_sizes(s, opts, &l2_cache_tables, &refcount_cache_tables,
+                           errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* The caches may depend on each other, so always replace both of them */
+    ret = qcow2_cache_flush(bs, s->l2_table_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush L2 table cache");
+        goto out;
+    }
+
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not flush refcount block cache");
+        goto out;
+    }
+
+    qcow2_cache_destroy(bs, s->l2_table_cache);
+    qcow2_cache_destroy(bs, s->refcount_block_cache);
+
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables);
+    ret = 0;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static BlockMetadataCacheStatsList *
+qcow2_get_metadata_cache_stats(const BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BlockMetadataCacheStatsList *l2, *refcount;
+
+    l2 = g_malloc0(sizeof(*l2));
+    refcount = g_malloc0(sizeof(*refcount));
+
+    l2->value = qcow2_cache_get_stats(s, s->l2_table_cache);
+    l2->next = refcount;
+    refcount->value = qcow2_cache_get_stats(s, s->refcount_block_cache);
+
+    return l2;
+}
+
 static int coroutine_fn qcow2_co_is_allocated(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum)
 {
@@ -971,6 +1146,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
     QDict *options;
+    int64_t l2_cache_size, refcount_cache_size;
 
     /*
      * Backing files are read-only which makes all of their metadata immutable,
@@ -983,11 +1159,20 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
     }
 
+    l2_cache_size = (int64_t) qcow2_cache_get_num_tables(s->l2_table_cache)
+                  * s->cluster_size;
+    refcount_cache_size =
+        (int64_t) qcow2_cache_get_num_tables(s->refcount_block_cache)
+        * s->cluster_size;
+
     qcow2_close(bs);
 
     options = qdict_new();
     qdict_put(options, QCOW2_OPT_LAZY_REFCOUNTS,
               qbool_from_int(s->use_lazy_refcounts));
+    qdict_put(options, QCOW2_OPT_L2_CACHE_SIZE, qint_from_int(l2_cache_size));
+    qdict_put(options, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+              qint_from_int(refcount_cache_size));
 
     memset(s, 0, sizeof(BDRVQcowState));
     qcow2_open(bs, options, flags);
@@ -1558,12 +1743,71 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+typedef struct Qcow2CompressJob {
+    const uint8_t *src;
+    uint8_t *dest;
+    int cluster_size;
+    int ret;        /* compressed size, 0 if incompressible or -errno */
+    bool done;
+} Qcow2CompressJob;
+
+/* Runs in a thread pool worker */
+static int qcow2_compress_cluster(void *opaque)
+{
+    Qcow2CompressJob *job = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = job->cluster_size;
+    strm.next_in = (uint8_t *)job->src;
+    strm.avail_out = job->cluster_size;
+    strm.next_out = job->dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    out_len = strm.next_out - job->dest;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= job->cluster_size) {
+        /* could not compress */
+        return 0;
+    }
+    return out_len;
+}
+
+static void qcow2_compress_cluster_cb(void *opaque, int ret)
+{
+    Qcow2CompressJob *job = opaque;
+
+    job->ret = ret;
+    job->done = true;
+}
+
+/*
+ * Compresses all clusters of the request in parallel in the thread pool, but
+ * allocates and writes them one after another in guest order, so that the
+ * image layout is the same as with cluster-by-cluster compression.
+ */
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    ThreadPool *pool;
+    Qcow2CompressJob *jobs;
+    int ret, i, nb_clusters;
     uint8_t *out_buf;
     uint64_t cluster_offset;
 
@@ -1576,73 +1820,79 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return 0;
     }
 
-    if (nb_sectors != s->cluster_sectors) {
-        ret = -EINVAL;
+    if ((sector_num & (s->cluster_sectors - 1)) != 0) {
+        return -EINVAL;
+    }
+
+    if ((nb_sectors & (s->cluster_sectors - 1)) != 0) {
+        int padded_sectors;
+        uint8_t *pad_buf;
 
         /* Zero-pad last write if image size is not cluster aligned */
-        if (sector_num + nb_sectors == bs->total_sectors &&
-            nb_sectors < s->cluster_sectors) {
-            uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
-            memset(pad_buf, 0, s->cluster_size);
-            memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
-            qemu_vfree(pad_buf);
+        if (sector_num + nb_sectors != bs->total_sectors) {
+            return -EINVAL;
         }
-        return ret;
-    }
-
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
 
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
+        padded_sectors = align_offset(nb_sectors, s->cluster_sectors);
+        pad_buf = qemu_blockalign(bs, padded_sectors * BDRV_SECTOR_SIZE);
+        memset(pad_buf, 0, padded_sectors * BDRV_SECTOR_SIZE);
+        memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
+        ret = qcow2_write_compressed(bs, sector_num, pad_buf, padded_sectors);
+        qemu_vfree(pad_buf);
+        return ret;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    nb_clusters = nb_sectors / s->cluster_sectors;
+    jobs = g_malloc0(nb_clusters * sizeof(*jobs));
+    out_buf = g_malloc((size_t) nb_clusters * s->cluster_size);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    for (i = 0; i < nb_clusters; i++) {
+        jobs[i].src = buf + (size_t) i * s->cluster_size;
+        jobs[i].dest = out_buf + (size_t) i * s->cluster_size;
+        jobs[i].cluster_size = s->cluster_size;
+        thread_pool_submit_aio(pool, qcow2_compress_cluster, &jobs[i],
+                               qcow2_compress_cluster_cb, &jobs[i]);
     }
-    out_len = strm.next_out - out_buf;
 
-    deflateEnd(&strm);
+    ret = 0;
+    for (i = 0; i < nb_clusters; i++) {
+        int64_t cluster_sector = sector_num + i * s->cluster_sectors;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+        while (!jobs[i].done) {
+            aio_poll(bdrv_get_aio_context(bs), true);
+        }
         if (ret < 0) {
-            goto fail;
+            /* wait for the remaining jobs, they still use the buffers */
+            continue;
         }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
+
+        if (jobs[i].ret < 0) {
+            ret = jobs[i].ret;
+        } else if (jobs[i].ret == 0) {
+            /* could not compress: write normal cluster */
+            ret = bdrv_write(bs, cluster_sector, jobs[i].src,
+                             MIN(s->cluster_sectors,
+                                 bs->total_sectors - cluster_sector));
+        } else {
+            cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+                cluster_sector << 9, jobs[i].ret);
+            if (!cluster_offset) {
+                ret = -EIO;
+                continue;
+            }
+            cluster_offset &= s->cluster_offset_mask;
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+            ret = bdrv_pwrite(bs->file, cluster_offset, jobs[i].dest,
+                              jobs[i].ret);
         }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
+        if (ret > 0) {
+            ret = 0;
         }
     }
 
-    ret = 0;
-fail:
     g_free(out_buf);
+    g_free(jobs);
     return ret;
 }
 
@@ -1815,6 +2065,9 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
+    .bdrv_set_metadata_cache_size   = qcow2_set_metadata_cache_size,
+    .bdrv_get_metadata_cache_stats  = qcow2_get_metadata_cache_stats,
+
     .create_options = qcow2_create_options,
     .bdrv_check = qcow2_check,
 };
@@ -21,13 +21,16 @@
 static void qed_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QEDAIOCB *acb = (QEDAIOCB *)blockacb;
+    AioContext *aio_context = bdrv_get_aio_context(acb->common.bs);
     bool finished = false;
 
     /* Wait for the request to finish */
+    aio_context_acquire(aio_context);
     acb->finished = &finished;
     while (!finished) {
-        qemu_aio_wait();
+        aio_poll(aio_context, true);
     }
+    aio_context_release(aio_context);
 }
 
 static const AIOCBInfo qed_aiocb_info = {
@@ -351,6 +354,13 @@ static void qed_need_check_timer_cb(void *opaque)
 
 static void qed_start_need_check_timer(BDRVQEDState *s)
 {
+    /* QEMUTimers belong to the main loop.  Outside of it the need check
+     * flag simply stays set until the image is closed.
+     */
+    if (bdrv_get_aio_context(s->bs) != qemu_get_aio_context()) {
+        return;
+    }
+
     trace_qed_start_need_check_timer(s);
 
     /* Use vm_clock so we don't alter the image file while suspended for
@@ -363,10 +373,21 @@ static void qed_start_need_check_timer(BDRVQEDState *s)
 /* It's okay to call this multiple times or when no timer is started */
 static void qed_cancel_need_check_timer(BDRVQEDState *s)
 {
+    if (bdrv_get_aio_context(s->bs) != qemu_get_aio_context()) {
+        return;
+    }
+
     trace_qed_cancel_need_check_timer(s);
     qemu_del_timer(s->need_check_timer);
 }
 
+static void bdrv_qed_detach_aio_context(BlockDriverState *bs)
+{
+    BDRVQEDState *s = bs->opaque;
+
+    qed_cancel_need_check_timer(s);
+}
+
 static void bdrv_qed_rebind(BlockDriverState *bs)
 {
     BDRVQEDState *s = bs->opaque;
@@ -882,7 +903,8 @@ static void qed_aio_complete(QEDAIOCB *acb, int ret)
 
     /* Arrange for a bh to invoke the completion function */
     acb->bh_ret = ret;
-    acb->bh = qemu_bh_new(qed_aio_complete_bh, acb);
+    acb->bh = aio_bh_new(bdrv_get_aio_context(acb->common.bs),
+                         qed_aio_complete_bh, acb);
     qemu_bh_schedule(acb->bh);
 
     /* Start next allocating write request waiting behind this one.  Note that
@@ -1586,6 +1608,7 @@ static BlockDriver bdrv_qed = {
     .bdrv_change_backing_file = bdrv_qed_change_backing_file,
     .bdrv_invalidate_cache    = bdrv_qed_invalidate_cache,
     .bdrv_check               = bdrv_qed_check,
+    .bdrv_detach_aio_context  = bdrv_qed_detach_aio_context,
 };
 
 static void bdrv_qed_init(void)
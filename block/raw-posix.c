@@ -138,6 +138,10 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+    LuringState *io_uring;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
@@ -150,6 +154,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    bool use_linux_io_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -231,7 +238,8 @@ static void raw_parse_flags(int bdrv_flags, int *open_flags)
 }
 
 #ifdef CONFIG_LINUX_AIO
-static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
+static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags,
+                       AioContext *aio_context)
 {
     int ret = -1;
     assert(aio_ctx != NULL);
@@ -249,6 +257,7 @@ static int raw_set_aio(void **aio_ctx, int *use_aio, int bdrv_flags)
             if (!*aio_ctx) {
                 goto error;
             }
+            laio_attach_aio_context(*aio_ctx, aio_context);
         }
         *use_aio = 1;
     } else {
@@ -262,6 +271,85 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_io_uring(LuringState **io_uring, bool *use_linux_io_uring,
+                            int bdrv_flags, AioContext *aio_context)
+{
+    /* Unlike Linux AIO, io_uring is asynchronous without O_DIRECT too */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*io_uring == NULL) {
+            *io_uring = luring_init();
+            if (!*io_uring) {
+                return -1;
+            }
+            luring_attach_aio_context(*io_uring, aio_context);
+        }
+        *use_linux_io_uring = true;
+    } else {
+        *use_linux_io_uring = false;
+    }
+    return 0;
+}
+#endif
+
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        laio_detach_aio_context(s->aio_ctx, bdrv_get_aio_context(bs));
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+
+#ifdef CONFIG_LINUX_AIO
+    if (s->aio_ctx) {
+        laio_attach_aio_context(s->aio_ctx, new_context);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_attach_aio_context(s->io_uring, new_context);
+    }
+#endif
+}
+
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->aio_ctx) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+    if (s->aio_ctx) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
+}
+
 static QemuOptsList raw_runtime_opts = {
     .name = "raw",
     .head = QTAILQ_HEAD_INITIALIZER(raw_runtime_opts.head),
@@ -315,7 +403,17 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     s->fd = fd;
 
 #ifdef CONFIG_LINUX_AIO
-    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags)) {
+    if (raw_set_aio(&s->aio_ctx, &s->use_aio, bdrv_flags,
+                    bdrv_get_aio_context(bs))) {
+        qemu_close(fd);
+        ret = -errno;
+        goto fail;
+    }
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_io_uring(&s->io_uring, &s->use_linux_io_uring, bdrv_flags,
+                         bdrv_get_aio_context(bs))) {
         qemu_close(fd);
         ret = -errno;
         goto fail;
@@ -364,7 +462,18 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     /* we can use s->aio_ctx instead of a copy, because the use_aio flag is
      * valid in the 'false' condition even if aio_ctx is set, and raw_set_aio()
      * won't override aio_ctx if aio_ctx is non-NULL */
-    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags)) {
+    if (raw_set_aio(&s->aio_ctx, &raw_s->use_aio, state->flags,
+                    bdrv_get_aio_context(state->bs))) {
+        return -1;
+    }
+#endif
+
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_linux_io_uring = s->use_linux_io_uring;
+
+    /* as for Linux AIO, s->io_uring is only ever set up once */
+    if (raw_set_io_uring(&s->io_uring, &raw_s->use_linux_io_uring,
+                         state->flags, bdrv_get_aio_context(state->bs))) {
         return -1;
     }
 #endif
@@ -435,6 +544,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_linux_io_uring = raw_s->use_linux_io_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -825,6 +937,13 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->io_uring, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -853,12 +972,27 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        return luring_submit(bs, s->io_uring, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->io_uring) {
+        luring_detach_aio_context(s->io_uring, bdrv_get_aio_context(bs));
+        luring_cleanup(s->io_uring);
+        s->io_uring = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1175,6 +1309,16 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
 {
     BDRVRawState *s = bs->opaque;
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Punch the hole from the ring; block devices need BLKDISCARD, which
+     * only the thread pool can do.
+     */
+    if (s->use_linux_io_uring && s->has_discard) {
+        return luring_submit(bs, s->io_uring, s->fd, sector_num, NULL,
+                             nb_sectors, cb, opaque, QEMU_AIO_DISCARD);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, NULL, nb_sectors,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
@@ -1212,6 +1356,12 @@ static BlockDriver bdrv_file = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+
     .create_options = raw_create_options,
 };
 
@@ -1551,6 +1701,12 @@ static BlockDriver bdrv_host_device = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+
     /* generic scsi device */
 #ifdef __linux__
     .bdrv_ioctl         = hdev_ioctl,
@@ -1674,6 +1830,12 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+
     /* removable device support */
     .bdrv_is_inserted   = floppy_is_inserted,
     .bdrv_media_changed = floppy_media_changed,
@@ -1775,6 +1937,12 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
     .bdrv_eject         = cdrom_eject,
@@ -1896,6 +2064,12 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_get_allocated_file_size
                         = raw_get_allocated_file_size,
 
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
+
     /* removable device support */
     .bdrv_is_inserted   = cdrom_is_inserted,
     .bdrv_eject         = cdrom_eject,
@@ -1903,40 +2077,6 @@ static BlockDriver bdrv_host_cdrom = {
 };
 #endif /* __FreeBSD__ */
 
-#ifdef CONFIG_LINUX_AIO
-/**
- * Return the file descriptor for Linux AIO
- *
- * This function is a layering violation and should be removed when it becomes
- * possible to call the block layer outside the global mutex.  It allows the
- * caller to hijack the file descriptor so I/O can be performed outside the
- * block layer.
- */
-int raw_get_aio_fd(BlockDriverState *bs)
-{
-    BDRVRawState *s;
-
-    if (!bs->drv) {
-        return -ENOMEDIUM;
-    }
-
-    if (bs->drv == bdrv_find_format("raw")) {
-        bs = bs->file;
-    }
-
-    /* raw-posix has several protocols so just check for raw_aio_readv */
-    if (bs->drv->bdrv_aio_readv != raw_aio_readv) {
-        return -ENOTSUP;
-    }
-
-    s = bs->opaque;
-    if (!s->use_aio) {
-        return -ENOTSUP;
-    }
-    return s->fd;
-}
-#endif /* CONFIG_LINUX_AIO */
-
 static void bdrv_file_init(void)
 {
     /*
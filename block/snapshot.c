@@ -73,7 +73,14 @@ int bdrv_snapshot_create(BlockDriverState *bs,
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_create) {
-        return drv->bdrv_snapshot_create(bs, sn_info);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        /* Keep a dataplane thread away from the metadata */
+        aio_context_acquire(aio_context);
+        ret = drv->bdrv_snapshot_create(bs, sn_info);
+        aio_context_release(aio_context);
+        return ret;
     }
     if (bs->file) {
         return bdrv_snapshot_create(bs->file, sn_info);
@@ -85,24 +92,31 @@ int bdrv_snapshot_goto(BlockDriverState *bs,
                        const char *snapshot_id)
 {
     BlockDriver *drv = bs->drv;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
     int ret, open_ret;
 
     if (!drv) {
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_goto) {
-        return drv->bdrv_snapshot_goto(bs, snapshot_id);
+        /* Keep a dataplane thread away from the metadata */
+        aio_context_acquire(aio_context);
+        ret = drv->bdrv_snapshot_goto(bs, snapshot_id);
+        aio_context_release(aio_context);
+        return ret;
     }
 
     if (bs->file) {
+        aio_context_acquire(aio_context);
         drv->bdrv_close(bs);
         ret = bdrv_snapshot_goto(bs->file, snapshot_id);
         open_ret = drv->bdrv_open(bs, NULL, bs->open_flags);
         if (open_ret < 0) {
             bdrv_delete(bs->file);
             bs->drv = NULL;
-            return open_ret;
+            ret = open_ret;
         }
+        aio_context_release(aio_context);
         return ret;
     }
 
@@ -116,7 +130,14 @@ int bdrv_snapshot_delete(BlockDriverState *bs, const char *snapshot_id)
         return -ENOMEDIUM;
     }
     if (drv->bdrv_snapshot_delete) {
-        return drv->bdrv_snapshot_delete(bs, snapshot_id);
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+        int ret;
+
+        /* Keep a dataplane thread away from the metadata */
+        aio_context_acquire(aio_context);
+        ret = drv->bdrv_snapshot_delete(bs, snapshot_id);
+        aio_context_release(aio_context);
+        return ret;
     }
     if (bs->file) {
         return bdrv_snapshot_delete(bs->file, snapshot_id);
@@ -464,13 +464,9 @@ static DriveInfo *blockdev_init(QemuOpts *all_opts,
         bdrv_flags |= BDRV_O_NO_FLUSH;
     }
 
-#ifdef CONFIG_LINUX_AIO
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
     if ((buf = qemu_opt_get(opts, "aio")) != NULL) {
-        if (!strcmp(buf, "native")) {
-            bdrv_flags |= BDRV_O_NATIVE_AIO;
-        } else if (!strcmp(buf, "threads")) {
-            /* this is the default */
-        } else {
+        if (bdrv_parse_aio(buf, &bdrv_flags) < 0) {
            error_report("invalid aio option");
            return NULL;
         }
@@ -1269,6 +1265,7 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
 {
     BlockIOLimit io_limits;
     BlockDriverState *bs;
+    AioContext *aio_context;
 
     bs = bdrv_find(device);
     if (!bs) {
@@ -1287,6 +1284,9 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+
     bs->io_limits = io_limits;
 
     if (!bs->io_limits_enabled && bdrv_io_limits_enabled(bs)) {
@@ -1298,6 +1298,8 @@ void qmp_block_set_io_throttle(const char *device, int64_t bps, int64_t bps_rd,
             qemu_mod_timer(bs->block_timer, qemu_get_clock_ns(vm_clock));
         }
     }
+
+    aio_context_release(aio_context);
 }
 
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -1379,6 +1381,54 @@ void qmp_block_resize(const char *device, int64_t size, Error **errp)
     }
 }
 
+void qmp_block_set_metadata_cache_size(const char *device,
+                                       bool has_cache_size, int64_t cache_size,
+                                       bool has_l2_cache_size,
+                                       int64_t l2_cache_size,
+                                       bool has_refcount_cache_size,
+                                       int64_t refcount_cache_size,
+                                       Error **errp)
+{
+    BlockDriverState *bs;
+    QDict *options;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        error_set(errp, QERR_DEVICE_NOT_FOUND, device);
+        return;
+    }
+
+    if (!has_cache_size && !has_l2_cache_size && !has_refcount_cache_size) {
+        error_set(errp, QERR_MISSING_PARAMETER, "cache-size");
+        return;
+    }
+    if ((has_cache_size && cache_size < 0) ||
+        (has_l2_cache_size && l2_cache_size < 0) ||
+        (has_refcount_cache_size && refcount_cache_size < 0)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "cache-size",
+                  "a >=0 size");
+        return;
+    }
+
+    options = qdict_new();
+    if (has_cache_size) {
+        qdict_put(options, "cache-size", qint_from_int(cache_size));
+    }
+    if (has_l2_cache_size) {
+        qdict_put(options, "l2-cache-size", qint_from_int(l2_cache_size));
+    }
+    if (has_refcount_cache_size) {
+        qdict_put(options, "refcount-cache-size",
+                  qint_from_int(refcount_cache_size));
+    }
+
+    /* cached tables must not be in use while the caches are replaced */
+    bdrv_drain_all();
+
+    bdrv_set_metadata_cache_size(bs, options, errp);
+    QDECREF(options);
+}
+
 static void block_job_cb(void *opaque, int ret)
 {
     BlockDriverState *bs = opaque;
@@ -1935,7 +1985,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -2057,7 +2107,7 @@ QemuOptsList qemu_old_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -22,6 +22,8 @@
 #include "tcg.h"
 #include "qemu/atomic.h"
 #include "sysemu/qtest.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 
 bool qemu_cpu_has_work(CPUState *cpu)
 {
@@ -96,8 +98,10 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     /* execute the generated code */
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -105,54 +109,25 @@ static TranslationBlock *tb_find_slow(CPUArchState *env,
                                       target_ulong cs_base,
                                       uint64_t flags)
 {
-    TranslationBlock *tb, **ptb1;
-    unsigned int h;
-    tb_page_addr_t phys_pc, phys_page1;
-    target_ulong virt_page2;
+    TranslationBlock *tb;
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
 
     /* find translated block using physical mappings */
-    phys_pc = get_page_addr_code(env, pc);
-    phys_page1 = phys_pc & TARGET_PAGE_MASK;
-    h = tb_phys_hash_func(phys_pc);
-    ptb1 = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    for(;;) {
-        tb = *ptb1;
-        if (!tb)
-            goto not_found;
-        if (tb->pc == pc &&
-            tb->page_addr[0] == phys_page1 &&
-            tb->cs_base == cs_base &&
-            tb->flags == flags) {
-            /* check next page if needed */
-            if (tb->page_addr[1] != -1) {
-                tb_page_addr_t phys_page2;
-
-                virt_page2 = (pc & TARGET_PAGE_MASK) +
-                    TARGET_PAGE_SIZE;
-                phys_page2 = get_page_addr_code(env, virt_page2);
-                if (tb->page_addr[1] == phys_page2)
-                    goto found;
-            } else {
-                goto found;
-            }
+    tb = tb_htable_lookup(env, pc, cs_base, flags);
+    if (!tb) {
+        tb_lock();
+        /* another vCPU may have translated it meanwhile */
+        tb = tb_htable_lookup(env, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(env, pc, cs_base, flags, 0);
         }
-        ptb1 = &tb->phys_hash_next;
-    }
- not_found:
-   /* if no translated code available, then translate it now */
-    tb = tb_gen_code(env, pc, cs_base, flags, 0);
-
- found:
-    /* Move the last found TB to the head of the list */
-    if (likely(*ptb1)) {
-        *ptb1 = tb->phys_hash_next;
-        tb->phys_hash_next = tcg_ctx.tb_ctx.tb_phys_hash[h];
-        tcg_ctx.tb_ctx.tb_phys_hash[h] = tb;
+        tb_unlock();
     }
+
     /* we add the TB in the virtual pc hash table */
-    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_jmp_cache_set(env, tb_jmp_cache_hash_func(pc), tb);
     return tb;
 }
 
@@ -174,6 +149,35 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     return tb;
 }
 
+/* Profile the TBs that are not part of a trace yet: count how often they
+   are entered and through which direct exit they are left.  Such TBs are
+   kept unchained so that every execution goes through here.  Once a TB
+   has run tcg_trace_threshold times it is replaced by a trace.  */
+static TranslationBlock *tb_trace_profile(CPUArchState *env,
+                                          TranslationBlock *tb,
+                                          tcg_target_ulong *next_tb)
+{
+    TranslationBlock *last_tb;
+    int n;
+
+    if (*next_tb != 0) {
+        last_tb = (TranslationBlock *)(*next_tb & ~TB_EXIT_MASK);
+        n = *next_tb & TB_EXIT_MASK;
+        if (!(last_tb->cflags & CF_TRACE) &&
+            last_tb->exec_count < tcg_trace_threshold && n < 2) {
+            last_tb->exit_count[n]++;
+            *next_tb = 0;
+        }
+    }
+    if (!(tb->cflags & CF_TRACE) && tb->exec_count < tcg_trace_threshold) {
+        *next_tb = 0;
+        if (++tb->exec_count == tcg_trace_threshold) {
+            tb = tb_gen_trace(env, tb);
+        }
+    }
+    return tb;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 void cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -297,6 +301,14 @@ int cpu_exec(CPUArchState *env)
             for(;;) {
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+#if !defined(CONFIG_USER_ONLY)
+                    /* interrupt delivery talks to the interrupt
+                       controllers, which are protected by the iothread
+                       lock */
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_lock_iothread();
+                    }
+#endif
                     if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -573,6 +585,11 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+#if !defined(CONFIG_USER_ONLY)
+                    if (qemu_tcg_mttcg_enabled()) {
+                        qemu_mutex_unlock_iothread();
+                    }
+#endif
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -595,7 +612,6 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -606,6 +622,9 @@ int cpu_exec(CPUArchState *env)
                     next_tb = 0;
                     tcg_ctx.tb_ctx.tb_invalidated_flag = 0;
                 }
+                if (tcg_trace_threshold) {
+                    tb = tb_trace_profile(env, tb, &next_tb);
+                }
                 if (qemu_loglevel_mask(CPU_LOG_EXEC)) {
                     qemu_log("Trace %p [" TARGET_FMT_lx "] %s\n",
                              tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
@@ -614,10 +633,17 @@ int cpu_exec(CPUArchState *env)
                    spans two pages, we cannot safely do a direct
                    jump. */
                 if (next_tb != 0 && tb->page_addr[1] == -1) {
-                    tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
-                                next_tb & TB_EXIT_MASK, tb);
+                    TranslationBlock *last_tb;
+
+                    last_tb = (TranslationBlock *)(next_tb & ~TB_EXIT_MASK);
+                    /* either TB may have been invalidated by another vCPU
+                       since we looked it up */
+                    tb_lock();
+                    if (!last_tb->invalid && !tb->invalid) {
+                        tb_add_jump(last_tb, next_tb & TB_EXIT_MASK, tb);
+                    }
+                    tb_unlock();
                 }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -681,6 +707,16 @@ int cpu_exec(CPUArchState *env)
              * local variables as longjmp is marked 'noreturn'. */
             cpu = current_cpu;
             env = cpu->env_ptr;
+            tb_lock_reset();
+#if !defined(CONFIG_USER_ONLY)
+            if (qemu_tcg_mttcg_enabled()) {
+                /* drop whatever the helper that longjmp'ed was holding */
+                qemu_tcg_atomic_lock_reset();
+                if (qemu_mutex_iothread_locked()) {
+                    qemu_mutex_unlock_iothread();
+                }
+            }
+#endif
         }
     } /* for(;;) */
 
@@ -37,6 +37,8 @@
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "qemu/tls.h"
+#include "qemu/error-report.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -62,6 +64,15 @@
 
 static CPUState *next_cpu;
 
+/* Multi-threaded TCG: one host thread per vCPU instead of a single thread
+   running all of them round-robin.  */
+static bool mttcg_enabled;
+
+bool qemu_tcg_mttcg_enabled(void)
+{
+    return mttcg_enabled;
+}
+
 static bool cpu_thread_is_idle(CPUState *cpu)
 {
     if (cpu->stop || cpu->queued_work_first) {
@@ -475,7 +486,9 @@ static void cpu_signal(int sig)
     if (current_cpu) {
         cpu_exit(current_cpu);
     }
-    exit_request = 1;
+    if (!mttcg_enabled) {
+        exit_request = 1;
+    }
 }
 
 #ifdef CONFIG_LINUX
@@ -618,6 +631,7 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
 
 static QemuThread io_thread;
 
@@ -630,6 +644,19 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* Multi-threaded TCG: vCPU threads currently inside cpu_exec(), and
+   whether one of them waits for the others to leave it.  Both are
+   protected by the iothread lock.  */
+static int tcg_running_cpus;
+static bool tcg_exclusive_pending;
+static QemuCond qemu_exclusive_cond;
+static int tcg_tb_flush_pending;
+
+/* Serializes guest atomic sequences (x86 LOCK prefix, ARM STREX) between
+   vCPU threads.  */
+static QemuMutex qemu_tcg_atomic_mutex;
+static DEFINE_TLS(bool, tcg_atomic_locked);
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -637,7 +664,9 @@ void qemu_init_cpu_loop(void)
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
     qemu_cond_init(&qemu_io_proceeded_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
     qemu_mutex_init(&qemu_global_mutex);
+    qemu_mutex_init(&qemu_tcg_atomic_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
@@ -835,6 +864,126 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+/* Wait until no other vCPU thread is inside cpu_exec().  Called with the
+   iothread lock held from a vCPU thread that is outside cpu_exec() too.  */
+static void qemu_tcg_start_exclusive(CPUState *self)
+{
+    CPUState *cpu;
+
+    tcg_exclusive_pending = true;
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        if (cpu != self) {
+            cpu_exit(cpu);
+        }
+    }
+    while (tcg_running_cpus > 0) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+static void qemu_tcg_end_exclusive(void)
+{
+    tcg_exclusive_pending = false;
+    qemu_cond_broadcast(&qemu_exclusive_cond);
+}
+
+void qemu_tcg_request_tb_flush(void)
+{
+    CPUState *cpu;
+
+    atomic_set(&tcg_tb_flush_pending, 1);
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        cpu_exit(cpu);
+    }
+}
+
+static void qemu_tcg_cpu_exec_start(CPUState *cpu)
+{
+    while (tcg_exclusive_pending) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+    if (atomic_xchg(&tcg_tb_flush_pending, 0)) {
+        qemu_tcg_start_exclusive(cpu);
+        tb_flush_exclusive(cpu->env_ptr);
+        qemu_tcg_end_exclusive();
+    }
+    tcg_running_cpus++;
+}
+
+static void qemu_tcg_cpu_exec_end(CPUState *cpu)
+{
+    tcg_running_cpus--;
+    if (tcg_exclusive_pending && tcg_running_cpus == 0) {
+        qemu_cond_broadcast(&qemu_exclusive_cond);
+    }
+}
+
+void qemu_tcg_atomic_lock(void)
+{
+    if (mttcg_enabled) {
+        qemu_mutex_lock(&qemu_tcg_atomic_mutex);
+        tls_var(tcg_atomic_locked) = true;
+    }
+}
+
+void qemu_tcg_atomic_unlock(void)
+{
+    if (mttcg_enabled && tls_var(tcg_atomic_locked)) {
+        tls_var(tcg_atomic_locked) = false;
+        qemu_mutex_unlock(&qemu_tcg_atomic_mutex);
+    }
+}
+
+void qemu_tcg_atomic_lock_reset(void)
+{
+    qemu_tcg_atomic_unlock();
+}
+
+static void qemu_tcg_mt_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
+static int tcg_cpu_exec(CPUArchState *env);
+
+static void *qemu_tcg_mt_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    qemu_tcg_init_cpu_signals();
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+    current_cpu = cpu;
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        if (cpu_can_run(cpu)) {
+            qemu_tcg_cpu_exec_start(cpu);
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(cpu->env_ptr);
+            qemu_mutex_lock_iothread();
+            /* cpu_exec() clears it on the way out */
+            current_cpu = cpu;
+            qemu_tcg_cpu_exec_end(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            }
+        }
+        qemu_tcg_mt_wait_io_event(cpu);
+    }
+
+    return NULL;
+}
+
 static void tcg_exec_all(void);
 
 static void tcg_signal_cpu_creation(CPUState *cpu, void *data)
@@ -917,7 +1066,7 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if ((!tcg_enabled() || mttcg_enabled) && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -949,7 +1098,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || mttcg_enabled) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -960,13 +1109,20 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+bool qemu_mutex_iothread_locked(void)
+{
+    return tls_var(iothread_locked);
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu = first_cpu;
@@ -994,7 +1150,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !mttcg_enabled) {
             cpu = first_cpu;
             while (cpu) {
                 cpu->stop = false;
@@ -1035,6 +1191,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (mttcg_enabled) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_mt_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1171,6 +1339,51 @@ static int tcg_cpu_exec(CPUArchState *env)
     return ret;
 }
 
+static void qemu_tcg_configure_traces(QemuOpts *opts)
+{
+    uint64_t threshold = qemu_opt_get_number(opts, "tcg-trace-threshold", 0);
+
+    if (!threshold) {
+        return;
+    }
+#if defined(TARGET_SUPPORTS_TCG_TRACES)
+    if (use_icount) {
+        error_report("tcg-trace-threshold cannot be used with -icount");
+        exit(1);
+    }
+    tcg_trace_threshold = MIN(threshold, UINT32_MAX);
+#else
+    error_report("tcg-trace-threshold is not supported for this target");
+    exit(1);
+#endif
+}
+
+void qemu_tcg_configure(QemuOpts *opts)
+{
+    const char *mode = qemu_opt_get(opts, "tcg-threads");
+
+    qemu_tcg_configure_traces(opts);
+    if (!mode || !strcmp(mode, "single")) {
+        return;
+    }
+    if (strcmp(mode, "multi")) {
+        error_report("Invalid tcg-threads mode '%s', "
+                     "expected 'single' or 'multi'", mode);
+        exit(1);
+    }
+#if defined(TARGET_SUPPORTS_MTTCG) && defined(__linux__)
+    if (use_icount) {
+        error_report("tcg-threads=multi cannot be used with -icount");
+        exit(1);
+    }
+    mttcg_enabled = true;
+#else
+    error_report("tcg-threads=multi is not supported for this target "
+                 "or host");
+    exit(1);
+#endif
+}
+
 static void tcg_exec_all(void)
 {
     int r;
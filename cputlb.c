@@ -26,6 +26,7 @@
 #include "exec/cputlb.h"
 
 #include "exec/memory-internal.h"
+#include "sysemu/cpus.h"
 
 //#define DEBUG_TLB
 //#define DEBUG_TLB_CHECK
@@ -40,6 +41,52 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+/* Fills after which the victim TLB size is reconsidered even if the
+   guest does not flush its TLB.  */
+#define VTLB_RESIZE_WINDOW (4 * CPU_TLB_SIZE)
+
+/* Batched flushes of more pages than this flush the whole TLB instead.  */
+#define TLB_FLUSH_BATCH_MAX (CPU_TLB_SIZE / 2)
+
+QEMU_BUILD_BUG_ON((NB_MMU_MODES << CPU_TLB_BITS) > 0x10000);
+
+static void tlb_vtlb_clear(CPUArchState *env, int start, int end)
+{
+    int mmu_idx, i;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = start; i < end; i++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+}
+
+/* Grow the victim TLB when the guest touched more pages since the last
+ * check than the main TLB can hold.  Shrink it when it did not even get
+ * filled once, so that flushing and searching it are cheaper.
+ */
+static void tlb_vtlb_resize(CPUArchState *env)
+{
+    CPUTLBStats *s = &env->tlb_stats;
+    uint64_t fills = s->fills - s->window_fills;
+    int size = env->vtlb_size;
+
+    s->window_fills = s->fills;
+    if (fills > CPU_TLB_SIZE && size < CPU_VTLB_MAX_SIZE) {
+        size *= 2;
+    } else if (fills < size && size > CPU_VTLB_MIN_SIZE) {
+        size /= 2;
+    }
+    if (size != env->vtlb_size) {
+        if (size > env->vtlb_size) {
+            tlb_vtlb_clear(env, env->vtlb_size, size);
+        }
+        env->vtlb_size = size;
+        env->vtlb_index = 0;
+        s->vtlb_resizes++;
+    }
+}
+
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
  * If flush_global is false, flush (at least) all tlb entries not
@@ -64,63 +111,283 @@ void tlb_flush(CPUArchState *env, int flush_global)
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    for (i = 0; i < CPU_TLB_SIZE; i++) {
-        int mmu_idx;
+    if (env->vtlb_size == 0) {
+        /* first flush, at reset: the tables are not initialized yet */
+        env->vtlb_size = CPU_VTLB_MIN_SIZE;
+        env->vtlb_used = CPU_VTLB_MIN_SIZE;
+        env->tlb_dirty_count = CPU_TLB_DIRTY_LOG + 1;
+    }
 
-        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-            env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+    /* Guests that switch address spaces often flush a TLB that has
+       seen few fills since the previous flush; only reset those.  */
+    if (env->tlb_dirty_count > CPU_TLB_DIRTY_LOG) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            int mmu_idx;
+
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
+            }
+        }
+        env->tlb_stats.full_flushes++;
+    } else {
+        for (i = 0; i < env->tlb_dirty_count; i++) {
+            int k = env->tlb_dirty_log[i];
+
+            env->tlb_table[k >> CPU_TLB_BITS][k & (CPU_TLB_SIZE - 1)] =
+                s_cputlb_empty_entry;
         }
     }
+    env->tlb_dirty_count = 0;
+
+    tlb_vtlb_clear(env, 0, MIN(env->vtlb_used, env->vtlb_size));
+    env->vtlb_used = 0;
+    tlb_vtlb_resize(env);
 
-    memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+    tb_jmp_cache_clear(env);
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
+    env->tlb_stats.flushes++;
     tlb_flush_count++;
 }
 
+static void tlb_flush_async_work(void *opaque)
+{
+    tlb_flush(opaque, 1);
+}
+
+/* Flush the TLB of every vCPU.  With multi-threaded TCG a vCPU's TLB may
+ * only be modified by its own thread, so the flush is queued on the other
+ * vCPUs and happens before they next execute guest code.  Must be called
+ * with the iothread lock held.
+ */
+void tlb_flush_all(int flush_global)
+{
+    CPUState *cpu;
+
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        if (!qemu_tcg_mttcg_enabled() || qemu_cpu_is_self(cpu)) {
+            tlb_flush(cpu->env_ptr, flush_global);
+        } else {
+            async_run_on_cpu(cpu, tlb_flush_async_work, cpu->env_ptr);
+        }
+    }
+}
+
+static inline bool tlb_hit_page(target_ulong tlb_addr, target_ulong page)
+{
+    return page == (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+/* Remember that the main TLB entry 'index' of 'mmu_idx' was filled.  */
+static inline void tlb_log_fill(CPUArchState *env, int mmu_idx, int index)
+{
+    int n = env->tlb_dirty_count;
+
+    if (n <= CPU_TLB_DIRTY_LOG) {
+        if (n < CPU_TLB_DIRTY_LOG) {
+            env->tlb_dirty_log[n] = (mmu_idx << CPU_TLB_BITS) | index;
+        }
+        env->tlb_dirty_count = n + 1;
+    }
+}
+
+static inline bool tlb_entry_is_empty(CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 &&
+           te->addr_code == -1;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_hit_page(tlb_entry->addr_read, addr) ||
+        tlb_hit_page(tlb_entry->addr_write, addr) ||
+        tlb_hit_page(tlb_entry->addr_code, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
-void tlb_flush_page(CPUArchState *env, target_ulong addr)
+/* Called by the softmmu helpers when the main TLB misses.  If the victim
+ * TLB has the page, swap the entry with the main TLB slot at 'index' and
+ * return true; the caller then retries the access.  'elt_ofs' selects the
+ * addr_read, addr_write or addr_code field.
+ */
+bool victim_tlb_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page)
 {
-    CPUState *cpu = ENV_GET_CPU(env);
-    int i;
-    int mmu_idx;
+    int vidx;
 
-#if defined(DEBUG_TLB)
-    printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
-#endif
-    /* Check if we need to flush due to large pages.  */
+    env->tlb_stats.misses++;
+    for (vidx = 0; vidx < env->vtlb_size; vidx++) {
+        CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
+        target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
+
+        if (tlb_hit_page(cmp, page)) {
+            CPUTLBEntry tmptlb;
+            hwaddr tmpiotlb;
+
+            tmptlb = env->tlb_table[mmu_idx][index];
+            env->tlb_table[mmu_idx][index] = *vtlb;
+            *vtlb = tmptlb;
+            tlb_log_fill(env, mmu_idx, index);
+
+            tmpiotlb = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = tmpiotlb;
+
+            env->tlb_stats.victim_hits++;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Return true if a batched flush must flush the whole TLB, because 'addr'
+   is covered by a large page.  */
+static bool tlb_flush_is_large_page(CPUArchState *env, target_ulong addr)
+{
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
 #if defined(DEBUG_TLB)
         printf("tlb_flush_page: forced full flush ("
                TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                env->tlb_flush_addr, env->tlb_flush_mask);
 #endif
+        return true;
+    }
+    return false;
+}
+
+/* Flush the main TLB entries and jump cache for one page; the victim TLB
+   is left to the caller, so that it is scanned once per batch.  */
+static void tlb_flush_page_main(CPUArchState *env, target_ulong page)
+{
+    int i = (page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_entry(&env->tlb_table[mmu_idx][i], page);
+    }
+    tb_flush_jmp_cache(env, page);
+}
+
+static inline bool tlb_hit_range(target_ulong tlb_addr, target_ulong start,
+                                 target_ulong len)
+{
+    target_ulong page = tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK);
+
+    return !(page & TLB_INVALID_MASK) && page - start < len;
+}
+
+/* Flush the pages overlapping [addr, addr + len) in a single pass over
+ * the victim TLB.  Ranges of more than TLB_FLUSH_BATCH_MAX pages flush
+ * the whole TLB, which is cheaper than flushing them one by one.
+ */
+void tlb_flush_page_range(CPUArchState *env, target_ulong addr,
+                          target_ulong len)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    target_ulong start = addr & TARGET_PAGE_MASK;
+    target_ulong page, npages, n;
+    int i, mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page_range: " TARGET_FMT_lx "+" TARGET_FMT_lx "\n",
+           addr, len);
+#endif
+    if (len == 0) {
+        return;
+    }
+    if (len >= TLB_FLUSH_BATCH_MAX * TARGET_PAGE_SIZE) {
         tlb_flush(env, 1);
         return;
     }
+    /* round up to whole pages */
+    len = (len + (addr - start) + ~TARGET_PAGE_MASK) & TARGET_PAGE_MASK;
+    npages = len >> TARGET_PAGE_BITS;
+    for (page = start, n = 0; n < npages; page += TARGET_PAGE_SIZE, n++) {
+        if (tlb_flush_is_large_page(env, page)) {
+            tlb_flush(env, 1);
+            return;
+        }
+    }
+
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
 
-    addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    for (page = start, n = 0; n < npages; page += TARGET_PAGE_SIZE, n++) {
+        tlb_flush_page_main(env, page);
+    }
+
+    /* check whether there are entries that need to be flushed in the vtlb */
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (i = 0; i < env->vtlb_used && i < env->vtlb_size; i++) {
+            CPUTLBEntry *te = &env->tlb_v_table[mmu_idx][i];
+
+            if (tlb_hit_range(te->addr_read, start, len) ||
+                tlb_hit_range(te->addr_write, start, len) ||
+                tlb_hit_range(te->addr_code, start, len)) {
+                *te = s_cputlb_empty_entry;
+            }
+        }
     }
 
-    tb_flush_jmp_cache(env, addr);
+    env->tlb_stats.page_flushes += npages;
+    if (npages > 1) {
+        env->tlb_stats.range_flushes++;
+    }
+}
+
+void tlb_flush_page(CPUArchState *env, target_ulong addr)
+{
+    tlb_flush_page_range(env, addr, 1);
+}
+
+/* Flush the 'n' pages in 'addrs', which need not be sorted or distinct,
+ * in a single pass over the victim TLB.
+ */
+void tlb_flush_page_set(CPUArchState *env, const target_ulong *addrs, int n)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    int i, j, mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_page_set: %d pages\n", n);
+#endif
+    if (n > TLB_FLUSH_BATCH_MAX) {
+        tlb_flush(env, 1);
+        return;
+    }
+    for (j = 0; j < n; j++) {
+        if (tlb_flush_is_large_page(env, addrs[j])) {
+            tlb_flush(env, 1);
+            return;
+        }
+    }
+
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    cpu->current_tb = NULL;
+
+    for (j = 0; j < n; j++) {
+        tlb_flush_page_main(env, addrs[j] & TARGET_PAGE_MASK);
+    }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->vtlb_used && i < env->vtlb_size; i++) {
+            CPUTLBEntry *te = &env->tlb_v_table[mmu_idx][i];
+
+            if (tlb_entry_is_empty(te)) {
+                continue;
+            }
+            for (j = 0; j < n; j++) {
+                tlb_flush_entry(te, addrs[j] & TARGET_PAGE_MASK);
+            }
+        }
+    }
+
+    env->tlb_stats.page_flushes += n;
+    env->tlb_stats.range_flushes++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -129,7 +396,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 {
     cpu_physical_memory_reset_dirty(ram_addr,
                                     ram_addr + TARGET_PAGE_SIZE,
-                                    CODE_DIRTY_FLAG);
+                                    DIRTY_MEMORY_CODE);
 }
 
 /* update the TLB so that writes in physical page 'phys_addr' are no longer
@@ -137,7 +404,7 @@ void tlb_protect_code(ram_addr_t ram_addr)
 void tlb_unprotect_code_phys(CPUArchState *env, ram_addr_t ram_addr,
                              target_ulong vaddr)
 {
-    cpu_physical_memory_set_dirty_flags(ram_addr, CODE_DIRTY_FLAG);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_CODE);
 }
 
 static bool tlb_is_dirty_ram(CPUTLBEntry *tlbe)
@@ -200,6 +467,11 @@ void cpu_tlb_reset_dirty_all(ram_addr_t start1, ram_addr_t length)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
             }
+
+            for (i = 0; i < env->vtlb_size; i++) {
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
+            }
         }
     }
 }
@@ -223,6 +495,12 @@ void tlb_set_dirty(CPUArchState *env, target_ulong vaddr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
     }
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->vtlb_size; i++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][i], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -257,7 +535,9 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
 {
     MemoryRegionSection *section;
     unsigned int index;
+    int vidx;
     target_ulong address;
+    target_ulong vaddr_page;
     target_ulong code_address;
     uintptr_t addend;
     CPUTLBEntry *te;
@@ -294,8 +574,37 @@ void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                                             prot, &address);
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* The victim TLB must not hold an older mapping of this page.  */
+    vaddr_page = vaddr & TARGET_PAGE_MASK;
+    for (vidx = 0; vidx < env->vtlb_size; vidx++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], vaddr_page);
+    }
+
+    /* Do not discard the translation in te, evict it into the victim
+       TLB, unless it maps the same page.  */
+    if (env->vtlb_size && !tlb_entry_is_empty(te) &&
+        !tlb_hit_page(te->addr_read, vaddr_page) &&
+        !tlb_hit_page(te->addr_write, vaddr_page) &&
+        !tlb_hit_page(te->addr_code, vaddr_page)) {
+        vidx = env->vtlb_index++ % env->vtlb_size;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+        if (vidx >= env->vtlb_used) {
+            env->vtlb_used = vidx + 1;
+        }
+    }
+    tlb_log_fill(env, mmu_idx, index);
+
+    env->tlb_stats.fills++;
+    if (env->vtlb_size &&
+        env->tlb_stats.fills - env->tlb_stats.window_fills >=
+        VTLB_RESIZE_WINDOW) {
+        tlb_vtlb_resize(env);
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
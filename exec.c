@@ -90,6 +90,24 @@ struct PhysPageEntry {
 
 typedef PhysPageEntry Node[L2_SIZE];
 
+/* A few recent results of phys_page_find().  Entries are tagged with the
+ * generation of the AddressSpaceDispatch they were looked up in; every
+ * change to the memory map installs a dispatch with a new generation, so
+ * that stale entries never match.
+ */
+#define PHYS_CACHE_SIZE 4
+
+typedef struct PhysCacheEntry {
+    unsigned int gen;
+    hwaddr index;
+    MemoryRegionSection *section;
+} PhysCacheEntry;
+
+typedef struct PhysLookupCache {
+    PhysCacheEntry entry[PHYS_CACHE_SIZE];
+    unsigned int next;
+} PhysLookupCache;
+
 struct AddressSpaceDispatch {
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
@@ -98,8 +116,14 @@ struct AddressSpaceDispatch {
     Node *nodes;
     MemoryRegionSection *sections;
     AddressSpace *as;
+    unsigned int gen;
+    /* used outside vCPU threads, with the iothread lock held */
+    PhysLookupCache cache;
 };
 
+/* generation of the last AddressSpaceDispatch created, never 0 */
+static unsigned int phys_dispatch_gen;
+
 #define SUBPAGE_IDX(addr) ((addr) & ~TARGET_PAGE_MASK)
 typedef struct subpage_t {
     MemoryRegion iomem;
@@ -230,6 +254,51 @@ bool memory_region_is_unassigned(MemoryRegion *mr)
         && mr != &io_mem_watch;
 }
 
+/* vCPU threads use their own lookup cache; other threads share the
+ * dispatch's cache if they hold the iothread lock, and bypass the cache
+ * otherwise.
+ */
+static PhysLookupCache *phys_lookup_cache(AddressSpaceDispatch *d)
+{
+    CPUState *cpu = current_cpu;
+
+    if (cpu) {
+        if (!cpu->phys_cache) {
+            cpu->phys_cache = g_new0(PhysLookupCache, 1);
+        }
+        return cpu->phys_cache;
+    }
+    if (qemu_mutex_iothread_locked()) {
+        return &d->cache;
+    }
+    return NULL;
+}
+
+static MemoryRegionSection *phys_page_find_cached(AddressSpaceDispatch *d,
+                                                  hwaddr index)
+{
+    PhysLookupCache *cache = phys_lookup_cache(d);
+    PhysCacheEntry *e;
+    MemoryRegionSection *section;
+    int i;
+
+    if (!cache) {
+        return phys_page_find(d->phys_map, index, d->nodes, d->sections);
+    }
+    for (i = 0; i < PHYS_CACHE_SIZE; i++) {
+        e = &cache->entry[i];
+        if (e->index == index && e->gen == d->gen) {
+            return e->section;
+        }
+    }
+    section = phys_page_find(d->phys_map, index, d->nodes, d->sections);
+    e = &cache->entry[cache->next++ % PHYS_CACHE_SIZE];
+    e->gen = d->gen;
+    e->index = index;
+    e->section = section;
+    return section;
+}
+
 static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
                                                         hwaddr addr,
                                                         bool resolve_subpage)
@@ -237,8 +306,7 @@ static MemoryRegionSection *address_space_lookup_region(AddressSpaceDispatch *d,
     MemoryRegionSection *section;
     subpage_t *subpage;
 
-    section = phys_page_find(d->phys_map, addr >> TARGET_PAGE_BITS,
-                             d->nodes, d->sections);
+    section = phys_page_find_cached(d, addr >> TARGET_PAGE_BITS);
     if (resolve_subpage && section->mr->subpage) {
         subpage = container_of(section->mr, subpage_t, iomem);
         section = &d->sections[subpage->sub_section[SUBPAGE_IDX(addr)]];
@@ -695,7 +763,7 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t end,
 
 /* Note: start and end must be within the same ram block.  */
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
-                                     int dirty_flags)
+                                     unsigned client)
 {
     uintptr_t length;
 
@@ -705,13 +773,123 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
     length = end - start;
     if (length == 0)
         return;
-    cpu_physical_memory_mask_dirty_range(start, length, dirty_flags);
+    cpu_physical_memory_clear_dirty_range(start, length, client);
 
     if (tcg_enabled()) {
         tlb_reset_dirty_range_all(start, end, length);
     }
 }
 
+/* Marks dirty the pages set in @bitmap, a little endian bitmap of host pages
+ * such as the dirty log of KVM.  Whole words are merged when @start is
+ * aligned to a word of the dirty bitmaps.
+ */
+void cpu_physical_memory_set_dirty_lebitmap(unsigned long *bitmap,
+                                            ram_addr_t start,
+                                            ram_addr_t pages)
+{
+    unsigned long hpratio = getpagesize() / TARGET_PAGE_SIZE;
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long len = BITS_TO_LONGS(pages);
+    unsigned long i, j, c, temp;
+    int k;
+
+    if (hpratio == 1 && (page % BITS_PER_LONG) == 0) {
+        page = BIT_WORD(page);
+        for (i = 0; i < len; i++) {
+            if (!bitmap[i]) {
+                continue;
+            }
+            temp = leul_to_cpu(bitmap[i]);
+            for (k = 0; k < DIRTY_MEMORY_NUM; k++) {
+                atomic_or(&ram_list.dirty_memory[k][page + i], temp);
+                set_bit_atomic(((page + i) * BITS_PER_LONG) >>
+                               DIRTY_SUMMARY_BITS, ram_list.dirty_summary[k]);
+            }
+        }
+        xen_modified_memory(start, pages << TARGET_PAGE_BITS);
+        return;
+    }
+
+    for (i = 0; i < len; i++) {
+        if (bitmap[i] != 0) {
+            c = leul_to_cpu(bitmap[i]);
+            do {
+                j = ctzl(c);
+                c &= ~(1ul << j);
+                cpu_physical_memory_set_dirty_range(
+                    start + ((i * BITS_PER_LONG + j) * hpratio <<
+                             TARGET_PAGE_BITS),
+                    TARGET_PAGE_SIZE * hpratio);
+            } while (c != 0);
+        }
+    }
+}
+
+/* Moves the dirty bits of @client for the first @pages pages of RAM into
+ * @dest and returns how many of them were not set in @dest yet.
+ *
+ * Only the parts of the dirty bitmap whose summary bit is set are scanned,
+ * one word at a time, so that the cost depends on how much memory was
+ * dirtied rather than on the size of RAM.  The summary bit is cleared before
+ * the words it covers are read; writers set it after the page bit, so a
+ * concurrent update is either collected now or at the next sync.
+ */
+uint64_t cpu_physical_memory_sync_dirty_bitmap(unsigned long *dest,
+                                               ram_addr_t pages,
+                                               unsigned client)
+{
+    unsigned long *src = ram_list.dirty_memory[client];
+    unsigned long *summary = ram_list.dirty_summary[client];
+    unsigned long nr_chunks = DIV_ROUND_UP(pages, 1UL << DIRTY_SUMMARY_BITS);
+    unsigned long nr_words = BITS_TO_LONGS(pages);
+    unsigned long chunk, k, first, last, bits, mask;
+    uint64_t num_dirty = 0;
+
+    for (chunk = find_first_bit(summary, nr_chunks); chunk < nr_chunks;
+         chunk = find_next_bit(summary, nr_chunks, chunk + 1)) {
+        clear_bit(chunk, summary);
+        smp_mb();
+
+        first = BIT_WORD(chunk << DIRTY_SUMMARY_BITS);
+        last = MIN(BIT_WORD((chunk + 1) << DIRTY_SUMMARY_BITS), nr_words);
+        for (k = first; k < last; k++) {
+            if (!src[k]) {
+                continue;
+            }
+            mask = ~0UL;
+            if (k == nr_words - 1) {
+                mask = BITMAP_LAST_WORD_MASK(pages);
+            }
+            if (mask == ~0UL) {
+                bits = atomic_xchg(&src[k], 0);
+            } else {
+                /* pages beyond @dest stay dirty for a later sync */
+                bits = __sync_fetch_and_and(&src[k], ~mask) & mask;
+                if (src[k]) {
+                    set_bit(chunk, summary);
+                }
+            }
+            num_dirty += ctpopl(bits & ~dest[k]);
+            dest[k] |= bits;
+
+            /* make TCG trap the next write to these pages again */
+            if (tcg_enabled()) {
+                while (bits) {
+                    ram_addr_t addr = (ram_addr_t)(k * BITS_PER_LONG +
+                                                   ctzl(bits))
+                                      << TARGET_PAGE_BITS;
+                    tlb_reset_dirty_range_all(addr, addr + TARGET_PAGE_SIZE,
+                                              TARGET_PAGE_SIZE);
+                    bits &= bits - 1;
+                }
+            }
+        }
+    }
+
+    return num_dirty;
+}
+
 static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
@@ -1113,6 +1291,11 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                    MemoryRegion *mr)
 {
     RAMBlock *block, *new_block;
+    ram_addr_t old_ram_size, new_ram_size;
+    unsigned long old_chunks, new_chunks;
+    int i;
+
+    old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = g_malloc0(sizeof(*new_block));
@@ -1166,11 +1349,20 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
-    ram_list.phys_dirty = g_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0, size >> TARGET_PAGE_BITS);
-    cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
+    new_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
+    if (new_ram_size > old_ram_size) {
+        old_chunks = DIV_ROUND_UP(old_ram_size, 1UL << DIRTY_SUMMARY_BITS);
+        new_chunks = DIV_ROUND_UP(new_ram_size, 1UL << DIRTY_SUMMARY_BITS);
+        for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+            ram_list.dirty_memory[i] =
+                bitmap_zero_extend(ram_list.dirty_memory[i],
+                                   old_ram_size, new_ram_size);
+            ram_list.dirty_summary[i] =
+                bitmap_zero_extend(ram_list.dirty_summary[i],
+                                   old_chunks, new_chunks);
+        }
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, size);
 
     qemu_ram_setup_dump(new_block->host, size);
     qemu_madvise(new_block->host, size, QEMU_MADV_HUGEPAGE);
@@ -1452,11 +1644,8 @@ found:
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
                                uint64_t val, unsigned size)
 {
-    int dirty_flags;
-    dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
-    if (!(dirty_flags & CODE_DIRTY_FLAG)) {
+    if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
         tb_invalidate_phys_page_fast(ram_addr, size);
-        dirty_flags = cpu_physical_memory_get_dirty_flags(ram_addr);
     }
     switch (size) {
     case 1:
@@ -1471,11 +1660,11 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
     default:
         abort();
     }
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
-    cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_VGA);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff) {
+    if (cpu_physical_memory_is_dirty(ram_addr)) {
         CPUArchState *env = current_cpu->env_ptr;
         tlb_set_dirty(env, env->mem_io_vaddr);
     }
@@ -1712,10 +1901,14 @@ static void io_mem_init(void)
 static void mem_begin(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = g_new(AddressSpaceDispatch, 1);
+    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
 
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .is_leaf = 0 };
     d->as = as;
+    if (++phys_dispatch_gen == 0) {
+        ++phys_dispatch_gen;
+    }
+    d->gen = phys_dispatch_gen;
     as->next_dispatch = d;
 }
 
@@ -1760,16 +1953,10 @@ static void core_commit(MemoryListener *listener)
 
 static void tcg_commit(MemoryListener *listener)
 {
-    CPUState *cpu;
-
     /* since each CPU stores ram addresses in its TLB cache, we must
        reset the modified entries */
     /* XXX: slow ! */
-    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
-        CPUArchState *env = cpu->env_ptr;
-
-        tlb_flush(env, 1);
-    }
+    tlb_flush_all(1);
 }
 
 static void core_log_global_start(MemoryListener *listener)
@@ -1893,7 +2080,8 @@ static void invalidate_and_set_dirty(hwaddr addr,
         /* invalidate code */
         tb_invalidate_phys_page_range(addr, addr + length, 0);
         /* set dirty bit */
-        cpu_physical_memory_set_dirty_flags(addr, (0xff & ~CODE_DIRTY_FLAG));
+        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_MIGRATION);
+        cpu_physical_memory_set_dirty_flag(addr, DIRTY_MEMORY_VGA);
     }
     xen_modified_memory(addr, length);
 }
@@ -2473,8 +2661,9 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
                 /* invalidate code */
                 tb_invalidate_phys_page_range(addr1, addr1 + 4, 0);
                 /* set dirty bit */
-                cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                cpu_physical_memory_set_dirty_flag(addr1,
+                                                   DIRTY_MEMORY_MIGRATION);
+                cpu_physical_memory_set_dirty_flag(addr1, DIRTY_MEMORY_VGA);
             }
         }
     }
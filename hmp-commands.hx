@@ -928,6 +928,39 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "migrate_set_channels",
+        .args_type  = "value:i",
+        .params     = "value",
+        .help       = "set the number of channels used to send RAM during "
+                      "migration",
+        .mhandler.cmd = hmp_migrate_set_channels,
+    },
+
+STEXI
+@item migrate_set_channels @var{value}
+@findex migrate_set_channels
+Send guest RAM over @var{value} parallel connections, each served by its own
+thread.  Only tcp: and unix: migrations support more than one channel.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress_params",
+        .args_type  = "level:i,threads:i?,decompress_threads:i?",
+        .params     = "level [threads [decompress_threads]]",
+        .help       = "set the compression level and threads used by the "
+                      "compress migration capability",
+        .mhandler.cmd = hmp_migrate_set_compress_params,
+    },
+
+STEXI
+@item migrate_set_compress_params @var{level} [@var{threads} [@var{decompress_threads}]]
+@findex migrate_set_compress_params
+Set the zlib compression @var{level} (0 to 9) used by the compress migration
+capability, and optionally the number of threads that compress pages on the
+source and decompress them on the destination.
 ETEXI
 
     {
@@ -1615,6 +1648,8 @@ show block device statistics
 show the cpu registers
 @item info cpus
 show infos for each CPU
+@item info iothreads
+show iothreads
 @item info history
 show the command line history
 @item info irq
@@ -213,6 +213,38 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
+        if (info->xbzrle_cache->has_sets) {
+            XBZRLECacheSetStatsList *set;
+            int i = 0;
+
+            monitor_printf(mon, "xbzrle cache sets (hits/misses):");
+            for (set = info->xbzrle_cache->sets; set; set = set->next, i++) {
+                monitor_printf(mon, "%s %d: %" PRIu64 "/%" PRIu64,
+                               i % 4 ? "" : "\n ", i, set->value->hits,
+                               set->value->misses);
+            }
+            monitor_printf(mon, "\n");
+        }
+    }
+
+    if (info->has_compression) {
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed transferred: %" PRIu64 " kbytes\n",
+                       info->compression->bytes >> 10);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        monitor_printf(mon, "compression rate: %0.2f\n",
+                       info->compression->compression_rate);
+    }
+
+    if (info->has_postcopy) {
+        monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                       info->postcopy->requests);
+        monitor_printf(mon, "postcopy average latency: %" PRIu64 " us\n",
+                       info->postcopy->average_latency);
+        monitor_printf(mon, "postcopy max latency: %" PRIu64 " us\n",
+                       info->postcopy->max_latency);
     }
 
     qapi_free_MigrationInfo(info);
@@ -282,6 +314,28 @@ void hmp_info_cpus(Monitor *mon, const QDict *qdict)
     qapi_free_CpuInfoList(cpu_list);
 }
 
+void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
+{
+    IOThreadInfoList *info_list = qmp_query_iothreads(NULL);
+    IOThreadInfoList *info;
+
+    for (info = info_list; info; info = info->next) {
+        monitor_printf(mon, "%s: thread_id=%" PRId64, info->value->id,
+                       info->value->thread_id);
+        if (info->value->has_cpus) {
+            monitor_printf(mon, " cpus=%s", info->value->cpus);
+        }
+        monitor_printf(mon, " poll-max-ns=%" PRId64 " poll-grow=%" PRId64
+                       " poll-shrink=%" PRId64 " poll-successes=%" PRId64
+                       "/%" PRId64 "\n",
+                       info->value->poll_max_ns, info->value->poll_grow,
+                       info->value->poll_shrink, info->value->poll_successes,
+                       info->value->poll_attempts);
+    }
+
+    qapi_free_IOThreadInfoList(info_list);
+}
+
 void hmp_info_block(Monitor *mon, const QDict *qdict)
 {
     BlockInfoList *block_list, *info;
@@ -986,6 +1040,39 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_channels(Monitor *mon, const QDict *qdict)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    qmp_migrate_set_channels(value, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
+void hmp_migrate_set_compress_params(Monitor *mon, const QDict *qdict)
+{
+    int64_t level = qdict_get_int(qdict, "level");
+    bool has_threads = qdict_haskey(qdict, "threads");
+    int64_t threads = qdict_get_try_int(qdict, "threads", 0);
+    bool has_decompress_threads = qdict_haskey(qdict, "decompress_threads");
+    int64_t decompress_threads = qdict_get_try_int(qdict,
+                                                   "decompress_threads", 0);
+    Error *err = NULL;
+
+    qmp_migrate_set_compress_params(true, level, has_threads, threads,
+                                    has_decompress_threads,
+                                    decompress_threads, &err);
+    if (err) {
+        monitor_printf(mon, "%s\n", error_get_pretty(err));
+        error_free(err);
+        return;
+    }
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1507,7 +1594,12 @@ void hmp_qemu_io(Monitor *mon, const QDict *qdict)
 
     bs = bdrv_find(device);
     if (bs) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        /* The device may be bound to a dataplane thread */
+        aio_context_acquire(aio_context);
         qemuio_command(bs, command);
+        aio_context_release(aio_context);
     } else {
         error_set(&err, QERR_DEVICE_NOT_FOUND, device);
     }
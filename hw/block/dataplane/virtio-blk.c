@@ -17,57 +17,47 @@
 #include "qemu/thread.h"
 #include "qemu/error-report.h"
 #include "hw/virtio/dataplane/vring.h"
-#include "ioq.h"
 #include "block/block.h"
 #include "hw/virtio/virtio-blk.h"
 #include "virtio-blk.h"
 #include "block/aio.h"
 #include "hw/virtio/virtio-bus.h"
+#include "sysemu/iothread.h"
+#include "qom/object_interfaces.h"
 
 enum {
     SEG_MAX = 126,                  /* maximum number of I/O segments */
     VRING_MAX = SEG_MAX + 2,        /* maximum number of vring descriptors */
-    REQ_MAX = VRING_MAX,            /* maximum number of requests in the vring,
-                                     * is VRING_MAX / 2 with traditional and
-                                     * VRING_MAX with indirect descriptors */
 };
 
 typedef struct {
-    struct iocb iocb;               /* Linux AIO control block */
+    VirtIOBlockDataPlane *s;
     QEMUIOVector *inhdr;            /* iovecs for virtio_blk_inhdr */
     unsigned int head;              /* vring descriptor index */
-    struct iovec *bounce_iov;       /* used if guest buffers are unaligned */
-    QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
+    QEMUIOVector qiov;              /* data buffers, owned by the request */
+    BlockAcctCookie acct;
 } VirtIOBlockRequest;
 
 struct VirtIOBlockDataPlane {
     bool started;
     bool stopping;
-    QEMUBH *start_bh;
-    QemuThread thread;
 
     VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
 
     VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
+    IOThread *iothread;             /* user-specified or private */
 
     /* Note that these EventNotifiers are assigned by value.  This is
      * fine as long as you do not call event_notifier_cleanup on them
      * (because you don't own the file descriptor or handle; you just
      * use it).
      */
-    AioContext *ctx;
-    EventNotifier io_notifier;      /* Linux AIO completion */
+    AioContext *ctx;                /* BlockDriverState is bound to this */
     EventNotifier host_notifier;    /* doorbell */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
-    VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
-                                             queue */
-
-    unsigned int num_reqs;
+    unsigned int num_reqs;          /* requests in flight in the block layer */
 };
 
 /* Raise an interrupt to signal guest, if necessary */
@@ -80,34 +70,13 @@ static void notify_guest(VirtIOBlockDataPlane *s)
     event_notifier_set(s->guest_notifier);
 }
 
-static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
+static void complete_request(VirtIOBlockRequest *req, unsigned char status,
+                             int len)
 {
-    VirtIOBlockDataPlane *s = opaque;
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
-    struct virtio_blk_inhdr hdr;
-    int len;
-
-    if (likely(ret >= 0)) {
-        hdr.status = VIRTIO_BLK_S_OK;
-        len = ret;
-    } else {
-        hdr.status = VIRTIO_BLK_S_IOERR;
-        len = 0;
-    }
-
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
-
-    if (req->read_qiov) {
-        assert(req->bounce_iov);
-        qemu_iovec_from_buf(req->read_qiov, 0, req->bounce_iov->iov_base, len);
-        qemu_iovec_destroy(req->read_qiov);
-        g_slice_free(QEMUIOVector, req->read_qiov);
-    }
-
-    if (req->bounce_iov) {
-        qemu_vfree(req->bounce_iov->iov_base);
-        g_slice_free(struct iovec, req->bounce_iov);
-    }
+    VirtIOBlockDataPlane *s = req->s;
+    struct virtio_blk_inhdr hdr = {
+        .status = status,
+    };
 
     qemu_iovec_from_buf(req->inhdr, 0, &hdr, sizeof(hdr));
     qemu_iovec_destroy(req->inhdr);
@@ -118,10 +87,27 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * transferred plus the status bytes.
      */
     vring_push(&s->vring, req->head, len + sizeof(hdr));
+    notify_guest(s);
 
+    qemu_iovec_destroy(&req->qiov);
+    g_slice_free(VirtIOBlockRequest, req);
     s->num_reqs--;
 }
 
+static void complete_rdwr(void *opaque, int ret)
+{
+    VirtIOBlockRequest *req = opaque;
+
+    trace_virtio_blk_data_plane_complete_request(req->s, req->head, ret);
+    bdrv_acct_done(req->s->blk->conf.bs, &req->acct);
+
+    if (likely(ret == 0)) {
+        complete_request(req, VIRTIO_BLK_S_OK, req->qiov.size);
+    } else {
+        complete_request(req, VIRTIO_BLK_S_IOERR, 0);
+    }
+}
+
 static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
@@ -150,53 +136,63 @@ static void do_get_id_cmd(VirtIOBlockDataPlane *s,
     complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
-                       struct iovec *iov, unsigned int iov_cnt,
-                       long long offset, unsigned int head,
-                       QEMUIOVector *inhdr)
+static VirtIOBlockRequest *alloc_request(VirtIOBlockDataPlane *s,
+                                         unsigned int head,
+                                         QEMUIOVector *inhdr)
 {
-    struct iocb *iocb;
-    QEMUIOVector qiov;
-    struct iovec *bounce_iov = NULL;
-    QEMUIOVector *read_qiov = NULL;
-
-    qemu_iovec_init_external(&qiov, iov, iov_cnt);
-    if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
-        void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
-
-        if (read) {
-            /* Need to copy back from bounce buffer on completion */
-            read_qiov = g_slice_new(QEMUIOVector);
-            qemu_iovec_init(read_qiov, iov_cnt);
-            qemu_iovec_concat_iov(read_qiov, iov, iov_cnt, 0, qiov.size);
-        } else {
-            qemu_iovec_to_buf(&qiov, 0, bounce_buffer, qiov.size);
-        }
+    VirtIOBlockRequest *req = g_slice_new(VirtIOBlockRequest);
 
-        /* Redirect I/O to aligned bounce buffer */
-        bounce_iov = g_slice_new(struct iovec);
-        bounce_iov->iov_base = bounce_buffer;
-        bounce_iov->iov_len = qiov.size;
-        iov = bounce_iov;
-        iov_cnt = 1;
+    req->s = s;
+    req->head = head;
+    req->inhdr = inhdr;
+    s->num_reqs++;
+    return req;
+}
+
+static void do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+                        struct iovec *iov, unsigned int iov_cnt,
+                        int64_t sector_num, unsigned int head,
+                        QEMUIOVector *inhdr)
+{
+    BlockDriverState *bs = s->blk->conf.bs;
+    VirtIOBlockRequest *req = alloc_request(s, head, inhdr);
+
+    /* The vring iovecs are reused for the next request, so keep a copy */
+    qemu_iovec_init(&req->qiov, iov_cnt);
+    qemu_iovec_concat_iov(&req->qiov, iov, iov_cnt, 0,
+                          iov_size(iov, iov_cnt));
+
+    if (req->qiov.size % BDRV_SECTOR_SIZE) {
+        complete_request(req, VIRTIO_BLK_S_IOERR, 0);
+        return;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    bdrv_acct_start(bs, &req->acct, req->qiov.size,
+                    read ? BDRV_ACCT_READ : BDRV_ACCT_WRITE);
+    if (read) {
+        bdrv_aio_readv(bs, sector_num, &req->qiov,
+                       req->qiov.size / BDRV_SECTOR_SIZE, complete_rdwr, req);
+    } else {
+        bdrv_aio_writev(bs, sector_num, &req->qiov,
+                        req->qiov.size / BDRV_SECTOR_SIZE, complete_rdwr, req);
+    }
+}
 
-    /* Fill in virtio block metadata needed for completion */
-    VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
-    req->head = head;
-    req->inhdr = inhdr;
-    req->bounce_iov = bounce_iov;
-    req->read_qiov = read_qiov;
-    return 0;
+static void do_flush_cmd(VirtIOBlockDataPlane *s, unsigned int head,
+                         QEMUIOVector *inhdr)
+{
+    BlockDriverState *bs = s->blk->conf.bs;
+    VirtIOBlockRequest *req = alloc_request(s, head, inhdr);
+
+    qemu_iovec_init(&req->qiov, 0);
+    bdrv_acct_start(bs, &req->acct, 0, BDRV_ACCT_FLUSH);
+    bdrv_aio_flush(bs, complete_rdwr, req);
 }
 
-static int process_request(IOQueue *ioq, struct iovec iov[],
+static int process_request(VirtIOBlockDataPlane *s, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -228,11 +224,11 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
@@ -241,12 +237,7 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
-        /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
-        if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
-        } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
-        }
+        do_flush_cmd(s, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
@@ -266,24 +257,15 @@ static int flush_true(EventNotifier *e)
     return true;
 }
 
-static void handle_notify(EventNotifier *e)
+static void process_vring(VirtIOBlockDataPlane *s)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
-
-    /* There is one array of iovecs into which all new requests are extracted
-     * from the vring.  Requests are read from the vring and the translated
-     * descriptors are written to the iovecs array.  The iovecs do not have to
-     * persist across handle_notify() calls because the kernel copies the
-     * iovecs on io_submit().
-     *
-     * Handling io_submit() EAGAIN may require storing the requests across
-     * handle_notify() calls until the kernel has sufficient resources to
-     * accept more I/O.  This is not implemented yet.
+    /* There is one array of iovecs into which each new request is extracted
+     * from the vring.  The translated descriptors are written to the iovecs
+     * array and copied into the request before it is handed to the block
+     * layer, so the array can be reused for the next request.
      */
     struct iovec iovec[VRING_MAX];
     struct iovec *end = &iovec[VRING_MAX];
-    struct iovec *iov = iovec;
 
     /* When a request is read from the vring, the index of the first descriptor
      * (aka head) is returned so that the completed request can be pushed onto
@@ -294,15 +276,17 @@ static void handle_notify(EventNotifier *e)
      */
     int head;
     unsigned int out_num = 0, in_num = 0;
-    unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    /* Submit all requests from this notification together */
+    bdrv_io_plug(s->blk->conf.bs);
+
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
         vring_disable_notification(s->vdev, &s->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(s->vdev, &s->vring, iovec, end,
+                             &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
@@ -310,11 +294,10 @@ static void handle_notify(EventNotifier *e)
             trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
                                                         head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
+            if (process_request(s, iovec, out_num, in_num, head) < 0) {
                 vring_set_broken(&s->vring);
                 break;
             }
-            iov += out_num + in_num;
         }
 
         if (likely(head == -EAGAIN)) { /* vring emptied */
@@ -325,85 +308,63 @@ static void handle_notify(EventNotifier *e)
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
-            /* Since there are no iovecs[] left, stop processing for now.  Do
-             * not re-enable guest->host notifies since the I/O completion
-             * handler knows to check for more vring descriptors anyway.
+            /* A single request does not fit into iovecs[], stop processing.
+             * Do not re-enable guest->host notifies.
              */
             break;
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
-    if (num_queued > 0) {
-        s->num_reqs += num_queued;
-
-        int rc = ioq_submit(&s->ioqueue);
-        if (unlikely(rc < 0)) {
-            fprintf(stderr, "ioq_submit failed %d\n", rc);
-            exit(1);
-        }
-    }
+    bdrv_io_unplug(s->blk->conf.bs);
 }
 
-static int flush_io(EventNotifier *e)
+static void handle_notify(EventNotifier *e)
 {
     VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+                                           host_notifier);
 
-    return s->num_reqs > 0;
+    event_notifier_test_and_clear(&s->host_notifier);
+    process_vring(s);
 }
 
-static void handle_io(EventNotifier *e)
+/* Busy-polling callback: pick up requests without waiting for a kick */
+static bool poll_notify(EventNotifier *e)
 {
     VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+                                           host_notifier);
 
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
-    }
+    uint16_t old_avail_idx = s->vring.last_avail_idx;
 
-    /* If there were more requests than iovecs, the vring will not be empty yet
-     * so check again.  There should now be enough resources to process more
-     * requests.
-     */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
+    if (s->vring.broken || !vring_more_avail(&s->vring)) {
+        return false;
     }
-}
-
-static void *data_plane_thread(void *opaque)
-{
-    VirtIOBlockDataPlane *s = opaque;
-
-    do {
-        aio_poll(s->ctx, true);
-    } while (!s->stopping || s->num_reqs > 0);
-    return NULL;
-}
+    process_vring(s);
 
-static void start_data_plane_bh(void *opaque)
-{
-    VirtIOBlockDataPlane *s = opaque;
-
-    qemu_bh_delete(s->start_bh);
-    s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    /* A request that could not be popped is not progress */
+    return s->vring.last_avail_idx != old_avail_idx;
 }
 
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   VirtIOBlockDataPlane **dataplane)
 {
     VirtIOBlockDataPlane *s;
-    int fd;
+    IOThread *iothread = NULL;
+    Error *local_err = NULL;
 
     *dataplane = NULL;
 
-    if (!blk->data_plane) {
+    if (!blk->data_plane && !blk->iothread) {
         return true;
     }
 
+    if (blk->iothread) {
+        iothread = iothread_find(blk->iothread);
+        if (!iothread) {
+            error_report("iothread '%s' not found", blk->iothread);
+            return false;
+        }
+    }
+
     if (blk->scsi) {
         error_report("device is incompatible with x-data-plane, use scsi=off");
         return false;
@@ -423,17 +384,31 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
         return false;
     }
 
-    fd = raw_get_aio_fd(blk->conf.bs);
-    if (fd < 0) {
+    if (!bdrv_can_set_aio_context(blk->conf.bs)) {
         error_report("drive is incompatible with x-data-plane, "
-                     "use format=raw,cache=none,aio=native");
+                     "its block driver only runs in the main loop");
         return false;
     }
 
+    if (iothread) {
+        object_ref(OBJECT(iothread));
+    } else {
+        /* Without iothread= the device gets an event loop thread of its own */
+        iothread = IOTHREAD(object_new(TYPE_IOTHREAD));
+        user_creatable_complete(OBJECT(iothread), &local_err);
+        if (local_err) {
+            error_report("%s", error_get_pretty(local_err));
+            error_free(local_err);
+            object_unref(OBJECT(iothread));
+            return false;
+        }
+    }
+
     s = g_new0(VirtIOBlockDataPlane, 1);
     s->vdev = vdev;
-    s->fd = fd;
     s->blk = blk;
+    s->iothread = iothread;
+    s->ctx = iothread_get_aio_context(iothread);
 
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
@@ -450,6 +425,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 
     virtio_blk_data_plane_stop(s);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    object_unref(OBJECT(s->iothread));
     g_free(s);
 }
 
@@ -458,7 +434,6 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     VirtQueue *vq;
-    int i;
 
     if (s->started) {
         return;
@@ -469,8 +444,6 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         return;
     }
 
-    s->ctx = aio_context_new();
-
     /* Set up guest notifier (irq) */
     if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
@@ -485,25 +458,20 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
         exit(1);
     }
     s->host_notifier = *virtio_queue_get_host_notifier(vq);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify, flush_true);
-
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
-    }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io, flush_io);
 
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
+    /* The iothread may already be running other devices' requests */
+    aio_context_acquire(s->ctx);
+    bdrv_set_aio_context(s->blk->conf.bs, s->ctx);
+    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify,
+                           flush_true);
+    aio_set_event_notifier_poll(s->ctx, &s->host_notifier, poll_notify);
+    aio_context_release(s->ctx);
+
     /* Kick right away to begin processing requests already in vring */
     event_notifier_set(virtio_queue_get_host_notifier(vq));
-
-    /* Spawn thread in BH so it inherits iothread cpusets */
-    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
-    qemu_bh_schedule(s->start_bh);
 }
 
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
@@ -516,22 +484,24 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
-    if (s->start_bh) {
-        qemu_bh_delete(s->start_bh);
-        s->start_bh = NULL;
-    } else {
-        aio_notify(s->ctx);
-        qemu_thread_join(&s->thread);
+    aio_context_acquire(s->ctx);
+
+    /* Stop notifications for new requests from guest */
+    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL, NULL);
+
+    /* Complete requests that are still in flight while the vring is still
+     * set up, their completion pushes to it.
+     */
+    while (s->num_reqs > 0) {
+        aio_poll(s->ctx, true);
     }
 
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL, NULL);
-    ioq_cleanup(&s->ioqueue);
+    /* Hand the BlockDriverState back to the main loop */
+    bdrv_set_aio_context(s->blk->conf.bs, qemu_get_aio_context());
 
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL, NULL);
-    k->set_host_notifier(qbus->parent, 0, false);
+    aio_context_release(s->ctx);
 
-    aio_context_unref(s->ctx);
+    k->set_host_notifier(qbus->parent, 0, false);
 
     /* Clean up guest notifier (irq) */
     k->set_guest_notifiers(qbus->parent, 1, false);
@@ -354,6 +354,7 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
     VirtIOSCSICommon *vs = &s->parent_obj;
 
     VirtIOSCSIReq *req;
+    GSList *plugged = NULL, *l;
     int n;
 
     while ((req = virtio_scsi_pop_req(s, vq))) {
@@ -397,11 +398,22 @@ static void virtio_scsi_handle_cmd(VirtIODevice *vdev, VirtQueue *vq)
             }
         }
 
+        /* Submit the requests for each disk together at the end */
+        if (d->conf.bs && !g_slist_find(plugged, d->conf.bs)) {
+            bdrv_io_plug(d->conf.bs);
+            plugged = g_slist_prepend(plugged, d->conf.bs);
+        }
+
         n = scsi_req_enqueue(req->sreq);
         if (n) {
             scsi_req_continue(req->sreq);
         }
     }
+
+    for (l = plugged; l; l = l->next) {
+        bdrv_io_unplug(l->data);
+    }
+    g_slist_free(plugged);
 }
 
 static void virtio_scsi_get_config(VirtIODevice *vdev,
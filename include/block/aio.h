@@ -67,16 +67,49 @@ typedef struct AioContext {
     /* Used for aio_notify.  */
     EventNotifier notifier;
 
+    /* Set by aio_notify() and cleared when @notifier is read; ends a polling
+     * phase early so that bottom halves and lock waiters are not delayed.
+     */
+    bool notified;
+
     /* GPollFDs for aio_poll() */
     GArray *pollfds;
 
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
+
+    /* Recursive lock taken by any thread that runs or uses this context.
+     * Waiters are served in FIFO order: each takes a ticket from @tail and
+     * waits until @head reaches it.
+     */
+    QemuMutex lock;
+    QemuCond lock_cond;
+    QemuThread owner;
+    unsigned int nesting;
+    unsigned int head;
+    unsigned int tail;
+
+    /* Adaptive polling, see aio_context_set_poll_params().  @poll_ns is the
+     * current polling time budget, it moves between 0 and @poll_max_ns.
+     */
+    int64_t poll_ns;
+    int64_t poll_max_ns;
+    int64_t poll_grow;
+    int64_t poll_shrink;
+
+    /* Number of polling phases, and how many of them found work */
+    uint64_t poll_attempts;
+    uint64_t poll_successes;
 } AioContext;
 
 /* Returns 1 if there are still outstanding AIO requests; 0 otherwise */
 typedef int (AioFlushEventNotifierHandler)(EventNotifier *e);
 
+/* Returns true if progress was made, usually by running the handler's work
+ * directly; false if there is nothing to do yet.  Must not block.
+ */
+typedef bool (AioPollEventNotifierHandler)(EventNotifier *e);
+
 /**
  * aio_context_new: Allocate a new AioContext.
  *
@@ -102,6 +135,41 @@ void aio_context_ref(AioContext *ctx);
  */
 void aio_context_unref(AioContext *ctx);
 
+/**
+ * aio_context_acquire:
+ * @ctx: The AioContext to operate on.
+ *
+ * The thread that runs @ctx holds this lock around aio_poll().  Any other
+ * thread must take it before touching objects bound to @ctx, such as a
+ * BlockDriverState.  The lock is recursive; if it is contended, the holder
+ * is kicked out of a blocking aio_poll() so that it releases the lock soon.
+ */
+void aio_context_acquire(AioContext *ctx);
+
+/**
+ * aio_context_release:
+ * @ctx: The AioContext to operate on.
+ *
+ * Release the lock taken with aio_context_acquire().
+ */
+void aio_context_release(AioContext *ctx);
+
+/**
+ * aio_context_set_poll_params:
+ * @ctx: The AioContext to operate on.
+ * @max_ns: Maximum time to poll before blocking, 0 disables polling.
+ * @grow: Factor by which the polling time grows, 0 selects the default.
+ * @shrink: Divisor by which the polling time shrinks, 0 resets it to zero.
+ *
+ * A blocking aio_poll() first calls the handlers' polling callbacks in a
+ * loop for up to the current polling time, and only then sleeps.  The
+ * polling time grows while events arrive within @max_ns of entering
+ * aio_poll(), and shrinks when they do not.  Polling is only done when every
+ * handler with requests in flight has a polling callback.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink);
+
 /**
  * aio_bh_new: Allocate a new bottom half structure.
  *
@@ -126,6 +194,17 @@ QEMUBH *aio_bh_new(AioContext *ctx, QEMUBHFunc *cb, void *opaque);
  */
 void aio_notify(AioContext *ctx);
 
+/**
+ * aio_context_wait: Wait for aio_notify() on an idle AioContext.
+ * @ctx: The AioContext to operate on.
+ *
+ * A blocking aio_poll() returns immediately when no handler has requests
+ * in flight.  Event loop threads call this afterwards, without holding
+ * the context, to sleep until a bottom half or handler is added or
+ * aio_notify() is called.
+ */
+void aio_context_wait(AioContext *ctx);
+
 /**
  * aio_bh_poll: Poll bottom halves for an AioContext.
  *
@@ -135,6 +214,13 @@ void aio_notify(AioContext *ctx);
  */
 int aio_bh_poll(AioContext *ctx);
 
+/**
+ * aio_bh_pending: Return whether a bottom half is scheduled in @ctx.
+ *
+ * Idle bottom halves are not counted.
+ */
+bool aio_bh_pending(AioContext *ctx);
+
 /**
  * qemu_bh_schedule: Schedule a bottom half.
  *
@@ -228,6 +314,16 @@ void aio_set_event_notifier(AioContext *ctx,
                             EventNotifierHandler *io_read,
                             AioFlushEventNotifierHandler *io_flush);
 
+/* Add a polling callback to an event notifier registered with
+ * aio_set_event_notifier().  While the AioContext busy-polls, @io_poll is
+ * called instead of waiting for @notifier to become readable.  The callback
+ * is dropped together with the handler.  Polling is only implemented on
+ * POSIX hosts; elsewhere the callback is never invoked.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollEventNotifierHandler *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -74,6 +74,7 @@ typedef struct BlockDevOps {
 #define BDRV_O_CHECK       0x1000  /* open solely for consistency check */
 #define BDRV_O_ALLOW_RDWR  0x2000  /* allow reopen to change from r/o to r/w */
 #define BDRV_O_UNMAP       0x4000  /* execute guest UNMAP/TRIM operations */
+#define BDRV_O_IO_URING    0x8000  /* use io_uring instead of the thread pool */
 
 #define BDRV_O_CACHE_MASK  (BDRV_O_NOCACHE | BDRV_O_CACHE_WB | BDRV_O_NO_FLUSH)
 
@@ -125,6 +126,7 @@ void bdrv_swap(BlockDriverState *bs_new, BlockDriverState *bs_old);
 void bdrv_append(BlockDriverState *bs_new, BlockDriverState *bs_top);
 void bdrv_delete(BlockDriverState *bs);
 int bdrv_parse_cache_flags(const char *mode, int *flags);
+int bdrv_parse_aio(const char *mode, int *flags);
 int bdrv_parse_discard_flags(const char *mode, int *flags);
 int bdrv_file_open(BlockDriverState **pbs, const char *filename,
                    QDict *options, int flags);
@@ -264,6 +266,11 @@ BlockDriverAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
 void bdrv_invalidate_cache(BlockDriverState *bs);
 void bdrv_invalidate_cache_all(void);
 
+/* Resize the metadata caches of image formats, see the format's cache size
+ * options for the contents of @options */
+int bdrv_set_metadata_cache_size(BlockDriverState *bs, QDict *options,
+                                 Error **errp);
+
 void bdrv_clear_incoming_migration_all(void);
 
 /* Ensure contents are flushed to disk.  */
@@ -359,14 +366,48 @@ void bdrv_disable_copy_on_read(BlockDriverState *bs);
 void bdrv_set_in_use(BlockDriverState *bs, int in_use);
 int bdrv_in_use(BlockDriverState *bs);
 
-#ifdef CONFIG_LINUX_AIO
-int raw_get_aio_fd(BlockDriverState *bs);
-#else
-static inline int raw_get_aio_fd(BlockDriverState *bs)
-{
-    return -ENOTSUP;
-}
-#endif
+/**
+ * bdrv_get_aio_context:
+ *
+ * Returns: the currently bound #AioContext
+ */
+AioContext *bdrv_get_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_set_aio_context:
+ *
+ * Changes the #AioContext used for fd handlers, timers, and BHs by this
+ * BlockDriverState and all its children.
+ *
+ * This function must be called from the old #AioContext or with a lock held so
+ * the old #AioContext is not executing.
+ */
+void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context);
+
+/**
+ * bdrv_can_set_aio_context:
+ *
+ * Returns: whether every driver in the tree below @bs supports being bound
+ * to an #AioContext other than the main loop's.
+ */
+bool bdrv_can_set_aio_context(BlockDriverState *bs);
+
+/**
+ * bdrv_io_plug:
+ *
+ * Start holding back requests submitted to @bs so that they can be passed
+ * to the host in one go by bdrv_io_unplug(), for example all requests taken
+ * from a virtqueue on one notification.  Calls nest.  Do not wait for
+ * requests to complete while plugged, they may not have been submitted yet.
+ */
+void bdrv_io_plug(BlockDriverState *bs);
+
+/**
+ * bdrv_io_unplug:
+ *
+ * Undo bdrv_io_plug().  The outermost call submits the held back requests.
+ */
+void bdrv_io_unplug(BlockDriverState *bs);
 
 enum BlockAcctType {
     BDRV_ACCT_READ,
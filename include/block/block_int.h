@@ -142,6 +142,19 @@ struct BlockDriver {
      */
     void (*bdrv_invalidate_cache)(BlockDriverState *bs);
 
+    /*
+     * Resize the meta-data caches according to the cache size options in
+     * @options. No requests may be in flight when this is called.
+     */
+    int (*bdrv_set_metadata_cache_size)(BlockDriverState *bs, QDict *options,
+                                        Error **errp);
+
+    /*
+     * Returns hit/miss statistics for each meta-data cache of the image.
+     */
+    BlockMetadataCacheStatsList *(*bdrv_get_metadata_cache_stats)(
+        const BlockDriverState *bs);
+
     /*
      * Flushes all data that was already written to the OS all the way down to
      * the disk (for example raw-posix calls fsync()).
@@ -218,6 +231,23 @@ struct BlockDriver {
      */
     int (*bdrv_has_zero_init)(BlockDriverState *bs);
 
+    /* Remove fd handlers, timers, and other event loop callbacks so the event
+     * loop is no longer in use.  Called with no in-flight requests and in
+     * depth-first traversal order with parents before child nodes.
+     */
+    void (*bdrv_detach_aio_context)(BlockDriverState *bs);
+
+    /* Add fd handlers, timers, and other event loop callbacks so I/O requests
+     * can be processed again.  Called with no in-flight requests and in
+     * depth-first traversal order with child nodes before parent nodes.
+     */
+    void (*bdrv_attach_aio_context)(BlockDriverState *bs,
+                                    AioContext *new_context);
+
+    /* Hold back and then submit requests in a batch, see bdrv_io_plug() */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
+
     QLIST_ENTRY(BlockDriver) list;
 };
 
@@ -270,6 +300,8 @@ struct BlockDriverState {
     BlockIOBaseValue slice_submitted;
     CoQueue      throttled_reqs;
     QEMUTimer    *block_timer;
+    QEMUBH       *block_timer_bh;     /* arms block_timer from the main loop */
+    int64_t      block_timer_expire;
     bool         io_limits_enabled;
 
     /* I/O stats (display with "info blockstats"). */
@@ -303,6 +335,9 @@ struct BlockDriverState {
     BlockJob *job;
 
     QDict *options;
+
+    /* event loop used for fd handlers, timers, and BHs */
+    AioContext *aio_context;
 };
 
 int get_tmp_filename(char *filename, int size);
@@ -319,13 +354,6 @@ void bdrv_set_io_limits(BlockDriverState *bs,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
-/**
- * bdrv_get_aio_context:
- *
- * Returns: the currently bound #AioContext
- */
-AioContext *bdrv_get_aio_context(BlockDriverState *bs);
-
 #ifdef _WIN32
 int is_windows_drive(const char *filename);
 #endif
@@ -47,6 +47,17 @@ typedef uintptr_t ram_addr_t;
 
 /* memory API */
 
+/* Clients of the dirty memory tracking */
+#define DIRTY_MEMORY_VGA       0
+#define DIRTY_MEMORY_CODE      1
+#define DIRTY_MEMORY_MIGRATION 2
+#define DIRTY_MEMORY_NUM       3        /* num of dirty bits */
+
+/* One bit of the dirty summary covers 2^DIRTY_SUMMARY_BITS pages; at least
+ * one word of the dirty bitmap.
+ */
+#define DIRTY_SUMMARY_BITS     9
+
 typedef void CPUWriteMemoryFunc(void *opaque, hwaddr addr, uint32_t value);
 typedef uint32_t CPUReadMemoryFunc(void *opaque, hwaddr addr);
 
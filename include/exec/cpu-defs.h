@@ -71,9 +71,23 @@ typedef uint64_t target_ulong;
 #define TB_JMP_ADDR_MASK (TB_JMP_PAGE_SIZE - 1)
 #define TB_JMP_PAGE_MASK (TB_JMP_CACHE_SIZE - TB_JMP_PAGE_SIZE)
 
+/* Number of jump cache slots remembered since the last full clear.  If no
+   more than this were set, clearing the cache only needs to reset them.  */
+#define TB_JMP_CACHE_LOG 64
+
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* The victim TLB keeps entries evicted from the direct mapped TLB.  It is
+   fully associative, and grows or shrinks between these sizes depending
+   on how much the main TLB misses between flushes.  */
+#define CPU_VTLB_MIN_SIZE 8
+#define CPU_VTLB_MAX_SIZE 64
+
+/* Number of main TLB fills remembered since the last flush.  Up to this
+   many, tlb_flush() resets only the filled entries instead of the whole
+   table.  */
+#define CPU_TLB_DIRTY_LOG 64
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -103,12 +117,42 @@ typedef struct CPUTLBEntry {
 
 QEMU_BUILD_BUG_ON(sizeof(CPUTLBEntry) != (1 << CPU_TLB_ENTRY_BITS));
 
+typedef struct CPUTLBStats {
+    /* main TLB misses that reached the softmmu helpers */
+    uint64_t misses;
+    /* misses satisfied by the victim TLB */
+    uint64_t victim_hits;
+    /* entries filled by tlb_set_page() */
+    uint64_t fills;
+    uint64_t flushes;
+    uint64_t page_flushes;
+    /* calls to tlb_flush_page_range() and tlb_flush_page_set() */
+    uint64_t range_flushes;
+    /* flushes that had to clear the whole main TLB */
+    uint64_t full_flushes;
+    uint64_t vtlb_resizes;
+    /* 'fills' when the victim TLB size was last reconsidered */
+    uint64_t window_fills;
+} CPUTLBStats;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     hwaddr iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    /* Only the first vtlb_size entries of the victim TLB are used. */ \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];           \
+    hwaddr iotlb_v[NB_MMU_MODES][CPU_VTLB_MAX_SIZE];                    \
+    int vtlb_size;                                                      \
+    int vtlb_index;                                                     \
+    /* Victim TLB entries past this one are empty since the last flush. */ \
+    int vtlb_used;                                                      \
+    /* (mmu_idx << CPU_TLB_BITS) | index of main TLB fills; the count   \
+       goes past CPU_TLB_DIRTY_LOG when the log overflowed. */          \
+    uint16_t tlb_dirty_log[CPU_TLB_DIRTY_LOG];                          \
+    int tlb_dirty_count;                                                \
+    CPUTLBStats tlb_stats;
 
 #else
 
@@ -154,6 +198,9 @@ typedef struct CPUWatchpoint {
                                      memory was accessed */             \
     CPU_COMMON_TLB                                                      \
     struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];           \
+    /* Slots set since the last clear, see tb_jmp_cache_set().  */      \
+    uint16_t tb_jmp_cache_log[TB_JMP_CACHE_LOG];                        \
+    int tb_jmp_cache_count;                                             \
                                                                         \
     int64_t icount_extra; /* Instructions until next timer event.  */   \
     /* Number of cycles left, with interrupt flag in high bit.          \
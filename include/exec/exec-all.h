@@ -97,7 +97,11 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 #if !defined(CONFIG_USER_ONLY)
 /* cputlb.c */
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
+void tlb_flush_page_range(CPUArchState *env, target_ulong addr,
+                          target_ulong len);
+void tlb_flush_page_set(CPUArchState *env, const target_ulong *addrs, int n);
 void tlb_flush(CPUArchState *env, int flush_global);
+void tlb_flush_all(int flush_global);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
@@ -107,15 +111,34 @@ static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
 }
 
+static inline void tlb_flush_page_range(CPUArchState *env, target_ulong addr,
+                                        target_ulong len)
+{
+}
+
+static inline void tlb_flush_page_set(CPUArchState *env,
+                                      const target_ulong *addrs, int n)
+{
+}
+
 static inline void tlb_flush(CPUArchState *env, int flush_global)
 {
 }
+
+static inline void tlb_flush_all(int flush_global)
+{
+}
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
 
+/* initial and maximum size of the physical TB hash table; it doubles
+   whenever it holds more TBs than buckets */
 #define CODE_GEN_PHYS_HASH_BITS     15
-#define CODE_GEN_PHYS_HASH_SIZE     (1 << CODE_GEN_PHYS_HASH_BITS)
+#define CODE_GEN_PHYS_HASH_MAX_BITS 24
+
+/* number of code buffer regions; fewer are used if the buffer is small */
+#define CODE_GEN_REGIONS 8
 
 /* estimated block size for TB allocation */
 /* XXX: use a per code average code fragment size and modulate it
@@ -139,9 +162,10 @@ struct TranslationBlock {
     uint64_t flags; /* flags defining in which context the code was generated */
     uint16_t size;      /* size of target code for this block (1 <=
                            size <= TARGET_PAGE_SIZE) */
-    uint16_t cflags;    /* compile flags */
+    uint32_t cflags;    /* compile flags */
 #define CF_COUNT_MASK  0x7fff
 #define CF_LAST_IO     0x8000 /* Last insn may be an IO access.  */
+#define CF_TRACE       0x10000 /* Follow hot branches, see tb_gen_trace() */
 
     uint8_t *tc_ptr;    /* pointer to the translated code */
     /* next matching tb for physical address. */
@@ -166,27 +190,73 @@ struct TranslationBlock {
     struct TranslationBlock *jmp_next[2];
     struct TranslationBlock *jmp_first;
     uint32_t icount;
+    /* set by tb_phys_invalidate(); such a TB must not be chained to */
+    bool invalid;
+    /* hot-trace profile: times the TB was entered and left through each
+       direct exit while unchained.  Updates from parallel vCPUs may be
+       lost.  */
+    uint32_t exec_count;
+    uint32_t exit_count[2];
+    /* for CF_TRACE blocks, one TB_TRACE_* code of TB_TRACE_BITS for each
+       branch the translator followed, so that a retranslation with
+       search_pc takes the same path */
+    uint32_t trace_path;
 };
 
+enum {
+    TB_TRACE_STOP,      /* the trace ends here */
+    TB_TRACE_NEXT,      /* conditional branch, not taken */
+    TB_TRACE_TAKEN,     /* conditional branch, taken */
+    TB_TRACE_JMP,       /* direct jump or call */
+};
+
+#define TB_TRACE_BITS      2
+#define TB_TRACE_MAX_EDGES 8
+
 #include "exec/spinlock.h"
 
 typedef struct TBContext TBContext;
+typedef struct TBHashTable TBHashTable;
+typedef struct TBRegion TBRegion;
 
 struct TBContext {
 
     TranslationBlock *tbs;
-    TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
+    /* TBs by (phys_pc, pc, flags).  Updated under tb_lock; lookups may
+       run concurrently, see tb_htable_lookup().  */
+    TBHashTable *htable;
+    /* tables replaced by a resize, freed by the next tb_flush */
+    TBHashTable *htable_retired;
     int nb_tbs;
+    /* The code buffer is split in regions that are filled in turn.  When
+       the last one is full, the oldest region is evicted and reused.  */
+    TBRegion *regions;
+    int nb_regions;
+    int cur_region;
     /* any access to the tbs or the page table must use this lock */
     spinlock_t tb_lock;
 
     /* statistics */
     int tb_flush_count;
+    int tb_evict_count;
+    int tb_evicted_tb_count;
+    int tb_trace_count;
+    int tb_trace_abort_count;
     int tb_phys_invalidate_count;
+    int tb_hash_resize_count;
+    uint64_t tb_hash_lookups;
+    uint64_t tb_hash_lookup_steps;
 
     int tb_invalidated_flag;
 };
 
+/* Serialize translation, lookup in the physical hash and TB chaining.
+ * In system emulation the lock nests and is dropped by tb_lock_reset()
+ * when cpu_exec() is re-entered through longjmp. */
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
+
 static inline unsigned int tb_jmp_cache_hash_page(target_ulong pc)
 {
     target_ulong tmp;
@@ -202,14 +272,44 @@ static inline unsigned int tb_jmp_cache_hash_func(target_ulong pc)
 	    | (tmp & TB_JMP_ADDR_MASK));
 }
 
-static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
+/* Set a jump cache slot, logging it so that tb_jmp_cache_clear() can
+   reset just the slots used since the last clear.  */
+static inline void tb_jmp_cache_set(CPUArchState *env, unsigned int h,
+                                    TranslationBlock *tb)
+{
+    int n = env->tb_jmp_cache_count;
+
+    if (n <= TB_JMP_CACHE_LOG) {
+        if (n < TB_JMP_CACHE_LOG) {
+            env->tb_jmp_cache_log[n] = h;
+        }
+        env->tb_jmp_cache_count = n + 1;
+    }
+    env->tb_jmp_cache[h] = tb;
+}
+
+static inline uint32_t tb_hash_func(tb_page_addr_t phys_pc, target_ulong pc,
+                                    uint64_t flags)
 {
-    return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
+    uint64_t h;
+
+    h = ((uint64_t)phys_pc >> 2) ^ ((uint64_t)pc << 24) ^ flags;
+    h *= 0x9e3779b97f4a7c15ULL;
+    return h >> 32;
 }
 
 void tb_free(TranslationBlock *tb);
+TranslationBlock *tb_htable_lookup(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags);
 void tb_flush(CPUArchState *env);
+void tb_jmp_cache_clear(CPUArchState *env);
+void tb_flush_exclusive(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb);
+int tb_trace_hot_exit(CPUArchState *env, target_ulong pc, target_ulong end,
+                      target_ulong cs_base, uint64_t flags);
+/* executions after which a TB is retranslated as a trace, 0 = never */
+extern unsigned int tcg_trace_threshold;
 
 #if defined(USE_DIRECT_JUMP)
 
@@ -391,6 +491,8 @@ bool io_mem_write(struct MemoryRegion *mr, hwaddr addr,
 
 void tlb_fill(CPUArchState *env1, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr);
+bool victim_tlb_hit(CPUArchState *env, int mmu_idx, int index,
+                    size_t elt_ofs, target_ulong page);
 
 #include "exec/softmmu_defs.h"
 
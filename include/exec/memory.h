@@ -33,13 +33,6 @@
 typedef struct MemoryRegionOps MemoryRegionOps;
 typedef struct MemoryRegionMmio MemoryRegionMmio;
 
-/* Must match *_DIRTY_FLAGS in cpu-all.h.  To be replaced with dynamic
- * registration.
- */
-#define DIRTY_MEMORY_VGA       0
-#define DIRTY_MEMORY_CODE      1
-#define DIRTY_MEMORY_MIGRATION 3
-
 struct MemoryRegionMmio {
     CPUReadMemoryFunc *read[3];
     CPUWriteMemoryFunc *write[3];
@@ -570,6 +563,22 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size);
 
+/**
+ * memory_region_set_dirty_lebitmap: Mark pages of a memory region as dirty
+ *
+ * Marks as dirty for all clients the pages set in @bitmap, such as a dirty
+ * log returned by KVM.
+ *
+ * @mr: the memory region being dirtied.
+ * @addr: the address (relative to the start of the region) of the first
+ *        page, aligned to the host page size.
+ * @bitmap: one bit per host page, stored as little endian longs.
+ * @pages: number of host pages covered by @bitmap.
+ */
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap,
+                                      ram_addr_t pages);
+
 /**
  * memory_region_test_and_clear_dirty: Check whether a range of bytes is dirty
  *                                     for a specified client. It clears them.
@@ -931,6 +940,23 @@ void memory_global_dirty_log_start(void);
  */
 void memory_global_dirty_log_stop(void);
 
+/**
+ * memory_global_sync_dirty_bitmap: collect the dirty pages of all RAM
+ *
+ * Moves the dirty bits of @client for the RAM pages below @pages into @dest
+ * and clears them.  Only the parts of RAM that were written since the last
+ * call are scanned.
+ *
+ * Returns the number of pages that were not yet set in @dest.
+ *
+ * @dest: bitmap indexed by ram_addr_t page number, @pages bits long.
+ * @pages: number of pages covered by @dest.
+ * @client: the user of the logging information; %DIRTY_MEMORY_MIGRATION or
+ *          %DIRTY_MEMORY_VGA.
+ */
+uint64_t memory_global_sync_dirty_bitmap(unsigned long *dest,
+                                         ram_addr_t pages, unsigned client);
+
 void mtree_info(fprintf_function mon_printf, void *f);
 
 /**
@@ -54,6 +54,11 @@
 #define ADDR_READ addr_read
 #endif
 
+/* on a main TLB miss, look for the page in the victim TLB */
+#define VICTIM_TLB_HIT(ty)                                              \
+    victim_tlb_hit(env, mmu_idx, index, offsetof(CPUTLBEntry, ty),      \
+                   addr & TARGET_PAGE_MASK)
+
 static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
                                                         target_ulong addr,
                                                         int mmu_idx,
@@ -125,6 +130,9 @@ glue(glue(helper_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env, target_ulong addr,
         }
     } else {
         /* the page is not in the TLB : fill it */
+        if (VICTIM_TLB_HIT(ADDR_READ)) {
+            goto redo;
+        }
         retaddr = GETPC_EXT();
 #ifdef ALIGNED_ONLY
         if ((addr & (DATA_SIZE - 1)) != 0)
@@ -182,6 +190,9 @@ glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
+        if (VICTIM_TLB_HIT(ADDR_READ)) {
+            goto redo;
+        }
         tlb_fill(env, addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         goto redo;
     }
@@ -257,6 +268,9 @@ void glue(glue(helper_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
+        if (VICTIM_TLB_HIT(addr_write)) {
+            goto redo;
+        }
         retaddr = GETPC_EXT();
 #ifdef ALIGNED_ONLY
         if ((addr & (DATA_SIZE - 1)) != 0)
@@ -312,6 +326,9 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
         }
     } else {
         /* the page is not in the TLB : fill it */
+        if (VICTIM_TLB_HIT(addr_write)) {
+            goto redo;
+        }
         tlb_fill(env, addr, 1, mmu_idx, retaddr);
         goto redo;
     }
@@ -326,3 +343,4 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(CPUArchState *env,
 #undef USUFFIX
 #undef DATA_SIZE
 #undef ADDR_READ
+#undef VICTIM_TLB_HIT
@@ -23,6 +23,12 @@
 #include "qapi-types.h"
 #include "exec/cpu-common.h"
 
+/* Maximum number of threads that compress or decompress RAM pages */
+#define MAX_COMPRESS_THREADS 255
+
+/* Maximum number of parallel RAM send channels */
+#define MAX_MIGRATION_CHANNELS 16
+
 struct MigrationParams {
     bool blk;
     bool shared;
@@ -50,10 +56,23 @@ struct MigrationState
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
     int64_t setup_time;
+    int channels;
+    int compress_level;
+    int compress_threads;
+    int decompress_threads;
+    char *uri;
+    /* sent on each additional channel, see migrate_open_channel() */
+    uint64_t channel_token;
 };
 
 void process_incoming_migration(QEMUFile *f);
 
+void migration_incoming_set_listener(int fd);
+void migration_incoming_close_listener(void);
+void migration_incoming_expect_channels(int num, uint64_t token);
+QEMUFile *migration_incoming_accept_channel(Error **errp);
+QEMUFile *migrate_open_channel(MigrationState *s, Error **errp);
+
 void qemu_start_incoming_migration(const char *uri, Error **errp);
 
 uint64_t migrate_max_downtime(void);
@@ -113,8 +132,18 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+XBZRLECacheSetStatsList *xbzrle_mig_cache_set_stats(void);
+uint64_t compress_mig_pages_transferred(void);
+uint64_t compress_mig_bytes_transferred(void);
+uint64_t compress_mig_busy(void);
+double compress_mig_rate(void);
 
 void ram_handle_compressed(void *host, uint8_t ch, uint64_t size);
+void ram_load_cleanup(void);
+bool ram_postcopy_ready(void);
+bool ram_postcopy_active(void);
+int ram_postcopy_wait(void);
+PostcopyStats *ram_postcopy_get_stats(void);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -138,9 +167,17 @@ bool migrate_auto_converge(void);
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
+bool xbzrle_select_accel(unsigned int n);
+const char *xbzrle_accel_name(void);
 
+bool migrate_postcopy_ram(void);
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
+int migrate_channels(void);
+bool migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
 
 int64_t xbzrle_cache_resize(int64_t new_size);
 
@@ -37,14 +37,16 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size);
 void cache_fini(PageCache *cache);
 
 /**
- * cache_is_cached: Checks to see if the page is cached
+ * cache_is_cached: Checks to see if the page is cached.  A hit marks the
+ * page as most recently used within its set and is accounted in the
+ * statistics of the set.
  *
  * Returns %true if page is cached
  *
  * @cache pointer to the PageCache struct
  * @addr: page addr
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr);
+bool cache_is_cached(PageCache *cache, uint64_t addr);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -58,7 +60,8 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will copy the data on insert. the previous value will be overwritten,
+ * otherwise the least recently used page of the set is replaced
  *
  * @cache pointer to the PageCache struct
  * @addr: page address
@@ -77,4 +80,32 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata);
  */
 int64_t cache_resize(PageCache *cache, int64_t num_pages);
 
+/**
+ * cache_get_num_sets: Get the number of sets of the page cache
+ *
+ * @cache pointer to the PageCache struct
+ */
+int64_t cache_get_num_sets(const PageCache *cache);
+
+/**
+ * cache_get_set_stats: Get the lookup statistics of one set
+ *
+ * @cache pointer to the PageCache struct
+ * @set: set index, smaller than cache_get_num_sets()
+ * @hits: returns the number of lookups that found the page
+ * @misses: returns the number of lookups that did not find the page
+ */
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         uint64_t *hits, uint64_t *misses);
+
+/**
+ * cache_get_stats: Get the lookup statistics summed over all sets
+ *
+ * @cache pointer to the PageCache struct
+ * @hits: returns the number of lookups that found the page
+ * @misses: returns the number of lookups that did not find the page
+ */
+void cache_get_stats(const PageCache *cache, uint64_t *hits,
+                     uint64_t *misses);
+
 #endif
@@ -274,6 +274,10 @@ typedef struct PCIHostDeviceAddress {
 } PCIHostDeviceAddress;
 
 void tcg_exec_init(unsigned long tb_size);
+int tb_cache_open(const char *path, bool readonly);
+void tb_cache_load(const char *key);
+void tb_cache_save(void);
+void tcg_log_exit_stats(void);
 bool tcg_enabled(void);
 
 void cpu_exec_init_all(void);
@@ -299,6 +299,16 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+/**
+ * qemu_mutex_iothread_locked: Return whether the calling thread holds the
+ * main loop mutex.
+ *
+ * Only meaningful for threads that take the mutex through
+ * qemu_mutex_lock_iothread().  Used by multi-threaded TCG vCPUs, which
+ * run without the mutex and take it around accesses to device state.
+ */
+bool qemu_mutex_iothread_locked(void);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
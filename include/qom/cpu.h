@@ -155,6 +155,8 @@ struct kvm_run;
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
  * @next_cpu: Next CPU sharing TB cache.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @phys_cache: Recent physical memory map lookups done by this CPU,
+ *   allocated on first use and freed with the CPU.
  *
  * State of one CPU core or thread.
  */
@@ -197,6 +199,8 @@ struct CPUState {
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
 
+    struct PhysLookupCache *phys_cache;
+
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
     uint32_t halted; /* used by alpha, cris, ppc TCG */
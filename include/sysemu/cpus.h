@@ -1,6 +1,8 @@
 #ifndef QEMU_CPUS_H
 #define QEMU_CPUS_H
 
+#include "qemu/option.h"
+
 /* cpus.c */
 void qemu_init_cpu_loop(void);
 void resume_all_vcpus(void);
@@ -13,6 +15,14 @@ void cpu_synchronize_all_post_init(void);
 
 void qtest_clock_warp(int64_t dest);
 
+/* multi-threaded TCG */
+void qemu_tcg_configure(QemuOpts *opts);
+bool qemu_tcg_mttcg_enabled(void);
+void qemu_tcg_request_tb_flush(void);
+void qemu_tcg_atomic_lock(void);
+void qemu_tcg_atomic_unlock(void);
+void qemu_tcg_atomic_lock_reset(void);
+
 #ifndef CONFIG_USER_ONLY
 /* vl.c */
 extern int smp_cores;
@@ -0,0 +1,375 @@
+/*
+ * Event loop thread
+ *
+ * Copyright Red Hat Inc., 2013
+ *
+ * Authors:
+ *  Stefan Hajnoczi   <stefanha@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qom/object.h"
+#include "qom/object_interfaces.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "block/aio.h"
+#include "sysemu/iothread.h"
+#include "qapi/visitor.h"
+#include "qmp-commands.h"
+
+#ifdef CONFIG_LINUX
+#include <sched.h>
+#endif
+
+#define IOTHREADS_PATH "/objects"
+
+/* A few tens of microseconds cover the completion latency of fast SSDs
+ * while bounding the CPU time wasted when the guest is idle.
+ */
+#define IOTHREAD_POLL_MAX_NS_DEFAULT 32768
+
+typedef ObjectClass IOThreadClass;
+
+#define IOTHREAD_GET_CLASS(obj) \
+   OBJECT_GET_CLASS(IOThreadClass, obj, TYPE_IOTHREAD)
+#define IOTHREAD_CLASS(klass) \
+   OBJECT_CLASS_CHECK(IOThreadClass, klass, TYPE_IOTHREAD)
+
+/* Returns 0 or a negative errno value */
+static int iothread_set_affinity(IOThread *iothread)
+{
+#ifdef CONFIG_LINUX
+    cpu_set_t set;
+    int cpu;
+
+    if (iothread->first_cpu < 0) {
+        return 0;
+    }
+
+    CPU_ZERO(&set);
+    for (cpu = iothread->first_cpu; cpu <= iothread->last_cpu; cpu++) {
+        CPU_SET(cpu, &set);
+    }
+    if (sched_setaffinity(0, sizeof(set), &set) < 0) {
+        return -errno;
+    }
+#endif
+    return 0;
+}
+
+static void *iothread_run(void *opaque)
+{
+    IOThread *iothread = opaque;
+
+    qemu_mutex_lock(&iothread->init_done_lock);
+    iothread->thread_id = qemu_get_thread_id();
+    iothread->affinity_errno = iothread_set_affinity(iothread);
+    qemu_cond_signal(&iothread->init_done_cond);
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    while (!iothread->stopping) {
+        bool progress;
+
+        aio_context_acquire(iothread->ctx);
+        progress = aio_poll(iothread->ctx, true);
+        aio_context_release(iothread->ctx);
+
+        /* No device has requests in flight, sleep until one is added */
+        if (!progress && !iothread->stopping) {
+            aio_context_wait(iothread->ctx);
+        }
+    }
+    return NULL;
+}
+
+static void iothread_wakeup_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+static bool iothread_wakeup_poll(EventNotifier *e)
+{
+    IOThread *iothread = container_of(e, IOThread, wakeup);
+
+    return atomic_read(&iothread->stopping);
+}
+
+static void iothread_stop(IOThread *iothread)
+{
+    iothread->stopping = true;
+    event_notifier_set(&iothread->wakeup);
+    aio_notify(iothread->ctx);
+    qemu_thread_join(&iothread->thread);
+}
+
+static void iothread_instance_finalize(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (!iothread->ctx) {
+        return;
+    }
+    iothread_stop(iothread);
+    aio_set_event_notifier(iothread->ctx, &iothread->wakeup, NULL, NULL);
+    event_notifier_cleanup(&iothread->wakeup);
+    qemu_cond_destroy(&iothread->init_done_cond);
+    qemu_mutex_destroy(&iothread->init_done_lock);
+    aio_context_unref(iothread->ctx);
+}
+
+static void iothread_complete(UserCreatable *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->stopping = false;
+    iothread->thread_id = -1;
+    iothread->ctx = aio_context_new();
+
+    event_notifier_init(&iothread->wakeup, false);
+    aio_set_event_notifier(iothread->ctx, &iothread->wakeup,
+                           iothread_wakeup_read, NULL);
+    aio_set_event_notifier_poll(iothread->ctx, &iothread->wakeup,
+                                iothread_wakeup_poll);
+    aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                iothread->poll_grow, iothread->poll_shrink);
+
+    qemu_mutex_init(&iothread->init_done_lock);
+    qemu_cond_init(&iothread->init_done_cond);
+
+    /* This assumes we are called from a thread with useful CPU affinity for us
+     * to inherit.
+     */
+    qemu_thread_create(&iothread->thread, iothread_run,
+                       iothread, QEMU_THREAD_JOINABLE);
+
+    /* Wait for initialization to complete */
+    qemu_mutex_lock(&iothread->init_done_lock);
+    while (iothread->thread_id == -1) {
+        qemu_cond_wait(&iothread->init_done_cond,
+                       &iothread->init_done_lock);
+    }
+    qemu_mutex_unlock(&iothread->init_done_lock);
+
+    if (iothread->affinity_errno) {
+        error_setg_errno(errp, -iothread->affinity_errno,
+                         "iothread: failed to set CPU affinity");
+    }
+}
+
+static char *iothread_get_cpus(Object *obj, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    if (iothread->first_cpu < 0) {
+        return g_strdup("");
+    }
+    if (iothread->first_cpu == iothread->last_cpu) {
+        return g_strdup_printf("%d", iothread->first_cpu);
+    }
+    return g_strdup_printf("%d-%d", iothread->first_cpu, iothread->last_cpu);
+}
+
+static void iothread_set_cpus(Object *obj, const char *value, Error **errp)
+{
+#ifdef CONFIG_LINUX
+    IOThread *iothread = IOTHREAD(obj);
+    unsigned long first, last;
+    char *endptr;
+
+    if (iothread->ctx) {
+        error_setg(errp, "iothread: cpus cannot be changed while running");
+        return;
+    }
+
+    /* Same syntax as -numa node,cpus=N[-M] */
+    first = last = strtoul(value, &endptr, 10);
+    if (*endptr == '-') {
+        last = strtoul(endptr + 1, &endptr, 10);
+    }
+    if (endptr == value || *endptr != '\0' || last < first ||
+        last >= CPU_SETSIZE) {
+        error_setg(errp, "iothread: invalid cpus '%s', expected N[-M]",
+                   value);
+        return;
+    }
+
+    iothread->first_cpu = first;
+    iothread->last_cpu = last;
+#else
+    error_setg(errp, "iothread: CPU affinity is not supported on this host");
+#endif
+}
+
+typedef struct {
+    const char *name;
+    ptrdiff_t offset;           /* field's byte offset in IOThread struct */
+} PollParamInfo;
+
+static PollParamInfo poll_max_ns_info = {
+    "poll-max-ns", offsetof(IOThread, poll_max_ns),
+};
+static PollParamInfo poll_grow_info = {
+    "poll-grow", offsetof(IOThread, poll_grow),
+};
+static PollParamInfo poll_shrink_info = {
+    "poll-shrink", offsetof(IOThread, poll_shrink),
+};
+
+static void iothread_get_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+
+    visit_type_int64(v, field, name, errp);
+}
+
+static void iothread_set_poll_param(Object *obj, Visitor *v, void *opaque,
+                                    const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    PollParamInfo *info = opaque;
+    int64_t *field = (void *)iothread + info->offset;
+    Error *local_err = NULL;
+    int64_t value;
+
+    visit_type_int64(v, &value, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    if (value < 0) {
+        error_setg(errp, "iothread: %s must not be negative", info->name);
+        return;
+    }
+
+    *field = value;
+
+    /* Can be changed at run-time with qom-set */
+    if (iothread->ctx) {
+        aio_context_set_poll_params(iothread->ctx, iothread->poll_max_ns,
+                                    iothread->poll_grow,
+                                    iothread->poll_shrink);
+    }
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    IOThread *iothread = IOTHREAD(obj);
+
+    iothread->first_cpu = -1;
+    iothread->last_cpu = -1;
+    iothread->poll_max_ns = IOTHREAD_POLL_MAX_NS_DEFAULT;
+    object_property_add_str(obj, "cpus", iothread_get_cpus,
+                            iothread_set_cpus, NULL);
+    object_property_add(obj, "poll-max-ns", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_max_ns_info, NULL);
+    object_property_add(obj, "poll-grow", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_grow_info, NULL);
+    object_property_add(obj, "poll-shrink", "int",
+                        iothread_get_poll_param, iothread_set_poll_param,
+                        NULL, &poll_shrink_info, NULL);
+}
+
+static void iothread_class_init(ObjectClass *klass, void *class_data)
+{
+    UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
+    ucc->complete = iothread_complete;
+}
+
+static const TypeInfo iothread_info = {
+    .name = TYPE_IOTHREAD,
+    .parent = TYPE_OBJECT,
+    .class_init = iothread_class_init,
+    .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
+    .instance_finalize = iothread_instance_finalize,
+    .interfaces = (InterfaceInfo[]) {
+        {TYPE_USER_CREATABLE},
+        {}
+    },
+};
+
+static void iothread_register_types(void)
+{
+    type_register_static(&iothread_info);
+}
+
+type_init(iothread_register_types)
+
+IOThread *iothread_find(const char *id)
+{
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+    Object *child;
+
+    child = object_resolve_path_component(container, id);
+    if (!child) {
+        return NULL;
+    }
+    return (IOThread *)object_dynamic_cast(child, TYPE_IOTHREAD);
+}
+
+char *iothread_get_id(IOThread *iothread)
+{
+    char *path = object_get_canonical_path(OBJECT(iothread));
+    char *id = g_strdup(strrchr(path, '/') + 1);
+
+    g_free(path);
+    return id;
+}
+
+AioContext *iothread_get_aio_context(IOThread *iothread)
+{
+    return iothread->ctx;
+}
+
+static int query_one_iothread(Object *object, void *opaque)
+{
+    IOThreadInfoList ***prev = opaque;
+    IOThreadInfoList *elem;
+    IOThreadInfo *info;
+    IOThread *iothread;
+
+    iothread = (IOThread *)object_dynamic_cast(object, TYPE_IOTHREAD);
+    if (!iothread) {
+        return 0;
+    }
+
+    info = g_new0(IOThreadInfo, 1);
+    info->id = iothread_get_id(iothread);
+    info->thread_id = iothread->thread_id;
+    if (iothread->first_cpu >= 0) {
+        info->has_cpus = true;
+        info->cpus = iothread_get_cpus(object, NULL);
+    }
+    info->poll_max_ns = iothread->poll_max_ns;
+    info->poll_grow = iothread->poll_grow;
+    info->poll_shrink = iothread->poll_shrink;
+    info->poll_attempts = iothread->ctx->poll_attempts;
+    info->poll_successes = iothread->ctx->poll_successes;
+
+    elem = g_new0(IOThreadInfoList, 1);
+    elem->value = info;
+    elem->next = NULL;
+
+    **prev = elem;
+    *prev = &elem->next;
+    return 0;
+}
+
+IOThreadInfoList *qmp_query_iothreads(Error **errp)
+{
+    IOThreadInfoList *head = NULL;
+    IOThreadInfoList **prev = &head;
+    Object *container = container_get(object_get_root(), IOTHREADS_PATH);
+
+    object_child_foreach(container, query_one_iothread, &prev);
+    return head;
+}
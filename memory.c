@@ -22,6 +22,8 @@
 #include <assert.h>
 
 #include "exec/memory-internal.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 
 //#define DEBUG_UNASSIGNED
 
@@ -1174,15 +1176,28 @@ bool memory_region_get_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size, unsigned client)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                         1 << client);
+    return cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
 }
 
 void memory_region_set_dirty(MemoryRegion *mr, hwaddr addr,
                              hwaddr size)
 {
     assert(mr->terminates);
-    return cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size, -1);
+    cpu_physical_memory_set_dirty_range(mr->ram_addr + addr, size);
+}
+
+void memory_region_set_dirty_lebitmap(MemoryRegion *mr, hwaddr addr,
+                                      unsigned long *bitmap,
+                                      ram_addr_t pages)
+{
+    assert(mr->terminates);
+    cpu_physical_memory_set_dirty_lebitmap(bitmap, mr->ram_addr + addr, pages);
+}
+
+uint64_t memory_global_sync_dirty_bitmap(unsigned long *dest,
+                                         ram_addr_t pages, unsigned client)
+{
+    return cpu_physical_memory_sync_dirty_bitmap(dest, pages, client);
 }
 
 bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
@@ -1190,12 +1205,11 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
 {
     bool ret;
     assert(mr->terminates);
-    ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size,
-                                        1 << client);
+    ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
     if (ret) {
         cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                         mr->ram_addr + addr + size,
-                                        1 << client);
+                                        client);
     }
     return ret;
 }
@@ -1243,7 +1257,7 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr,
                                     mr->ram_addr + addr + size,
-                                    1 << client);
+                                    client);
 }
 
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
@@ -1737,15 +1751,41 @@ void address_space_destroy(AddressSpace *as)
     g_free(as->ioeventfds);
 }
 
+/* Multi-threaded TCG vCPUs run without the iothread lock; device
+ * callbacks still expect it to be held.
+ */
+static bool io_mem_lock(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
 bool io_mem_read(MemoryRegion *mr, hwaddr addr, uint64_t *pval, unsigned size)
 {
-    return memory_region_dispatch_read(mr, addr, pval, size);
+    bool locked = io_mem_lock();
+    bool ret;
+
+    ret = memory_region_dispatch_read(mr, addr, pval, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 bool io_mem_write(MemoryRegion *mr, hwaddr addr,
                   uint64_t val, unsigned size)
 {
-    return memory_region_dispatch_write(mr, addr, val, size);
+    bool locked = io_mem_lock();
+    bool ret;
+
+    ret = memory_region_dispatch_write(mr, addr, val, size);
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return ret;
 }
 
 typedef struct MemoryRegionList MemoryRegionList;
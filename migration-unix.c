@@ -61,7 +61,8 @@ static void unix_accept_incoming_migration(void *opaque)
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
     } while (c == -1 && errno == EINTR);
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
-    close(s);
+    /* The source announces the additional channels it connects, if any */
+    migration_incoming_set_listener(s);
 
     DPRINTF("accepted migration\n");
 
@@ -80,6 +81,7 @@ static void unix_accept_incoming_migration(void *opaque)
     return;
 
 out:
+    migration_incoming_close_listener();
     close(c);
 }
 
@@ -19,6 +19,7 @@
 #include "migration/qemu-file.h"
 #include "sysemu/sysemu.h"
 #include "block/block.h"
+#include "block/coroutine.h"
 #include "qemu/sockets.h"
 #include "migration/block.h"
 #include "qemu/thread.h"
@@ -54,6 +55,11 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREADS 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREADS 2
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -68,6 +74,10 @@ MigrationState *migrate_get_current(void)
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
         .mbps = -1,
+        .channels = 1,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_threads = DEFAULT_MIGRATE_COMPRESS_THREADS,
+        .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREADS,
     };
 
     return &current_migration;
@@ -96,6 +106,102 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     }
 }
 
+/* Listening socket of the incoming migration, kept open until the additional
+ * channels announced by the source have connected, or until the migration
+ * has been loaded */
+static int incoming_listen_fd = -1;
+/* Additional channels that may still connect, and the token they must send
+ * first so that unrelated connections are not taken for one */
+static int incoming_channels;
+static uint64_t incoming_token;
+
+void migration_incoming_set_listener(int fd)
+{
+    incoming_listen_fd = fd;
+    incoming_channels = 0;
+}
+
+void migration_incoming_close_listener(void)
+{
+    if (incoming_listen_fd != -1) {
+        closesocket(incoming_listen_fd);
+        incoming_listen_fd = -1;
+    }
+}
+
+void migration_incoming_expect_channels(int num, uint64_t token)
+{
+    incoming_channels = num;
+    incoming_token = token;
+    if (!num) {
+        migration_incoming_close_listener();
+    }
+}
+
+static int migration_incoming_accept(void)
+{
+    int c;
+
+    /* The incoming migration coroutine runs in the main loop; let it
+     * run while the source has not connected the channel yet. */
+    if (qemu_in_coroutine()) {
+        qemu_set_nonblock(incoming_listen_fd);
+    } else {
+        qemu_set_block(incoming_listen_fd);
+    }
+    for (;;) {
+        c = qemu_accept(incoming_listen_fd, NULL, NULL);
+        if (c != -1) {
+            break;
+        }
+        if (socket_error() == EAGAIN) {
+            yield_until_fd_readable(incoming_listen_fd);
+        } else if (socket_error() != EINTR) {
+            break;
+        }
+    }
+
+    return c;
+}
+
+QEMUFile *migration_incoming_accept_channel(Error **errp)
+{
+    QEMUFile *f;
+    int c;
+
+    if (incoming_listen_fd == -1 || !incoming_channels) {
+        error_setg(errp, "incoming migration does not accept more channels");
+        return NULL;
+    }
+
+    for (;;) {
+        c = migration_incoming_accept();
+        if (c == -1) {
+            error_setg_errno(errp, socket_error(),
+                             "could not accept migration channel");
+            return NULL;
+        }
+
+        /* Read the token without blocking the main loop either */
+        if (qemu_in_coroutine()) {
+            qemu_set_nonblock(c);
+        }
+        f = qemu_fopen_socket(c, "rb");
+        if (qemu_get_be64(f) == incoming_token && !qemu_file_get_error(f)) {
+            break;
+        }
+        fprintf(stderr, "dropping connection that is not part of the "
+                "migration\n");
+        qemu_fclose(f);
+    }
+
+    qemu_set_block(c);
+    if (--incoming_channels == 0) {
+        migration_incoming_close_listener();
+    }
+    return f;
+}
+
 static void process_incoming_migration_co(void *opaque)
 {
     QEMUFile *f = opaque;
@@ -103,6 +209,8 @@ static void process_incoming_migration_co(void *opaque)
 
     ret = qemu_loadvm_state(f);
     qemu_fclose(f);
+    ram_load_cleanup();
+    migration_incoming_close_listener();
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
@@ -176,14 +284,37 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
+        info->xbzrle_cache->sets = xbzrle_mig_cache_set_stats();
+        info->xbzrle_cache->has_sets = info->xbzrle_cache->sets != NULL;
+    }
+}
+
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = g_malloc0(sizeof(*info->compression));
+        info->compression->pages = compress_mig_pages_transferred();
+        info->compression->bytes = compress_mig_bytes_transferred();
+        info->compression->busy = compress_mig_busy();
+        info->compression->compression_rate = compress_mig_rate();
     }
 }
 
+static void get_postcopy_stats(MigrationInfo *info)
+{
+    info->postcopy = ram_postcopy_get_stats();
+    info->has_postcopy = info->postcopy != NULL;
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
     MigrationState *s = migrate_get_current();
 
+    /* also reported on the destination, where the state stays NONE */
+    get_postcopy_stats(info);
+
     switch (s->state) {
     case MIG_STATE_NONE:
         /* no migration has happened ever */
@@ -225,9 +356,11 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -361,17 +494,27 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int channels = s->channels;
+    int compress_level = s->compress_level;
+    int compress_threads = s->compress_threads;
+    int decompress_threads = s->decompress_threads;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
 
+    g_free(s->uri);
     memset(s, 0, sizeof(*s));
     s->params = *params;
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->channels = channels;
+    s->compress_level = compress_level;
+    s->compress_threads = compress_threads;
+    s->decompress_threads = decompress_threads;
 
     s->bandwidth_limit = bandwidth_limit;
+    s->channel_token = ((uint64_t)g_random_int() << 32) | g_random_int();
     s->state = MIG_STATE_SETUP;
     trace_migrate_set_state(MIG_STATE_SETUP);
 
@@ -417,7 +560,46 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (s->channels > 1 && !strstart(uri, "tcp:", NULL) &&
+        !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "multiple migration channels require a tcp: or "
+                   "unix: URI");
+        return;
+    }
+
+    if (migrate_use_compression()) {
+        if (s->channels > 1) {
+            error_setg(errp, "compression does not support multiple "
+                       "migration channels");
+            return;
+        }
+        if (migrate_use_xbzrle()) {
+            error_setg(errp, "the compress and xbzrle capabilities cannot be "
+                       "enabled together");
+            return;
+        }
+#ifdef CONFIG_RDMA
+        if (strstart(uri, "x-rdma:", NULL)) {
+            error_setg(errp, "compression is not supported with RDMA");
+            return;
+        }
+#endif
+    }
+
+    if (migrate_postcopy_ram()) {
+        if (s->channels > 1) {
+            error_setg(errp, "post-copy does not support multiple migration "
+                       "channels");
+            return;
+        }
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "post-copy requires a tcp: or unix: URI");
+            return;
+        }
+    }
+
     s = migrate_init(&params);
+    s->uri = g_strdup(uri);
 
     if (strstart(uri, "tcp:", &p)) {
         tcp_start_outgoing_migration(s, p, &local_err);
@@ -445,6 +627,42 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     }
 }
 
+/* Opens an additional connection to the destination of @s */
+QEMUFile *migrate_open_channel(MigrationState *s, Error **errp)
+{
+    const char *p;
+    QEMUFile *f;
+    int fd;
+
+    if (s->uri && strstart(s->uri, "tcp:", &p)) {
+        fd = inet_connect(p, errp);
+#if !defined(WIN32)
+    } else if (s->uri && strstart(s->uri, "unix:", &p)) {
+        fd = unix_connect(p, errp);
+#endif
+    } else {
+        error_setg(errp, "migration URI does not support multiple channels");
+        return NULL;
+    }
+
+    if (fd < 0) {
+        return NULL;
+    }
+    qemu_set_block(fd);
+    f = qemu_fopen_socket(fd, "wb");
+
+    /* Identifies the connection as part of this migration */
+    qemu_put_be64(f, s->channel_token);
+    qemu_fflush(f);
+    if (qemu_file_get_error(f)) {
+        error_setg_errno(errp, -qemu_file_get_error(f),
+                         "could not set up migration channel");
+        qemu_fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
 void qmp_migrate_cancel(Error **errp)
 {
     migrate_fd_cancel(migrate_get_current());
@@ -469,6 +687,66 @@ int64_t qmp_query_migrate_cache_size(Error **errp)
     return migrate_xbzrle_cache_size();
 }
 
+void qmp_migrate_set_channels(int64_t value, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (value < 1 || value > MAX_MIGRATION_CHANNELS) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "value",
+                  "a number of channels between 1 and 16");
+        return;
+    }
+
+    s->channels = value;
+}
+
+void qmp_migrate_set_compress_params(bool has_level, int64_t level,
+                                     bool has_threads, int64_t threads,
+                                     bool has_decompress_threads,
+                                     int64_t decompress_threads,
+                                     Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (s->state == MIG_STATE_ACTIVE || s->state == MIG_STATE_SETUP) {
+        error_set(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+
+    if (has_level && (level < 0 || level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "level",
+                  "a compression level between 0 and 9");
+        return;
+    }
+    if (has_threads && (threads < 1 || threads > MAX_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "threads",
+                  "a number of threads between 1 and 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_COMPRESS_THREADS)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "a number of threads between 1 and 255");
+        return;
+    }
+
+    if (has_level) {
+        s->compress_level = level;
+    }
+    if (has_threads) {
+        s->compress_threads = threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_threads = decompress_threads;
+    }
+}
+
 void qmp_migrate_set_speed(int64_t value, Error **errp)
 {
     MigrationState *s;
@@ -521,6 +799,15 @@ bool migrate_zero_blocks(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_BLOCKS];
 }
 
+bool migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_POSTCOPY_RAM];
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -539,6 +826,51 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+int migrate_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->channels;
+}
+
+bool migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_threads;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_threads;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -549,6 +881,7 @@ static void *migration_thread(void *opaque)
     int64_t initial_bytes = 0;
     int64_t max_size = 0;
     int64_t start_time = initial_time;
+    int64_t end_time = 0;
     bool old_vm_running = false;
 
     DPRINTF("beginning savevm\n");
@@ -567,7 +900,12 @@ static void *migration_thread(void *opaque)
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            /*
+             * With post-copy, switch over as soon as the bulk stage is
+             * over; the remaining dirty pages are pulled by the destination.
+             */
+            if (pending_size && pending_size >= max_size &&
+                !(migrate_postcopy_ram() && ram_postcopy_ready())) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 int ret;
@@ -584,6 +922,18 @@ static void *migration_thread(void *opaque)
                     qemu_savevm_state_complete(s->file);
                 }
                 qemu_mutex_unlock_iothread();
+                end_time = qemu_get_clock_ms(rt_clock);
+
+                if (ram_postcopy_active()) {
+                    /*
+                     * The destination owns the guest from now on and the
+                     * source can never be restarted.
+                     */
+                    old_vm_running = false;
+                    if (ram_postcopy_wait() < 0) {
+                        ret = -1;
+                    }
+                }
 
                 if (ret < 0) {
                     migrate_set_state(s, MIG_STATE_ACTIVE, MIG_STATE_ERROR);
@@ -632,8 +982,7 @@ static void *migration_thread(void *opaque)
 
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
-        int64_t end_time = qemu_get_clock_ms(rt_clock);
-        s->total_time = end_time - s->total_time;
+        s->total_time = qemu_get_clock_ms(rt_clock) - s->total_time;
         s->downtime = end_time - start_time;
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is a set-associative cache indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -33,17 +33,34 @@
     do { } while (0)
 #endif
 
+/*
+ * Pages are mapped to a set of PAGE_CACHE_WAYS slots by their address and
+ * replaced in LRU order within the set.  The data of all slots lives in a
+ * single arena that is allocated up front, so inserting a page never has to
+ * allocate memory.  The cache is only ever used by the migration thread and
+ * therefore needs no locking.
+ */
+#define PAGE_CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
-    uint8_t *it_data;
 };
 
+typedef struct CacheSet {
+    uint64_t hits;
+    uint64_t misses;
+} CacheSet;
+
 struct PageCache {
     CacheItem *page_cache;
+    uint8_t *arena;
+    CacheSet *sets;
     unsigned int page_size;
+    unsigned int num_ways;
+    int64_t num_sets;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
@@ -71,14 +88,24 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, PAGE_CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache sets to %" PRId64 " with %u ways\n",
+            cache->num_sets, cache->num_ways);
+
+    cache->arena = g_try_malloc(cache->max_num_items * page_size);
+    if (!cache->arena) {
+        DPRINTF("Failed to allocate cache arena\n");
+        g_free(cache);
+        return NULL;
+    }
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
+    cache->sets = g_malloc0(cache->num_sets * sizeof(*cache->sets));
 
     for (i = 0; i < cache->max_num_items; i++) {
-        cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
         cache->page_cache[i].it_addr = -1;
     }
@@ -88,56 +115,95 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
 
 void cache_fini(PageCache *cache)
 {
-    int64_t i;
-
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    for (i = 0; i < cache->max_num_items; i++) {
-        g_free(cache->page_cache[i].it_data);
-    }
-
+    g_free(cache->arena);
+    g_free(cache->sets);
     g_free(cache->page_cache);
     cache->page_cache = NULL;
+    cache->arena = NULL;
+    cache->sets = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+static size_t cache_get_set(const PageCache *cache, uint64_t address)
 {
-    size_t pos;
+    size_t set;
+
+    g_assert(cache->num_sets);
+    set = (address / cache->page_size) & (cache->num_sets - 1);
+    return set;
+}
 
-    g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+static inline uint8_t *cache_item_data(const PageCache *cache,
+                                       const CacheItem *it)
+{
+    return cache->arena + (it - cache->page_cache) * cache->page_size;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_find(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *it;
+    unsigned int way;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    it = &cache->page_cache[cache_get_set(cache, addr) * cache->num_ways];
+    for (way = 0; way < cache->num_ways; way++, it++) {
+        if (it->it_addr == addr) {
+            return it;
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    CacheSet *set = &cache->sets[cache_get_set(cache, addr)];
+    CacheItem *it = cache_find(cache, addr);
 
-    pos = cache_get_cache_pos(cache, addr);
+    if (!it) {
+        set->misses++;
+        return false;
+    }
 
-    return &cache->page_cache[pos];
+    set->hits++;
+    it->it_age = ++cache->max_item_age;
+    return true;
 }
 
 uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_find(cache, addr);
+
+    return it ? cache_item_data(cache, it) : NULL;
+}
+
+/* Returns the slot for @addr, replacing the LRU page of its set if needed */
+static CacheItem *cache_get_slot(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it, *victim;
+    unsigned int way;
+
+    victim = it = &cache->page_cache[cache_get_set(cache, addr) *
+                                     cache->num_ways];
+    for (way = 0; way < cache->num_ways; way++, it++) {
+        if (it->it_addr == addr) {
+            return it;
+        }
+        if (victim->it_addr == -1) {
+            continue;
+        }
+        if (it->it_addr == -1 || it->it_age < victim->it_age) {
+            victim = it;
+        }
+    }
+
+    if (victim->it_addr == -1) {
+        cache->num_items++;
+    }
+    return victim;
 }
 
 void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
@@ -149,16 +215,9 @@ void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
     g_assert(cache->page_cache);
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    /* free old cached data if any */
-    g_free(it->it_data);
+    it = cache_get_slot(cache, addr);
 
-    if (!it->it_data) {
-        cache->num_items++;
-    }
-
-    it->it_data = g_memdup(pdata, cache->page_size);
+    memcpy(cache_item_data(cache, it), pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
 }
@@ -188,29 +247,36 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, keeping the MRU pages of each set */
     for (i = 0; i < cache->max_num_items; i++) {
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+            new_it = cache_get_slot(new_cache, old_it->it_addr);
+            if (new_it->it_addr != -1 && new_it->it_age >= old_it->it_age) {
+                continue;
             }
+            memcpy(cache_item_data(new_cache, new_it),
+                   cache_item_data(cache, old_it), cache->page_size);
+            new_it->it_age = old_it->it_age;
+            new_it->it_addr = old_it->it_addr;
         }
     }
 
-    g_free(cache->page_cache);
+    /* keep the statistics; sets that are split keep theirs in the lower
+       half, merged sets add them up */
+    for (i = 0; i < cache->num_sets; i++) {
+        CacheSet *set = &new_cache->sets[i & (new_cache->num_sets - 1)];
+
+        set->hits += cache->sets[i].hits;
+        set->misses += cache->sets[i].misses;
+    }
+
+    cache_fini(cache);
     cache->page_cache = new_cache->page_cache;
+    cache->arena = new_cache->arena;
+    cache->sets = new_cache->sets;
+    cache->num_ways = new_cache->num_ways;
+    cache->num_sets = new_cache->num_sets;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
 
@@ -218,3 +284,29 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 
     return cache->max_num_items;
 }
+
+int64_t cache_get_num_sets(const PageCache *cache)
+{
+    return cache->num_sets;
+}
+
+void cache_get_set_stats(const PageCache *cache, int64_t set,
+                         uint64_t *hits, uint64_t *misses)
+{
+    g_assert(set >= 0 && set < cache->num_sets);
+
+    *hits = cache->sets[set].hits;
+    *misses = cache->sets[set].misses;
+}
+
+void cache_get_stats(const PageCache *cache, uint64_t *hits, uint64_t *misses)
+{
+    int64_t i;
+
+    *hits = 0;
+    *misses = 0;
+    for (i = 0; i < cache->num_sets; i++) {
+        *hits += cache->sets[i].hits;
+        *misses += cache->sets[i].misses;
+    }
+}
@@ -103,6 +103,10 @@ static void help(void)
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
+           "  '-m' specifies the number of requests in flight during conversion\n"
+           "       (1 to 16, default 8)\n"
+           "  '-W' allows out of order writes during conversion (only recommended\n"
+           "       for preallocated targets like host devices or raw images)\n"
            "\n"
            "Parameters to check subcommand:\n"
            "  '-r' tries to repair any inconsistencies that are found during the check.\n"
@@ -1114,17 +1118,304 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+typedef enum ImgConvertBlockStatus {
+    BLK_DATA,
+    BLK_BACKING_FILE,
+} ImgConvertBlockStatus;
+
+/*
+ * State of a (non-compressed) image conversion. Up to MAX_COROUTINES
+ * coroutines each pick the next chunk of the input, read it and write it to
+ * the output image, so that several reads and writes are in flight at once.
+ * Unless out-of-order writes are allowed, the writes are still issued in
+ * the order of the chunks in the input.
+ */
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int src_num;
+    int64_t total_sectors;
+    int64_t sector_num;
+    int64_t wr_offs;
+
+    /* source of the chunk starting at sector_num */
+    int src_cur;
+    int64_t src_cur_offset;
+    int64_t src_cur_sectors;
+
+    BlockDriverState *target;
+    bool has_zero_init;
+    bool target_has_backing;
+    bool wr_in_order;
+    int min_sparse;
+    int buf_sectors;
+
+    int num_coroutines;
+    int running_coroutines;
+    Coroutine *co[MAX_COROUTINES];
+    int64_t wait_sector_num[MAX_COROUTINES];
+    CoMutex lock;
+    int ret;
+} ImgConvertState;
+
+static void convert_select_part(ImgConvertState *s, int64_t sector_num)
+{
+    uint64_t bs_sectors;
+
+    while (sector_num - s->src_cur_offset >= s->src_cur_sectors) {
+        s->src_cur_offset += s->src_cur_sectors;
+        s->src_cur++;
+        assert(s->src_cur < s->src_num);
+        bdrv_get_geometry(s->src[s->src_cur], &bs_sectors);
+        s->src_cur_sectors = bs_sectors;
+    }
+}
+
+/*
+ * Returns the size of the next chunk starting at @sector_num and stores its
+ * status in @status. A chunk never crosses the boundary between two input
+ * images.
+ */
+static int coroutine_fn convert_iteration_sectors(ImgConvertState *s,
+                                                  int64_t sector_num,
+                                                  ImgConvertBlockStatus *status)
+{
+    int64_t src_sector;
+    int n, n1;
+    int ret;
+
+    convert_select_part(s, sector_num);
+    src_sector = sector_num - s->src_cur_offset;
+
+    n = MIN(s->total_sectors - sector_num, s->buf_sectors);
+    n = MIN(n, s->src_cur_sectors - src_sector);
+    *status = BLK_DATA;
+
+    /* If the output image is being created as a copy on write image, assume
+     * that sectors which are unallocated in the input image are present in
+     * both the output's and input's base images (no need to copy them). */
+    if (s->has_zero_init && s->target_has_backing) {
+        ret = bdrv_co_is_allocated(s->src[s->src_cur], src_sector, n, &n1);
+        if (ret < 0) {
+            error_report("error while reading metadata for sector %" PRId64
+                         ": %s", src_sector, strerror(-ret));
+            return ret;
+        }
+        if (!ret) {
+            *status = BLK_BACKING_FILE;
+        }
+        n = n1;
+    }
+
+    return n;
+}
+
+static int coroutine_fn convert_co_read(BlockDriverState *bs,
+                                        int64_t src_sector, int nb_sectors,
+                                        uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    iov.iov_base = buf;
+    iov.iov_len = nb_sectors << BDRV_SECTOR_BITS;
+    qemu_iovec_init_external(&qiov, &iov, 1);
+
+    ret = bdrv_co_readv(bs, src_sector, nb_sectors, &qiov);
+    if (ret < 0) {
+        error_report("error while reading sector %" PRId64 ": %s",
+                     src_sector, strerror(-ret));
+    }
+    return ret;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool allocated;
+    int n;
+    int ret;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image, copy
+         * all sectors even the ones containing only NUL bytes, because they
+         * may differ from the sectors in the base image.
+         *
+         * If the output is to a host device, we also write out sectors that
+         * are entirely 0, since whatever data was already there is garbage,
+         * not 0s. */
+        n = nb_sectors;
+        allocated = true;
+        if (s->has_zero_init && !s->target_has_backing) {
+            allocated = is_allocated_sectors_min(buf, nb_sectors, &n,
+                                                 s->min_sparse);
+        }
+
+        if (allocated) {
+            iov.iov_base = buf;
+            iov.iov_len = n << BDRV_SECTOR_BITS;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64 ": %s",
+                             sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf = NULL;
+    int ret, i;
+    int index = -1;
+
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i] == qemu_coroutine_self()) {
+            index = i;
+            break;
+        }
+    }
+    assert(index >= 0);
+
+    s->running_coroutines++;
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (s->ret == 0) {
+        ImgConvertBlockStatus status;
+        BlockDriverState *src;
+        int64_t sector_num, src_sector;
+        int n;
+
+        qemu_co_mutex_lock(&s->lock);
+        if (s->ret != 0 || s->sector_num >= s->total_sectors) {
+            qemu_co_mutex_unlock(&s->lock);
+            break;
+        }
+        n = convert_iteration_sectors(s, s->sector_num, &status);
+        if (n < 0) {
+            qemu_co_mutex_unlock(&s->lock);
+            s->ret = n;
+            break;
+        }
+        /* save current position and allocation status to local variables */
+        sector_num = s->sector_num;
+        src = s->src[s->src_cur];
+        src_sector = sector_num - s->src_cur_offset;
+        s->sector_num += n;
+        qemu_co_mutex_unlock(&s->lock);
+
+        if (status == BLK_DATA) {
+            ret = convert_co_read(src, src_sector, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* keep writes in order */
+            while (s->wr_offs != sector_num && s->ret == 0) {
+                s->wait_sector_num[index] = sector_num;
+                qemu_coroutine_yield();
+            }
+            s->wait_sector_num[index] = -1;
+        }
+
+        if (s->ret == 0 && status == BLK_DATA) {
+            ret = convert_co_write(s, sector_num, n, buf);
+            if (ret < 0) {
+                s->ret = ret;
+            }
+        }
+
+        if (s->wr_in_order) {
+            /* reenter the coroutine that might have waited for this write
+             * to complete */
+            s->wr_offs = sector_num + n;
+            for (i = 0; i < s->num_coroutines; i++) {
+                if (s->co[i] && s->wait_sector_num[i] == s->wr_offs) {
+                    qemu_coroutine_enter(s->co[i], NULL);
+                    break;
+                }
+            }
+        }
+
+        qemu_progress_print(100.0 * n / s->total_sectors, 100);
+    }
+
+    if (s->ret != 0 && s->wr_in_order) {
+        /* on error wake up everybody so that they can notice and exit */
+        for (i = 0; i < s->num_coroutines; i++) {
+            if (s->co[i] && s->wait_sector_num[i] != -1 && i != index) {
+                qemu_coroutine_enter(s->co[i], NULL);
+            }
+        }
+    }
+
+    qemu_vfree(buf);
+    s->co[index] = NULL;
+    s->running_coroutines--;
+}
+
+static int convert_do_copy(ImgConvertState *s)
+{
+    uint64_t bs_sectors;
+    int i;
+
+    bdrv_get_geometry(s->src[0], &bs_sectors);
+    s->src_cur = 0;
+    s->src_cur_offset = 0;
+    s->src_cur_sectors = bs_sectors;
+    s->sector_num = 0;
+    s->wr_offs = 0;
+    s->ret = 0;
+    s->buf_sectors = IO_BUF_SIZE / BDRV_SECTOR_SIZE;
+    s->running_coroutines = 0;
+
+    qemu_co_mutex_init(&s->lock);
+    for (i = 0; i < s->num_coroutines; i++) {
+        s->co[i] = qemu_coroutine_create(convert_co_do_copy);
+        s->wait_sector_num[i] = -1;
+    }
+    for (i = 0; i < s->num_coroutines; i++) {
+        if (s->co[i]) {
+            qemu_coroutine_enter(s->co[i], s);
+        }
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int chunk_sectors;
     int progress = 0, flags;
+    long num_coroutines = 8;
+    bool wr_in_order = true;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -1140,7 +1431,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:W");
         if (c == -1) {
             break;
         }
@@ -1197,6 +1488,22 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
+        case 'W':
+            wr_in_order = false;
+            break;
         }
     }
 
@@ -1204,6 +1511,11 @@ static int img_convert(int argc, char **argv)
         progress = 0;
     }
 
+    if (!wr_in_order && compress) {
+        error_report("Out of order write and compress are mutually exclusive");
+        return 1;
+    }
+
     bs_n = argc - optind - 1;
     if (bs_n < 1) {
         help();
@@ -1376,24 +1688,27 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
+        /* Pass as many clusters per request as fit into the buffer, so that
+         * the driver can compress them in parallel */
+        chunk_sectors = (IO_BUF_SIZE / cluster_size) * cluster_sectors;
         sector_num = 0;
 
         nb_sectors = total_sectors;
         if (nb_sectors != 0) {
             local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
+                (nb_sectors / MIN(nb_sectors, chunk_sectors));
         }
 
         for(;;) {
             int64_t bs_num;
-            int remainder;
+            int remainder, i;
             uint8_t *buf2;
 
             nb_sectors = total_sectors - sector_num;
             if (nb_sectors <= 0)
                 break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
+            if (nb_sectors >= chunk_sectors)
+                n = chunk_sectors;
             else
                 n = nb_sectors;
 
@@ -1431,13 +1746,34 @@ static int img_convert(int argc, char **argv)
             }
             assert (remainder == 0);
 
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
+            /* Skip clusters that contain only zeroes and write each run of
+             * other clusters with a single request */
+            i = 0;
+            while (i < n) {
+                int run = 0;
+
+                while (i + run < n) {
+                    int len = MIN(cluster_sectors, n - i - run);
+                    if (buffer_is_zero(buf + (i + run) * BDRV_SECTOR_SIZE,
+                                       len * BDRV_SECTOR_SIZE)) {
+                        break;
+                    }
+                    run += len;
+                }
+
+                if (run == 0) {
+                    i += MIN(cluster_sectors, n - i);
+                    continue;
+                }
+
+                ret = bdrv_write_compressed(out_bs, sector_num + i,
+                                            buf + i * BDRV_SECTOR_SIZE, run);
                 if (ret != 0) {
                     error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
+                                 ": %s", sector_num + i, strerror(-ret));
                     goto out;
                 }
+                i += run;
             }
             sector_num += n;
             qemu_progress_print(local_progress, 100);
@@ -1445,99 +1781,19 @@ static int img_convert(int argc, char **argv)
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    ret = bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                            n, &n1);
-                    if (ret < 0) {
-                        error_report("error while reading metadata for sector "
-                                     "%" PRId64 ": %s",
-                                     sector_num - bs_offset, strerror(-ret));
-                        goto out;
-                    }
-                    if (!ret) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+        ImgConvertState state = {
+            .src                = bs,
+            .src_num            = bs_n,
+            .total_sectors      = total_sectors,
+            .target             = out_bs,
+            .has_zero_init      = bdrv_has_zero_init(out_bs),
+            .target_has_backing = !!out_baseimg,
+            .wr_in_order        = wr_in_order,
+            .min_sparse         = min_sparse,
+            .num_coroutines     = num_coroutines,
+        };
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
+        ret = convert_do_copy(&state);
     }
 out:
     qemu_progress_end();
@@ -35,7 +35,11 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                tcg-threads=single|multi runs TCG vCPUs in one or per-vCPU threads\n"
+    "                tcg-trace-threshold=n retranslates blocks run n times as traces\n"
+    "                tb-cache=file keeps translated code in file across runs\n"
+    "                tb-cache-readonly=on|off do not update the tb-cache file on exit\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +62,33 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item tcg-threads=single|multi
+With @code{multi}, TCG runs every vCPU in its own host thread so that
+guest throughput can scale with the number of host cores. This is
+experimental, only available for some targets on Linux hosts, and cannot
+be combined with @option{-icount}. The default is @code{single}, where
+one thread runs all vCPUs in turn.
+@item tcg-trace-threshold=@var{n}
+Count how often each translated block runs and which way it branches, and
+retranslate blocks that ran @var{n} times as traces that continue along
+the branches most often taken, so that the generated code is optimized
+across them. This is experimental, only available for x86 targets, and
+cannot be combined with @option{-icount}. The default is 0, which
+disables it.
+@item tb-cache=@var{file}
+Load translated code from @var{file} at startup and write it back on
+exit, so that later runs of the same guest skip most of the translation
+work. Cached code is only used where the guest code it was translated from
+is unchanged. The file is ignored and rewritten if the QEMU build, the
+machine, the CPU model, @option{-icount}, @option{-singlestep} or
+@option{tcg-threads} differ from the run that created it. As its contents
+are executed, the file must be owned by the user or by root and must not be
+writable by others. A QEMU built as a position independent executable needs
+address space randomization disabled, for example by running it under
+@code{setarch -R}. This is only available for x86 targets on Linux hosts.
+@item tb-cache-readonly=on|off
+Use the @option{tb-cache} file without writing it back on exit (default: off).
+This lets many instances share a file that was prepared by a single run.
 @end table
 ETEXI
 
@@ -407,7 +438,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
     "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
@@ -443,7 +474,7 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Native Linux AIO is only asynchronous with @option{cache=none} or @option{cache=directsync}; io_uring also handles buffered I/O, flushes and discards on regular files asynchronously.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
 @item format=@var{format}
@@ -3099,6 +3130,25 @@ Create an new object of type @var{typename} setting properties
 in the order they are specified.  Note that the 'id'
 property must be set.  These objects are placed in the
 '/objects' path.
+
+@table @option
+@item -object iothread,id=@var{id}[,cpus=@var{n}[-@var{m}]][,poll-max-ns=@var{ns}][,poll-grow=@var{grow}][,poll-shrink=@var{shrink}]
+Create an event loop thread named @var{id}.  Devices that support it, such
+as virtio-blk with @code{iothread=@var{id}}, process their I/O in this
+thread instead of the main loop; several devices may share one iothread.
+@option{cpus} pins the thread to host CPU @var{n}, or to CPUs @var{n}
+through @var{m} inclusive.  Use @code{query-iothreads} to find the thread
+ids of running iothreads.
+
+Before sleeping, the thread busy-polls devices that support it (virtio-blk
+queues and @code{aio=native} completions) for up to @option{poll-max-ns}
+nanoseconds (default 32768, 0 disables polling).  The polling time adapts
+to the workload: it is multiplied by @option{poll-grow} (default 2) when a
+slightly longer poll would have found the next event, and divided by
+@option{poll-shrink} (default: reset to 0) when events arrive later than
+@option{poll-max-ns}.  The parameters can be changed at run-time with
+@code{qom-set}.
+@end table
 ETEXI
 
 DEF("msg", HAS_ARG, QEMU_OPTION_msg,
@@ -705,6 +705,59 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-set-channels",
+        .args_type  = "value:i",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_channels,
+    },
+
+SQMP
+migrate-set-channels
+--------------------
+
+Set the number of channels used to send RAM during migration.  With more than
+one channel, each channel is served by its own thread and connection to the
+destination.  Only tcp: and unix: URIs support more than one channel.
+
+Arguments:
+
+- "value": number of channels, between 1 and 16 (json-int)
+
+Example:
+
+-> { "execute": "migrate-set-channels", "arguments": { "value": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate-set-compress-params",
+        .args_type  = "level:i?,threads:i?,decompress-threads:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_compress_params,
+    },
+
+SQMP
+migrate-set-compress-params
+---------------------------
+
+Set the parameters used by the compress migration capability.
+
+Arguments:
+
+- "level": zlib compression level, between 0 and 9 (json-int, optional)
+- "threads": number of compression threads on the source, between 1 and 255
+  (json-int, optional)
+- "decompress-threads": number of decompression threads on the destination,
+  between 1 and 255 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-compress-params",
+     "arguments": { "level": 6, "threads": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -900,6 +953,35 @@ Example:
 -> { "execute": "block_resize", "arguments": { "device": "scratch", "size": 1073741824 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block-set-metadata-cache-size",
+        .args_type  = "device:B,cache-size:o?,l2-cache-size:o?,"
+                      "refcount-cache-size:o?",
+        .mhandler.cmd_new = qmp_marshal_input_block_set_metadata_cache_size,
+    },
+
+SQMP
+block-set-metadata-cache-size
+-----------------------------
+
+Resize the metadata caches of a block image while a guest is running.  Sizes
+that are not given are derived from the others like when the image is opened.
+
+Arguments:
+
+- "device": the device's ID, must be unique (json-string)
+- "cache-size": maximum combined metadata cache size (json-int, optional)
+- "l2-cache-size": maximum L2 table cache size (json-int, optional)
+- "refcount-cache-size": maximum refcount block cache size (json-int, optional)
+
+Example:
+
+-> { "execute": "block-set-metadata-cache-size",
+     "arguments": { "device": "ide0-hd0", "l2-cache-size": 4194304 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1907,6 +1989,15 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "metadata-caches": A json-array of the image format's metadata
+                         caches, if it has any (json-array, optional).
+                         Each cache is a json-object containing:
+        - "name": name of the cache, e.g. "l2" (json-string)
+        - "size": cache size in bytes (json-int)
+        - "entries": number of cached tables (json-int)
+        - "hits": lookups served from the cache (json-int)
+        - "misses": lookups that loaded a table (json-int)
+        - "evictions": cached tables that were replaced (json-int)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2045,6 +2136,63 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_cpus,
     },
 
+SQMP
+query-iothreads
+---------------
+
+Returns a list of information about each iothread.
+
+Note this list excludes the QEMU main loop thread, which is not declared
+using the -object iothread command-line option.  It is always the main thread
+of the process.
+
+Return a json-array. Each iothread is represented by a json-object, which
+contains:
+
+- "id": name of iothread (json-str)
+- "thread-id": ID of the underlying host thread (json-int)
+- "cpus": host CPUs the thread is restricted to (json-str, optional)
+- "poll-max-ns": maximum polling time in ns, 0 if disabled (json-int)
+- "poll-grow": polling time growth factor, 0 for the default (json-int)
+- "poll-shrink": polling time shrink divisor, 0 to reset it (json-int)
+- "poll-attempts": number of times the thread busy-polled (json-int)
+- "poll-successes": number of polling attempts that found work (json-int)
+
+Example:
+
+-> { "execute": "query-iothreads" }
+<- {
+      "return":[
+         {
+            "id":"iothread0",
+            "thread-id":3134,
+            "cpus":"2-3",
+            "poll-max-ns":32768,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-attempts":120581,
+            "poll-successes":97302
+         },
+         {
+            "id":"iothread1",
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-grow":0,
+            "poll-shrink":0,
+            "poll-attempts":0,
+            "poll-successes":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-iothreads",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_iothreads,
+    },
+
 SQMP
 query-pci
 ---------
@@ -2662,6 +2810,21 @@ The main json-object contains the following:
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+         - "sets": optional, a json-array with the "hits" and "misses"
+           of each set of the cache, present while the cache is allocated
+- "compression": only present if the compress capability is enabled.
+  It is a json-object with the following compression information:
+         - "pages": number of compressed pages
+         - "bytes": number of bytes transferred for compressed pages
+         - "busy": number of times a page waited for a compression thread
+         - "compression-rate": ratio between the uncompressed and compressed
+           size of the compressed pages (json-number)
+- "postcopy": only present if post-copy was started, on both the source
+  and the destination.
+  It is a json-object with the following post-copy information:
+         - "requests": number of pages requested by the destination
+         - "average-latency": average page request latency in microseconds
+         - "max-latency": maximum page request latency in microseconds
 
 Examples:
 
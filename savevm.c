@@ -920,6 +920,16 @@ int64_t qemu_file_get_rate_limit(QEMUFile *f)
     return f->xfer_limit;
 }
 
+/* Returns the bytes that may still be sent in the current rate limiting
+ * period, or a negative value if @f is not rate limited */
+int64_t qemu_file_get_rate_limit_left(QEMUFile *f)
+{
+    if (f->xfer_limit <= 0) {
+        return -1;
+    }
+    return MAX(f->xfer_limit - f->bytes_xfer, 0);
+}
+
 void qemu_file_set_rate_limit(QEMUFile *f, int64_t limit)
 {
     f->xfer_limit = limit;
@@ -930,6 +940,13 @@ void qemu_file_reset_rate_limit(QEMUFile *f)
     f->bytes_xfer = 0;
 }
 
+/* Accounts data sent on behalf of @f through another channel against its
+ * rate limit */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -0,0 +1,115 @@
+#!/bin/bash
+#
+# Compare the host AIO implementations of the raw-posix block driver
+#
+# This work is licensed under the terms of the GNU GPLv2 or later.
+# See the COPYING file in the top-level directory.
+#
+# The same qemu-io workload is run with --aio=threads, --aio=native and
+# --aio=io_uring, and the requests per second of each are printed.  Requests
+# are issued in batches of DEPTH asynchronous requests; aio_flush waits for
+# each batch to complete before the next one starts.
+#
+# Set QEMU_IO to pick the qemu-io binary (default: ./qemu-io).
+
+qemu_io=${QEMU_IO:-./qemu-io}
+requests=10000
+size=4k
+depth=32
+cache=none
+op=read
+pattern=seq
+modes="threads native io_uring"
+
+usage() {
+    cat <<EOF
+Usage: $0 [options] IMAGE
+
+  -n N       number of requests (default: $requests)
+  -s SIZE    request size in bytes, k and m suffixes allowed (default: $size)
+  -d DEPTH   requests in flight per batch (default: $depth)
+  -c MODE    cache mode (default: $cache); aio=native falls back to
+             threads unless MODE is none or directsync
+  -m MODES   AIO modes to compare (default: "$modes")
+  -r         random instead of sequential offsets
+  -w         write instead of read; this overwrites IMAGE
+  -h         display this help and exit
+EOF
+}
+
+while getopts "n:s:d:c:m:rwh" opt; do
+    case $opt in
+    n) requests=$OPTARG ;;
+    s) size=$OPTARG ;;
+    d) depth=$OPTARG ;;
+    c) cache=$OPTARG ;;
+    m) modes=$OPTARG ;;
+    r) pattern=rand ;;
+    w) op=write ;;
+    h) usage; exit 0 ;;
+    *) usage; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+image=$1
+if [ -z "$image" ]; then
+    usage
+    exit 1
+fi
+
+case $size in
+*[kK]) bytes=$((${size%[kK]} * 1024)) ;;
+*[mM]) bytes=$((${size%[mM]} * 1024 * 1024)) ;;
+*) bytes=$size ;;
+esac
+
+if [ -b "$image" ]; then
+    image_bytes=$(blockdev --getsize64 "$image")
+else
+    image_bytes=$(stat -L -c %s "$image")
+fi
+slots=$((image_bytes / bytes))
+if [ "$slots" -lt 1 ]; then
+    echo "$image is smaller than one request" >&2
+    exit 1
+fi
+
+gen_commands() {
+    local i offset
+
+    for ((i = 0; i < requests; i++)); do
+        if [ $pattern = rand ]; then
+            offset=$(((RANDOM * 32768 + RANDOM) % slots * bytes))
+        else
+            offset=$((i % slots * bytes))
+        fi
+        echo "aio_$op -q $offset $bytes"
+        if (((i + 1) % depth == 0)); then
+            echo "aio_flush"
+        fi
+    done
+    echo "aio_flush"
+    echo "quit"
+}
+
+cmds=$(mktemp)
+trap 'rm -f "$cmds"' EXIT
+gen_commands > "$cmds"
+
+echo "$requests ${pattern} ${op}s of $bytes bytes, depth $depth, cache=$cache"
+printf "%-10s %12s %10s\n" "aio" "requests/s" "MB/s"
+for mode in $modes; do
+    start=$(date +%s%N)
+    if ! "$qemu_io" --cache="$cache" --aio="$mode" "$image" \
+            < "$cmds" > /dev/null; then
+        echo "$mode: qemu-io failed" >&2
+        continue
+    fi
+    end=$(date +%s%N)
+
+    ns=$((end - start))
+    printf "%-10s %12d %10d\n" "$mode" \
+           $((requests * 1000000000 / ns)) \
+           $((requests * bytes * 1000 / ns))
+done
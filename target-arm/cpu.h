@@ -33,6 +33,9 @@
 
 #define TARGET_HAS_ICE 1
 
+/* guest atomics are serialized so vCPUs can run in parallel threads */
+#define TARGET_SUPPORTS_MTTCG
+
 #define EXCP_UDEF            1   /* undefined instruction */
 #define EXCP_SWI             2   /* software interrupt */
 #define EXCP_PREFETCH_ABORT  3
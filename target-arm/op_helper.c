@@ -18,6 +18,9 @@
  */
 #include "cpu.h"
 #include "helper.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "sysemu/cpus.h"
+#endif
 
 #define SIGNBIT (uint32_t)0x80000000
 #define SIGNBIT64 ((uint64_t)1 << 63)
@@ -231,6 +234,22 @@ void HELPER(exception)(CPUARMState *env, uint32_t excp)
     cpu_loop_exit(env);
 }
 
+/* Bracket the compare-and-store of STREX when vCPUs run in parallel
+   threads.  linux-user handles STREX in cpu_loop() instead.  */
+void HELPER(exclusive_lock)(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    qemu_tcg_atomic_lock();
+#endif
+}
+
+void HELPER(exclusive_unlock)(void)
+{
+#if !defined(CONFIG_USER_ONLY)
+    qemu_tcg_atomic_unlock();
+#endif
+}
+
 uint32_t HELPER(cpsr_read)(CPUARMState *env)
 {
     return cpsr_read(env) & ~CPSR_EXEC;
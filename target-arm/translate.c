@@ -28,6 +28,9 @@
 #include "disas/disas.h"
 #include "tcg-op.h"
 #include "qemu/log.h"
+#if !defined(CONFIG_USER_ONLY)
+#include "sysemu/cpus.h"
+#endif
 
 #include "helper.h"
 #define GEN_HELPER 1
@@ -108,6 +111,7 @@ static const char *regnames[] =
 /* initialize TCG globals.  */
 void arm_translate_init(void)
 {
+    uint64_t flags;
     int i;
 
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
@@ -137,6 +141,15 @@ void arm_translate_init(void)
 
 #define GEN_HELPER 2
 #include "helper.h"
+
+    /* helpers that only access the flags */
+    flags = tcg_global_mask_i32(cpu_NF) | tcg_global_mask_i32(cpu_ZF) |
+            tcg_global_mask_i32(cpu_CF) | tcg_global_mask_i32(cpu_VF);
+    tcg_set_helper_globals(helper_cpsr_read, flags, 0);
+    tcg_set_helper_globals(helper_shl_cc, 0, tcg_global_mask_i32(cpu_CF));
+    tcg_set_helper_globals(helper_shr_cc, 0, tcg_global_mask_i32(cpu_CF));
+    tcg_set_helper_globals(helper_sar_cc, 0, tcg_global_mask_i32(cpu_CF));
+    tcg_set_helper_globals(helper_ror_cc, 0, tcg_global_mask_i32(cpu_CF));
 }
 
 static inline TCGv_i32 load_cpu_offset(int offset)
@@ -4437,6 +4450,74 @@ static const uint8_t neon_2rm_sizes[] = {
     [NEON_2RM_VCVT_UF] = 0x4,
 };
 
+/* Translate a Q register "three registers of the same length" insn into a
+   single 128-bit TCG vector operation, if one exists.  Return nonzero if
+   the instruction was handled.  */
+static int gen_neon_3r_v128(int op, int u, int size, int rd, int rn, int rm)
+{
+    long dofs = vfp_reg_offset(1, rd);
+    long nofs = vfp_reg_offset(1, rn);
+    long mofs = vfp_reg_offset(1, rm);
+
+    switch (op) {
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_and_v128(cpu_env, dofs, nofs, mofs);
+            return 1;
+        case 1: /* VBIC */
+            tcg_gen_andc_v128(cpu_env, dofs, nofs, mofs);
+            return 1;
+        case 2: /* VORR */
+            tcg_gen_or_v128(cpu_env, dofs, nofs, mofs);
+            return 1;
+        case 4: /* VEOR */
+            tcg_gen_xor_v128(cpu_env, dofs, nofs, mofs);
+            return 1;
+        }
+        break;
+    case NEON_3R_VADD_VSUB:
+        switch ((u << 2) | size) {
+        case 0: tcg_gen_add8_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 1: tcg_gen_add16_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 2: tcg_gen_add32_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 3: tcg_gen_add64_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 4: tcg_gen_sub8_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 5: tcg_gen_sub16_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 6: tcg_gen_sub32_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 7: tcg_gen_sub64_v128(cpu_env, dofs, nofs, mofs); return 1;
+        }
+        break;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            break;
+        }
+        switch (size) { /* VCEQ */
+        case 0: tcg_gen_cmpeq8_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 1: tcg_gen_cmpeq16_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 2: tcg_gen_cmpeq32_v128(cpu_env, dofs, nofs, mofs); return 1;
+        }
+        break;
+    case NEON_3R_VCGT:
+        if (u) {
+            break;
+        }
+        switch (size) { /* signed VCGT */
+        case 0: tcg_gen_cmpgt8_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 1: tcg_gen_cmpgt16_v128(cpu_env, dofs, nofs, mofs); return 1;
+        case 2: tcg_gen_cmpgt32_v128(cpu_env, dofs, nofs, mofs); return 1;
+        }
+        break;
+    case NEON_3R_VMUL:
+        if (!u && size == 1) {
+            tcg_gen_mul16_v128(cpu_env, dofs, nofs, mofs);
+            return 1;
+        }
+        break;
+    }
+    return 0;
+}
+
 /* Translate a NEON data processing instruction.  Return nonzero if the
    instruction is invalid.
    We process data in a mixture of 32-bit and 64-bit chunks.
@@ -4478,6 +4559,9 @@ static int disas_neon_data_insn(CPUARMState * env, DisasContext *s, uint32_t ins
         if (q && ((rd | rn | rm) & 1)) {
             return 1;
         }
+        if (q && gen_neon_3r_v128(op, u, size, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -6509,6 +6593,10 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
        } */
     fail_label = gen_new_label();
     done_label = gen_new_label();
+    if (qemu_tcg_mttcg_enabled()) {
+        /* no other vCPU may store-exclusive in between */
+        gen_helper_exclusive_lock();
+    }
     tcg_gen_brcond_i32(TCG_COND_NE, addr, cpu_exclusive_addr, fail_label);
     tmp = tcg_temp_new_i32();
     switch (size) {
@@ -6563,6 +6651,9 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
+    if (qemu_tcg_mttcg_enabled()) {
+        gen_helper_exclusive_unlock();
+    }
     tcg_gen_movi_i32(cpu_exclusive_addr, -1);
 }
 #endif
@@ -36,6 +36,16 @@
 
 #define TARGET_HAS_ICE 1
 
+/* guest atomics are serialized so vCPUs can run in parallel threads */
+#define TARGET_SUPPORTS_MTTCG
+
+/* translated code embeds no host pointers besides the TB itself, so it
+   can be reused by a later run */
+#define TARGET_SUPPORTS_TB_CACHE
+
+/* the translator can follow hot branches, see gen_trace_next() */
+#define TARGET_SUPPORTS_TCG_TRACES
+
 #ifdef TARGET_X86_64
 #define ELF_MACHINE	EM_X86_64
 #else
@@ -22,8 +22,10 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
+#include "sysemu/cpus.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
+#if defined(CONFIG_USER_ONLY)
 /* broken thread support */
 
 static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
@@ -37,6 +39,20 @@ void helper_unlock(void)
 {
     spin_unlock(&global_cpu_lock);
 }
+#else
+/* LOCK-prefixed instructions only exclude each other, not plain stores
+   from other vCPUs.  A fault inside the locked instruction releases the
+   lock when cpu_exec() is re-entered.  */
+void helper_lock(void)
+{
+    qemu_tcg_atomic_lock();
+}
+
+void helper_unlock(void)
+{
+    qemu_tcg_atomic_unlock();
+}
+#endif
 
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
@@ -23,6 +23,8 @@
 
 #if !defined(CONFIG_USER_ONLY)
 #include "exec/softmmu_exec.h"
+#include "sysemu/cpus.h"
+#include "qemu/main-loop.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
 /* check if Port I/O is allowed in TSS */
@@ -144,6 +146,24 @@ void helper_movl_drN_T0(CPUX86State *env, int reg, target_ulong t0)
 {
 }
 #else
+/* The local APIC is device state, protected by the iothread lock that
+   multi-threaded TCG vCPUs do not hold while running guest code.  */
+static bool apic_lock_iothread(void)
+{
+    if (qemu_tcg_mttcg_enabled() && !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
+static void apic_unlock_iothread(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 target_ulong helper_read_crN(CPUX86State *env, int reg)
 {
     target_ulong val;
@@ -155,7 +175,10 @@ target_ulong helper_read_crN(CPUX86State *env, int reg)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = apic_lock_iothread();
+
             val = cpu_get_apic_tpr(env->apic_state);
+            apic_unlock_iothread(locked);
         } else {
             val = env->v_tpr;
         }
@@ -179,7 +202,10 @@ void helper_write_crN(CPUX86State *env, int reg, target_ulong t0)
         break;
     case 8:
         if (!(env->hflags2 & HF2_VINTR_MASK)) {
+            bool locked = apic_lock_iothread();
+
             cpu_set_apic_tpr(env->apic_state, t0);
+            apic_unlock_iothread(locked);
         }
         env->v_tpr = t0 & 0x0f;
         break;
@@ -286,8 +312,13 @@ void helper_wrmsr(CPUX86State *env)
         env->sysenter_eip = val;
         break;
     case MSR_IA32_APICBASE:
+    {
+        bool locked = apic_lock_iothread();
+
         cpu_set_apic_base(env->apic_state, val);
+        apic_unlock_iothread(locked);
         break;
+    }
     case MSR_EFER:
         {
             uint64_t update_mask;
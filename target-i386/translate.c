@@ -121,6 +121,14 @@ typedef struct DisasContext {
     int cpuid_ext2_features;
     int cpuid_ext3_features;
     int cpuid_7_0_ebx_features;
+    /* hot-trace state, see gen_trace_next() */
+    int trace;          /* translating a CF_TRACE block */
+    int trace_replay;   /* retranslating it to restore the CPU state */
+    int trace_edges;    /* branches followed so far */
+    target_ulong trace_block_pc; /* where the block being extended starts */
+    int trace_nb_exits;
+    int trace_exit_label[TB_TRACE_MAX_EDGES];
+    target_ulong trace_exit_eip[TB_TRACE_MAX_EDGES];
 } DisasContext;
 
 static void gen_eob(DisasContext *s);
@@ -2421,12 +2429,75 @@ static inline void gen_goto_tb(DisasContext *s, int tb_num, target_ulong eip)
     }
 }
 
-static inline void gen_jcc(DisasContext *s, int b,
+/* In a trace, decide whether translation continues across the branch
+   that ends the current block.  'code' is the TB_TRACE_* code of the
+   edge, or -1 for a conditional branch: its direction then comes from
+   the profile of the block, as translated on its own.  Only forward
+   edges within the first page are followed, so that tb->size still
+   covers all the guest code of the trace.  When retranslating with
+   search_pc, the recorded decisions are replayed.  Return the code of
+   the edge to follow, or TB_TRACE_STOP.  */
+static int gen_trace_next(CPUX86State *env, DisasContext *s, int code,
+                          target_ulong next_eip, target_ulong target_eip)
+{
+    TranslationBlock *tb = s->tb;
+    int shift = s->trace_edges * TB_TRACE_BITS;
+    target_ulong pc;
+    int hot;
+
+    if (!s->trace || s->trace_edges == TB_TRACE_MAX_EDGES) {
+        return TB_TRACE_STOP;
+    }
+    if (s->trace_replay) {
+        code = (tb->trace_path >> shift) & ((1 << TB_TRACE_BITS) - 1);
+    } else {
+        if (code < 0) {
+            hot = tb_trace_hot_exit(env, s->trace_block_pc, s->pc,
+                                    s->cs_base, s->flags);
+            code = hot < 0 ? TB_TRACE_STOP : TB_TRACE_NEXT + hot;
+        }
+        pc = s->cs_base + (code == TB_TRACE_NEXT ? next_eip : target_eip);
+        if (pc < s->pc ||
+            (pc & TARGET_PAGE_MASK) != (tb->pc & TARGET_PAGE_MASK)) {
+            code = TB_TRACE_STOP;
+        }
+        tb->trace_path |= code << shift;
+    }
+    if (code != TB_TRACE_STOP) {
+        s->trace_edges++;
+        s->trace_block_pc = s->cs_base +
+            (code == TB_TRACE_NEXT ? next_eip : target_eip);
+    }
+    return code;
+}
+
+/* Leave the trace for 'eip' if condition 'b' holds.  The exit itself is
+   generated after the end of the trace, so that the hot path is a
+   straight line.  */
+static void gen_trace_side_exit(DisasContext *s, int b, target_ulong eip)
+{
+    int l1 = gen_new_label();
+
+    gen_jcc1(s, b, l1);
+    s->trace_exit_label[s->trace_nb_exits] = l1;
+    s->trace_exit_eip[s->trace_nb_exits++] = eip;
+}
+
+static inline void gen_jcc(CPUX86State *env, DisasContext *s, int b,
                            target_ulong val, target_ulong next_eip)
 {
     int l1, l2;
 
     if (s->jmp_opt) {
+        switch (gen_trace_next(env, s, -1, next_eip, val)) {
+        case TB_TRACE_NEXT:
+            gen_trace_side_exit(s, b, val);
+            return;
+        case TB_TRACE_TAKEN:
+            gen_trace_side_exit(s, b ^ 1, next_eip);
+            s->pc = s->cs_base + val;
+            return;
+        }
         l1 = gen_new_label();
         gen_jcc1(s, b, l1);
 
@@ -2844,6 +2915,17 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* direct jump or call: continue the trace at 'eip' if possible */
+static void gen_jmp_trace(CPUX86State *env, DisasContext *s, target_ulong eip)
+{
+    if (s->jmp_opt &&
+        gen_trace_next(env, s, TB_TRACE_JMP, eip, eip) != TB_TRACE_STOP) {
+        s->pc = s->cs_base + eip;
+    } else {
+        gen_jmp(s, eip);
+    }
+}
+
 static inline void gen_ldq_env_A0(int idx, int offset)
 {
     int mem_index = (idx >> 2) - 1;
@@ -3056,6 +3138,41 @@ static const SSEFunc_0_epp sse_op_table1[256][4] = {
     [0xfe] = MMX_OP2(paddl),
 };
 
+/* 128-bit operations from sse_op_table1 that have a TCG v128 equivalent.
+   They apply to the 0x66 prefixed (xmm) forms and, for the logic ops, also
+   to the unprefixed ps forms.  With SWAP set the first source is op2.  */
+typedef void (*SSEFunc_v128)(TCGv_ptr base, tcg_target_long dofs,
+                             tcg_target_long aofs, tcg_target_long bofs);
+
+static const struct SSEV128Op {
+    SSEFunc_v128 fn;
+    bool swap;
+} sse_v128_table[256] = {
+    [0x54] = { tcg_gen_and_v128 },
+    [0x55] = { tcg_gen_andc_v128, true },
+    [0x56] = { tcg_gen_or_v128 },
+    [0x57] = { tcg_gen_xor_v128 },
+    [0x64] = { tcg_gen_cmpgt8_v128 },
+    [0x65] = { tcg_gen_cmpgt16_v128 },
+    [0x66] = { tcg_gen_cmpgt32_v128 },
+    [0x74] = { tcg_gen_cmpeq8_v128 },
+    [0x75] = { tcg_gen_cmpeq16_v128 },
+    [0x76] = { tcg_gen_cmpeq32_v128 },
+    [0xd4] = { tcg_gen_add64_v128 },
+    [0xd5] = { tcg_gen_mul16_v128 },
+    [0xdb] = { tcg_gen_and_v128 },
+    [0xdf] = { tcg_gen_andc_v128, true },
+    [0xeb] = { tcg_gen_or_v128 },
+    [0xef] = { tcg_gen_xor_v128 },
+    [0xf8] = { tcg_gen_sub8_v128 },
+    [0xf9] = { tcg_gen_sub16_v128 },
+    [0xfa] = { tcg_gen_sub32_v128 },
+    [0xfb] = { tcg_gen_sub64_v128 },
+    [0xfc] = { tcg_gen_add8_v128 },
+    [0xfd] = { tcg_gen_add16_v128 },
+    [0xfe] = { tcg_gen_add32_v128 },
+};
+
 static const SSEFunc_0_epp sse_op_table2[3 * 8][2] = {
     [0 + 2] = MMX_OP2(psrlw),
     [0 + 4] = MMX_OP2(psraw),
@@ -4610,6 +4727,13 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = cpu_ldub_code(env, s->pc++);
+#ifndef HOST_WORDS_BIGENDIAN
+            if (b == 0x70 && b1 == 1) {
+                /* pshufd; the XMM_L lanes are in host memory order */
+                tcg_gen_shuf32_v128(cpu_env, op1_offset, op2_offset, val);
+                break;
+            }
+#endif
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             /* XXX: introduce a new table? */
@@ -4650,6 +4774,16 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (is_xmm && b1 < 2 && sse_v128_table[b].fn) {
+                if (sse_v128_table[b].swap) {
+                    sse_v128_table[b].fn(cpu_env, op1_offset,
+                                         op2_offset, op1_offset);
+                } else {
+                    sse_v128_table[b].fn(cpu_env, op1_offset,
+                                         op1_offset, op2_offset);
+                }
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -6816,7 +6950,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
                 tval &= 0xffffffff;
             gen_movtl_T0_im(next_eip);
             gen_push_T0(s);
-            gen_jmp(s, tval);
+            gen_jmp_trace(env, s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6843,7 +6977,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffff;
         else if(!CODE64(s))
             tval &= 0xffffffff;
-        gen_jmp(s, tval);
+        gen_jmp_trace(env, s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6864,7 +6998,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += s->pc - s->cs_base;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jmp(s, tval);
+        gen_jmp_trace(env, s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, OT_BYTE);
@@ -6880,7 +7014,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         tval += next_eip;
         if (s->dflag == 0)
             tval &= 0xffff;
-        gen_jcc(s, b, tval, next_eip);
+        gen_jcc(env, s, b, tval, next_eip);
         break;
 
     case 0x190 ... 0x19f: /* setcc Gv */
@@ -8181,6 +8315,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
 
 void optimize_flags_init(void)
 {
+    uint64_t eax, cc;
+
     cpu_env = tcg_global_reg_new_ptr(TCG_AREG0, "env");
     cpu_cc_op = tcg_global_mem_new_i32(TCG_AREG0,
                                        offsetof(CPUX86State, cc_op), "cc_op");
@@ -8246,6 +8382,23 @@ void optimize_flags_init(void)
     /* register helpers */
 #define GEN_HELPER 2
 #include "helper.h"
+
+    /* the BCD helpers only touch EAX and the flags */
+    eax = tcg_global_mask_tl(cpu_regs[R_EAX]);
+    cc = tcg_global_mask_i32(cpu_cc_op) | tcg_global_mask_tl(cpu_cc_dst) |
+         tcg_global_mask_tl(cpu_cc_src) | tcg_global_mask_tl(cpu_cc_src2);
+    tcg_set_helper_globals(helper_aam, eax, eax |
+                           tcg_global_mask_tl(cpu_cc_dst));
+    tcg_set_helper_globals(helper_aad, eax, eax |
+                           tcg_global_mask_tl(cpu_cc_dst));
+    tcg_set_helper_globals(helper_aaa, eax | cc, eax |
+                           tcg_global_mask_tl(cpu_cc_src));
+    tcg_set_helper_globals(helper_aas, eax | cc, eax |
+                           tcg_global_mask_tl(cpu_cc_src));
+    tcg_set_helper_globals(helper_daa, eax | cc, eax |
+                           tcg_global_mask_tl(cpu_cc_src));
+    tcg_set_helper_globals(helper_das, eax | cc, eax |
+                           tcg_global_mask_tl(cpu_cc_src));
 }
 
 /* generate intermediate code in gen_opc_buf and gen_opparam_buf for
@@ -8309,6 +8462,11 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
                     || (flags & HF_SOFTMMU_MASK)
 #endif
                     );
+    dc->trace = (tb->cflags & CF_TRACE) != 0;
+    dc->trace_replay = search_pc;
+    dc->trace_edges = 0;
+    dc->trace_block_pc = pc_start;
+    dc->trace_nb_exits = 0;
 #if 0
     /* check addseg logic */
     if (!dc->addseg && (dc->vm86 || !dc->pe || !dc->code32))
@@ -8329,6 +8487,10 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
     cpu_cc_srcT = tcg_temp_local_new();
 
     gen_opc_end = tcg_ctx.gen_opc_buf + OPC_MAX_SIZE;
+    if (dc->trace) {
+        /* leave room for the side exits */
+        gen_opc_end -= TB_TRACE_MAX_EDGES * 4;
+    }
 
     dc->is_jmp = DISAS_NEXT;
     pc_ptr = pc_start;
@@ -8394,6 +8556,11 @@ static inline void gen_intermediate_code_internal(X86CPU *cpu,
             break;
         }
     }
+    for (j = 0; j < dc->trace_nb_exits; j++) {
+        gen_set_label(dc->trace_exit_label[j]);
+        gen_jmp_im(dc->trace_exit_eip[j]);
+        tcg_gen_exit_tb(0);
+    }
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
     gen_tb_end(tb, num_insns);
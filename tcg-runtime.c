@@ -97,3 +97,63 @@ int64_t tcg_helper_mulsh_i64(int64_t arg1, int64_t arg2)
     muls64(&l, &h, arg1, arg2);
     return h;
 }
+
+/* 128-bit vector helpers, used when the host has no vector support.
+   The operands may alias each other, but only exactly.  */
+
+#define V128_HELPER(name, type, op)                                     \
+void tcg_helper_##name##_v128(void *d, void *a, void *b)                \
+{                                                                       \
+    type *vd = d, *va = a, *vb = b;                                     \
+    int i;                                                              \
+    for (i = 0; i < 16 / sizeof(type); i++) {                           \
+        vd[i] = op(va[i], vb[i]);                                       \
+    }                                                                   \
+}
+
+#define V128_ADD(x, y)      ((x) + (y))
+#define V128_SUB(x, y)      ((x) - (y))
+/* Narrow lanes are promoted to int, so multiply them as unsigned int to
+   avoid signed overflow; the store truncates the product.  */
+#define V128_MUL(x, y)      ((uint32_t)(x) * (uint32_t)(y))
+#define V128_AND(x, y)      ((x) & (y))
+#define V128_ANDC(x, y)     ((x) & ~(y))
+#define V128_OR(x, y)       ((x) | (y))
+#define V128_XOR(x, y)      ((x) ^ (y))
+#define V128_CMPEQ(x, y)    ((x) == (y) ? -1 : 0)
+#define V128_CMPGT(x, y)    ((x) > (y) ? -1 : 0)
+
+V128_HELPER(add8, uint8_t, V128_ADD)
+V128_HELPER(add16, uint16_t, V128_ADD)
+V128_HELPER(add32, uint32_t, V128_ADD)
+V128_HELPER(add64, uint64_t, V128_ADD)
+V128_HELPER(sub8, uint8_t, V128_SUB)
+V128_HELPER(sub16, uint16_t, V128_SUB)
+V128_HELPER(sub32, uint32_t, V128_SUB)
+V128_HELPER(sub64, uint64_t, V128_SUB)
+V128_HELPER(mul16, uint16_t, V128_MUL)
+V128_HELPER(and, uint64_t, V128_AND)
+V128_HELPER(andc, uint64_t, V128_ANDC)
+V128_HELPER(or, uint64_t, V128_OR)
+V128_HELPER(xor, uint64_t, V128_XOR)
+V128_HELPER(cmpeq8, int8_t, V128_CMPEQ)
+V128_HELPER(cmpeq16, int16_t, V128_CMPEQ)
+V128_HELPER(cmpeq32, int32_t, V128_CMPEQ)
+V128_HELPER(cmpgt8, int8_t, V128_CMPGT)
+V128_HELPER(cmpgt16, int16_t, V128_CMPGT)
+V128_HELPER(cmpgt32, int32_t, V128_CMPGT)
+
+/* Lanes are numbered in host memory order.  */
+void tcg_helper_shuf32_v128(void *d, void *a, uint32_t imm)
+{
+    uint32_t *vd = d, *va = a;
+    uint32_t t[4];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        t[i] = va[(imm >> (i * 2)) & 3];
+    }
+    for (i = 0; i < 4; i++) {
+        vd[i] = t[i];
+    }
+}
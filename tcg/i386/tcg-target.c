@@ -239,6 +239,7 @@ static inline int tcg_target_const_match(tcg_target_long val,
 
 #define P_EXT		0x100		/* 0x0f opcode prefix */
 #define P_DATA16	0x200		/* 0x66 opcode prefix */
+#define P_SIMDF3	0x8000		/* 0xf3 opcode prefix */
 #if TCG_TARGET_REG_BITS == 64
 # define P_ADDR32	0x400		/* 0x67 opcode prefix */
 # define P_REXW		0x800		/* Set REX.W = 1 */
@@ -297,6 +298,30 @@ static inline int tcg_target_const_match(tcg_target_long val,
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
+/* SSE2 opcodes, used for the v128 operations.  */
+#define OPC_MOVDQU_VxWx	(0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx	(0x7f | P_EXT | P_SIMDF3)
+#define OPC_PADDB	(0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW	(0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD	(0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ	(0xd4 | P_EXT | P_DATA16)
+#define OPC_PSUBB	(0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW	(0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD	(0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ	(0xfb | P_EXT | P_DATA16)
+#define OPC_PMULLW	(0xd5 | P_EXT | P_DATA16)
+#define OPC_PAND	(0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN	(0xdf | P_EXT | P_DATA16)
+#define OPC_POR		(0xeb | P_EXT | P_DATA16)
+#define OPC_PXOR	(0xef | P_EXT | P_DATA16)
+#define OPC_PCMPEQB	(0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW	(0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD	(0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPGTB	(0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW	(0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD	(0x66 | P_EXT | P_DATA16)
+#define OPC_PSHUFD	(0x70 | P_EXT | P_DATA16)
+
 /* Group 1 opcode extensions for 0x80-0x83.
    These are also used as modifiers for OPC_ARITH.  */
 #define ARITH_ADD 0
@@ -374,6 +399,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         assert((opc & P_REXW) == 0);
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
@@ -407,6 +435,9 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    }
     if (opc & P_EXT) {
         tcg_out8(s, 0x0f);
     }
@@ -1662,6 +1693,32 @@ void tcg_out_tb_finalize(TCGContext *s)
 }
 #endif  /* CONFIG_SOFTMMU */
 
+#if TCG_TARGET_HAS_v128
+/* The v128 operations work on memory and use %xmm0 and %xmm1 as scratch.
+   The SSE registers are not otherwise allocated by TCG and both of these
+   are call-clobbered in all host ABIs.  Unaligned moves are used because
+   guest vector registers in env are only guaranteed 8-byte alignment.  */
+static void tcg_out_v128(TCGContext *s, int opc, TCGReg base,
+                         tcg_target_long dofs, tcg_target_long aofs,
+                         tcg_target_long bofs)
+{
+    tcg_out_modrm_offset(s, OPC_MOVDQU_VxWx, 0, base, aofs);
+    tcg_out_modrm_offset(s, OPC_MOVDQU_VxWx, 1, base, bofs);
+    tcg_out_modrm(s, opc, 0, 1);
+    tcg_out_modrm_offset(s, OPC_MOVDQU_WxVx, 0, base, dofs);
+}
+
+static void tcg_out_shuf32_v128(TCGContext *s, TCGReg base,
+                                tcg_target_long dofs, tcg_target_long aofs,
+                                int imm)
+{
+    tcg_out_modrm_offset(s, OPC_MOVDQU_VxWx, 1, base, aofs);
+    tcg_out_modrm(s, OPC_PSHUFD, 0, 1);
+    tcg_out8(s, imm);
+    tcg_out_modrm_offset(s, OPC_MOVDQU_WxVx, 0, base, dofs);
+}
+#endif
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -2023,6 +2080,72 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+#if TCG_TARGET_HAS_v128
+    case INDEX_op_add8_v128:
+        c = OPC_PADDB;
+        goto gen_v128;
+    case INDEX_op_add16_v128:
+        c = OPC_PADDW;
+        goto gen_v128;
+    case INDEX_op_add32_v128:
+        c = OPC_PADDD;
+        goto gen_v128;
+    case INDEX_op_add64_v128:
+        c = OPC_PADDQ;
+        goto gen_v128;
+    case INDEX_op_sub8_v128:
+        c = OPC_PSUBB;
+        goto gen_v128;
+    case INDEX_op_sub16_v128:
+        c = OPC_PSUBW;
+        goto gen_v128;
+    case INDEX_op_sub32_v128:
+        c = OPC_PSUBD;
+        goto gen_v128;
+    case INDEX_op_sub64_v128:
+        c = OPC_PSUBQ;
+        goto gen_v128;
+    case INDEX_op_mul16_v128:
+        c = OPC_PMULLW;
+        goto gen_v128;
+    case INDEX_op_and_v128:
+        c = OPC_PAND;
+        goto gen_v128;
+    case INDEX_op_or_v128:
+        c = OPC_POR;
+        goto gen_v128;
+    case INDEX_op_xor_v128:
+        c = OPC_PXOR;
+        goto gen_v128;
+    case INDEX_op_cmpeq8_v128:
+        c = OPC_PCMPEQB;
+        goto gen_v128;
+    case INDEX_op_cmpeq16_v128:
+        c = OPC_PCMPEQW;
+        goto gen_v128;
+    case INDEX_op_cmpeq32_v128:
+        c = OPC_PCMPEQD;
+        goto gen_v128;
+    case INDEX_op_cmpgt8_v128:
+        c = OPC_PCMPGTB;
+        goto gen_v128;
+    case INDEX_op_cmpgt16_v128:
+        c = OPC_PCMPGTW;
+        goto gen_v128;
+    case INDEX_op_cmpgt32_v128:
+        c = OPC_PCMPGTD;
+    gen_v128:
+        tcg_out_v128(s, c, args[0], args[1], args[2], args[3]);
+        break;
+    case INDEX_op_andc_v128:
+        /* pandn inverts its destination operand.  */
+        tcg_out_v128(s, OPC_PANDN, args[0], args[1], args[3], args[2]);
+        break;
+    case INDEX_op_shuf32_v128:
+        tcg_out_shuf32_v128(s, args[0], args[1], args[2], args[3]);
+        break;
+#endif
+
     default:
         tcg_abort();
     }
@@ -2145,6 +2268,29 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_sub2_i64, { "r", "r", "0", "1", "re", "re" } },
 #endif
 
+#if TCG_TARGET_HAS_v128
+    { INDEX_op_add8_v128, { "r" } },
+    { INDEX_op_add16_v128, { "r" } },
+    { INDEX_op_add32_v128, { "r" } },
+    { INDEX_op_add64_v128, { "r" } },
+    { INDEX_op_sub8_v128, { "r" } },
+    { INDEX_op_sub16_v128, { "r" } },
+    { INDEX_op_sub32_v128, { "r" } },
+    { INDEX_op_sub64_v128, { "r" } },
+    { INDEX_op_mul16_v128, { "r" } },
+    { INDEX_op_and_v128, { "r" } },
+    { INDEX_op_andc_v128, { "r" } },
+    { INDEX_op_or_v128, { "r" } },
+    { INDEX_op_xor_v128, { "r" } },
+    { INDEX_op_cmpeq8_v128, { "r" } },
+    { INDEX_op_cmpeq16_v128, { "r" } },
+    { INDEX_op_cmpeq32_v128, { "r" } },
+    { INDEX_op_cmpgt8_v128, { "r" } },
+    { INDEX_op_cmpgt16_v128, { "r" } },
+    { INDEX_op_cmpgt32_v128, { "r" } },
+    { INDEX_op_shuf32_v128, { "r" } },
+#endif
+
 #if TCG_TARGET_REG_BITS == 64
     { INDEX_op_qemu_ld8u, { "r", "L" } },
     { INDEX_op_qemu_ld8s, { "r", "L" } },
@@ -96,6 +96,13 @@ typedef enum {
 #define TCG_TARGET_HAS_sub2_i32         1
 #define TCG_TARGET_HAS_mulu2_i32        1
 #define TCG_TARGET_HAS_muls2_i32        1
+/* SSE2 is architectural on x86_64; for 32-bit hosts rely on the compiler
+   having been told that it may be used.  */
+#if TCG_TARGET_REG_BITS == 64 || defined(__SSE2__)
+#define TCG_TARGET_HAS_v128             1
+#else
+#define TCG_TARGET_HAS_v128             0
+#endif
 
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_div2_i64         1
@@ -77,6 +77,20 @@ static void reset_all_temps(int nb_temps)
     }
 }
 
+/* Reset the temporaries that do not survive the end of a basic block.
+   Globals and local temps keep their value on the fall-through path of
+   a conditional branch, so what is known about them still holds there.  */
+static void reset_bb_temps(TCGContext *s, int nb_temps)
+{
+    int i;
+
+    for (i = s->nb_globals; i < nb_temps; i++) {
+        if (!s->temps[i].temp_local) {
+            reset_temp(i);
+        }
+    }
+}
+
 static int op_bits(TCGOpcode op)
 {
     const TCGOpDef *def = &tcg_op_defs[op];
@@ -1092,7 +1106,11 @@ static TCGArg *tcg_constant_folding(TCGContext *s, uint16_t *tcg_opc_ptr,
                We trash everything if the operation is the end of a basic
                block, otherwise we only trash the output args.  "mask" is
                the non-zero bits mask for the first output arg.  */
-            if (def->flags & TCG_OPF_BB_END) {
+            if (def->flags & TCG_OPF_COND_BRANCH) {
+                /* labels reset everything, so only the fall-through
+                   path, e.g. the rest of a trace, sees the globals */
+                reset_bb_temps(s, nb_temps);
+            } else if (def->flags & TCG_OPF_BB_END) {
                 reset_all_temps(nb_temps);
             } else {
                 for (i = 0; i < def->nb_oargs; i++) {
@@ -394,6 +394,9 @@ static inline void tcg_gen_helperN(void *func, int flags, int sizemask,
                                    TCGArg ret, int nargs, TCGArg *args)
 {
     TCGv_ptr fn;
+    if (tcg_ctx.nb_helper_globals) {
+        flags |= tcg_helper_globals_flags(func);
+    }
     fn = tcg_const_ptr(func);
     tcg_gen_callN(&tcg_ctx, fn, flags, sizemask, ret,
                   nargs, args);
@@ -2566,6 +2569,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
 #define tcg_global_mem_new tcg_global_mem_new_i32
+#define tcg_global_mask_tl tcg_global_mask_i32
 #define tcg_temp_local_new() tcg_temp_local_new_i32()
 #define tcg_temp_free tcg_temp_free_i32
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i32
@@ -2578,6 +2582,7 @@ static inline void tcg_gen_muls2_i64(TCGv_i64 rl, TCGv_i64 rh,
 #define tcg_temp_new() tcg_temp_new_i64()
 #define tcg_global_reg_new tcg_global_reg_new_i64
 #define tcg_global_mem_new tcg_global_mem_new_i64
+#define tcg_global_mask_tl tcg_global_mask_i64
 #define tcg_temp_local_new() tcg_temp_local_new_i64()
 #define tcg_temp_free tcg_temp_free_i64
 #define tcg_gen_qemu_ldst_op tcg_gen_op3i_i64
@@ -2979,3 +2984,105 @@ static inline void tcg_gen_qemu_st64(TCGv_i64 arg, TCGv addr, int mem_index)
                                                  TCGV_PTR_TO_NAT(A), (B))
 #define tcg_gen_ext_i32_ptr(R, A) tcg_gen_ext_i32_i64(TCGV_PTR_TO_NAT(R), (A))
 #endif /* TCG_TARGET_REG_BITS != 32 */
+
+/* 128-bit vector operations.  DOFS, AOFS and BOFS are the offsets from
+   BASE (normally cpu_env) of 16-byte vectors in memory; the operands may
+   alias only exactly, and must not overlap a TCG global.  Hosts without
+   vector support call out to tcg-runtime.c.  */
+static inline void tcg_gen_op_v128(TCGOpcode opc, void *helper, TCGv_ptr base,
+                                   tcg_target_long dofs, tcg_target_long aofs,
+                                   tcg_target_long bofs)
+{
+    if (TCG_TARGET_HAS_v128) {
+        *tcg_ctx.gen_opc_ptr++ = opc;
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(base);
+        *tcg_ctx.gen_opparam_ptr++ = dofs;
+        *tcg_ctx.gen_opparam_ptr++ = aofs;
+        *tcg_ctx.gen_opparam_ptr++ = bofs;
+    } else {
+        TCGv_ptr d = tcg_temp_new_ptr();
+        TCGv_ptr a = tcg_temp_new_ptr();
+        TCGv_ptr b = tcg_temp_new_ptr();
+        TCGArg args[3];
+        int sizemask = 0;
+
+        tcg_gen_addi_ptr(d, base, dofs);
+        tcg_gen_addi_ptr(a, base, aofs);
+        tcg_gen_addi_ptr(b, base, bofs);
+        args[0] = GET_TCGV_PTR(d);
+        args[1] = GET_TCGV_PTR(a);
+        args[2] = GET_TCGV_PTR(b);
+        sizemask |= tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+        sizemask |= tcg_gen_sizemask(2, TCG_TARGET_REG_BITS == 64, 0);
+        sizemask |= tcg_gen_sizemask(3, TCG_TARGET_REG_BITS == 64, 0);
+        tcg_gen_helperN(helper, TCG_CALL_NO_READ_GLOBALS, sizemask,
+                        TCG_CALL_DUMMY_ARG, 3, args);
+        tcg_temp_free_ptr(d);
+        tcg_temp_free_ptr(a);
+        tcg_temp_free_ptr(b);
+    }
+}
+
+#define TCG_GEN_V128(name)                                                \
+static inline void tcg_gen_##name##_v128(TCGv_ptr base, tcg_target_long d, \
+                                         tcg_target_long a,               \
+                                         tcg_target_long b)               \
+{                                                                         \
+    tcg_gen_op_v128(INDEX_op_##name##_v128, tcg_helper_##name##_v128,     \
+                    base, d, a, b);                                       \
+}
+
+TCG_GEN_V128(add8)
+TCG_GEN_V128(add16)
+TCG_GEN_V128(add32)
+TCG_GEN_V128(add64)
+TCG_GEN_V128(sub8)
+TCG_GEN_V128(sub16)
+TCG_GEN_V128(sub32)
+TCG_GEN_V128(sub64)
+TCG_GEN_V128(mul16)
+TCG_GEN_V128(and)
+TCG_GEN_V128(andc)
+TCG_GEN_V128(or)
+TCG_GEN_V128(xor)
+TCG_GEN_V128(cmpeq8)
+TCG_GEN_V128(cmpeq16)
+TCG_GEN_V128(cmpeq32)
+TCG_GEN_V128(cmpgt8)
+TCG_GEN_V128(cmpgt16)
+TCG_GEN_V128(cmpgt32)
+
+#undef TCG_GEN_V128
+
+/* Lane I of the result is lane (IMM >> (I * 2)) & 3 of A, with lanes
+   numbered in host memory order.  */
+static inline void tcg_gen_shuf32_v128(TCGv_ptr base, tcg_target_long dofs,
+                                       tcg_target_long aofs, int imm)
+{
+    if (TCG_TARGET_HAS_v128) {
+        *tcg_ctx.gen_opc_ptr++ = INDEX_op_shuf32_v128;
+        *tcg_ctx.gen_opparam_ptr++ = GET_TCGV_PTR(base);
+        *tcg_ctx.gen_opparam_ptr++ = dofs;
+        *tcg_ctx.gen_opparam_ptr++ = aofs;
+        *tcg_ctx.gen_opparam_ptr++ = imm & 0xff;
+    } else {
+        TCGv_ptr d = tcg_temp_new_ptr();
+        TCGv_ptr a = tcg_temp_new_ptr();
+        TCGv_i32 i = tcg_const_i32(imm & 0xff);
+        TCGArg args[3];
+        int sizemask = 0;
+
+        tcg_gen_addi_ptr(d, base, dofs);
+        tcg_gen_addi_ptr(a, base, aofs);
+        args[0] = GET_TCGV_PTR(d);
+        args[1] = GET_TCGV_PTR(a);
+        args[2] = GET_TCGV_I32(i);
+        sizemask |= tcg_gen_sizemask(1, TCG_TARGET_REG_BITS == 64, 0);
+        sizemask |= tcg_gen_sizemask(2, TCG_TARGET_REG_BITS == 64, 0);
+        tcg_gen_helperN(tcg_helper_shuf32_v128, TCG_CALL_NO_READ_GLOBALS,
+                        sizemask, TCG_CALL_DUMMY_ARG, 3, args);
+        tcg_temp_free_ptr(d);
+        tcg_temp_free_ptr(a);
+        tcg_temp_free_i32(i);
+    }
+}
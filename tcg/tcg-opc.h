@@ -85,13 +85,14 @@ DEF(rotl_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_rot_i32))
 DEF(rotr_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_rot_i32))
 DEF(deposit_i32, 1, 2, 2, IMPL(TCG_TARGET_HAS_deposit_i32))
 
-DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END)
+DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH)
 
 DEF(add2_i32, 2, 4, 0, IMPL(TCG_TARGET_HAS_add2_i32))
 DEF(sub2_i32, 2, 4, 0, IMPL(TCG_TARGET_HAS_sub2_i32))
 DEF(mulu2_i32, 2, 2, 0, IMPL(TCG_TARGET_HAS_mulu2_i32))
 DEF(muls2_i32, 2, 2, 0, IMPL(TCG_TARGET_HAS_muls2_i32))
-DEF(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | IMPL(TCG_TARGET_REG_BITS == 32))
+DEF(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH |
+    IMPL(TCG_TARGET_REG_BITS == 32))
 DEF(setcond2_i32, 1, 4, 1, IMPL(TCG_TARGET_REG_BITS == 32))
 
 DEF(ext8s_i32, 1, 1, 0, IMPL(TCG_TARGET_HAS_ext8s_i32))
@@ -145,7 +146,7 @@ DEF(rotl_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_rot_i64))
 DEF(rotr_i64, 1, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_rot_i64))
 DEF(deposit_i64, 1, 2, 2, IMPL64 | IMPL(TCG_TARGET_HAS_deposit_i64))
 
-DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | IMPL64)
+DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | IMPL64)
 DEF(ext8s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext8s_i64))
 DEF(ext16s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext16s_i64))
 DEF(ext32s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext32s_i64))
@@ -168,6 +169,32 @@ DEF(sub2_i64, 2, 4, 0, IMPL64 | IMPL(TCG_TARGET_HAS_sub2_i64))
 DEF(mulu2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_mulu2_i64))
 DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 
+/* 128-bit vector operations on memory.  The input is the base pointer
+   and the constant arguments are the byte offsets of the destination and
+   of the sources (the second source is an immediate for shuf32_v128).  */
+#define IMPLV128 (IMPL(TCG_TARGET_HAS_v128) | TCG_OPF_SIDE_EFFECTS)
+
+DEF(add8_v128, 0, 1, 3, IMPLV128)
+DEF(add16_v128, 0, 1, 3, IMPLV128)
+DEF(add32_v128, 0, 1, 3, IMPLV128)
+DEF(add64_v128, 0, 1, 3, IMPLV128)
+DEF(sub8_v128, 0, 1, 3, IMPLV128)
+DEF(sub16_v128, 0, 1, 3, IMPLV128)
+DEF(sub32_v128, 0, 1, 3, IMPLV128)
+DEF(sub64_v128, 0, 1, 3, IMPLV128)
+DEF(mul16_v128, 0, 1, 3, IMPLV128)
+DEF(and_v128, 0, 1, 3, IMPLV128)
+DEF(andc_v128, 0, 1, 3, IMPLV128)
+DEF(or_v128, 0, 1, 3, IMPLV128)
+DEF(xor_v128, 0, 1, 3, IMPLV128)
+DEF(cmpeq8_v128, 0, 1, 3, IMPLV128)
+DEF(cmpeq16_v128, 0, 1, 3, IMPLV128)
+DEF(cmpeq32_v128, 0, 1, 3, IMPLV128)
+DEF(cmpgt8_v128, 0, 1, 3, IMPLV128)
+DEF(cmpgt16_v128, 0, 1, 3, IMPLV128)
+DEF(cmpgt32_v128, 0, 1, 3, IMPLV128)
+DEF(shuf32_v128, 0, 1, 3, IMPLV128)
+
 /* QEMU specific */
 #if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
 DEF(debug_insn_start, 0, 0, 2, TCG_OPF_NOT_PRESENT)
@@ -251,4 +278,5 @@ DEF(qemu_st64, 0, 2, 1, TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)
 
 #undef IMPL
 #undef IMPL64
+#undef IMPLV128
 #undef DEF
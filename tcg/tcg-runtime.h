@@ -17,4 +17,25 @@ uint64_t tcg_helper_divu_i64(uint64_t arg1, uint64_t arg2);
 uint64_t tcg_helper_remu_i64(uint64_t arg1, uint64_t arg2);
 uint64_t tcg_helper_muluh_i64(uint64_t arg1, uint64_t arg2);
 
+void tcg_helper_add8_v128(void *d, void *a, void *b);
+void tcg_helper_add16_v128(void *d, void *a, void *b);
+void tcg_helper_add32_v128(void *d, void *a, void *b);
+void tcg_helper_add64_v128(void *d, void *a, void *b);
+void tcg_helper_sub8_v128(void *d, void *a, void *b);
+void tcg_helper_sub16_v128(void *d, void *a, void *b);
+void tcg_helper_sub32_v128(void *d, void *a, void *b);
+void tcg_helper_sub64_v128(void *d, void *a, void *b);
+void tcg_helper_mul16_v128(void *d, void *a, void *b);
+void tcg_helper_and_v128(void *d, void *a, void *b);
+void tcg_helper_andc_v128(void *d, void *a, void *b);
+void tcg_helper_or_v128(void *d, void *a, void *b);
+void tcg_helper_xor_v128(void *d, void *a, void *b);
+void tcg_helper_cmpeq8_v128(void *d, void *a, void *b);
+void tcg_helper_cmpeq16_v128(void *d, void *a, void *b);
+void tcg_helper_cmpeq32_v128(void *d, void *a, void *b);
+void tcg_helper_cmpgt8_v128(void *d, void *a, void *b);
+void tcg_helper_cmpgt16_v128(void *d, void *a, void *b);
+void tcg_helper_cmpgt32_v128(void *d, void *a, void *b);
+void tcg_helper_shuf32_v128(void *d, void *a, uint32_t imm);
+
 #endif
@@ -637,6 +637,59 @@ void tcg_register_helper(void *func, const char *name)
     s->nb_helpers++;
 }
 
+/* Declare that the helper 'func' only reads the globals in 'reads' and
+   only writes those in 'writes', built with tcg_global_mask_i32() and
+   friends.  The other globals can then stay in host registers across
+   calls to it.  The helper must not raise exceptions, which read all
+   the globals.  The TCG_CALL_NO_*_GLOBALS flags still apply.  */
+void tcg_set_helper_globals(void *func, uint64_t reads, uint64_t writes)
+{
+    TCGContext *s = &tcg_ctx;
+    TCGHelperGlobals *hg;
+
+    assert(s->nb_helper_globals < TCG_MAX_HELPER_GLOBALS);
+    hg = &s->helper_globals[s->nb_helper_globals++];
+    hg->func = (tcg_target_ulong)func;
+    /* a written global may be only partially written, so it must also
+       be synced first */
+    hg->writes = writes | (1ULL << 63);
+    hg->reads = reads | hg->writes;
+}
+
+int tcg_helper_globals_flags(void *func)
+{
+    TCGContext *s = &tcg_ctx;
+    int i;
+
+    for (i = 0; i < s->nb_helper_globals; i++) {
+        if (s->helper_globals[i].func == (tcg_target_ulong)func) {
+            return (i + 1) << TCG_CALL_GLOBALS_SHIFT;
+        }
+    }
+    return 0;
+}
+
+/* Return in 'reads' and 'writes' the globals that a helper call with
+   the given flags may access, in the format of TCGHelperGlobals.  */
+static void tcg_call_globals(TCGContext *s, int flags,
+                             uint64_t *reads, uint64_t *writes)
+{
+    int n = (flags & TCG_CALL_GLOBALS_MASK) >> TCG_CALL_GLOBALS_SHIFT;
+
+    *reads = flags & TCG_CALL_NO_READ_GLOBALS ? 0 : -1;
+    *writes = flags & (TCG_CALL_NO_READ_GLOBALS |
+                       TCG_CALL_NO_WRITE_GLOBALS) ? 0 : -1;
+    if (n) {
+        *reads &= s->helper_globals[n - 1].reads;
+        *writes &= s->helper_globals[n - 1].writes;
+    }
+}
+
+static inline bool tcg_global_in(uint64_t mask, int temp)
+{
+    return (mask >> MIN(temp, 63)) & 1;
+}
+
 /* Note: we convert the 64 bit args to 32 bit and do some alignment
    and endian swap. Maybe it would be better to do the alignment
    and endian swap in tcg_reg_alloc_call(). */
@@ -1237,6 +1290,25 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *dead_temps,
     }
 }
 
+/* liveness analysis: conditional branch: the code at the label expects
+   globals and local temps in memory, but they can stay live in
+   registers on the fall-through path.  Other temps are dead. */
+static inline void tcg_la_cond_branch(TCGContext *s, uint8_t *dead_temps,
+                                      uint8_t *mem_temps)
+{
+    int i;
+
+    memset(mem_temps, 1, s->nb_globals);
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            mem_temps[i] = 1;
+        } else {
+            dead_temps[i] = 1;
+            mem_temps[i] = 0;
+        }
+    }
+}
+
 /* Liveness analysis : update the opc_dead_args array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1270,6 +1342,7 @@ static void tcg_liveness_analysis(TCGContext *s)
         case INDEX_op_call:
             {
                 int call_flags;
+                uint64_t reads, writes;
 
                 nb_args = args[-1];
                 args -= nb_args;
@@ -1307,14 +1380,16 @@ static void tcg_liveness_analysis(TCGContext *s)
                         mem_temps[arg] = 0;
                     }
 
-                    if (!(call_flags & TCG_CALL_NO_READ_GLOBALS)) {
-                        /* globals should be synced to memory */
-                        memset(mem_temps, 1, s->nb_globals);
-                    }
-                    if (!(call_flags & (TCG_CALL_NO_WRITE_GLOBALS |
-                                        TCG_CALL_NO_READ_GLOBALS))) {
-                        /* globals should go back to memory */
-                        memset(dead_temps, 1, s->nb_globals);
+                    /* globals that the helper reads should be synced to
+                       memory, those it writes should go back to memory */
+                    tcg_call_globals(s, call_flags, &reads, &writes);
+                    for (i = 0; i < s->nb_globals; i++) {
+                        if (tcg_global_in(reads, i)) {
+                            mem_temps[i] = 1;
+                        }
+                        if (tcg_global_in(writes, i)) {
+                            dead_temps[i] = 1;
+                        }
                     }
 
                     /* input args are live */
@@ -1450,7 +1525,9 @@ static void tcg_liveness_analysis(TCGContext *s)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_cond_branch(s, dead_temps, mem_temps);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, dead_temps, mem_temps);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1584,6 +1661,20 @@ static void temp_allocate_frame(TCGContext *s, int temp)
     s->current_frame_offset += (tcg_target_long)sizeof(tcg_target_long);
 }
 
+/* load or store temporary 'ts' from or to its memory location; these
+   are counted for tcg_dump_info() */
+static inline void tcg_out_ld_temp(TCGContext *s, TCGTemp *ts, int reg)
+{
+    tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+    s->temp_ld_count++;
+}
+
+static inline void tcg_out_st_temp(TCGContext *s, TCGTemp *ts, int reg)
+{
+    tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+    s->temp_st_count++;
+}
+
 /* sync register 'reg' by saving it to the corresponding temporary */
 static inline void tcg_reg_sync(TCGContext *s, int reg)
 {
@@ -1597,7 +1688,7 @@ static inline void tcg_reg_sync(TCGContext *s, int reg)
         if (!ts->mem_allocated) {
             temp_allocate_frame(s, temp);
         }
-        tcg_out_st(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+        tcg_out_st_temp(s, ts, reg);
     }
     ts->mem_coherent = 1;
 }
@@ -1715,6 +1806,21 @@ static void save_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* sync a global or local temporary to its canonical location and
+   assume it can be read by the following code, while it stays live. */
+static inline void temp_sync_live(TCGContext *s, int temp,
+                                  TCGRegSet allocated_regs)
+{
+#ifdef USE_LIVENESS_ANALYSIS
+    /* The liveness analysis already ensures that it is synced. Keep an
+       assert for safety. */
+    assert(s->temps[temp].val_type != TEMP_VAL_REG ||
+           s->temps[temp].fixed_reg || s->temps[temp].mem_coherent);
+#else
+    temp_sync(s, temp, allocated_regs);
+#endif
+}
+
 /* sync globals to their canonical location and assume they can be
    read by the following code. 'allocated_regs' is used in case a
    temporary registers needs to be allocated to store a constant. */
@@ -1723,12 +1829,7 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     int i;
 
     for (i = 0; i < s->nb_globals; i++) {
-#ifdef USE_LIVENESS_ANALYSIS
-        assert(s->temps[i].val_type != TEMP_VAL_REG || s->temps[i].fixed_reg ||
-               s->temps[i].mem_coherent);
-#else
-        temp_sync(s, i, allocated_regs);
-#endif
+        temp_sync_live(s, i, allocated_regs);
     }
 }
 
@@ -1757,6 +1858,28 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* at a conditional branch, the code at the label expects globals and
+   local temporaries at their canonical location, but the fall-through
+   path can keep them in registers.  Other temporaries are dead. */
+static void tcg_reg_alloc_cond_branch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        if (s->temps[i].temp_local) {
+            temp_sync_live(s, i, allocated_regs);
+        } else {
+#ifdef USE_LIVENESS_ANALYSIS
+            assert(s->temps[i].val_type == TEMP_VAL_DEAD);
+#else
+            temp_dead(s, i);
+#endif
+        }
+    }
+
+    sync_globals(s, allocated_regs);
+}
+
 #define IS_DEAD_ARG(n) ((dead_args >> (n)) & 1)
 #define NEED_SYNC_ARG(n) ((sync_args >> (n)) & 1)
 
@@ -1810,7 +1933,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
         || ts->val_type == TEMP_VAL_MEM) {
         ts->reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
         if (ts->val_type == TEMP_VAL_MEM) {
-            tcg_out_ld(s, ts->type, ts->reg, ts->mem_reg, ts->mem_offset);
+            tcg_out_ld_temp(s, ts, ts->reg);
             ts->mem_coherent = 1;
         } else if (ts->val_type == TEMP_VAL_CONST) {
             tcg_out_movi(s, ts->type, ts->reg, ts->val);
@@ -1828,7 +1951,7 @@ static void tcg_reg_alloc_mov(TCGContext *s, const TCGOpDef *def,
         if (!ots->mem_allocated) {
             temp_allocate_frame(s, args[0]);
         }
-        tcg_out_st(s, ots->type, ts->reg, ots->mem_reg, ots->mem_offset);
+        tcg_out_st_temp(s, ots, ts->reg);
         if (IS_DEAD_ARG(1)) {
             temp_dead(s, args[1]);
         }
@@ -1899,7 +2022,7 @@ static void tcg_reg_alloc_op(TCGContext *s,
         ts = &s->temps[arg];
         if (ts->val_type == TEMP_VAL_MEM) {
             reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
-            tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+            tcg_out_ld_temp(s, ts, reg);
             ts->val_type = TEMP_VAL_REG;
             ts->reg = reg;
             ts->mem_coherent = 1;
@@ -1959,7 +2082,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cond_branch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2048,6 +2173,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     int const_func_arg, allocate_args;
     TCGRegSet allocated_regs;
     const TCGArgConstraint *arg_ct;
+    uint64_t reads, writes;
 
     arg = *args++;
 
@@ -2086,7 +2212,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
                                     s->reserved_regs);
                 /* XXX: not correct if reading values from the stack */
-                tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_out_ld_temp(s, ts, reg);
                 tcg_out_st(s, ts->type, reg, TCG_REG_CALL_STACK, stack_offset);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 reg = tcg_reg_alloc(s, tcg_target_available_regs[ts->type], 
@@ -2116,7 +2242,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
                     tcg_out_mov(s, ts->type, reg, ts->reg);
                 }
             } else if (ts->val_type == TEMP_VAL_MEM) {
-                tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+                tcg_out_ld_temp(s, ts, reg);
             } else if (ts->val_type == TEMP_VAL_CONST) {
                 /* XXX: sign extend ? */
                 tcg_out_movi(s, ts->type, reg, ts->val);
@@ -2135,7 +2261,7 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
     const_func_arg = 0;
     if (ts->val_type == TEMP_VAL_MEM) {
         reg = tcg_reg_alloc(s, arg_ct->u.regs, allocated_regs);
-        tcg_out_ld(s, ts->type, reg, ts->mem_reg, ts->mem_offset);
+        tcg_out_ld_temp(s, ts, reg);
         func_arg = reg;
         tcg_regset_set_reg(allocated_regs, reg);
     } else if (ts->val_type == TEMP_VAL_REG) {
@@ -2177,12 +2303,13 @@ static int tcg_reg_alloc_call(TCGContext *s, const TCGOpDef *def,
 
     /* Save globals if they might be written by the helper, sync them if
        they might be read. */
-    if (flags & TCG_CALL_NO_READ_GLOBALS) {
-        /* Nothing to do */
-    } else if (flags & TCG_CALL_NO_WRITE_GLOBALS) {
-        sync_globals(s, allocated_regs);
-    } else {
-        save_globals(s, allocated_regs);
+    tcg_call_globals(s, flags, &reads, &writes);
+    for (i = 0; i < s->nb_globals; i++) {
+        if (tcg_global_in(writes, i)) {
+            temp_save(s, i, allocated_regs);
+        } else if (tcg_global_in(reads, i)) {
+            temp_sync_live(s, i, allocated_regs);
+        }
     }
 
     tcg_out_op(s, opc, &func_arg, &const_func_arg);
@@ -2394,7 +2521,26 @@ int tcg_gen_code(TCGContext *s, uint8_t *gen_code_buf)
    Return -1 if not found. */
 int tcg_gen_code_search_pc(TCGContext *s, uint8_t *gen_code_buf, long offset)
 {
-    return tcg_gen_code_common(s, gen_code_buf, offset);
+    int64_t ld_count = s->temp_ld_count, st_count = s->temp_st_count;
+    int ret;
+
+    ret = tcg_gen_code_common(s, gen_code_buf, offset);
+    /* only count the code that is actually used */
+    s->temp_ld_count = ld_count;
+    s->temp_st_count = st_count;
+    return ret;
+}
+
+static void tcg_dump_ldst_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    TCGContext *s = &tcg_ctx;
+    int64_t n = s->guest_insn_count ? s->guest_insn_count : 1;
+
+    cpu_fprintf(f, "translated insns    %" PRId64 "\n", s->guest_insn_count);
+    cpu_fprintf(f, "temp loads/insn     %0.2f\n",
+                (double)s->temp_ld_count / n);
+    cpu_fprintf(f, "temp stores/insn    %0.2f\n",
+                (double)s->temp_st_count / n);
 }
 
 #ifdef CONFIG_PROFILER
@@ -2441,12 +2587,14 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 s->restore_count);
     cpu_fprintf(f, "  avg cycles        %0.1f\n",
                 s->restore_count ? (double)s->restore_time / s->restore_count : 0);
+    tcg_dump_ldst_info(f, cpu_fprintf);
 
     dump_op_count();
 }
 #else
 void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
 {
+    tcg_dump_ldst_info(f, cpu_fprintf);
     cpu_fprintf(f, "[TCG profiler not compiled]\n");
 }
 #endif
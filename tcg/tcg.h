@@ -292,6 +292,10 @@ typedef int TCGv_i64;
 #define TCG_CALL_NO_WRITE_GLOBALS   0x0020
 /* Helper can be safely suppressed if the return value is not used. */
 #define TCG_CALL_NO_SIDE_EFFECTS    0x0040
+/* Index + 1 of the globals declared for the helper with
+   tcg_set_helper_globals(), 0 if none.  Set by tcg_gen_helperN().  */
+#define TCG_CALL_GLOBALS_SHIFT      8
+#define TCG_CALL_GLOBALS_MASK       0xff00
 
 /* convenience version of most used call flags */
 #define TCG_CALL_NO_RWG         TCG_CALL_NO_READ_GLOBALS
@@ -398,6 +402,16 @@ typedef struct TCGHelperInfo {
     const char *name;
 } TCGHelperInfo;
 
+/* Globals that a helper may read and write.  Bit i stands for the global
+   with index i, bit 63 for all the globals from index 63 on.  */
+typedef struct TCGHelperGlobals {
+    tcg_target_ulong func;
+    uint64_t reads;
+    uint64_t writes;
+} TCGHelperGlobals;
+
+#define TCG_MAX_HELPER_GLOBALS 32
+
 typedef struct TCGContext TCGContext;
 
 struct TCGContext {
@@ -440,6 +454,14 @@ struct TCGContext {
     int allocated_helpers;
     int helpers_sorted;
 
+    TCGHelperGlobals helper_globals[TCG_MAX_HELPER_GLOBALS];
+    int nb_helper_globals;
+
+    /* code generation statistics, see tcg_dump_info() */
+    int64_t guest_insn_count;
+    int64_t temp_ld_count; /* host loads of temps from memory */
+    int64_t temp_st_count; /* host stores of temps to memory */
+
 #ifdef CONFIG_PROFILER
     /* profiling info */
     int64_t tb_count1;
@@ -599,6 +621,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: the following instruction is
+       in the same extended basic block.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -672,6 +697,23 @@ TCGArg *tcg_optimize(TCGContext *s, uint16_t *tcg_opc_ptr, TCGArg *args,
 
 /* only used for debugging purposes */
 void tcg_register_helper(void *func, const char *name);
+void tcg_set_helper_globals(void *func, uint64_t reads, uint64_t writes);
+int tcg_helper_globals_flags(void *func);
+
+static inline uint64_t tcg_global_mask_i32(TCGv_i32 t)
+{
+    return 1ULL << MIN(GET_TCGV_I32(t), 63);
+}
+
+static inline uint64_t tcg_global_mask_i64(TCGv_i64 t)
+{
+#if TCG_TARGET_REG_BITS == 32
+    /* the high half is the following global */
+    return 3ULL << MIN(GET_TCGV_I64(t), 62);
+#else
+    return 1ULL << MIN(GET_TCGV_I64(t), 63);
+#endif
+}
 const char *tcg_helper_get_name(TCGContext *s, void *func);
 void tcg_dump_ops(TCGContext *s);
 
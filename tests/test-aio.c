@@ -340,6 +340,105 @@ static void test_wait_event_notifier_noflush(void)
     event_notifier_cleanup(&data.e);
 }
 
+typedef struct {
+    EventNotifier e;
+    bool thread_acquired;
+} AcquireTestData;
+
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+static void dummy_notifier_read(EventNotifier *e)
+{
+    event_notifier_test_and_clear(e);
+}
+
+static void *test_acquire_thread(void *opaque)
+{
+    AcquireTestData *data = opaque;
+
+    /* Blocks until the main thread's aio_poll() is kicked and the context
+     * is released.
+     */
+    aio_context_acquire(ctx);
+    aio_context_release(ctx);
+
+    data->thread_acquired = true;
+    return NULL;
+}
+
+static bool event_poll_cb(EventNotifier *e)
+{
+    EventNotifierTestData *data = container_of(e, EventNotifierTestData, e);
+
+    /* Pretend that work shows up on the third check */
+    if (++data->n < 3) {
+        return false;
+    }
+    data->active = 0;
+    return true;
+}
+
+static void test_poll_event_notifier(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 1 };
+    uint64_t attempts = ctx->poll_attempts;
+    uint64_t successes = ctx->poll_successes;
+
+    aio_context_set_poll_params(ctx, 1000000000LL, 0, 0);
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, event_ready_cb, event_active_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, event_poll_cb);
+
+    /* Consume the aio_notify() calls, which would cut polling short */
+    g_assert(aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 0);
+
+    /* Skip the ramp up; the callback finds work without a wakeup */
+    ctx->poll_ns = ctx->poll_max_ns;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 3);
+    g_assert_cmpint(data.active, ==, 0);
+    g_assert_cmpint(ctx->poll_attempts, ==, attempts + 1);
+    g_assert_cmpint(ctx->poll_successes, ==, successes + 1);
+    g_assert_cmpint(ctx->poll_ns, ==, ctx->poll_max_ns);
+
+    aio_context_set_poll_params(ctx, 0, 0, 0);
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    g_assert(!aio_poll(ctx, false));
+    event_notifier_cleanup(&data.e);
+}
+
+static void test_acquire(void)
+{
+    QemuThread thread;
+    AcquireTestData data = { .thread_acquired = false };
+
+    /* An active dummy notifier makes aio_poll() block */
+    event_notifier_init(&data.e, false);
+    aio_set_event_notifier(ctx, &data.e, dummy_notifier_read, flush_true);
+
+    aio_context_acquire(ctx);
+    aio_context_acquire(ctx);
+    aio_context_release(ctx);
+
+    qemu_thread_create(&thread, test_acquire_thread,
+                       &data, QEMU_THREAD_JOINABLE);
+
+    /* The other thread kicks us out of aio_poll() */
+    g_assert(aio_poll(ctx, true));
+    g_assert(!data.thread_acquired);
+    aio_context_release(ctx);
+
+    qemu_thread_join(&thread);
+    g_assert(data.thread_acquired);
+
+    aio_set_event_notifier(ctx, &data.e, NULL, NULL);
+    event_notifier_cleanup(&data.e);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -648,6 +747,8 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/poll",              test_poll_event_notifier);
+    g_test_add_func("/aio/acquire",                 test_acquire);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
@@ -0,0 +1,129 @@
+/*
+ * Page cache unit tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include <glib.h>
+#include <string.h>
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 4096
+
+static uint8_t page[PAGE_SIZE];
+
+static void fill_page(uint64_t addr)
+{
+    memset(page, (uint8_t)(addr / PAGE_SIZE), PAGE_SIZE);
+}
+
+static void test_insert_lookup(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint64_t hits, misses;
+    uint8_t *data;
+
+    g_assert(cache);
+    g_assert(!cache_is_cached(cache, 0));
+
+    fill_page(3 * PAGE_SIZE);
+    cache_insert(cache, 3 * PAGE_SIZE, page);
+    g_assert(cache_is_cached(cache, 3 * PAGE_SIZE));
+
+    data = get_cached_data(cache, 3 * PAGE_SIZE);
+    g_assert(data);
+    g_assert(memcmp(data, page, PAGE_SIZE) == 0);
+    g_assert(get_cached_data(cache, 4 * PAGE_SIZE) == NULL);
+
+    cache_get_stats(cache, &hits, &misses);
+    g_assert_cmpint(hits, ==, 1);
+    g_assert_cmpint(misses, ==, 1);
+
+    cache_get_set_stats(cache, 3 % cache_get_num_sets(cache), &hits, &misses);
+    g_assert_cmpint(hits, ==, 1);
+    g_assert_cmpint(misses, ==, 0);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    int64_t num_sets = cache_get_num_sets(cache);
+    int ways = 64 / num_sets;
+    uint64_t addr;
+    int i;
+
+    /* fill set 0 */
+    for (i = 0; i < ways; i++) {
+        addr = i * num_sets * PAGE_SIZE;
+        fill_page(addr);
+        cache_insert(cache, addr, page);
+    }
+
+    /* make the oldest page the most recently used one */
+    g_assert(cache_is_cached(cache, 0));
+
+    /* the second page inserted is evicted now */
+    addr = ways * num_sets * PAGE_SIZE;
+    fill_page(addr);
+    cache_insert(cache, addr, page);
+
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_is_cached(cache, addr));
+    g_assert(!cache_is_cached(cache, num_sets * PAGE_SIZE));
+    for (i = 2; i < ways; i++) {
+        g_assert(cache_is_cached(cache, i * num_sets * PAGE_SIZE));
+    }
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(64, PAGE_SIZE);
+    uint64_t addr, hits, misses;
+    int i;
+
+    for (i = 0; i < 64; i++) {
+        addr = i * PAGE_SIZE;
+        fill_page(addr);
+        cache_insert(cache, addr, page);
+    }
+
+    g_assert_cmpint(cache_resize(cache, 256), ==, 256);
+    for (i = 0; i < 64; i++) {
+        addr = i * PAGE_SIZE;
+        fill_page(addr);
+        g_assert(cache_is_cached(cache, addr));
+        g_assert(memcmp(get_cached_data(cache, addr), page, PAGE_SIZE) == 0);
+    }
+
+    g_assert(!cache_is_cached(cache, 64 * PAGE_SIZE));
+
+    /* shrinking keeps the most recently used pages and the statistics */
+    g_assert_cmpint(cache_resize(cache, 16), ==, 16);
+    for (i = 48; i < 64; i++) {
+        addr = i * PAGE_SIZE;
+        fill_page(addr);
+        g_assert(memcmp(get_cached_data(cache, addr), page, PAGE_SIZE) == 0);
+    }
+    cache_get_stats(cache, &hits, &misses);
+    g_assert_cmpint(hits, ==, 64);
+    g_assert_cmpint(misses, ==, 1);
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/insert-lookup", test_insert_lookup);
+    g_test_add_func("/page-cache/lru", test_lru);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
@@ -0,0 +1,242 @@
+/*
+ * qcow2 L2/refcount table cache unit tests and lookup benchmark.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+
+/* Small tables keep the memory footprint of the large caches down */
+#define TEST_CLUSTER_BITS   MIN_CLUSTER_BITS
+#define TEST_CLUSTER_SIZE   (1 << TEST_CLUSTER_BITS)
+
+typedef struct {
+    BlockDriverState bs;
+    BDRVQcowState s;
+    Qcow2Cache *c;
+} CacheTestState;
+
+static CacheTestState *cache_test_init(int num_tables)
+{
+    CacheTestState *t = g_malloc0(sizeof(*t));
+
+    t->s.cluster_bits = TEST_CLUSTER_BITS;
+    t->s.cluster_size = TEST_CLUSTER_SIZE;
+    t->bs.opaque = &t->s;
+
+    t->c = qcow2_cache_create(&t->bs, num_tables);
+    t->s.l2_table_cache = t->c;
+
+    return t;
+}
+
+static void cache_test_cleanup(CacheTestState *t)
+{
+    qcow2_cache_destroy(&t->bs, t->c);
+    g_free(t);
+}
+
+/* Loads the table at cluster index @n without reading from the image */
+static void *cache_test_get(CacheTestState *t, uint64_t n)
+{
+    void *table;
+    int ret;
+
+    ret = qcow2_cache_get_empty(&t->bs, t->c, n << TEST_CLUSTER_BITS, &table);
+    g_assert_cmpint(ret, ==, 0);
+    g_assert(table != NULL);
+
+    return table;
+}
+
+static void cache_test_touch(CacheTestState *t, uint64_t n)
+{
+    void *table = cache_test_get(t, n);
+    qcow2_cache_put(&t->bs, t->c, &table);
+    g_assert(table == NULL);
+}
+
+static BlockMetadataCacheStats *cache_test_stats(CacheTestState *t)
+{
+    return qcow2_cache_get_stats(&t->s, t->c);
+}
+
+static void test_hit_miss(void)
+{
+    CacheTestState *t = cache_test_init(4);
+    BlockMetadataCacheStats *stats;
+    uint8_t *table;
+    int i;
+
+    for (i = 1; i <= 4; i++) {
+        table = cache_test_get(t, i);
+        memset(table, i, TEST_CLUSTER_SIZE);
+        qcow2_cache_put(&t->bs, t->c, (void **) &table);
+    }
+
+    /* Cached tables keep their contents */
+    for (i = 1; i <= 4; i++) {
+        table = cache_test_get(t, i);
+        g_assert_cmpint(table[0], ==, i);
+        g_assert_cmpint(table[TEST_CLUSTER_SIZE - 1], ==, i);
+        qcow2_cache_put(&t->bs, t->c, (void **) &table);
+    }
+
+    stats = cache_test_stats(t);
+    g_assert_cmpstr(stats->name, ==, "l2");
+    g_assert_cmpint(stats->entries, ==, 4);
+    g_assert_cmpint(stats->size, ==, 4 * TEST_CLUSTER_SIZE);
+    g_assert_cmpint(stats->misses, ==, 4);
+    g_assert_cmpint(stats->hits, ==, 4);
+    g_assert_cmpint(stats->evictions, ==, 0);
+    qapi_free_BlockMetadataCacheStats(stats);
+
+    cache_test_cleanup(t);
+}
+
+static void test_lru(void)
+{
+    CacheTestState *t = cache_test_init(4);
+    BlockMetadataCacheStats *stats;
+    int i;
+
+    for (i = 1; i <= 4; i++) {
+        cache_test_touch(t, i);
+    }
+
+    /* Table 1 becomes the most recently used one, so 2 is replaced by 5 */
+    cache_test_touch(t, 1);
+    cache_test_touch(t, 5);
+
+    stats = cache_test_stats(t);
+    g_assert_cmpint(stats->misses, ==, 5);
+    g_assert_cmpint(stats->evictions, ==, 1);
+    qapi_free_BlockMetadataCacheStats(stats);
+
+    cache_test_touch(t, 1);
+    cache_test_touch(t, 3);
+    cache_test_touch(t, 4);
+    cache_test_touch(t, 5);
+
+    stats = cache_test_stats(t);
+    g_assert_cmpint(stats->misses, ==, 5);
+    g_assert_cmpint(stats->hits, ==, 5);
+    qapi_free_BlockMetadataCacheStats(stats);
+
+    cache_test_touch(t, 2);
+
+    stats = cache_test_stats(t);
+    g_assert_cmpint(stats->misses, ==, 6);
+    g_assert_cmpint(stats->evictions, ==, 2);
+    qapi_free_BlockMetadataCacheStats(stats);
+
+    cache_test_cleanup(t);
+}
+
+static void test_referenced_not_replaced(void)
+{
+    CacheTestState *t = cache_test_init(4);
+    BlockMetadataCacheStats *stats;
+    void *tables[3];
+    int i;
+
+    /* Tables 1-3 stay in use, so 4-9 must all share the remaining entry */
+    for (i = 0; i < 3; i++) {
+        tables[i] = cache_test_get(t, i + 1);
+    }
+    for (i = 4; i < 10; i++) {
+        cache_test_touch(t, i);
+    }
+    for (i = 0; i < 3; i++) {
+        void *table = cache_test_get(t, i + 1);
+
+        g_assert(table == tables[i]);
+        qcow2_cache_put(&t->bs, t->c, &table);
+        qcow2_cache_put(&t->bs, t->c, &tables[i]);
+    }
+
+    stats = cache_test_stats(t);
+    g_assert_cmpint(stats->hits, ==, 3);
+    g_assert_cmpint(stats->misses, ==, 9);
+    g_assert_cmpint(stats->evictions, ==, 5);
+    qapi_free_BlockMetadataCacheStats(stats);
+
+    cache_test_cleanup(t);
+}
+
+/*
+ * Lookup benchmark
+ */
+
+static void perf_lookup(void)
+{
+    unsigned int num_tables, i, idx, max;
+    double duration;
+
+    max = 10000000;
+
+    for (num_tables = 16; num_tables <= 65536; num_tables *= 4) {
+        CacheTestState *t = cache_test_init(num_tables);
+
+        for (i = 0; i < num_tables; i++) {
+            cache_test_touch(t, i + 1);
+        }
+
+        /* i * 7919 would wrap around before the end of the loop */
+        idx = 0;
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            cache_test_touch(t, idx + 1);
+            idx = (idx + 7919) % num_tables;
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("Lookup with %u tables, %u iterations: %f s "
+                       "(%f ns per lookup)\n", num_tables, max, duration,
+                       duration * 1e9 / max);
+
+        cache_test_cleanup(t);
+    }
+}
+
+static void perf_replace(void)
+{
+    unsigned int num_tables, i, max;
+    double duration;
+
+    max = 10000000;
+
+    for (num_tables = 16; num_tables <= 65536; num_tables *= 4) {
+        CacheTestState *t = cache_test_init(num_tables);
+
+        /* Every lookup misses and replaces the least recently used table */
+        g_test_timer_start();
+        for (i = 0; i < max; i++) {
+            cache_test_touch(t, i + 1);
+        }
+        duration = g_test_timer_elapsed();
+
+        g_test_message("Replace with %u tables, %u iterations: %f s "
+                       "(%f ns per replacement)\n", num_tables, max, duration,
+                       duration * 1e9 / max);
+
+        cache_test_cleanup(t);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2-cache/hit-miss", test_hit_miss);
+    g_test_add_func("/qcow2-cache/lru", test_lru);
+    g_test_add_func("/qcow2-cache/referenced", test_referenced_not_replaced);
+    if (g_test_perf()) {
+        g_test_add_func("/qcow2-cache/perf/lookup", perf_lookup);
+        g_test_add_func("/qcow2-cache/perf/replace", perf_replace);
+    }
+    return g_test_run();
+}
@@ -0,0 +1,94 @@
+/*
+ * Test the generic 128-bit vector helpers of TCG
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include <stdint.h>
+#include <string.h>
+#include "qemu/osdep.h"
+#include "tcg/tcg-runtime.h"
+
+static void test_add(void)
+{
+    uint8_t a[16], b[16], d[16];
+    uint64_t a64[2] = { 0xffffffffffffffffULL, 1 };
+    uint64_t b64[2] = { 1, 0x7fffffffffffffffULL };
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        a[i] = 0xf0 + i;
+        b[i] = 0x20;
+    }
+    tcg_helper_add8_v128(d, a, b);
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpuint(d[i], ==, (uint8_t)(0x110 + i));
+    }
+
+    tcg_helper_add64_v128(a64, a64, b64);
+    g_assert_cmpuint(a64[0], ==, 0);
+    g_assert_cmpuint(a64[1], ==, 0x8000000000000000ULL);
+}
+
+static void test_mul16(void)
+{
+    uint16_t a[8] = { 0, 1, 2, 0x100, 0x8000, 0xffff, 0xffff, 0x1234 };
+    uint16_t b[8] = { 7, 0xffff, 0x8000, 0x100, 2, 2, 0xffff, 0x5678 };
+    uint16_t d[8];
+    int i;
+
+    tcg_helper_mul16_v128(d, a, b);
+    for (i = 0; i < 8; i++) {
+        g_assert_cmpuint(d[i], ==, (uint16_t)((uint32_t)a[i] * b[i]));
+    }
+    g_assert_cmpuint(d[6], ==, 1);
+
+    /* operands may alias the destination */
+    tcg_helper_mul16_v128(a, a, a);
+    g_assert_cmpuint(a[5], ==, 1);
+    g_assert_cmpuint(a[4], ==, 0);
+}
+
+static void test_cmp(void)
+{
+    int8_t a[16], b[16], d[16];
+    int i;
+
+    for (i = 0; i < 16; i++) {
+        a[i] = i - 8;
+        b[i] = 0;
+    }
+    tcg_helper_cmpgt8_v128(d, a, b);
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpint(d[i], ==, i > 8 ? -1 : 0);
+    }
+    tcg_helper_cmpeq8_v128(d, a, b);
+    for (i = 0; i < 16; i++) {
+        g_assert_cmpint(d[i], ==, i == 8 ? -1 : 0);
+    }
+}
+
+static void test_shuf32(void)
+{
+    uint32_t a[4] = { 10, 11, 12, 13 };
+
+    /* reverse the lanes in place */
+    tcg_helper_shuf32_v128(a, a, 0x1b);
+    g_assert_cmpuint(a[0], ==, 13);
+    g_assert_cmpuint(a[1], ==, 12);
+    g_assert_cmpuint(a[2], ==, 11);
+    g_assert_cmpuint(a[3], ==, 10);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/tcg-runtime/v128/add", test_add);
+    g_test_add_func("/tcg-runtime/v128/mul16", test_mul16);
+    g_test_add_func("/tcg-runtime/v128/cmp", test_cmp);
+    g_test_add_func("/tcg-runtime/v128/shuf32", test_shuf32);
+    return g_test_run();
+}
@@ -179,6 +179,109 @@ static void test_encode_decode(void)
     }
 }
 
+/* Changes about @percent percent of the page in runs of up to 64 bytes */
+static void dirty_page(uint8_t *page, int percent)
+{
+    int left = PAGE_SIZE * percent / 100;
+    int offset, len;
+
+    while (left > 0) {
+        offset = g_test_rand_int_range(0, PAGE_SIZE);
+        len = g_test_rand_int_range(1, 65);
+        len = MIN(len, PAGE_SIZE - offset);
+        len = MIN(len, left);
+        memset(page + offset, g_test_rand_int_range(1, 256), len);
+        left -= len;
+    }
+}
+
+static void test_encode_accel(void)
+{
+    uint8_t *old_page = g_malloc0(PAGE_SIZE);
+    uint8_t *new_page = g_malloc0(PAGE_SIZE);
+    uint8_t *expected = g_malloc(PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int i, n, dlen, expected_len;
+
+    for (i = 0; i < 1000; i++) {
+        memcpy(new_page, old_page, PAGE_SIZE);
+        dirty_page(new_page, g_test_rand_int_range(0, 60));
+
+        /* every implementation must produce the same stream */
+        g_assert(xbzrle_select_accel(0));
+        expected_len = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                            expected, PAGE_SIZE);
+        for (n = 1; xbzrle_select_accel(n); n++) {
+            dlen = xbzrle_encode_buffer(old_page, new_page, PAGE_SIZE,
+                                        compressed, PAGE_SIZE);
+            g_assert_cmpint(dlen, ==, expected_len);
+            if (dlen > 0) {
+                g_assert(memcmp(compressed, expected, dlen) == 0);
+            }
+        }
+
+        if (expected_len > 0) {
+            g_assert_cmpint(xbzrle_decode_buffer(expected, expected_len,
+                                                 old_page, PAGE_SIZE),
+                            <=, PAGE_SIZE);
+        }
+        g_assert(memcmp(old_page, new_page, PAGE_SIZE) == 0 ||
+                 expected_len == -1);
+        memcpy(old_page, new_page, PAGE_SIZE);
+    }
+
+    xbzrle_select_accel(0);
+
+    g_free(old_page);
+    g_free(new_page);
+    g_free(expected);
+    g_free(compressed);
+}
+
+static void perf_encode(void)
+{
+    const int num_pages = 256;
+    const int iterations = 200;
+    static const int percents[] = { 0, 1, 5, 25 };
+    uint8_t *old_pages = g_malloc0(num_pages * PAGE_SIZE);
+    uint8_t *new_pages = g_malloc0(num_pages * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    double duration;
+    int i, j, n, p;
+
+    for (p = 0; p < ARRAY_SIZE(percents); p++) {
+        memcpy(new_pages, old_pages, num_pages * PAGE_SIZE);
+        for (i = 0; i < num_pages; i++) {
+            dirty_page(new_pages + i * PAGE_SIZE, percents[p]);
+        }
+
+        for (n = 0; xbzrle_select_accel(n); n++) {
+            g_test_timer_start();
+            for (j = 0; j < iterations; j++) {
+                for (i = 0; i < num_pages; i++) {
+                    xbzrle_encode_buffer(old_pages + i * PAGE_SIZE,
+                                         new_pages + i * PAGE_SIZE, PAGE_SIZE,
+                                         compressed, PAGE_SIZE);
+                }
+            }
+            duration = g_test_timer_elapsed();
+
+            g_test_message("Encode %s, %d%% dirty: %f s "
+                           "(%.0f pages/s, %.1f MB/s)\n",
+                           xbzrle_accel_name(), percents[p], duration,
+                           num_pages * iterations / duration,
+                           num_pages * iterations * (PAGE_SIZE / 1e6)
+                           / duration);
+        }
+    }
+
+    xbzrle_select_accel(0);
+
+    g_free(old_pages);
+    g_free(new_pages);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +294,10 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf/encode", perf_encode);
+    }
 
     return g_test_run();
 }
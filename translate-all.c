@@ -54,11 +54,16 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "exec/memory-internal.h"
+#include "sysemu/cpus.h"
 #endif
 
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/thread.h"
+#include "qemu/tls.h"
+#include "qemu/error-report.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -121,10 +126,66 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+unsigned int tcg_trace_threshold;
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
 
+#if defined(CONFIG_USER_ONLY)
+void tb_lock(void)
+{
+    spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+}
+
+void tb_unlock(void)
+{
+    spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+}
+
+void tb_lock_reset(void)
+{
+}
+
+/* linux-user serializes invalidation with mmap_lock(), which tb_link_page()
+   already takes inside tb_lock; do not nest the other way round.  */
+#define tb_lock_sys()   do { } while (0)
+#define tb_unlock_sys() do { } while (0)
+#else
+/* With multi-threaded TCG every vCPU thread translates and invalidates
+   code, and device emulation may invalidate it from the iothread.  The
+   lock nests so that the public entry points below can take it whether
+   or not they are reached from cpu_exec()'s own locked region.  */
+static QemuMutex tb_mutex;
+static DEFINE_TLS(int, tb_lock_count);
+
+void tb_lock(void)
+{
+    if (tls_var(tb_lock_count)++ == 0) {
+        qemu_mutex_lock(&tb_mutex);
+    }
+}
+
+void tb_unlock(void)
+{
+    assert(tls_var(tb_lock_count) > 0);
+    if (--tls_var(tb_lock_count) == 0) {
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+void tb_lock_reset(void)
+{
+    if (tls_var(tb_lock_count)) {
+        tls_var(tb_lock_count) = 0;
+        qemu_mutex_unlock(&tb_mutex);
+    }
+}
+
+#define tb_lock_sys()   tb_lock()
+#define tb_unlock_sys() tb_unlock()
+#endif
+
 void cpu_gen_init(void)
 {
     tcg_context_init(&tcg_ctx); 
@@ -174,6 +235,7 @@ int cpu_gen_code(CPUArchState *env, TranslationBlock *tb, int *gen_code_size_ptr
 #endif
     gen_code_size = tcg_gen_code(s, gen_code_buf);
     *gen_code_size_ptr = gen_code_size;
+    s->guest_insn_count += tb->icount;
 #ifdef CONFIG_PROFILER
     s->code_time += profile_getclock();
     s->code_in_len += tb->size;
@@ -252,11 +314,14 @@ bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
 
+    tb_lock_sys();
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(tb, env, retaddr);
+        tb_unlock_sys();
         return true;
     }
+    tb_unlock_sys();
     return false;
 }
 
@@ -449,6 +514,89 @@ static inline PageDesc *page_find(tb_page_addr_t index)
 # define USE_MMAP
 #endif
 
+/* The persistent translation cache reuses host code as is, so it needs
+   the code buffer back at the same address (hence mmap) and the same
+   build of QEMU, loaded at the same address.  */
+#if !defined(CONFIG_USER_ONLY) && defined(TARGET_SUPPORTS_TB_CACHE) && \
+    defined(USE_MMAP) && defined(__linux__)
+# define USE_TB_CACHE
+
+#include <sys/personality.h>
+#ifdef CONFIG_GETAUXVAL
+#include <sys/auxv.h>
+#include "elf.h"
+#endif
+
+#define TB_CACHE_MAGIC    "QEMUTBC"
+#define TB_CACHE_VERSION  2
+
+/* File layout: this header, a TBCacheRegion per region, the tbs array,
+   the guest code hash of each TB and, page aligned, the code buffer.  */
+struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t tb_size;
+    /* the executable that generated the code: its build ID or, if it was
+       linked without one, the file itself */
+    uint8_t build_id[32];
+    uint32_t build_id_len;
+    uint32_t padding0;
+    uint64_t exe_dev;
+    uint64_t exe_ino;
+    uint64_t exe_size;
+    uint64_t exe_mtime;
+    uint64_t exe_text;
+    /* the configuration the code was generated for */
+    uint64_t key_hash;
+    uint32_t icount;
+    uint32_t mttcg;
+    uint32_t singlestep;
+    uint32_t padding1;
+    /* FNV-1a of the regions, tbs, hashes and the used part of the code */
+    uint64_t checksum;
+    /* layout of the translation buffers */
+    uint64_t code_gen_buffer;
+    uint64_t code_gen_buffer_size;
+    uint64_t tbs;
+    uint32_t max_blocks;
+    uint32_t nb_regions;
+    uint64_t region_size;
+    uint32_t cur_region;
+    uint32_t padding;
+    uint64_t regions_offset;
+    uint64_t tbs_offset;
+    uint64_t hash_offset;
+    uint64_t code_offset;
+    /* the prologue stolen from the end of the code buffer */
+    uint8_t prologue[1024];
+};
+
+typedef struct TBCacheRegion {
+    uint64_t used;
+    uint32_t nb_tbs;
+    uint32_t padding;
+} TBCacheRegion;
+
+static struct {
+    char *path;
+    bool readonly;
+    /* the file that was opened, and its header if it is usable */
+    int fd;
+    struct TBCacheHeader *header;
+    /* guest code hash of each dormant TB, 0 for all other TBs */
+    uint64_t *code_hash;
+    /* dormant TBs, chained through phys_hash_next */
+    TranslationBlock **index;
+    unsigned int index_bits;
+    int dormant;
+    /* statistics */
+    int loaded;
+    int hits;
+    int stale;
+    uint64_t key_hash;
+} tb_cache = { .fd = -1 };
+#endif
+
 /* Minimum size of the code gen buffer.  This number is randomly chosen,
    but not so small that we can't have a fair number of TB's live.  */
 #define MIN_CODE_GEN_BUFFER_SIZE     (1024u * 1024)
@@ -539,6 +687,13 @@ static inline void *alloc_code_gen_buffer(void)
     start = 0x90000000ul;
 # endif
 
+#ifdef USE_TB_CACHE
+    /* Try to get the buffer where the cached code was generated.  */
+    if (tb_cache.header) {
+        start = tb_cache.header->code_gen_buffer;
+    }
+#endif
+
     buf = mmap((void *)start, tcg_ctx.code_gen_buffer_size,
                PROT_WRITE | PROT_READ | PROT_EXEC, flags, -1, 0);
     return buf == MAP_FAILED ? NULL : buf;
@@ -555,6 +710,665 @@ static inline void *alloc_code_gen_buffer(void)
 }
 #endif /* USE_STATIC_CODE_GEN_BUFFER, USE_MMAP */
 
+struct TBRegion {
+    uint8_t *start;
+    /* end of the generated code; only valid when not the current region */
+    uint8_t *end;
+    /* the region's TBs are tbs[first_tb, first_tb + nb_tbs), sorted by
+       tc_ptr */
+    int first_tb;
+    int nb_tbs;
+};
+
+/* size of each region and per-region limits, see tb_regions_init() */
+static size_t tb_region_size;
+static size_t tb_region_max_size;
+static int tb_region_max_blocks;
+
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t reserve = TCG_MAX_OP_SIZE * OPC_BUF_SIZE;
+    int i, n;
+
+    /* Each region must leave room for a good number of TBs after the
+       space reserved for the largest one.  */
+    n = CODE_GEN_REGIONS;
+    while (n > 1 && tcg_ctx.code_gen_buffer_size / n < 4 * reserve) {
+        n /= 2;
+    }
+    tb_region_size = (tcg_ctx.code_gen_buffer_size / n) &
+                     ~(size_t)(CODE_GEN_ALIGN - 1);
+    tb_region_max_size = tb_region_size - reserve;
+    tb_region_max_blocks = tcg_ctx.code_gen_max_blocks / n;
+
+    ctx->nb_regions = n;
+    ctx->cur_region = 0;
+    ctx->regions = g_new0(TBRegion, n);
+    for (i = 0; i < n; i++) {
+        ctx->regions[i].start = tcg_ctx.code_gen_buffer + i * tb_region_size;
+        ctx->regions[i].end = ctx->regions[i].start;
+        ctx->regions[i].first_tb = i * tb_region_max_blocks;
+    }
+}
+
+static inline uint8_t *tb_region_end(TBRegion *r)
+{
+    if (r == &tcg_ctx.tb_ctx.regions[tcg_ctx.tb_ctx.cur_region]) {
+        return tcg_ctx.code_gen_ptr;
+    }
+    return r->end;
+}
+
+#ifdef USE_TB_CACHE
+#define TB_CACHE_HASH_SEED 0xcbf29ce484222325ULL
+
+/* FNV-1a */
+static uint64_t tb_cache_hash_bytes(uint64_t h, const uint8_t *p, size_t len)
+{
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint64_t tb_cache_code_hash(TranslationBlock *tb,
+                                   tb_page_addr_t phys_pc,
+                                   tb_page_addr_t phys_page2)
+{
+    size_t len;
+    uint64_t h;
+
+    len = MIN(tb->size, TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK));
+    h = tb_cache_hash_bytes(TB_CACHE_HASH_SEED, qemu_get_ram_ptr(phys_pc),
+                            len);
+    if (phys_page2 != -1) {
+        h = tb_cache_hash_bytes(h, qemu_get_ram_ptr(phys_page2),
+                                tb->size - len);
+    }
+    /* 0 marks TBs that are not dormant */
+    return h ? h : 1;
+}
+
+static inline TranslationBlock **tb_cache_bucket(TranslationBlock *tb)
+{
+    tb_page_addr_t phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    uint32_t h = tb_hash_func(phys_pc, tb->pc, tb->flags);
+
+    return &tb_cache.index[h & ((1u << tb_cache.index_bits) - 1)];
+}
+
+/* Forget about a dormant TB whose region is being evicted.  */
+static void tb_cache_forget(TranslationBlock *tb)
+{
+    int n = tb - tcg_ctx.tb_ctx.tbs;
+    TranslationBlock **ptb;
+
+    if (!tb_cache.dormant || !tb_cache.code_hash[n]) {
+        return;
+    }
+    for (ptb = tb_cache_bucket(tb); *ptb; ptb = &(*ptb)->phys_hash_next) {
+        if (*ptb == tb) {
+            *ptb = tb->phys_hash_next;
+            break;
+        }
+    }
+    tb_cache.code_hash[n] = 0;
+    tb_cache.dormant--;
+}
+
+static void tb_cache_flush(void)
+{
+    if (!tb_cache.dormant) {
+        return;
+    }
+    memset(tb_cache.index, 0,
+           sizeof(TranslationBlock *) << tb_cache.index_bits);
+    memset(tb_cache.code_hash, 0,
+           tcg_ctx.code_gen_max_blocks * sizeof(uint64_t));
+    tb_cache.dormant = 0;
+}
+
+/* Breakpoints are compiled into the translated code, and inserting one
+   only invalidates live TBs.  Check whether any CPU has a breakpoint on
+   the pages of a dormant TB, which then must be translated again.  */
+static bool tb_cache_has_breakpoint(target_ulong pc, target_ulong virt_page2)
+{
+    CPUState *cpu;
+    CPUBreakpoint *bp;
+
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        CPUArchState *env = cpu->env_ptr;
+
+        QTAILQ_FOREACH(bp, &env->breakpoints, entry) {
+            target_ulong page = bp->pc & TARGET_PAGE_MASK;
+
+            if (page == (pc & TARGET_PAGE_MASK) || page == virt_page2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/* Look for a dormant TB loaded from the cache file and bring it back to
+   life if the guest code it was translated from has not changed.  Called
+   with tb_lock held.  */
+static TranslationBlock *tb_cache_revive(CPUArchState *env, target_ulong pc,
+                                         target_ulong cs_base, int flags,
+                                         tb_page_addr_t phys_pc)
+{
+    TranslationBlock *tb, **ptb;
+    tb_page_addr_t phys_page2;
+    target_ulong virt_page2;
+    uint32_t h;
+    int n;
+
+    if (!tb_cache.dormant) {
+        return NULL;
+    }
+    h = tb_hash_func(phys_pc, pc, flags);
+    ptb = &tb_cache.index[h & ((1u << tb_cache.index_bits) - 1)];
+    for (; (tb = *ptb) != NULL; ptb = &tb->phys_hash_next) {
+        if (tb->pc == pc && tb->cs_base == cs_base && tb->flags == flags &&
+            tb->page_addr[0] == (phys_pc & TARGET_PAGE_MASK)) {
+            break;
+        }
+    }
+    if (!tb) {
+        return NULL;
+    }
+
+    virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
+    phys_page2 = -1;
+    if ((pc & TARGET_PAGE_MASK) != virt_page2) {
+        phys_page2 = get_page_addr_code(env, virt_page2);
+    }
+
+    n = tb - tcg_ctx.tb_ctx.tbs;
+    *ptb = tb->phys_hash_next;
+    tb_cache.dormant--;
+    if (tb->page_addr[1] != phys_page2 ||
+        tb_cache_has_breakpoint(pc, virt_page2) ||
+        tb_cache_code_hash(tb, phys_pc, phys_page2) !=
+        tb_cache.code_hash[n]) {
+        tb_cache.code_hash[n] = 0;
+        tb_cache.stale++;
+        return NULL;
+    }
+    tb_cache.code_hash[n] = 0;
+    tb_cache.hits++;
+
+    tb->invalid = false;
+    tb->exec_count = 0;
+    tb->exit_count[0] = tb->exit_count[1] = 0;
+    tb_link_page(tb, phys_pc, phys_page2);
+    return tb;
+}
+
+#ifdef CONFIG_GETAUXVAL
+#ifndef NT_GNU_BUILD_ID
+#define NT_GNU_BUILD_ID 3
+#endif
+
+#if HOST_LONG_BITS == 64
+typedef Elf64_Phdr TBCachePhdr;
+#else
+typedef Elf32_Phdr TBCachePhdr;
+#endif
+
+/* Copy the GNU build ID of the executable to 'hdr', if it has one.  */
+static void tb_cache_build_id(struct TBCacheHeader *hdr)
+{
+    const TBCachePhdr *phdr = (const TBCachePhdr *)getauxval(AT_PHDR);
+    int phnum = getauxval(AT_PHNUM);
+    const uint8_t *p, *end, *desc;
+    const Elf32_Nhdr *nh;
+    uintptr_t base = 0;
+    int i;
+
+    if (!phdr) {
+        return;
+    }
+    for (i = 0; i < phnum; i++) {
+        if (phdr[i].p_type == PT_PHDR) {
+            base = (uintptr_t)phdr - phdr[i].p_vaddr;
+        }
+    }
+    for (i = 0; i < phnum; i++) {
+        if (phdr[i].p_type != PT_NOTE) {
+            continue;
+        }
+        p = (const uint8_t *)(base + phdr[i].p_vaddr);
+        end = p + phdr[i].p_memsz;
+        while (p + sizeof(*nh) <= end) {
+            nh = (const Elf32_Nhdr *)p;
+            desc = p + sizeof(*nh) + ROUND_UP(nh->n_namesz, 4);
+            if (nh->n_type == NT_GNU_BUILD_ID && nh->n_namesz == 4 &&
+                !memcmp(p + sizeof(*nh), "GNU", 4) &&
+                nh->n_descsz <= sizeof(hdr->build_id) &&
+                desc + nh->n_descsz <= end) {
+                memcpy(hdr->build_id, desc, nh->n_descsz);
+                hdr->build_id_len = nh->n_descsz;
+                return;
+            }
+            p = desc + ROUND_UP(nh->n_descsz, 4);
+        }
+    }
+}
+#else
+static void tb_cache_build_id(struct TBCacheHeader *hdr)
+{
+}
+#endif
+
+static bool tb_cache_identity(struct TBCacheHeader *hdr)
+{
+    struct stat st;
+
+    memset(hdr, 0, sizeof(*hdr));
+    memcpy(hdr->magic, TB_CACHE_MAGIC, sizeof(hdr->magic));
+    hdr->version = TB_CACHE_VERSION;
+    hdr->tb_size = sizeof(TranslationBlock);
+    tb_cache_build_id(hdr);
+    if (!hdr->build_id_len) {
+        if (stat("/proc/self/exe", &st) < 0) {
+            return false;
+        }
+        hdr->exe_dev = st.st_dev;
+        hdr->exe_ino = st.st_ino;
+        hdr->exe_size = st.st_size;
+        hdr->exe_mtime = st.st_mtime;
+    }
+    /* helpers are called by absolute address */
+    hdr->exe_text = (uintptr_t)tcg_exec_init;
+    /* -singlestep ends every TB after one instruction */
+    hdr->singlestep = singlestep;
+    return true;
+}
+
+#ifdef PIE
+/* A position independent executable only loads at the same address
+   again if address space randomization is disabled.  */
+static bool tb_cache_randomized(void)
+{
+    char buf[4] = "";
+    int fd;
+
+    if (personality(0xffffffff) & ADDR_NO_RANDOMIZE) {
+        return false;
+    }
+    fd = open("/proc/sys/kernel/randomize_va_space", O_RDONLY);
+    if (fd < 0) {
+        return true;
+    }
+    if (read(fd, buf, sizeof(buf) - 1) < 0) {
+        buf[0] = 0;
+    }
+    close(fd);
+    return buf[0] != '0';
+}
+#endif
+
+/* Offsets of the parts of the file for the current translation buffers */
+static void tb_cache_layout(struct TBCacheHeader *hdr)
+{
+    hdr->regions_offset = sizeof(*hdr);
+    hdr->tbs_offset = hdr->regions_offset +
+        tcg_ctx.tb_ctx.nb_regions * sizeof(TBCacheRegion);
+    hdr->hash_offset = hdr->tbs_offset +
+        tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock);
+    hdr->code_offset = ROUND_UP(hdr->hash_offset +
+        tcg_ctx.code_gen_max_blocks * sizeof(uint64_t), getpagesize());
+}
+
+/* Set up the persistent translation cache in 'path'.  This must be called
+   before tcg_exec_init(), so that the translation buffers can be placed
+   where the cached code expects them.  A missing or stale file is not an
+   error, it is rewritten by tb_cache_save() unless 'readonly'.  The file
+   is executed, so it must belong to the user or root and must not be
+   writable by anybody else.  */
+int tb_cache_open(const char *path, bool readonly)
+{
+    struct TBCacheHeader *hdr, id;
+    struct stat st;
+
+#ifdef PIE
+    if (tb_cache_randomized()) {
+        error_report("tb-cache: a position independent QEMU needs address "
+                     "space randomization disabled, e.g. with 'setarch -R'");
+        return -1;
+    }
+#endif
+
+    tb_cache.path = g_strdup(path);
+    tb_cache.readonly = readonly;
+    tb_cache.fd = qemu_open(path, O_RDONLY);
+    if (tb_cache.fd < 0) {
+        if (errno == ENOENT && !readonly) {
+            return 0;
+        }
+        error_report("tb-cache: cannot open '%s': %s", path, strerror(errno));
+        return -1;
+    }
+    if (fstat(tb_cache.fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        (st.st_uid != geteuid() && st.st_uid != 0) ||
+        (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        error_report("tb-cache: '%s' must be a regular file owned by the "
+                     "user or root and not writable by others", path);
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+        return -1;
+    }
+
+    hdr = g_new(struct TBCacheHeader, 1);
+    if (pread(tb_cache.fd, hdr, sizeof(*hdr), 0) != sizeof(*hdr) ||
+        !tb_cache_identity(&id) ||
+        memcmp(hdr->magic, id.magic, sizeof(id.magic)) ||
+        hdr->version != id.version || hdr->tb_size != id.tb_size ||
+        hdr->build_id_len != id.build_id_len ||
+        memcmp(hdr->build_id, id.build_id, sizeof(id.build_id)) ||
+        hdr->exe_dev != id.exe_dev || hdr->exe_ino != id.exe_ino ||
+        hdr->exe_size != id.exe_size || hdr->exe_mtime != id.exe_mtime ||
+        hdr->exe_text != id.exe_text || hdr->singlestep != id.singlestep) {
+        g_free(hdr);
+        close(tb_cache.fd);
+        tb_cache.fd = -1;
+        return 0;
+    }
+    tb_cache.header = hdr;
+    return 0;
+}
+
+/* Fill the translation buffers from the cache file.  The TBs stay
+   dormant until tb_gen_code() asks for them and the guest code still
+   hashes to the same value.  'key' identifies the machine and CPU
+   model, which affect translation without being part of the TB flags.  */
+void tb_cache_load(const char *key)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    struct TBCacheHeader *hdr = tb_cache.header;
+    struct TBCacheHeader layout;
+    TBCacheRegion *cr;
+    TranslationBlock *tb;
+    struct stat st;
+    uint64_t h;
+    uint8_t *map;
+    int i, j;
+
+    if (!tb_cache.path) {
+        return;
+    }
+    tb_cache.key_hash = tb_cache_hash_bytes(TB_CACHE_HASH_SEED,
+                                            (const uint8_t *)key,
+                                            strlen(key));
+    if (!hdr) {
+        return;
+    }
+    tb_cache_layout(&layout);
+    if (hdr->key_hash != tb_cache.key_hash ||
+        hdr->icount != !!use_icount ||
+        hdr->mttcg != qemu_tcg_mttcg_enabled() ||
+        hdr->code_gen_buffer != (uintptr_t)tcg_ctx.code_gen_buffer ||
+        hdr->code_gen_buffer_size != tcg_ctx.code_gen_buffer_size ||
+        hdr->tbs != (uintptr_t)ctx->tbs ||
+        hdr->max_blocks != tcg_ctx.code_gen_max_blocks ||
+        hdr->nb_regions != ctx->nb_regions ||
+        hdr->region_size != tb_region_size ||
+        hdr->cur_region >= ctx->nb_regions ||
+        hdr->regions_offset != layout.regions_offset ||
+        hdr->tbs_offset != layout.tbs_offset ||
+        hdr->hash_offset != layout.hash_offset ||
+        hdr->code_offset != layout.code_offset ||
+        !tb_cache.code_hash ||
+        memcmp(hdr->prologue, tcg_ctx.code_gen_prologue,
+               sizeof(hdr->prologue)) ||
+        fstat(tb_cache.fd, &st) < 0 ||
+        st.st_size < hdr->code_offset + hdr->code_gen_buffer_size) {
+        goto out;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, tb_cache.fd, 0);
+    if (map == MAP_FAILED) {
+        goto out;
+    }
+
+    /* Reject a truncated or damaged file before running any of it */
+    cr = (TBCacheRegion *)(map + hdr->regions_offset);
+    h = tb_cache_hash_bytes(TB_CACHE_HASH_SEED, map + hdr->regions_offset,
+                            hdr->hash_offset - hdr->regions_offset +
+                            tcg_ctx.code_gen_max_blocks * sizeof(uint64_t));
+    for (i = 0; i < ctx->nb_regions; i++) {
+        if (cr[i].used > tb_region_size ||
+            cr[i].nb_tbs > tb_region_max_blocks) {
+            break;
+        }
+        h = tb_cache_hash_bytes(h, map + hdr->code_offset +
+                                i * tb_region_size, cr[i].used);
+    }
+    if (i < ctx->nb_regions || h != hdr->checksum) {
+        munmap(map, st.st_size);
+        goto out;
+    }
+
+    tb_lock();
+    memcpy(ctx->tbs, map + hdr->tbs_offset,
+           tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    memcpy(tb_cache.code_hash, map + hdr->hash_offset,
+           tcg_ctx.code_gen_max_blocks * sizeof(uint64_t));
+
+    tb_cache.index_bits = CODE_GEN_PHYS_HASH_BITS;
+    tb_cache.index = g_new0(TranslationBlock *, 1u << tb_cache.index_bits);
+    ctx->nb_tbs = 0;
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        memcpy(r->start, map + hdr->code_offset + (r->start -
+               tcg_ctx.code_gen_buffer), cr[i].used);
+        flush_icache_range((uintptr_t)r->start,
+                           (uintptr_t)r->start + cr[i].used);
+        r->end = r->start + cr[i].used;
+        r->nb_tbs = cr[i].nb_tbs;
+        ctx->nb_tbs += r->nb_tbs;
+
+        for (j = r->first_tb; j < r->first_tb + tb_region_max_blocks; j++) {
+            tb = &ctx->tbs[j];
+            if (j >= r->first_tb + r->nb_tbs) {
+                tb_cache.code_hash[j] = 0;
+                continue;
+            }
+            tb->invalid = true;
+            tb->phys_hash_next = NULL;
+            tb->page_next[0] = tb->page_next[1] = NULL;
+            tb->jmp_next[0] = tb->jmp_next[1] = NULL;
+            tb->jmp_first = (TranslationBlock *)((uintptr_t)tb | 2);
+            if (tb_cache.code_hash[j]) {
+                TranslationBlock **bucket = tb_cache_bucket(tb);
+
+                tb->phys_hash_next = *bucket;
+                *bucket = tb;
+                tb_cache.dormant++;
+            }
+        }
+    }
+    ctx->cur_region = hdr->cur_region;
+    tcg_ctx.code_gen_ptr = ctx->regions[ctx->cur_region].end;
+    tb_cache.loaded = tb_cache.dormant;
+    tb_unlock();
+    munmap(map, st.st_size);
+
+out:
+    close(tb_cache.fd);
+    tb_cache.fd = -1;
+    g_free(tb_cache.header);
+    tb_cache.header = NULL;
+}
+
+/* Write the translation buffers to the cache file, for the next run to
+   pick up.  No vCPU may be running.  */
+void tb_cache_save(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    struct TBCacheHeader hdr;
+    TBCacheRegion *cr;
+    TranslationBlock *tb;
+    CPUState *cpu;
+    uint64_t *hash;
+    char *tmp;
+    size_t size;
+    bool ok;
+    int fd, i, j;
+
+    if (!tb_cache.path || tb_cache.readonly || !tb_cache.code_hash ||
+        !tb_cache_identity(&hdr)) {
+        return;
+    }
+    /* Code translated for the debugger's single-stepping is no use later */
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        if (cpu->singlestep_enabled) {
+            return;
+        }
+    }
+    tmp = g_strdup_printf("%s.%d", tb_cache.path, (int)getpid());
+    fd = qemu_open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        error_report("tb-cache: cannot create '%s': %s", tmp, strerror(errno));
+        g_free(tmp);
+        return;
+    }
+
+    tb_lock();
+    hdr.key_hash = tb_cache.key_hash;
+    hdr.icount = !!use_icount;
+    hdr.mttcg = qemu_tcg_mttcg_enabled();
+    hdr.code_gen_buffer = (uintptr_t)tcg_ctx.code_gen_buffer;
+    hdr.code_gen_buffer_size = tcg_ctx.code_gen_buffer_size;
+    hdr.tbs = (uintptr_t)ctx->tbs;
+    hdr.max_blocks = tcg_ctx.code_gen_max_blocks;
+    hdr.nb_regions = ctx->nb_regions;
+    hdr.region_size = tb_region_size;
+    hdr.cur_region = ctx->cur_region;
+    tb_cache_layout(&hdr);
+    memcpy(hdr.prologue, tcg_ctx.code_gen_prologue, sizeof(hdr.prologue));
+
+    /* Dormant TBs keep the hash they were loaded with, the others get
+       the hash of their guest code.  Only plain TBs are worth keeping.  */
+    hash = g_memdup(tb_cache.code_hash,
+                    tcg_ctx.code_gen_max_blocks * sizeof(uint64_t));
+    cr = g_new0(TBCacheRegion, ctx->nb_regions);
+    for (i = 0; i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        cr[i].used = tb_region_end(r) - r->start;
+        cr[i].nb_tbs = r->nb_tbs;
+        for (j = r->first_tb; j < r->first_tb + r->nb_tbs; j++) {
+            tb = &ctx->tbs[j];
+            if (!tb->invalid && tb->cflags == 0) {
+                hash[j] = tb_cache_code_hash(tb, tb->page_addr[0] +
+                                             (tb->pc & ~TARGET_PAGE_MASK),
+                                             tb->page_addr[1]);
+            }
+        }
+    }
+
+    size = tcg_ctx.code_gen_max_blocks * sizeof(uint64_t);
+    hdr.checksum = tb_cache_hash_bytes(TB_CACHE_HASH_SEED, (uint8_t *)cr,
+                                       ctx->nb_regions * sizeof(*cr));
+    hdr.checksum = tb_cache_hash_bytes(hdr.checksum, (uint8_t *)ctx->tbs,
+                                       hdr.hash_offset - hdr.tbs_offset);
+    hdr.checksum = tb_cache_hash_bytes(hdr.checksum, (uint8_t *)hash, size);
+    for (i = 0; i < ctx->nb_regions; i++) {
+        hdr.checksum = tb_cache_hash_bytes(hdr.checksum,
+                                           ctx->regions[i].start, cr[i].used);
+    }
+    ok = qemu_write_full(fd, &hdr, sizeof(hdr)) == sizeof(hdr) &&
+         qemu_write_full(fd, cr, ctx->nb_regions * sizeof(*cr)) ==
+         ctx->nb_regions * sizeof(*cr) &&
+         qemu_write_full(fd, ctx->tbs, hdr.hash_offset - hdr.tbs_offset) ==
+         hdr.hash_offset - hdr.tbs_offset &&
+         qemu_write_full(fd, hash, size) == size;
+    for (i = 0; ok && i < ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        ok = lseek(fd, hdr.code_offset + (r->start - tcg_ctx.code_gen_buffer),
+                   SEEK_SET) != (off_t)-1 &&
+             qemu_write_full(fd, r->start, cr[i].used) == cr[i].used;
+    }
+    ok = ok && ftruncate(fd, hdr.code_offset +
+                         tcg_ctx.code_gen_buffer_size) == 0;
+    tb_unlock();
+
+    if (close(fd) < 0) {
+        ok = false;
+    }
+    if (!ok || rename(tmp, tb_cache.path) < 0) {
+        error_report("tb-cache: cannot write '%s': %s", tb_cache.path,
+                     strerror(errno));
+        unlink(tmp);
+    }
+    g_free(cr);
+    g_free(hash);
+    g_free(tmp);
+}
+
+static TranslationBlock *tbs_alloc(int nb_tbs)
+{
+    void *hint = NULL;
+    void *tbs;
+
+    if (!tb_cache.path) {
+        return g_malloc(nb_tbs * sizeof(TranslationBlock));
+    }
+    /* exit_tb embeds TB addresses in the code, so they must not move */
+    if (tb_cache.header) {
+        hint = (void *)(uintptr_t)tb_cache.header->tbs;
+    }
+    tbs = mmap(hint, nb_tbs * sizeof(TranslationBlock),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (tbs == MAP_FAILED) {
+        return g_malloc(nb_tbs * sizeof(TranslationBlock));
+    }
+    tb_cache.code_hash = g_new0(uint64_t, nb_tbs);
+    return tbs;
+}
+#else
+int tb_cache_open(const char *path, bool readonly)
+{
+    error_report("tb-cache is not supported for this target or host");
+    return -1;
+}
+
+void tb_cache_load(const char *key)
+{
+}
+
+void tb_cache_save(void)
+{
+}
+
+static inline void tb_cache_forget(TranslationBlock *tb)
+{
+}
+
+static inline void tb_cache_flush(void)
+{
+}
+
+static inline TranslationBlock *tb_cache_revive(CPUArchState *env,
+                                                target_ulong pc,
+                                                target_ulong cs_base,
+                                                int flags,
+                                                tb_page_addr_t phys_pc)
+{
+    return NULL;
+}
+
+static TranslationBlock *tbs_alloc(int nb_tbs)
+{
+    return g_malloc(nb_tbs * sizeof(TranslationBlock));
+}
+#endif /* USE_TB_CACHE */
+
 static inline void code_gen_alloc(size_t tb_size)
 {
     tcg_ctx.code_gen_buffer_size = size_code_gen_buffer(tb_size);
@@ -580,8 +1394,141 @@ static inline void code_gen_alloc(size_t tb_size)
         (TCG_MAX_OP_SIZE * OPC_BUF_SIZE);
     tcg_ctx.code_gen_max_blocks = tcg_ctx.code_gen_buffer_size /
             CODE_GEN_AVG_BLOCK_SIZE;
-    tcg_ctx.tb_ctx.tbs =
-            g_malloc(tcg_ctx.code_gen_max_blocks * sizeof(TranslationBlock));
+    tcg_ctx.tb_ctx.tbs = tbs_alloc(tcg_ctx.code_gen_max_blocks);
+    tb_regions_init();
+}
+
+struct TBHashTable {
+    unsigned int bits;
+    /* number of TBs in the table */
+    size_t count;
+    TBHashTable *retired_next;
+    TranslationBlock *buckets[];
+};
+
+static TBHashTable *tb_htable_new(unsigned int bits)
+{
+    TBHashTable *ht;
+
+    ht = g_malloc0(sizeof(*ht) + (sizeof(TranslationBlock *) << bits));
+    ht->bits = bits;
+    return ht;
+}
+
+static inline TranslationBlock **tb_htable_bucket(TBHashTable *ht,
+                                                  tb_page_addr_t phys_pc,
+                                                  target_ulong pc,
+                                                  uint64_t flags)
+{
+    uint32_t h = tb_hash_func(phys_pc, pc, flags);
+
+    return &ht->buckets[h & ((1u << ht->bits) - 1)];
+}
+
+/* Move every TB to a table twice as large.  Readers still walking the old
+   table may follow links into the new one and miss a TB; that is harmless
+   because a failed lookup is always retried under tb_lock.  The old table
+   is kept until a tb_flush that no lookup can run concurrently with.  */
+static void tb_htable_grow(void)
+{
+    TBHashTable *old = tcg_ctx.tb_ctx.htable;
+    TBHashTable *ht = tb_htable_new(old->bits + 1);
+    TranslationBlock *tb, *next, **ptb;
+    size_t i;
+
+    for (i = 0; i < (1u << old->bits); i++) {
+        for (tb = old->buckets[i]; tb != NULL; tb = next) {
+            next = tb->phys_hash_next;
+            ptb = tb_htable_bucket(ht, tb->page_addr[0] +
+                                   (tb->pc & ~TARGET_PAGE_MASK),
+                                   tb->pc, tb->flags);
+            tb->phys_hash_next = *ptb;
+            *ptb = tb;
+        }
+    }
+    ht->count = old->count;
+    smp_wmb();
+    tcg_ctx.tb_ctx.htable = ht;
+
+    old->retired_next = tcg_ctx.tb_ctx.htable_retired;
+    tcg_ctx.tb_ctx.htable_retired = old;
+    tcg_ctx.tb_ctx.tb_hash_resize_count++;
+}
+
+static void tb_htable_insert(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TBHashTable *ht = tcg_ctx.tb_ctx.htable;
+    TranslationBlock **ptb;
+
+    ptb = tb_htable_bucket(ht, phys_pc, tb->pc, tb->flags);
+    tb->phys_hash_next = *ptb;
+    /* make the TB visible to concurrent lookups only once it is complete */
+    smp_wmb();
+    *ptb = tb;
+    if (++ht->count > (1u << ht->bits) &&
+        ht->bits < CODE_GEN_PHYS_HASH_MAX_BITS) {
+        tb_htable_grow();
+    }
+}
+
+static void tb_htable_remove(TranslationBlock *tb, tb_page_addr_t phys_pc)
+{
+    TBHashTable *ht = tcg_ctx.tb_ctx.htable;
+    TranslationBlock **ptb, *tb1;
+
+    ptb = tb_htable_bucket(ht, phys_pc, tb->pc, tb->flags);
+    for (;;) {
+        tb1 = *ptb;
+        if (tb1 == tb) {
+            *ptb = tb1->phys_hash_next;
+            break;
+        }
+        ptb = &tb1->phys_hash_next;
+    }
+    ht->count--;
+}
+
+/* Find the TB for (pc, cs_base, flags) at the physical address pc maps to.
+   Does not need tb_lock: the result can only be a false miss, which the
+   caller must confirm under the lock before translating.  */
+TranslationBlock *tb_htable_lookup(CPUArchState *env, target_ulong pc,
+                                   target_ulong cs_base, uint64_t flags)
+{
+    TBHashTable *ht;
+    TranslationBlock *tb;
+    tb_page_addr_t phys_pc, phys_page1, phys_page2;
+    target_ulong virt_page2;
+    unsigned int steps = 0;
+
+    phys_pc = get_page_addr_code(env, pc);
+    phys_page1 = phys_pc & TARGET_PAGE_MASK;
+
+    ht = atomic_read(&tcg_ctx.tb_ctx.htable);
+    smp_read_barrier_depends();
+    tb = atomic_read(tb_htable_bucket(ht, phys_pc, pc, flags));
+    for (; tb != NULL; tb = atomic_read(&tb->phys_hash_next)) {
+        smp_read_barrier_depends();
+        steps++;
+        if (tb->pc == pc &&
+            tb->page_addr[0] == phys_page1 &&
+            tb->cs_base == cs_base &&
+            tb->flags == flags &&
+            !tb->invalid) {
+            /* check next page if needed */
+            if (tb->page_addr[1] == -1) {
+                break;
+            }
+            virt_page2 = (pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE;
+            phys_page2 = get_page_addr_code(env, virt_page2);
+            if (tb->page_addr[1] == phys_page2) {
+                break;
+            }
+        }
+    }
+    /* statistics only; updates from parallel vCPUs may be lost */
+    tcg_ctx.tb_ctx.tb_hash_lookups++;
+    tcg_ctx.tb_ctx.tb_hash_lookup_steps += steps;
+    return tb;
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -591,6 +1538,10 @@ void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
+    tcg_ctx.tb_ctx.htable = tb_htable_new(CODE_GEN_PHYS_HASH_BITS);
+#if !defined(CONFIG_USER_ONLY)
+    qemu_mutex_init(&tb_mutex);
+#endif
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
     page_init();
@@ -606,32 +1557,42 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has too many translation blocks or too much generated
+   code; the caller must then move on to the next region.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks ||
-        (tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer) >=
-         tcg_ctx.code_gen_buffer_max_size) {
+    if (r->nb_tbs >= tb_region_max_blocks ||
+        (tcg_ctx.code_gen_ptr - r->start) >= tb_region_max_size) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &ctx->tbs[r->first_tb + r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    tb->invalid = false;
+    tb->exec_count = 0;
+    tb->exit_count[0] = tb->exit_count[1] = 0;
+    tb->trace_path = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (r->nb_tbs > 0 && tb == &ctx->tbs[r->first_tb + r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -677,51 +1638,114 @@ static void page_flush_tb(void)
     }
 }
 
-/* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUArchState *env1)
+/* Empty the jump cache of a CPU.  If only a few slots were set since the
+   last clear, only those are reset.  */
+void tb_jmp_cache_clear(CPUArchState *env)
 {
+    int i;
+
+    if (env->tb_jmp_cache_count > TB_JMP_CACHE_LOG) {
+        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+    } else {
+        for (i = 0; i < env->tb_jmp_cache_count; i++) {
+            env->tb_jmp_cache[env->tb_jmp_cache_log[i]] = NULL;
+        }
+    }
+    env->tb_jmp_cache_count = 0;
+}
+
+/* set by tb_flush() when the flush has to wait for an exclusive section */
+static int tb_flush_full_pending;
+
+/* flush all the translation blocks; no vCPU may be executing translated
+   code while this runs */
+/* XXX: linux-user does not guarantee this */
+/* If 'exclusive' is false, other threads may still be inside
+   tb_htable_lookup(), so no hash table can be freed.  */
+static void do_tb_flush(CPUArchState *env1, bool exclusive)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     CPUState *cpu;
+    int i;
 
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
-           tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.tb_ctx.nb_tbs > 0 ?
-           ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)) /
-           tcg_ctx.tb_ctx.nb_tbs : 0);
+    printf("qemu: flush nb_tbs=%d regions=%d\n", ctx->nb_tbs, ctx->nb_regions);
 #endif
+    tb_lock_sys();
     if ((unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer)
         > tcg_ctx.code_gen_buffer_size) {
         cpu_abort(env1, "Internal error: code buffer overflow\n");
     }
-    tcg_ctx.tb_ctx.nb_tbs = 0;
+    ctx->nb_tbs = 0;
+    for (i = 0; i < ctx->nb_regions; i++) {
+        ctx->regions[i].nb_tbs = 0;
+        ctx->regions[i].end = ctx->regions[i].start;
+    }
+    ctx->cur_region = 0;
 
     for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
         CPUArchState *env = cpu->env_ptr;
 
-        memset(env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof(void *));
+        tb_jmp_cache_clear(env);
     }
 
-    memset(tcg_ctx.tb_ctx.tb_phys_hash, 0,
-            CODE_GEN_PHYS_HASH_SIZE * sizeof(void *));
+    /* Free the old tables only if nobody can be walking them.  Otherwise
+       the current table keeps its size, so that retired tables do not
+       pile up across flushes.  */
+    while (exclusive && ctx->htable_retired) {
+        TBHashTable *ht = ctx->htable_retired;
+
+        ctx->htable_retired = ht->retired_next;
+        g_free(ht);
+    }
+    if (exclusive && ctx->htable->bits > CODE_GEN_PHYS_HASH_BITS) {
+        g_free(ctx->htable);
+        ctx->htable = tb_htable_new(CODE_GEN_PHYS_HASH_BITS);
+    } else {
+        memset(ctx->htable->buckets, 0,
+               sizeof(TranslationBlock *) << ctx->htable->bits);
+        ctx->htable->count = 0;
+    }
     page_flush_tb();
+    tb_cache_flush();
 
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    ctx->tb_flush_count++;
+    tb_unlock_sys();
+}
+
+/* flush all the translation blocks */
+void tb_flush(CPUArchState *env1)
+{
+#if !defined(CONFIG_USER_ONLY)
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Other vCPUs may still be running code from the buffer; the
+           flush is done once all of them have left cpu_exec().  */
+        atomic_set(&tb_flush_full_pending, 1);
+        qemu_tcg_request_tb_flush();
+        return;
+    }
+    /* the only thread that looks up TBs is the one calling us */
+    do_tb_flush(env1, true);
+#else
+    /* other threads may be looking up TBs while we flush */
+    do_tb_flush(env1, false);
+#endif
 }
 
 #ifdef DEBUG_TB_CHECK
 
 static void tb_invalidate_check(target_ulong address)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.htable;
     TranslationBlock *tb;
     int i;
 
     address &= TARGET_PAGE_MASK;
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tb_ctx.tb_phys_hash[i]; tb != NULL; tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << ht->bits); i++) {
+        for (tb = ht->buckets[i]; tb != NULL; tb = tb->phys_hash_next) {
             if (!(address + TARGET_PAGE_SIZE <= tb->pc ||
                   address >= tb->pc + tb->size)) {
                 printf("ERROR invalidate: address=" TARGET_FMT_lx
@@ -735,12 +1759,12 @@ static void tb_invalidate_check(target_ulong address)
 /* verify that all the pages have correct rights for code */
 static void tb_page_check(void)
 {
+    TBHashTable *ht = tcg_ctx.tb_ctx.htable;
     TranslationBlock *tb;
     int i, flags1, flags2;
 
-    for (i = 0; i < CODE_GEN_PHYS_HASH_SIZE; i++) {
-        for (tb = tcg_ctx.tb_ctx.tb_phys_hash[i]; tb != NULL;
-                tb = tb->phys_hash_next) {
+    for (i = 0; i < (1 << ht->bits); i++) {
+        for (tb = ht->buckets[i]; tb != NULL; tb = tb->phys_hash_next) {
             flags1 = page_get_flags(tb->pc);
             flags2 = page_get_flags(tb->pc + tb->size - 1);
             if ((flags1 & PAGE_WRITE) || (flags2 & PAGE_WRITE)) {
@@ -753,20 +1777,6 @@ static void tb_page_check(void)
 
 #endif
 
-static inline void tb_hash_remove(TranslationBlock **ptb, TranslationBlock *tb)
-{
-    TranslationBlock *tb1;
-
-    for (;;) {
-        tb1 = *ptb;
-        if (tb1 == tb) {
-            *ptb = tb1->phys_hash_next;
-            break;
-        }
-        ptb = &tb1->phys_hash_next;
-    }
-}
-
 static inline void tb_page_remove(TranslationBlock **ptb, TranslationBlock *tb)
 {
     TranslationBlock *tb1;
@@ -831,8 +1841,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
 
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
-    h = tb_phys_hash_func(phys_pc);
-    tb_hash_remove(&tcg_ctx.tb_ctx.tb_phys_hash[h], tb);
+    tb_htable_remove(tb, phys_pc);
 
     /* remove the TB from the page list */
     if (tb->page_addr[0] != page_addr) {
@@ -847,6 +1856,7 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     }
 
     tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
+    tb->invalid = true;
 
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
@@ -880,6 +1890,71 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tcg_ctx.tb_ctx.tb_phys_invalidate_count++;
 }
 
+/* Drop all the TBs of a region.  Invalidating them also unlinks the
+   chained jumps from other regions into this one, so that its code can
+   be overwritten.  */
+static void tb_region_evict(TBRegion *r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock *tb;
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        tb = &ctx->tbs[r->first_tb + i];
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        } else {
+            tb_cache_forget(tb);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    ctx->tb_evicted_tb_count += r->nb_tbs;
+    ctx->tb_evict_count++;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    ctx->tb_invalidated_flag = 1;
+}
+
+static inline TBRegion *tb_region_next(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    return &ctx->regions[(ctx->cur_region + 1) % ctx->nb_regions];
+}
+
+/* Continue code generation in the next region, which is the oldest one,
+   evicting whatever it still holds.  No vCPU may be executing code from
+   that region.  */
+static void tb_region_advance(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+
+    ctx->regions[ctx->cur_region].end = tcg_ctx.code_gen_ptr;
+    r = tb_region_next();
+    if (r->nb_tbs) {
+        tb_region_evict(r);
+    }
+    ctx->cur_region = r - ctx->regions;
+    tcg_ctx.code_gen_ptr = r->start;
+}
+
+/* Called by the multi-threaded TCG mode once all vCPUs are out of
+   cpu_exec(): flush everything if tb_flush() was called, otherwise
+   make room for new translations by evicting the oldest region.  */
+void tb_flush_exclusive(CPUArchState *env1)
+{
+    if (atomic_xchg(&tb_flush_full_pending, 0)) {
+        do_tb_flush(env1, true);
+        return;
+    }
+    tb_lock_sys();
+    if (tb_region_next()->nb_tbs) {
+        tb_region_advance();
+    }
+    tb_unlock_sys();
+}
+
 static inline void set_bits(uint8_t *tab, int start, int len)
 {
     int end, mask, end1;
@@ -947,10 +2022,28 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     int code_gen_size;
 
     phys_pc = get_page_addr_code(env, pc);
+    tb_lock_sys();
+    if (cflags == 0) {
+        tb = tb_cache_revive(env, pc, cs_base, flags, phys_pc);
+        if (tb) {
+            tb_unlock_sys();
+            return tb;
+        }
+    }
     tb = tb_alloc(pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+#if !defined(CONFIG_USER_ONLY)
+        if (qemu_tcg_mttcg_enabled() && tb_region_next()->nb_tbs) {
+            /* other vCPUs may be running from the region to be evicted:
+               leave cpu_exec() and let the eviction happen before
+               re-entering */
+            qemu_tcg_request_tb_flush();
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
+#endif
+        /* the current region is full, reuse the oldest one */
+        tb_region_advance();
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         /* Don't forget to invalidate previous TB info.  */
@@ -972,9 +2065,76 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+    tb_unlock_sys();
     return tb;
 }
 
+/* Return the direct exit (0 or 1) through which the TB for (pc, cs_base,
+   flags) was left at least 3/4 of the times it was profiled, or -1 if
+   there is no such TB or its profile is too short or not biased enough.
+   The TB must end at 'end', i.e. with the branch being translated.  Used
+   by the translators to decide which way a trace continues.  */
+int tb_trace_hot_exit(CPUArchState *env, target_ulong pc, target_ulong end,
+                      target_ulong cs_base, uint64_t flags)
+{
+    TranslationBlock *tb;
+    uint32_t n0, n1;
+
+    tb = tb_htable_lookup(env, pc, cs_base, flags);
+    if (!tb || (tb->cflags & CF_TRACE) || tb->pc + tb->size != end) {
+        return -1;
+    }
+    n0 = tb->exit_count[0];
+    n1 = tb->exit_count[1];
+    if (n0 + n1 < 16) {
+        return -1;
+    }
+    if (n0 >= 3 * n1) {
+        return 0;
+    }
+    if (n1 >= 3 * n0) {
+        return 1;
+    }
+    return -1;
+}
+
+/* Retranslate the hot TB 'tb' as a trace that continues across the
+   branches its profile shows to be biased, and replace 'tb' with it.
+   Return the TB that should be executed.  */
+TranslationBlock *tb_gen_trace(CPUArchState *env, TranslationBlock *tb)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TranslationBlock *trace;
+
+    tb_lock();
+    /* another vCPU may have replaced it meanwhile */
+    if (tb->invalid) {
+        tb_unlock();
+        return tb;
+    }
+    ctx->tb_invalidated_flag = 0;
+    trace = tb_gen_code(env, tb->pc, tb->cs_base, tb->flags, CF_TRACE);
+    if (ctx->tb_invalidated_flag) {
+        /* a region was evicted to make room for the trace and 'tb' may
+           have gone with it: leave both to the normal lookup */
+        tb_unlock();
+        return trace;
+    }
+    if (trace->trace_path == 0) {
+        /* no branch was followed, the trace is the same as 'tb' */
+        tb_phys_invalidate(trace, -1);
+        tb_free(trace);
+        ctx->tb_trace_abort_count++;
+        tb_unlock();
+        return tb;
+    }
+    tb_phys_invalidate(tb, -1);
+    tb_jmp_cache_set(env, tb_jmp_cache_hash_func(trace->pc), trace);
+    ctx->tb_trace_count++;
+    tb_unlock();
+    return trace;
+}
+
 /*
  * Invalidate all TBs which intersect with the target physical address range
  * [start;end[. NOTE: start and end may refer to *different* physical pages.
@@ -1019,8 +2179,10 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
     int current_flags = 0;
 #endif /* TARGET_HAS_PRECISE_SMC */
 
+    tb_lock_sys();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock_sys();
         return;
     }
     if (!p->code_bitmap &&
@@ -1113,6 +2275,7 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
         cpu_resume_from_signal(env, NULL);
     }
 #endif
+    tb_unlock_sys();
 }
 
 /* len must be <= 8 and start must be a multiple of len */
@@ -1130,8 +2293,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    tb_lock_sys();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
+        tb_unlock_sys();
         return;
     }
     if (p->code_bitmap) {
@@ -1144,6 +2309,7 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
     do_invalidate:
         tb_invalidate_phys_page_range(start, start + len, 1);
     }
+    tb_unlock_sys();
 }
 
 #if !defined(CONFIG_SOFTMMU)
@@ -1280,17 +2446,9 @@ static inline void tb_alloc_page(TranslationBlock *tb,
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2)
 {
-    unsigned int h;
-    TranslationBlock **ptb;
-
     /* Grab the mmap lock to stop another thread invalidating this TB
        before we are done.  */
     mmap_lock();
-    /* add in the physical hash table */
-    h = tb_phys_hash_func(phys_pc);
-    ptb = &tcg_ctx.tb_ctx.tb_phys_hash[h];
-    tb->phys_hash_next = *ptb;
-    *ptb = tb;
 
     /* add in the page list */
     tb_alloc_page(tb, 0, phys_pc & TARGET_PAGE_MASK);
@@ -1312,6 +2470,10 @@ static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
         tb_reset_jump(tb, 1);
     }
 
+    /* add in the physical hash table last, where lookups that do not
+       hold tb_lock can find the TB */
+    tb_htable_insert(tb, phys_pc);
+
 #ifdef DEBUG_TB_CHECK
     tb_page_check();
 #endif
@@ -1334,23 +2496,30 @@ bool is_tcg_gen_code(uintptr_t tc_ptr)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    size_t region;
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    region = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / tb_region_size;
+    if (region >= ctx->nb_regions) {
+        return NULL;
+    }
+    r = &ctx->regions[region];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_end(r)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
-    m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_min = r->first_tb;
+    m_max = r->first_tb + r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &ctx->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1360,7 +2529,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &ctx->tbs[m_max];
 }
 
 #if defined(TARGET_HAS_ICE) && !defined(CONFIG_USER_ONLY)
@@ -1385,6 +2554,7 @@ void tb_check_watchpoint(CPUArchState *env)
 {
     TranslationBlock *tb;
 
+    tb_lock_sys();
     tb = tb_find_pc(env->mem_io_pc);
     if (!tb) {
         cpu_abort(env, "check_watchpoint: could not find TB for pc=%p",
@@ -1392,6 +2562,7 @@ void tb_check_watchpoint(CPUArchState *env)
     }
     cpu_restore_state_from_tb(tb, env, env->mem_io_pc);
     tb_phys_invalidate(tb, -1);
+    tb_unlock_sys();
 }
 
 #ifndef CONFIG_USER_ONLY
@@ -1435,6 +2606,8 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    /* released by cpu_exec() when we longjmp back into it */
+    tb_lock_sys();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(env, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1503,49 +2676,77 @@ void tb_flush_jmp_cache(CPUArchState *env, target_ulong addr)
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
-    int direct_jmp_count, direct_jmp2_count, cross_page;
+    CPUState *cpu;
+    int i, k, target_code_size, max_target_code_size;
+    int direct_jmp_count, direct_jmp2_count, cross_page, regions_used;
+    size_t code_size;
     TranslationBlock *tb;
+    TBRegion *r;
+    TBHashTable *ht;
+    size_t hash_used, hash_max_chain, chain, j;
+
+    tb_lock();
+    ht = tcg_ctx.tb_ctx.htable;
+    hash_used = 0;
+    hash_max_chain = 0;
+    for (j = 0; j < (1u << ht->bits); j++) {
+        chain = 0;
+        for (tb = ht->buckets[j]; tb != NULL; tb = tb->phys_hash_next) {
+            chain++;
+        }
+        if (chain) {
+            hash_used++;
+            hash_max_chain = MAX(hash_max_chain, chain);
+        }
+    }
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
+    code_size = 0;
+    regions_used = 0;
+    for (k = 0; k < tcg_ctx.tb_ctx.nb_regions; k++) {
+        r = &tcg_ctx.tb_ctx.regions[k];
+        if (r->nb_tbs) {
+            regions_used++;
+            code_size += tb_region_end(r) - r->start;
         }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->tb_next_offset[0] != 0xffff) {
-            direct_jmp_count++;
-            if (tb->tb_next_offset[1] != 0xffff) {
-                direct_jmp2_count++;
+        for (i = r->first_tb; i < r->first_tb + r->nb_tbs; i++) {
+            tb = &tcg_ctx.tb_ctx.tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->tb_next_offset[0] != 0xffff) {
+                direct_jmp_count++;
+                if (tb->tb_next_offset[1] != 0xffff) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %zd/%zd\n",
+                code_size, tb_region_max_size * tcg_ctx.tb_ctx.nb_regions);
+    cpu_fprintf(f, "code regions        %d/%d used, current %d\n",
+                regions_used, tcg_ctx.tb_ctx.nb_regions,
+                tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
-            tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
+            tcg_ctx.tb_ctx.nb_tbs,
+            tb_region_max_blocks * tcg_ctx.tb_ctx.nb_regions);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
             tcg_ctx.tb_ctx.nb_tbs ? target_code_size /
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %zd bytes (expansion ratio: %0.1f)\n",
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+            target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
@@ -1556,12 +2757,60 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 direct_jmp2_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp2_count * 100) /
                         tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "TB hash buckets     %zu/%u (%d resizes)\n",
+                hash_used, 1u << ht->bits,
+                tcg_ctx.tb_ctx.tb_hash_resize_count);
+    cpu_fprintf(f, "TB hash chain       avg %0.2f max %zu\n",
+                hash_used ? (double) ht->count / hash_used : 0,
+                hash_max_chain);
+    cpu_fprintf(f, "TB hash lookups     %" PRIu64 " (avg %0.2f steps)\n",
+                tcg_ctx.tb_ctx.tb_hash_lookups,
+                tcg_ctx.tb_ctx.tb_hash_lookups ?
+                (double) tcg_ctx.tb_ctx.tb_hash_lookup_steps /
+                tcg_ctx.tb_ctx.tb_hash_lookups : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB eviction count   %d (%d TBs)\n",
+            tcg_ctx.tb_ctx.tb_evict_count,
+            tcg_ctx.tb_ctx.tb_evicted_tb_count);
+#ifdef USE_TB_CACHE
+    if (tb_cache.path) {
+        cpu_fprintf(f, "TB cache            %d loaded, %d dormant, "
+                    "%d revived, %d stale\n", tb_cache.loaded,
+                    tb_cache.dormant, tb_cache.hits, tb_cache.stale);
+    }
+#endif
+    if (tcg_trace_threshold) {
+        cpu_fprintf(f, "TB trace count      %d (%d not extended)\n",
+                    tcg_ctx.tb_ctx.tb_trace_count,
+                    tcg_ctx.tb_ctx.tb_trace_abort_count);
+    }
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for (cpu = first_cpu; cpu != NULL; cpu = cpu->next_cpu) {
+        CPUArchState *env = cpu->env_ptr;
+        CPUTLBStats *s = &env->tlb_stats;
+
+        cpu_fprintf(f, "CPU %d TLB           %" PRIu64 " misses, %" PRIu64
+                    " victim hits (%d entries, %" PRIu64 " resizes), %"
+                    PRIu64 " fills, %" PRIu64 " flushes (%" PRIu64
+                    " full), %" PRIu64 " page flushes (%" PRIu64
+                    " batched)\n", cpu->cpu_index, s->misses,
+                    s->victim_hits, env->vtlb_size, s->vtlb_resizes,
+                    s->fills, s->flushes, s->full_flushes,
+                    s->page_flushes, s->range_flushes);
+    }
     tcg_dump_info(f, cpu_fprintf);
+    tb_unlock();
+}
+
+/* -d tcg_stats: dump the code generation statistics before exiting */
+void tcg_log_exit_stats(void)
+{
+    if (qemu_loglevel_mask(CPU_LOG_TCG_STATS)) {
+        dump_exec_info(qemu_logfile, fprintf);
+    }
 }
 
 #else /* CONFIG_USER_ONLY */
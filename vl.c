@@ -145,6 +145,7 @@ int main(int argc, char **argv)
 #include "migration/migration.h"
 #include "sysemu/kvm.h"
 #include "qapi/qmp/qjson.h"
+#include "qom/object_interfaces.h"
 #include "qemu/option.h"
 #include "qemu/config-file.h"
 #include "qemu-options.h"
@@ -427,6 +428,22 @@ static QemuOptsList qemu_machine_opts = {
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "tcg-threads",
+            .type = QEMU_OPT_STRING,
+            .help = "TCG vCPU threading: single (default) or multi",
+        }, {
+            .name = "tcg-trace-threshold",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Executions after which a block becomes a trace",
+        }, {
+            .name = "tb-cache",
+            .type = QEMU_OPT_STRING,
+            .help = "File that keeps translated code across runs",
+        }, {
+            .name = "tb-cache-readonly",
+            .type = QEMU_OPT_BOOL,
+            .help = "Do not update the tb-cache file on exit",
         },
         { /* End of list */ }
     },
@@ -2683,6 +2700,14 @@ static QEMUMachine *machine_parse(const char *name)
 
 static int tcg_init(void)
 {
+    QemuOpts *opts = qemu_get_machine_opts();
+    const char *tb_cache = qemu_opt_get(opts, "tb-cache");
+
+    if (tb_cache &&
+        tb_cache_open(tb_cache,
+                      qemu_opt_get_bool(opts, "tb-cache-readonly", false))) {
+        exit(1);
+    }
     tcg_exec_init(tcg_tb_size * 1024 * 1024);
     return 0;
 }
@@ -2871,6 +2896,7 @@ static int object_create(QemuOpts *opts, void *opaque)
 {
     const char *type = qemu_opt_get(opts, "qom-type");
     const char *id = qemu_opts_id(opts);
+    Error *local_err = NULL;
     Object *obj;
 
     g_assert(type != NULL);
@@ -2885,6 +2911,14 @@ static int object_create(QemuOpts *opts, void *opaque)
         return -1;
     }
 
+    user_creatable_complete(obj, &local_err);
+    if (local_err) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        object_unref(obj);
+        return -1;
+    }
+
     object_property_add_child(container_get(object_get_root(), "/objects"),
                               id, obj, NULL);
 
@@ -4180,6 +4214,15 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    if (tcg_enabled()) {
+        char *key;
+
+        qemu_tcg_configure(qemu_get_machine_opts());
+        key = g_strdup_printf("%s:%s", machine->name,
+                              cpu_model ? cpu_model : "");
+        tb_cache_load(key);
+        g_free(key);
+    }
 
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
@@ -4431,6 +4474,10 @@ int main(int argc, char **argv, char **envp)
     main_loop();
     bdrv_close_all();
     pause_all_vcpus();
+    if (tcg_enabled()) {
+        tb_cache_save();
+        tcg_log_exit_stats();
+    }
     res_free();
 #ifdef CONFIG_TPM
     tpm_cleanup();
@@ -11,8 +11,227 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
+/*
+ * Run scanners.  Starting at offset @i, they return the offset of the first
+ * byte that does not belong to the current zero run (old and new byte
+ * differ) or non-zero run (old and new byte are equal), or @slen if the run
+ * extends to the end of the buffer.  All implementations return exactly
+ * the same offsets, so the choice of implementation does not affect the
+ * encoded stream.
+ */
+typedef int (*XbzrleScanFunc)(const uint8_t *old_buf, const uint8_t *new_buf,
+                              int i, int slen);
+
+static int zrun_end_generic(const uint8_t *old_buf, const uint8_t *new_buf,
+                            int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+
+    return i;
+}
+
+static int nzrun_end_generic(const uint8_t *old_buf, const uint8_t *new_buf,
+                             int i, int slen)
+{
+    long xor;
+
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        long mask = (long)0x0101010101010101ULL;
+        while (i < slen) {
+            xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+
+    return i;
+}
+
+#ifdef __SSE2__
+/* 16 bytes at a time; bit n of the mask is set if byte n is unchanged */
+static int zrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+        if (mask != 0xffff) {
+            return i + ctz32(~mask);
+        }
+    }
+
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_sse2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 16 <= slen; i += 16) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+/* 32 bytes at a time; bit n of the mask is set if byte n is unchanged */
+static int zrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                         int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+        if (mask != 0xffffffff) {
+            return i + ctz32(~mask);
+        }
+    }
+
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static int nzrun_end_avx2(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen)
+{
+    uint32_t mask;
+
+    for (; i + 32 <= slen; i += 32) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+#pragma GCC pop_options
+#endif
+
+typedef struct XbzrleAccel {
+    const char *name;
+    XbzrleScanFunc zrun_end;
+    XbzrleScanFunc nzrun_end;
+} XbzrleAccel;
+
+/* Sorted from best to worst, the generic implementation must come last */
+static const XbzrleAccel xbzrle_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", zrun_end_avx2, nzrun_end_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", zrun_end_sse2, nzrun_end_sse2 },
+#endif
+    { "generic", zrun_end_generic, nzrun_end_generic },
+};
+
+static const XbzrleAccel *xbzrle_accel =
+    &xbzrle_accels[ARRAY_SIZE(xbzrle_accels) - 1];
+
+static bool xbzrle_accel_usable(const XbzrleAccel *accel)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (accel->zrun_end == zrun_end_avx2) {
+        return __builtin_cpu_supports("avx2");
+    }
+#endif
+    return true;
+}
+
+bool xbzrle_select_accel(unsigned int n)
+{
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(xbzrle_accels); i++) {
+        if (xbzrle_accel_usable(&xbzrle_accels[i]) && n-- == 0) {
+            xbzrle_accel = &xbzrle_accels[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *xbzrle_accel_name(void)
+{
+    return xbzrle_accel->name;
+}
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    __builtin_cpu_init();
+#endif
+    xbzrle_select_accel(0);
+}
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -26,10 +245,10 @@
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
+    XbzrleScanFunc zrun_end = xbzrle_accel->zrun_end;
+    XbzrleScanFunc nzrun_end = xbzrle_accel->nzrun_end;
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res, xor;
-    uint8_t *nzrun_start = NULL;
+    int d = 0, i = 0, end;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
                sizeof(long)));
@@ -40,28 +259,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -75,49 +275,22 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
-        nzrun_start = new_buf + i;
-
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            long mask = (long)0x0101010101010101ULL;
-            while (i < slen) {
-                xor = *(long *)(old_buf + i) ^ *(long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
         if (d + nzrun_len > dlen) {
             return -1;
         }
-        memcpy(dst + d, nzrun_start, nzrun_len);
+        memcpy(dst + d, new_buf + i, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
+        i = end;
     }
 
     return d;